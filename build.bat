@@ -26,6 +26,10 @@ if defined flag (
     if "%flag%"=="debug" (
         goto parse_flags
     )
+    if "%flag%"=="truetype" (
+        set font_backend=truetype
+        goto parse_flags
+    )
     if "%flag%"=="clang" (
         set use_clang=1
         goto parse_flags
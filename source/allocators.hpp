@@ -1,10 +1,14 @@
 #pragma once
 
 
+void stack_init();
+void stack_thread_exit();
 void stack_enter_frame();
 void stack_leave_frame();
 
-void *stack_alloc_aligned(s64 size, s32 alignment);
+void *stack_alloc_aligned(s64 size, s32 alignment, bool zero = true);
+s64 stack_allocated_bytes();
+s64 stack_high_water_mark();
 
 // only work on the last allocation (last allocation is saved/restored on enter_frame/leave_frame)
 void stack_trim_allocation(void *allocation, s64 new_size);
@@ -12,6 +16,7 @@ void stack_grow_allocation(void *allocation, s64 new_size);
 s64 stack_get_allocation_size(void *allocation);
 
 #define stack_alloc(type, count) ((type *) stack_alloc_aligned(sizeof(type) * (count), alignof(type)))
+#define stack_alloc_uninitialized(type, count) ((type *) stack_alloc_aligned(sizeof(type) * (count), alignof(type), false))
 #define stack_grow_slice(slice, extra) (stack_grow_allocation((slice).data, ((slice).length + extra) * sizeof((slice).data[0])), (slice).length += extra)
 #define stack_make_slice(type, count) (Slice<type> { stack_alloc(type, (count)), (count) })
 
@@ -36,89 +41,143 @@ Slice<Type> arena_copy(Arena *arena, Slice<Type> source);
 #define arena_make_slice(arena, type, count) (Slice<type> { arena_alloc(arena, type, (count)), (count) })
 
 
+// Each thread has its own stack allocator, in address space which is reserved up front and committed as it is used.
+// 'stack_alloc' zeroes memory, 'stack_alloc_uninitialized' doesn't. Memory released by 'stack_leave_frame' is left as it
+// is, except in debug builds where both uninitialized and released memory is filled with garbage, so code that relies on
+// zeroes it didn't ask for breaks right away.
+// NB We link without the CRT, so there is no 'thread_local'. The allocators live in a TLS slot, which 'stack_init' sets up
+// before any other thread starts. Threads get their allocator on first use, and threads which exit before the program
+// does call 'stack_thread_exit' so its memory isn't leaked.
 struct StackAllocator
 {
-    enum { CAPACITY = 128*1024*1024 };
+    enum : s64 {
+        RESERVE = 8ll*1024*1024*1024,
+        COMMIT_STEP = 1024*1024,
+    };
     u8 *data;
     u64 length;
+    u64 committed;
+    u64 high_water_mark;
     void **last_frame;
 
     void *last_allocation;
     s64 last_allocation_size;
 };
-global_variable StackAllocator global_stack_allocator = {0};
+global_variable u32 stack_tls_index;
 
-void *stack_alloc_aligned(s64 size, s32 alignment)
-{
-    if (!global_stack_allocator.data) global_stack_allocator.data = (u8 *) MemBigAlloc(StackAllocator::CAPACITY);
-    global_stack_allocator.length = ((global_stack_allocator.length + alignment - 1) / alignment) * alignment;
+StackAllocator *_stack_get();
 
-    assert(global_stack_allocator.length + size <= StackAllocator::CAPACITY);
-    void *result = &global_stack_allocator.data[global_stack_allocator.length];
-    global_stack_allocator.length += size;
+enum { STACK_POISON_UNINITIALIZED = 0xcd, STACK_POISON_RELEASED = 0xdd };
 
-    global_stack_allocator.last_allocation = result;
-    global_stack_allocator.last_allocation_size = size;
+void _stack_set_length(StackAllocator *stack, u64 new_length)
+{
+    if (new_length > stack->committed) {
+        if (!stack->data) stack->data = (u8 *) MemBigReserve(StackAllocator::RESERVE);
+        assert(new_length <= StackAllocator::RESERVE);
+        u64 new_committed = round_up(new_length, StackAllocator::COMMIT_STEP);
+        MemBigCommit(stack->data + stack->committed, new_committed - stack->committed);
+        stack->committed = new_committed;
+    }
+    stack->length = new_length;
+    if (new_length > stack->high_water_mark) stack->high_water_mark = new_length;
+}
 
-    memset(result, 0, size);
+void *stack_alloc_aligned(s64 size, s32 alignment, bool zero)
+{
+    StackAllocator *stack = _stack_get();
+    u64 start = ((stack->length + alignment - 1) / alignment) * alignment;
+    _stack_set_length(stack, start + size);
+    void *result = &stack->data[start];
+
+    stack->last_allocation = result;
+    stack->last_allocation_size = size;
+
+    if (zero) {
+        memset(result, 0, size);
+    } else {
+        #if defined(DEBUG)
+        memset(result, STACK_POISON_UNINITIALIZED, size);
+        #endif
+    }
     return(result);
 }
 
 s64 stack_get_allocation_size(void *allocation)
 {
-    assert(allocation == global_stack_allocator.last_allocation);
-    return(global_stack_allocator.last_allocation_size);
+    StackAllocator *stack = _stack_get();
+    assert(allocation == stack->last_allocation);
+    return(stack->last_allocation_size);
 }
 
 void stack_trim_allocation(void *allocation, s64 new_size)
 {
-    assert(allocation == global_stack_allocator.last_allocation);
-    assert(new_size <= global_stack_allocator.last_allocation_size);
-    global_stack_allocator.length -= global_stack_allocator.last_allocation_size - new_size;
-    global_stack_allocator.last_allocation_size = new_size;
+    StackAllocator *stack = _stack_get();
+    assert(allocation == stack->last_allocation);
+    assert(new_size <= stack->last_allocation_size);
+    stack->length -= stack->last_allocation_size - new_size;
+    stack->last_allocation_size = new_size;
 }
 
+// The new part of the allocation is zeroed
 void stack_grow_allocation(void *allocation, s64 new_size)
 {
-    assert(allocation == global_stack_allocator.last_allocation);
-    assert(new_size >= global_stack_allocator.last_allocation_size);
-    s64 delta = new_size - global_stack_allocator.last_allocation_size;
-    assert(global_stack_allocator.length + delta <= StackAllocator::CAPACITY);
-    global_stack_allocator.length += delta;
-    global_stack_allocator.last_allocation_size = new_size;
+    StackAllocator *stack = _stack_get();
+    assert(allocation == stack->last_allocation);
+    assert(new_size >= stack->last_allocation_size);
+    s64 delta = new_size - stack->last_allocation_size;
+    _stack_set_length(stack, stack->length + delta);
+    memset((u8 *) allocation + stack->last_allocation_size, 0, delta);
+    stack->last_allocation_size = new_size;
 }
 
 void stack_enter_frame()
 {
-    void *previous_last_allocation = global_stack_allocator.last_allocation;
-    s64 previous_last_allocation_size = global_stack_allocator.last_allocation_size;
+    StackAllocator *stack = _stack_get();
+    void *previous_last_allocation = stack->last_allocation;
+    s64 previous_last_allocation_size = stack->last_allocation_size;
 
-    void **marker = stack_alloc(void *, 3);
+    void **marker = stack_alloc_uninitialized(void *, 3);
     marker[0] = previous_last_allocation;
     marker[1] = (void *) previous_last_allocation_size;
-    marker[2] = global_stack_allocator.last_frame;
-    global_stack_allocator.last_frame = marker;
+    marker[2] = stack->last_frame;
+    stack->last_frame = marker;
 
-    global_stack_allocator.last_allocation = 0;
-    global_stack_allocator.last_allocation_size = 0;
+    stack->last_allocation = 0;
+    stack->last_allocation_size = 0;
 }
 
 void stack_leave_frame()
 {
-    assert(global_stack_allocator.last_frame);
-    s64 old_length = global_stack_allocator.length;
-    global_stack_allocator.length = ((u8 *) global_stack_allocator.last_frame) - global_stack_allocator.data;
-    global_stack_allocator.last_allocation = global_stack_allocator.last_frame[0];
-    global_stack_allocator.last_allocation_size = (s64) global_stack_allocator.last_frame[1];
-    global_stack_allocator.last_frame = (void **) global_stack_allocator.last_frame[2];
-    memset(global_stack_allocator.data + global_stack_allocator.length, 0, old_length - global_stack_allocator.length);
+    StackAllocator *stack = _stack_get();
+    assert(stack->last_frame);
+    #if defined(DEBUG)
+    u64 old_length = stack->length;
+    #endif
+    stack->length = ((u8 *) stack->last_frame) - stack->data;
+    stack->last_allocation = stack->last_frame[0];
+    stack->last_allocation_size = (s64) stack->last_frame[1];
+    stack->last_frame = (void **) stack->last_frame[2];
+    #if defined(DEBUG)
+    memset(stack->data + stack->length, STACK_POISON_RELEASED, old_length - stack->length);
+    #endif
+}
+
+// Bytes currently allocated on this thread's stack, and the most that ever was
+s64 stack_allocated_bytes()
+{
+    return((s64) _stack_get()->length);
+}
+
+s64 stack_high_water_mark()
+{
+    return((s64) _stack_get()->high_water_mark);
 }
 
 template<typename Type>
 Slice<Type> stack_copy(Slice<Type> source)
 {
     Slice<Type> copy = {};
-    copy.data = stack_alloc(Type, source.length + 1);
+    copy.data = stack_alloc_uninitialized(Type, source.length + 1);
     copy.length = source.length;
     memcpy(copy.data, source.data, source.length * sizeof(Type));
     memset(&copy.data[source.length], 0, sizeof(Type));
@@ -210,6 +269,34 @@ Slice<Type> arena_copy(Arena *arena, Slice<Type> source)
 
 #include "win32.hpp"
 
+void stack_init()
+{
+    stack_tls_index = win32::TlsAlloc();
+    assert(stack_tls_index != win32::TLS_OUT_OF_INDEXES);
+}
+
+StackAllocator *_stack_get()
+{
+    StackAllocator *stack = (StackAllocator *) win32::TlsGetValue(stack_tls_index);
+    if (!stack) {
+        stack = (StackAllocator *) heap_alloc(sizeof(StackAllocator));
+        memset(stack, 0, sizeof(StackAllocator));
+        win32::TlsSetValue(stack_tls_index, stack);
+    }
+    return(stack);
+}
+
+void stack_thread_exit()
+{
+    StackAllocator *stack = (StackAllocator *) win32::TlsGetValue(stack_tls_index);
+    if (stack) {
+        assert(!stack->last_frame);
+        if (stack->data) MemBigFree(stack->data);
+        heap_free(stack);
+        win32::TlsSetValue(stack_tls_index, null);
+    }
+}
+
 void *heap_alloc(s64 size)
 {
     void *result = null;
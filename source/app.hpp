@@ -2,6 +2,8 @@
 #include "graphics.hpp"
 #include "gap_buffer.hpp"
 #include "parse.hpp"
+#include "find_in_files.hpp"
+#include "declarations.hpp"
 #include "colors.h"
 
 char *BUILD_INFO =
@@ -58,7 +60,8 @@ void update_build_script_errors();
 struct PromptSuggestion
 {
     s32 sort_index;
-    s32 match_offset;
+    s32 match_score;
+    u64 char_mask;
     str display_string;
     str display_string_extra;
 
@@ -68,6 +71,13 @@ struct PromptSuggestion
 };
 
 typedef void (*PromptExecuteFunction)(PromptSuggestion *selected, str typed);
+
+struct BrowseItem
+{
+    str path;
+    s32 path_index;
+    u8 rank;
+};
 typedef void (*PromptRefreshFunction)(str typed);
 
 
@@ -82,6 +92,7 @@ struct App
 {
     Font font;
     s32 max_glyphs_per_line;
+    TextStripCache text_strips;
 
     bool split_view;
     s32 focused_split;
@@ -102,6 +113,7 @@ struct App
     Rect command_prompt_screen_rect;
     s32 log_buffer_index;
     s32 script_buffer_index;
+    s32 search_buffer_index;
 
     Buffer *drag_buffer;
     View *drag_view;
@@ -113,10 +125,14 @@ struct App
     Arena build_error_arena;
     BuildErrorCachedPath *build_error_path_cache;
     Array<BuildError> build_errors;
+    s32 build_error_buffer_index; // Either 'script_buffer_index' or 'search_buffer_index', depending on what we ran last
+
+    FindInFiles find_in_files;
+    Arena find_in_files_arena; // For the paths and messages in 'build_errors' when they are search results
 
     Arena clipboard_arena;
     Slice<str> clipboard;
-    u64 platform_clipboard_hash;
+    u32 platform_clipboard_sequence; // From when we last put 'clipboard' in the platform clipboard
 
     EditMode repeat_mode;
     union {
@@ -141,6 +157,17 @@ struct App
     Path build_script;
 
     Path browse_directory;
+    FileIndex file_index; // Of 'browse_directory'
+    Array<BrowseItem> browse_items; // 'file_index' sorted for the browse prompt
+    u64 browse_items_generation;
+
+    DeclarationIndex declarations; // Of 'browse_directory'
+
+    // Index into 'buffers' by file identity, see 'buffer_for_path'. Buffers whose files don't exist yet are in 'unidentified'.
+    HashMap<PathIdentity, s32> buffers_by_identity;
+    Array<s32> unidentified_buffers;
+    s64 buffers_by_identity_count;
+    u32 buffers_by_identity_generation;
 
     struct {
         bool showing;
@@ -158,6 +185,11 @@ struct App
         s32 suggestion_matching;
         s32 suggestion_active;
 
+        // The first 'suggestion_matching' suggestions are the ones matching 'matched_typed'. NB 'matched_typed' keeps its
+        // storage across prompts, since it is overwritten on every keystroke.
+        bool suggestions_prepared;
+        Array<char> matched_typed;
+
         s64 matches_for_command_buffer_content_revision;
     } prompt;
 };
@@ -201,24 +233,45 @@ void show_buffer(s32 buffer_index)
 
 Buffer *buffer_for_path(Path path)
 {
-    Buffer *result = null;
-    for (s32 i = 0; i < app.buffers.length && !result; ++i) {
-        if (path_compare(path, app.buffers[i].path)) {
-            result = &app.buffers[i];
+    // Matching strings are the common case, and need no file system access
+    for (s32 i = 0; i < app.buffers.length; ++i) {
+        Path buffer_path = app.buffers[i].path;
+        bool same_string = buffer_path && path && buffer_path->length == path->length &&
+                           memcmp(buffer_path->data, path->data, path->length*sizeof(wchar_t)) == 0;
+        if (buffer_path == path || same_string) return(&app.buffers[i]);
+    }
+
+    PathIdentity identity;
+    if (!path_identity(path, &identity)) return(null);
+
+    if (app.buffers_by_identity_count != app.buffers.length || app.buffers_by_identity_generation != buffer_path_generation) {
+        app.buffers_by_identity.clear();
+        app.unidentified_buffers.clear();
+        for (s32 i = 0; i < app.buffers.length; ++i) {
+            PathIdentity buffer_identity;
+            if (path_identity(app.buffers[i].path, &buffer_identity)) app.buffers_by_identity.insert(buffer_identity, i);
+            else if (app.buffers[i].path)                             app.unidentified_buffers.append(i);
         }
+        app.buffers_by_identity_count = app.buffers.length;
+        app.buffers_by_identity_generation = buffer_path_generation;
     }
-    return(result);
+
+    s32 *index = app.buffers_by_identity.find(identity);
+    if (index) return(&app.buffers[*index]);
+
+    // The file of a buffer might have been made since we built the table
+    for (s64 i = 0; i < app.unidentified_buffers.length; ++i) {
+        Buffer *buffer = &app.buffers[app.unidentified_buffers[i]];
+        PathIdentity buffer_identity;
+        if (path_identity(buffer->path, &buffer_identity) && buffer_identity == identity) return(buffer);
+    }
+    return(null);
 }
 
 bool show_path(Path path)
 {
-    s32 buffer_index = -1;
-
-    for (s32 i = 0; i < app.buffers.length && buffer_index == -1; ++i) {
-        if (path_compare(path, app.buffers[i].path)) {
-            buffer_index = i;
-        }
-    }
+    Buffer *existing_buffer = buffer_for_path(path);
+    s32 buffer_index = existing_buffer? (s32) (existing_buffer - app.buffers.data) : -1;
 
     if (buffer_index == -1) {
         Buffer new_buffer = {};
@@ -306,6 +359,8 @@ void _command_change_tab_mode();
 void _command_save_as();
 void _command_change_directory();
 void _command_close_buffer();
+void prompt_find_in_files();
+void prompt_declarations();
 
 struct Command
 {
@@ -315,6 +370,8 @@ struct Command
 };
 Command COMMANDS[] = {
     { lit_to_str("Select all search results"), &_command_select_all_search_results, true },
+    { lit_to_str("Find in files"), &prompt_find_in_files, true },
+    { lit_to_str("Go to declaration"), &prompt_declarations, true },
     { lit_to_str("Save as..."), &_command_save_as, true },
     { lit_to_str("Change directory"), &_command_change_directory, true },
     { lit_to_str("Close buffer"), &_command_close_buffer, false },
@@ -390,6 +447,8 @@ void set_browse_directory(Path new_directory)
 {
     if (app.browse_directory) heap_free(app.browse_directory);
     app.browse_directory = heap_copy(new_directory);
+    file_index_start(&app.file_index, app.browse_directory);
+    declarations_start(&app.declarations, app.browse_directory);
 
     for_each (buffer, app.buffers) buffer_update_display_string(buffer, app.browse_directory);
 
@@ -403,12 +462,7 @@ void set_browse_directory(Path new_directory)
         app.build_error_active = previous_error_index;
 
         BuildError *active_error = &app.build_errors[app.build_error_active];
-        for (s32 i = 0; i < app.buffers.length; ++i) {
-            if (path_compare(active_error->path, app.buffers[i].path)) {
-                active_error->path_valid = true;
-                break;
-            }
-        }
+        if (buffer_for_path(active_error->path)) active_error->path_valid = true;
     }
 }
 
@@ -418,9 +472,12 @@ void set_browse_directory(Path new_directory)
 void _reset_prompt()
 {
     Arena arena = app.prompt.arena;
+    Array<char> matched_typed = app.prompt.matched_typed;
     memset(&app.prompt, 0, sizeof(app.prompt));
     arena_reset(&arena);
+    matched_typed.clear();
     app.prompt.arena = arena;
+    app.prompt.matched_typed = matched_typed;
 
     app.edit_mode = EditMode::INSERT;
     buffer_reset(&app.command_buffer);
@@ -428,9 +485,79 @@ void _reset_prompt()
     app.prompt.showing = true;
 }
 
-bool cmp_PromptSuggestion(PromptSuggestion *left, PromptSuggestion *right)
+struct PromptMatch
+{
+    s32 score;
+    s32 sort_index;
+    s32 index;
+};
+
+bool cmp_PromptMatch(PromptMatch *left, PromptMatch *right)
+{
+    if (left->score != right->score) return(left->score > right->score);
+    if (left->sort_index != right->sort_index) return(left->sort_index < right->sort_index);
+    return(left->index < right->index);
+}
+
+enum { PROMPT_MATCH_CHUNK = 4096 };
+
+struct PromptMatchJob
+{
+    Slice<PromptSuggestion> suggestions;
+    FuzzyPattern *pattern;
+    bool prepare;
+};
+
+void _prompt_match_chunk(void *data, s32 chunk)
+{
+    PromptMatchJob *job = (PromptMatchJob *) data;
+    s64 begin = (s64) chunk*PROMPT_MATCH_CHUNK;
+    s64 end = min(begin + PROMPT_MATCH_CHUNK, job->suggestions.length);
+    for (s64 i = begin; i < end; ++i) {
+        PromptSuggestion *suggestion = &job->suggestions[i];
+        if (job->prepare) {
+            if (suggestion->sort_index == 0) suggestion->sort_index = 1 + (s32) i;
+            suggestion->char_mask = fuzzy_char_mask(suggestion->display_string);
+        }
+
+        suggestion->match_score = FUZZY_NO_MATCH;
+        if ((suggestion->char_mask & job->pattern->mask) == job->pattern->mask) {
+            suggestion->match_score = fuzzy_score(job->pattern, suggestion->display_string);
+        }
+    }
+}
+
+// Scores the first 'count' suggestions, and moves the ones matching 'pattern' to the front, best first. Returns how many
+// matched. 'prepare' must be set the first time we see a set of suggestions, and then 'count' must cover all of them.
+s32 match_prompt_suggestions(Slice<PromptSuggestion> suggestions, s32 count, FuzzyPattern *pattern, bool prepare)
 {
-    return(left->sort_index < right->sort_index);
+    PromptMatchJob job = { slice(suggestions, 0, count), pattern, prepare };
+    parallel_for((count + PROMPT_MATCH_CHUNK - 1) / PROMPT_MATCH_CHUNK, &_prompt_match_chunk, &job);
+
+    stack_enter_frame();
+
+    // Sorting these is a lot cheaper than sorting the suggestions themselves when there are hundreds of thousands of files
+    Slice<PromptMatch> matches = { stack_alloc_uninitialized(PromptMatch, count), 0 };
+    for (s32 i = 0; i < count; ++i) {
+        PromptSuggestion *suggestion = &suggestions[i];
+        if (suggestion->match_score != FUZZY_NO_MATCH) matches[matches.length++] = { suggestion->match_score, suggestion->sort_index, i };
+    }
+    stable_sort(matches, &cmp_PromptMatch);
+
+    bool in_place = true;
+    for (s32 i = 0; i < matches.length && in_place; ++i) in_place = matches[i].index == i;
+    if (!in_place) {
+        Slice<PromptSuggestion> old = stack_copy(slice(suggestions, 0, count));
+        s32 next = 0;
+        for_each (match, matches) suggestions[next++] = old[match->index];
+        for_each (suggestion, old) {
+            if (suggestion->match_score == FUZZY_NO_MATCH) suggestions[next++] = *suggestion;
+        }
+        debug_assert(next == count);
+    }
+
+    stack_leave_frame();
+    return((s32) matches.length);
 }
 
 void update_prompt_suggestions()
@@ -439,36 +566,369 @@ void update_prompt_suggestions()
         app.prompt.matches_for_command_buffer_content_revision = app.command_buffer.revision;
         str typed = buffer_move_gap_to_end(&app.command_buffer);
 
+        stack_enter_frame();
+        FuzzyPattern pattern = fuzzy_pattern(typed);
+
+        // When the typed text only grows, what did not match before can not start matching now
+        s32 count = (s32) app.prompt.suggestions.length;
+        if (app.prompt.suggestions_prepared) {
+            FuzzyPattern previous = fuzzy_pattern(app.prompt.matched_typed.as_slice());
+            if (fuzzy_pattern_narrows(&pattern, &previous)) count = app.prompt.suggestion_matching;
+        }
+
         app.prompt.suggestion_active = 0;
-        app.prompt.suggestion_matching = 0;
+        app.prompt.suggestion_matching = match_prompt_suggestions(app.prompt.suggestions, count, &pattern, !app.prompt.suggestions_prepared);
+        app.prompt.suggestions_prepared = true;
+        app.prompt.matched_typed.clear();
+        memcpy(app.prompt.matched_typed.push(typed.length), typed.data, typed.length);
+        stack_leave_frame();
 
-        stack_enter_frame();
-        str typed_lower = utf8_map(typed, &unicode_lowercase);
-        str typed_upper = utf8_map(typed, &unicode_uppercase);
+        if (app.prompt.refresh_function) (*app.prompt.refresh_function)(typed);
+    }
+}
+
+#if defined(DEBUG)
+// Times filtering a made up tree of 500k paths while a query is typed one character at a time, both narrowing down from the
+// previous matches, as 'update_prompt_suggestions' does, and rescanning everything. Both must agree. The plain substring
+// search we used before is timed for comparison.
+void _fuzzy_match_benchmark()
+{
+    enum { PATHS = 500000 };
+    char *words[] = { "source", "include", "test", "build", "util", "graphics", "render", "font", "buffer", "parse", "app",
+                      "win32", "thread", "memory", "index", "prompt", "search", "highlight", "unicode", "io", "platform",
+                      "core", "data", "third_party", "Docs", "FileSystem" };
+    char *extensions[] = { ".cpp", ".hpp", ".h", ".c", ".txt", ".md", ".json" };
+
+    stack_enter_frame();
+    Slice<PromptSuggestion> narrowed = stack_make_slice(PromptSuggestion, PATHS);
+    Slice<PromptSuggestion> full = stack_make_slice(PromptSuggestion, PATHS);
+    u32 random = 0x12345678;
+    #define RANDOM(n) ((random ^= random << 13, random ^= random >> 17, random ^= random << 5) % (n))
+    for (s32 i = 0; i < PATHS; ++i) {
+        str path = {};
+        for (u32 depth = 1 + RANDOM(4); depth > 0; --depth) {
+            path = stack_printf("%.*s%s/", str_fmt(path), words[RANDOM(alen(words))]);
+        }
+        path = stack_printf("%.*s%s_%u%s", str_fmt(path), words[RANDOM(alen(words))], RANDOM(1000), extensions[RANDOM(alen(extensions))]);
+        narrowed[i].display_string = full[i].display_string = path;
+    }
+    #undef RANDOM
+
+    str query = lit_to_str("rendfontbuf.hpp");
+    s32 narrowed_matching = PATHS;
+    for (s32 length = 0; length <= query.length; ++length) {
+        str typed = slice(query, 0, length);
+        FuzzyPattern pattern = fuzzy_pattern(typed);
+
+        Time start = time_read();
+        narrowed_matching = match_prompt_suggestions(narrowed, narrowed_matching, &pattern, length == 0);
+        s64 narrowed_time = time_convert(start, time_read(), MICROSECONDS);
+
+        start = time_read();
+        s32 full_matching = match_prompt_suggestions(full, PATHS, &pattern, length == 0);
+        s64 full_time = time_convert(start, time_read(), MICROSECONDS);
+
+        assert(narrowed_matching == full_matching);
+        for (s32 i = 0; i < full_matching; ++i) assert(narrowed[i].display_string.data == full[i].display_string.data);
+
+        str lowercase = utf8_map(typed, &unicode_lowercase);
+        str uppercase = utf8_map(typed, &unicode_uppercase);
+        s32 substring_matching = 0;
+        start = time_read();
+        for_each (suggestion, full) substring_matching += str_search_ignore_case_internal(suggestion->display_string, lowercase, uppercase) != -1;
+        s64 substring_time = time_convert(start, time_read(), MICROSECONDS);
+
+        debug_printf("fuzzy match '%.*s', %i paths: %i matches, narrowed %i us, full %i us (substring %i matches, %i us)%s%.*s\n",
+                     str_fmt(typed), (s32) PATHS, full_matching, (s32) narrowed_time, (s32) full_time, substring_matching,
+                     (s32) substring_time, full_matching? ", best " : "", str_fmt(full_matching? full[0].display_string : str {}));
+    }
+    stack_leave_frame();
+}
 
-        for_each (suggestion, app.prompt.suggestions) {
-            if (suggestion->sort_index == 0) {
-                suggestion->sort_index = 1 + for_each_index(suggestion, app.prompt.suggestions);
+// Times what 'buffer_load' does after reading a 16MB file: the newline and indentation statistics, checked against the
+// plain loop we used to have, and laying out every line.
+void _buffer_load_benchmark()
+{
+    enum { SIZE = 16*1024*1024 };
+    char *lines[] = { "int x = 0;", "    return(y);", "        if (a && b) c();", "\tfoo(bar, baz);", "", "  // Comment",
+                      "                                        deeply_indented();", "struct Thing { s32 a, b; };" };
+    char *newlines[] = { "\n", "\r\n", "\r" };
+
+    Buffer buffer = {};
+    buffer.cap = SIZE;
+    buffer.data = (char *) MemBigAlloc(buffer.cap);
+    u32 random = 0x9e3779b9;
+    #define RANDOM(n) ((random ^= random << 13, random ^= random >> 17, random ^= random << 5) % (n))
+    while (true) {
+        str line = cstring_to_str(lines[RANDOM(alen(lines))]);
+        str newline = cstring_to_str(newlines[RANDOM(16) == 0? 1 + RANDOM(2) : 0]);
+        if (buffer.a + line.length + newline.length > SIZE) break;
+        memcpy(buffer.data + buffer.a, line.data, line.length); buffer.a += (s32) line.length;
+        memcpy(buffer.data + buffer.a, newline.data, newline.length); buffer.a += (s32) newline.length;
+    }
+    buffer.b = buffer.cap;
+    #undef RANDOM
+    str text = { buffer.data, buffer.a };
+
+    Time start = time_read();
+    BufferTextStats reference = {};
+    for (s64 i = 0; i < text.length;) {
+        if (text.data[i] == '\t') {
+            ++reference.tab_count;
+        } else {
+            s32 space_count = 0;
+            while (i < text.length && text.data[i] == ' ') ++i, ++space_count;
+            if (space_count > 0 && space_count <= alen(reference.leading_space_count)) ++reference.leading_space_count[space_count - 1];
+        }
+        while (i < text.length) {
+            char c = text.data[i++];
+            if (c == '\n') {
+                ++reference.lf_count;
+                break;
+            } else if (c == '\r') {
+                if (i < text.length && text.data[i] == '\n') {
+                    ++reference.crlf_count;
+                    ++i;
+                } else {
+                    ++reference.cr_count;
+                }
+                break;
             }
+        }
+    }
+    s64 reference_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+    start = time_read();
+    BufferTextStats stats = _buffer_text_stats(text);
+    s64 stats_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+    assert(memcmp(&stats, &reference, sizeof(stats)) == 0);
+
+    start = time_read();
+    buffer_set_layout_parameters(&buffer, &app.font, app.max_glyphs_per_line, 0, 0, false);
+    s64 layout_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+    debug_printf("buffer load, %i MB: stats %i MB/s (plain loop %i MB/s), layout of %i lines %i MB/s\n", (s32) (text.length >> 20),
+                 (s32) (text.length/stats_time), (s32) (text.length/reference_time), buffer.physical_line_count,
+                 (s32) (text.length/layout_time));
+
+    highlight_benchmark(text);
+
+    buffer_free(&buffer);
+}
 
-            s64 offset = str_search_ignore_case_internal(suggestion->display_string, typed_lower, typed_upper);
-            suggestion->match_offset = (s32) offset;
-            if (offset != -1) ++app.prompt.suggestion_matching;
+// Converts a buffer with LF newlines and carets all over it to CRLF and back, with the gap at a random place each time, and
+// checks that the text and every caret come back where they were. Checks the CRLF version against a plain conversion on
+// the way, and times both directions.
+void _line_endings_check()
+{
+    enum { SIZE = 4*1024*1024, SELECTIONS = 1000, ROUNDS = 8 };
+    char *lines[] = { "int x = 0;", "    return(y);", "", "\t// Comment", "struct Thing { s32 a, b; };", "\xc3\xa9\xe2\x82\xac" };
+
+    u32 random = 0x6a09e667;
+    #define RANDOM(n) ((random ^= random << 13, random ^= random >> 17, random ^= random << 5) % (n))
+    Array<char> text = {};
+    while (text.length < SIZE) {
+        str line = cstring_to_str(lines[RANDOM(alen(lines))]);
+        memcpy(text.push(line.length), line.data, line.length);
+        text.append('\n');
+    }
+
+    Buffer buffer = {};
+    buffer_reset(&buffer);
+    buffer_set_layout_parameters(&buffer, &app.font, app.max_glyphs_per_line, 0, 0, false);
+    _buffer_insert(&buffer, 0, text.as_slice(), false);
+
+    stack_enter_frame();
+    s32 *newlines_before = stack_alloc(s32, text.length + 1);
+    for (s64 i = 0; i < text.length; ++i) newlines_before[i + 1] = newlines_before[i] + (text[i] == '\n');
+    s32 *carets = stack_alloc(s32, 2*SELECTIONS);
+
+    s64 times[2] = {};
+    for (s32 round = 0; round < ROUNDS; ++round) {
+        View *view = &buffer.views[0];
+        view->selections.clear();
+        for (s32 i = 0; i < SELECTIONS; ++i) {
+            Selection selection = {};
+            selection.start.offset = carets[2*i] = RANDOM((u32) text.length + 1);
+            selection.end.offset = carets[2*i + 1] = RANDOM((u32) text.length + 1);
+            view->selections.append(selection);
+        }
+
+        _buffer_move_gap(&buffer, RANDOM((u32) text.length + 1));
+        Time start = time_read();
+        buffer_change_line_endings(&buffer, NewlineMode::CRLF);
+        times[0] += time_convert(start, time_read(), MICROSECONDS);
+
+        str crlf = buffer_move_gap_to_end(&buffer);
+        assert(crlf.length == text.length + newlines_before[text.length]);
+        for (s64 i = 0, j = 0; i < text.length; ++i) {
+            if (text[i] == '\n') assert(crlf[j++] == '\r');
+            assert(crlf[j++] == text[i]);
+        }
+        for (s32 i = 0; i < SELECTIONS; ++i) {
+            assert(view->selections[i].start.offset == carets[2*i] + newlines_before[carets[2*i]]);
+            assert(view->selections[i].end.offset == carets[2*i + 1] + newlines_before[carets[2*i + 1]]);
+        }
+
+        _buffer_move_gap(&buffer, RANDOM((u32) crlf.length + 1));
+        start = time_read();
+        buffer_change_line_endings(&buffer, NewlineMode::LF);
+        times[1] += time_convert(start, time_read(), MICROSECONDS);
+
+        str lf = buffer_move_gap_to_end(&buffer);
+        assert(lf.length == text.length && memcmp(lf.data, text.data, text.length) == 0);
+        for (s32 i = 0; i < SELECTIONS; ++i) {
+            assert(view->selections[i].start.offset == carets[2*i]);
+            assert(view->selections[i].end.offset == carets[2*i + 1]);
         }
+    }
+    #undef RANDOM
+
+    debug_printf("line endings, %i MB with %i carets: LF to CRLF %i MB/s, CRLF to LF %i MB/s, round trips match\n",
+                 (s32) (text.length >> 20), 2*SELECTIONS, (s32) (text.length*ROUNDS/max(times[0], 1ll)),
+                 (s32) (text.length*ROUNDS/max(times[1], 1ll)));
+
+    stack_leave_frame();
+    buffer_free(&buffer);
+    text.free();
+}
+
+// Times find in files over every file in the file index of the browse directory, once for a word which shows up in most
+// source files and once for text which shows up nowhere. Each search runs twice and only the second one counts, so the
+// files come from the file system cache.
+void _find_in_files_benchmark()
+{
+    FileIndex *index = &app.file_index;
+    file_index_collect(index);
+    if (!index->walk_done) {
+        debug_printf("find in files: skipped, still looking for files in the browse directory\n");
+        return;
+    }
+
+    stack_enter_frame();
+    s64 bytes = 0;
+    for_each (relative, index->paths) {
+        stack_enter_frame();
+        FileStamp stamp;
+        Path path = path_make_absolute(str_to_path(*relative), app.browse_directory);
+        if (path && file_stamp(path, &stamp)) bytes += stamp.size;
         stack_leave_frame();
+    }
+
+    str needles[] = { lit_to_str("return"), lit_to_str("qzx_not_in_any_file_xzq") };
+    for (s32 i = 0; i < alen(needles); ++i) {
+        s64 microseconds = 1;
+        s64 result_count = 0;
+        for (s32 round = 0; round < 2; ++round) {
+            FindInFiles search = {};
+            Array<FindInFilesResult> results = {};
+            Array<char> text = {};
+
+            Time start = time_read();
+            find_in_files_start(&search, app.browse_directory, index->paths.as_slice(), needles[i], 0);
+            while (find_in_files_running(&search)) win32::Sleep(1);
+            microseconds = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+            find_in_files_collect(&search, &results, &text);
+            result_count = results.length;
+            results.free();
+            text.free();
+            find_in_files_stop(&search);
+        }
+
+        debug_printf("find in files, \"%.*s\" in %i files, %i MB: %i MB/s, %i lines found\n", str_fmt(needles[i]),
+                     (s32) index->paths.length, (s32) (bytes >> 20), (s32) (bytes/microseconds), (s32) result_count);
+    }
+    stack_leave_frame();
+}
 
-        for (s32 i = 0, j = app.prompt.suggestions.length - 1; i < j; ) {
-            while (j >= 0 && app.prompt.suggestions[j].match_offset == -1) --j;
-            while (i <= j && app.prompt.suggestions[i].match_offset != -1) ++i;
-            if (i < j) swap(app.prompt.suggestions[i], app.prompt.suggestions[j]);
+// Checks the vectorized utf8 validation and conversions against the scalar versions on random strings, and times both on
+// 16MB of mostly ascii text with some other codepoints mixed in.
+void _unicode_benchmark()
+{
+    enum { SIZE = 16*1024*1024, FUZZ_SIZE = 256 };
+    u8 pieces[][4] = { { 0xc3, 0xa6 }, { 0xe2, 0x82, 0xac }, { 0xf0, 0x9f, 0x98, 0x80 }, { 0xed, 0xa0, 0x80 }, { 0xc0, 0xaf },
+                       { 0xe0, 0x80, 0xaf }, { 0xf4, 0x90, 0x80, 0x80 }, { 0xf8 }, { 0x80 }, { 0xe2, 0x82 }, { 0xf0, 0x9f } };
+
+    u8 *bytes = (u8 *) MemBigAlloc(SIZE);
+    u16 *wide = (u16 *) MemBigAlloc(SIZE*sizeof(u16));
+    u8 *narrow = (u8 *) MemBigAlloc(SIZE*3);
+    u16 *wide_reference = (u16 *) MemBigAlloc(SIZE*sizeof(u16));
+    u8 *narrow_reference = (u8 *) MemBigAlloc(SIZE*3);
+
+    u32 random = 0x9e3779b9;
+    #define RANDOM(n) ((random ^= random << 13, random ^= random >> 17, random ^= random << 5) % (n))
+    for (s32 i = 0; i < 100000; ++i) {
+        s64 length = 0;
+        while (length < FUZZ_SIZE - 4) {
+            if (RANDOM(2)) {
+                bytes[length++] = (u8) (' ' + RANDOM(95));
+            } else if (RANDOM(4)) {
+                u8 *piece = pieces[RANDOM(alen(pieces))];
+                for (s32 j = 0; j < 4 && piece[j]; ++j) bytes[length++] = piece[j];
+            } else {
+                bytes[length++] = (u8) RANDOM(256);
+            }
         }
+        length = RANDOM(FUZZ_SIZE - 4);
 
-        Slice<PromptSuggestion> all_matching = slice(app.prompt.suggestions, 0, app.prompt.suggestion_matching);
-        stable_sort(all_matching, &cmp_PromptSuggestion);
+        assert(utf8_validate(bytes, length) == _utf8_validate_scalar(bytes, length));
+        s64 wide_length = _utf8_to_utf16_simd(bytes, length, wide);
+        assert(wide_length == _utf8_to_utf16_scalar(bytes, length, wide_reference));
+        assert(memcmp(wide, wide_reference, wide_length*sizeof(u16)) == 0);
 
-        if (app.prompt.refresh_function) (*app.prompt.refresh_function)(typed);
+        // Random utf16, including unpaired surrogates
+        for (s64 j = 0; j < length; ++j) wide[j] = (u16) (RANDOM(2)? RANDOM(0x80) : RANDOM(0x10000));
+        s64 narrow_length = _utf16_to_utf8_simd(wide, length, narrow);
+        assert(narrow_length == _utf16_to_utf8_scalar(wide, length, narrow_reference));
+        assert(memcmp(narrow, narrow_reference, narrow_length) == 0);
     }
+
+    s64 length = 0;
+    while (length < SIZE - 4) {
+        if (RANDOM(64)) {
+            bytes[length++] = (u8) (' ' + RANDOM(95));
+        } else {
+            u8 *piece = pieces[RANDOM(3)];
+            for (s32 j = 0; j < 4 && piece[j]; ++j) bytes[length++] = piece[j];
+        }
+    }
+    #undef RANDOM
+
+    Time start = time_read();
+    bool valid = _utf8_validate_scalar(bytes, length);
+    s64 validate_scalar_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+    start = time_read();
+    assert(utf8_validate(bytes, length) == valid);
+    s64 validate_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+    start = time_read();
+    s64 wide_length = _utf8_to_utf16_scalar(bytes, length, wide_reference);
+    s64 to_utf16_scalar_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+    start = time_read();
+    assert(_utf8_to_utf16_simd(bytes, length, wide) == wide_length);
+    s64 to_utf16_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+    start = time_read();
+    s64 narrow_length = _utf16_to_utf8_scalar(wide, wide_length, narrow_reference);
+    s64 to_utf8_scalar_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+    start = time_read();
+    assert(_utf16_to_utf8_simd(wide, wide_length, narrow) == narrow_length);
+    s64 to_utf8_time = max(time_convert(start, time_read(), MICROSECONDS), 1);
+    assert(narrow_length == length && memcmp(narrow, bytes, length) == 0);
+
+    debug_printf("utf8, %i MB: validate %i MB/s (scalar %i MB/s), to utf16 %i MB/s (scalar %i MB/s), from utf16 %i MB/s (scalar %i MB/s)\n",
+                 (s32) (length >> 20), (s32) (length/validate_time), (s32) (length/validate_scalar_time),
+                 (s32) (length/to_utf16_time), (s32) (length/to_utf16_scalar_time),
+                 (s32) (length/to_utf8_time), (s32) (length/to_utf8_scalar_time));
+
+    MemBigFree(bytes);
+    MemBigFree(wide);
+    MemBigFree(narrow);
+    MemBigFree(wide_reference);
+    MemBigFree(narrow_reference);
 }
+#endif
 
 void execute_user_prompt(bool ignore_suggestions)
 {
@@ -600,8 +1060,8 @@ void _command_close_buffer()
             buffer_free(&app.buffers[buffer_index]);
             s32 swapped_index = app.buffers.length - 1;
 
-            assert(buffer_index != app.log_buffer_index && buffer_index != app.script_buffer_index &&
-                   swapped_index != app.log_buffer_index && swapped_index != app.script_buffer_index);
+            assert(buffer_index != app.log_buffer_index && buffer_index != app.script_buffer_index && buffer_index != app.search_buffer_index &&
+                   swapped_index != app.log_buffer_index && swapped_index != app.script_buffer_index && swapped_index != app.search_buffer_index);
 
             s32 initial_focused_split = app.focused_split;
             for (s32 i = 0; i < alen(app.splits); ++i) {
@@ -963,58 +1423,219 @@ void prompt_change_search_mode()
 }
 
 
-static bool
-_path_string_is_directory(str path)
+void find_in_files(str needle, u32 filters)
 {
-    for (s64 i = 0; i < path.length; i += 1) {
-        if (path.data[i] == '/' || path.data[i] == '\\') {
-            return(true);
+    stack_enter_frame();
+
+    app.build_errors.clear();
+    app.build_error_active = -1;
+    app.build_error_buffer_index = app.search_buffer_index;
+    app.show_build_script_info = true;
+    arena_reset(&app.find_in_files_arena);
+
+    FileIndex *index = &app.file_index;
+    file_index_collect(index);
+    find_in_files_start(&app.find_in_files, app.browse_directory, index->paths.as_slice(), needle, filters);
+
+    Buffer *search_buffer = &app.buffers[app.search_buffer_index];
+    buffer_reset(search_buffer);
+    str header = stack_printf("Searching for \"%.*s\" in %lli files in %.*s%s\n", str_fmt(needle), index->paths.length,
+                              str_fmt(path_to_str(app.browse_directory)), index->walk_done? "" : " (still looking for more files)");
+    buffer_insert_at_end(search_buffer, header);
+    show_buffer(app.search_buffer_index);
+
+    stack_leave_frame();
+}
+
+enum { FIND_IN_FILES_HEADER_LINES = 1 };
+
+// Moves new results from the worker threads into the search buffer, and adds them to 'build_errors' so we can jump to them.
+// Returns true if there were any.
+bool _find_in_files_update()
+{
+    Array<FindInFilesResult> results;
+    Array<char> text;
+    bool any = find_in_files_collect(&app.find_in_files, &results, &text);
+    if (any) {
+        stack_enter_frame();
+        buffer_insert_at_end(&app.buffers[app.search_buffer_index], { text.data, text.length });
+
+        // If a script was started since, the results still go in the buffer, but they aren't errors any more
+        bool listed = app.build_error_buffer_index == app.search_buffer_index;
+
+        FindInFiles *search = &app.find_in_files;
+        s32 path_index = -1;
+        Path path = null;
+        s64 offset = 0;
+        for (s64 i = 0; i < results.length && listed; ++i) {
+            FindInFilesResult *result = &results[i];
+            if (result->path_index != path_index) {
+                // Each file's results come together
+                path_index = result->path_index;
+                path = arena_copy(&app.find_in_files_arena, path_make_absolute(str_to_path(search->paths[path_index]), search->directory));
+            }
+
+            BuildError error = {};
+            error.script_output_line = 1 + FIND_IN_FILES_HEADER_LINES + (s32) app.build_errors.length;
+            error.line = result->line;
+            error.path_string = search->paths[path_index];
+            error.path = path;
+            error.error_message = arena_copy(&app.find_in_files_arena, str { text.data + offset + result->message_offset, result->length - result->message_offset - 1 });
+            app.build_errors.append(error);
+
+            offset += result->length;
         }
+        stack_leave_frame();
     }
-    return(false);
+    results.free();
+    text.free();
+    return(any);
 }
 
-static
-str _path_string_get_extension(str path)
+void prompt_find_in_files()
 {
-    str extension = {};
-    for (s64 i = path.length; i > 0; i -= 1) {
-        if (path.data[i - 1] == '.') {
-            extension = { &path.data[i], path.length - i };
-            break;
-        } else if (path.data[i - 1] == '/' || path.data[i - 1] == '\\') {
-            break;
+    _reset_prompt();
+    app.prompt.text = lit_to_str("Find in files");
+    app.prompt.no_suggestions_given = true;
+
+    app.prompt.execute_function = [](PromptSuggestion *selected, str typed) {
+        if (typed.length > 0) {
+            // Match like the search in the current buffer does
+            Buffer *buffer = &app.buffers[app.splits[app.focused_split].buffer_index];
+            View *view = &buffer->views[app.splits[app.focused_split].view_index];
+            find_in_files(typed, view->search.filters);
+        }
+    };
+}
+
+
+void _show_declaration(DeclarationTable *table, Declaration *declaration)
+{
+    stack_enter_frame();
+    Path path = path_make_absolute(str_to_path(declaration_path(table, declaration)), app.declarations.directory);
+    if (path && show_path(path)) {
+        Buffer *buffer = &app.buffers[app.splits[app.focused_split].buffer_index];
+        View *view = &buffer->views[app.splits[app.focused_split].view_index];
+        buffer_jump_to_physical_line(buffer, view, declaration->line, false);
+    }
+    stack_leave_frame();
+}
+
+// Jumps to where the identifier under the caret is declared. If the caret is on one of its declarations already, we jump to
+// the next one, so repeating this cycles through all of them.
+void go_to_declaration()
+{
+    Buffer *buffer = &app.buffers[app.splits[app.focused_split].buffer_index];
+    View *view = &buffer->views[app.splits[app.focused_split].view_index];
+
+    Selection selection = view->selections[view->focused_selection];
+    if (selection.start.offset == selection.end.offset) buffer_expand(buffer, view, &selection, BUFFER_EXPAND_WORD);
+    if (selection.start.offset == selection.end.offset) return;
+
+    stack_enter_frame();
+    str name = stack_copy(buffer_get_slice(buffer, selection.start.offset, selection.end.offset));
+
+    DeclarationTable *table = app.declarations.table;
+    Declaration *first = declaration_find(&app.declarations, name);
+    if (!first) {
+        if (app.declarations.table) prompt_show_error(stack_printf("Don't know where \"%.*s\" is declared", str_fmt(name)));
+        else                        prompt_show_error(lit_to_str("Still looking for declarations"));
+        stack_leave_frame();
+        return;
+    }
+
+    // Definitions before prototypes
+    s32 count = 0;
+    for (Declaration *d = first; d; d = d->next == -1? null : &table->declarations[d->next]) ++count;
+    Declaration **ordered = stack_alloc_uninitialized(Declaration *, count);
+    s32 next = 0;
+    for (s32 prototypes = 0; prototypes < 2; ++prototypes) {
+        for (Declaration *d = first; d; d = d->next == -1? null : &table->declarations[d->next]) {
+            if ((d->kind == DECLARATION_PROTOTYPE) == (prototypes == 1)) ordered[next++] = d;
+        }
+    }
+
+    s32 target = 0;
+    if (buffer->path) {
+        str relative = path_to_str_relative(buffer->path, app.declarations.directory);
+        s32 caret_offset = selection.carets[selection.focused_end].offset;
+        s32 line = buffer->lines[buffer_offset_to_virtual_line_index(buffer, caret_offset)].physical_line_index;
+        for (s32 i = 0; i < count; ++i) {
+            if (ordered[i]->line == line && declaration_path(table, ordered[i]) == relative) {
+                target = (i + 1) % count;
+                break;
+            }
         }
     }
-    return(extension);
+
+    _show_declaration(table, ordered[target]);
+    stack_leave_frame();
+}
+
+void prompt_declarations()
+{
+    stack_enter_frame();
+
+    _reset_prompt();
+    DeclarationTable *table = app.declarations.table;
+    str prompt_text = lit_to_str("Go to declaration");
+    str prompt_text_running = lit_to_str("Go to declaration (still looking for declarations)");
+    app.prompt.text = (app.declarations.running || !table)? prompt_text_running : prompt_text;
+
+    s32 count = table? (s32) table->declarations.length : 0;
+    app.prompt.suggestions = arena_make_slice(&app.prompt.arena, PromptSuggestion, count);
+    for (s32 i = 0; i < count; ++i) {
+        Declaration *declaration = &table->declarations[i];
+        PromptSuggestion *suggestion = &app.prompt.suggestions[i];
+        suggestion->display_string = declaration_name(table, declaration);
+        suggestion->display_string_extra = arena_copy(&app.prompt.arena, stack_printf("%.*s:%i", str_fmt(declaration_path(table, declaration)), declaration->line));
+        suggestion->user_integer = i;
+        suggestion->sort_index = 1 + i + (declaration->kind == DECLARATION_PROTOTYPE? count : 0);
+    }
+
+    // NB 'on_idle' doesn't swap out the table while the prompt is showing
+    app.prompt.execute_function = [](PromptSuggestion *selected, str typed) {
+        if (selected) _show_declaration(app.declarations.table, &app.declarations.table->declarations[selected->user_integer]);
+    };
+
+    stack_leave_frame();
 }
 
-bool cmp_DirItem(DirItem **left, DirItem **right)
+
+static bool
+_path_string_is_directory(str path)
 {
-    str left_string = (**left).display_string;
-    str right_string = (**right).display_string;
+    for (s64 i = 0; i < path.length; i += 1) {
+        if (path.data[i] == '/' || path.data[i] == '\\') {
+            return(true);
+        }
+    }
+    return(false);
+}
 
+// Lower ranks are shown first
+u8 _browse_item_rank(str path)
+{
     // Sort code files first.
     // Using "do we have highlighting" captures what I care about:
     // I mostly edit files for which I have syntax highlighting, so I'm likely to want to see these first in the file listing.
-    str left_extension = _path_string_get_extension(left_string);
-    str right_extension = _path_string_get_extension(right_string);
-    bool left_is_code = highlight_get_function_index(left_extension) != 0;
-    bool right_is_code = highlight_get_function_index(right_extension) != 0;
-    if (left_is_code != right_is_code) return(left_is_code && !right_is_code);
+    bool is_code = highlight_get_function_index(_path_string_get_extension(path)) != 0;
 
     //// Sort files starting with a dot last.
-    bool left_dot = left_string.length > 0 && left_string[0] == '.';
-    bool right_dot = right_string.length > 0 && right_string[0] == '.';
-    if (left_dot != right_dot) return(!left_dot && right_dot);
+    bool dot = path.length > 0 && path[0] == '.';
 
     // Sort files at the top level before other files.
-    bool left_is_root = !_path_string_is_directory(left_string);
-    bool right_is_root = !_path_string_is_directory(right_string);
-    if (left_is_root != right_is_root) return(left_is_root && !right_is_root);
+    bool is_root = !_path_string_is_directory(path);
+
+    return((u8) ((!is_code << 2) | (dot << 1) | !is_root));
+}
+
+bool cmp_BrowseItem(BrowseItem *left, BrowseItem *right)
+{
+    if (left->rank != right->rank) return(left->rank < right->rank);
 
     // Otherwise, sort files alphabetically.
-    return(in_lexicographic_order(&left_string, &right_string));
+    return(in_lexicographic_order(&left->path, &right->path));
 }
 
 void _prompt_browse_execute(PromptSuggestion *selected, str typed);
@@ -1025,34 +1646,38 @@ void prompt_browse()
     _reset_prompt();
     app.prompt.execute_function = &_prompt_browse_execute;
 
-    DirItemList items = path_list_directory(app.browse_directory);
+    // NB Strings in 'app.browse_items' point into the index, so we only collect changes here and while no prompt is showing
+    FileIndex *index = &app.file_index;
+    file_index_collect(index);
+    if (app.browse_items_generation != index->generation) {
+        app.browse_items.length = 0;
+        for (s32 i = 0; i < index->paths.length; ++i) {
+            app.browse_items.append({ index->paths[i], i, _browse_item_rank(index->paths[i]) });
+        }
+        stable_sort(app.browse_items.as_slice(), cmp_BrowseItem);
+        app.browse_items_generation = index->generation;
+    }
 
     str prompt_text = path_to_str(app.browse_directory);
+    if (!index->walk_done) prompt_text = stack_printf("%.*s (still looking for files)", str_fmt(prompt_text));
     app.prompt.text = arena_copy(&app.prompt.arena, prompt_text);
 
-    Slice<DirItem *> sorted_items = {};
-    sorted_items.data = stack_alloc(DirItem *, items.count);
-    for (DirItem *item = items.first; item; item = item->next) sorted_items.data[sorted_items.length++] = item;
-    assert(sorted_items.length == items.count);
-    stable_sort(sorted_items, cmp_DirItem);
-
-    app.prompt.suggestions = arena_make_slice(&app.prompt.arena, PromptSuggestion, items.count);
-    s32 i = 0;
-
-    for_each (item_ptr, sorted_items) {
-        DirItem *item = *item_ptr;
-
-        PromptSuggestion suggestion = {};
-        suggestion.user_pointer = arena_copy(&app.prompt.arena, item->full_path);
-        suggestion.display_string = arena_copy(&app.prompt.arena, item->display_string);
-
-        Buffer *matching_buffer = buffer_for_path(item->full_path);
-        if (matching_buffer) suggestion.display_string_extra = get_status_mark(matching_buffer);
+    s32 item_count = (s32) app.browse_items.length;
+    app.prompt.suggestions = arena_make_slice(&app.prompt.arena, PromptSuggestion, item_count);
+    s32 *positions = stack_alloc_uninitialized(s32, item_count);
+    for (s32 i = 0; i < item_count; ++i) {
+        BrowseItem *item = &app.browse_items[i];
+        app.prompt.suggestions[i].display_string = item->path;
+        positions[item->path_index] = i;
+    }
 
-        app.prompt.suggestions[i++] = suggestion;
+    // Looking up the few open buffers is much faster than comparing every file against every buffer
+    for_each (buffer, app.buffers) {
+        if (!buffer->path) continue;
+        s32 *path_index = index->lookup.find(path_to_str_relative(buffer->path, app.browse_directory));
+        if (path_index) app.prompt.suggestions[positions[*path_index]].display_string_extra = get_status_mark(buffer);
     }
 
-    assert(i == app.prompt.suggestions.length);
     stack_leave_frame();
 }
 void _prompt_browse_execute(PromptSuggestion *selected, str typed)
@@ -1072,8 +1697,8 @@ void _prompt_browse_execute(PromptSuggestion *selected, str typed)
     } else if (typed.length > 0 && path_is_normal_file(absolute_typed)) {
         show_path(absolute_typed);
     } else if (selected) {
-        Path selected_path = (Path) selected->user_pointer;
-        show_path(selected_path);
+        Path selected_path = path_make_absolute(str_to_path(selected->display_string), app.browse_directory);
+        if (selected_path) show_path(selected_path);
     } else if (typed.length > 0) {
         prompt_confirm_create_file(absolute_typed);
     }
@@ -1107,6 +1732,8 @@ void app_init()
     }
 
     app.browse_directory = heap_copy(get_working_directory());
+    file_index_start(&app.file_index, app.browse_directory);
+    declarations_start(&app.declarations, app.browse_directory);
     set_working_directory(str_to_path(L"C:\\"));
 
     debug_printf("%s\n", BUILD_INFO);
@@ -1117,6 +1744,14 @@ void app_init()
     script_buffer->path_display_string = lit_to_str("<script output>");
     script_buffer->path_display_string_static = true;
     for (s32 i = 0; i < 2; ++i) script_buffer->last_show_time[i] = ++app.show_time;
+    app.build_error_buffer_index = app.script_buffer_index;
+
+    app.search_buffer_index = (s32) app.buffers.length;
+    Buffer *search_buffer = app.buffers.push();
+    search_buffer->no_user_input = true;
+    search_buffer->path_display_string = lit_to_str("<search results>");
+    search_buffer->path_display_string_static = true;
+    for (s32 i = 0; i < 2; ++i) search_buffer->last_show_time[i] = ++app.show_time;
 
     s32 scratch_buffer_index = (s32) app.buffers.length;
     Buffer *scratch = app.buffers.push();
@@ -1135,6 +1770,7 @@ void app_init()
             debug_printf("Couldn't create scratch file (%s)\n", io_error_to_str(scratch_create_error));
         }
         scratch->path = heap_copy(scratch_path);
+        ++buffer_path_generation;
     }
 
     app.splits[app.focused_split].buffer_index = -1;
@@ -1142,6 +1778,7 @@ void app_init()
 
     buffer_normalize(&app.command_buffer, &app.command_buffer.views[0]);
 
+    app.font.on_glyphs_ready = &request_redraw;
     font_change_size(&app.font, 10);
 
     Slice<CmdArg> command_line_arguments = slice(get_command_line_arguments(), 1);
@@ -1196,19 +1833,127 @@ bool on_close_requested(bool force_prompt)
     return(may_close);
 }
 
-void paste(Buffer *buffer, View *view, s32 where)
+struct PasteReader
 {
-    stack_enter_frame();
-    str clipboard_data;
-    char *error = get_from_clipboard(&clipboard_data);
-    if (!error) {
-        history_insert_sentinel(buffer); // Mark on every copy/paste. Previous line just keeps track of the mode
-        buffer_empty_all_selections(buffer, view);
+    Buffer *buffer;
+    View *view;
+    s32 where;
+    bool started;
+    bool streaming;
+    BufferInsertStream stream;
+    Array<char> text; // Everything, if we can't stream it into the buffer
+};
+
+void _paste_start(PasteReader *reader)
+{
+    reader->started = true;
+    history_insert_sentinel(reader->buffer); // Mark on every copy/paste. Previous line just keeps track of the mode
+    buffer_empty_all_selections(reader->buffer, reader->view);
+
+    // With a single caret the text can go into the buffer as it comes, however much there is
+    reader->streaming = reader->where == 0 && reader->view->selections.length == 1;
+    if (reader->streaming) buffer_insert_stream_begin(reader->buffer, reader->view, &reader->stream);
+}
+
+void _paste_read(void *data, str block)
+{
+    PasteReader *reader = (PasteReader *) data;
+    if (!reader->started) _paste_start(reader);
+
+    if (reader->streaming) {
+        buffer_insert_stream_block(reader->buffer, &reader->stream, block);
+    } else {
+        memcpy(reader->text.push(block.length), block.data, block.length);
+    }
+}
+
+void _paste_finish(PasteReader *reader)
+{
+    if (!reader->started) _paste_start(reader);
+
+    if (reader->streaming) {
+        buffer_insert_stream_end(reader->buffer, reader->view, &reader->stream);
+    } else if (reader->text.length > 0) {
+        str text = { reader->text.data, reader->text.length };
+        if (reader->where == 0) {
+            buffer_insert_at_all_carets(reader->buffer, reader->view, text);
+        } else {
+            buffer_insert_on_new_line_at_all_carets(reader->buffer, reader->view, reader->where, text);
+        }
+    }
+    reader->text.free();
 
-        u64 hash = hash_good_64(clipboard_data);
-        if (hash == app.platform_clipboard_hash && view->selections.length > 1 && app.clipboard.length > 1) {
-            // NB (Morten, 2020-05-11) We assume that if the hashes are equal, the clipboard has not been modified
+    history_insert_sentinel(reader->buffer);
+}
+
+// Going through the platform clipboard replaces invalid utf8 with 0xfffd, joins encoded surrogate pairs into one codepoint,
+// and cuts the text off at the first zero byte. We only take our own copy directly if none of that would change anything.
+bool _clipboard_survives_round_trip(Slice<str> parts)
+{
+    for_each (part, parts) {
+        u8 *data = (u8 *) part->data;
+        if (!utf8_validate(data, part->length) || memchr(data, 0, part->length)) return(false);
+        for (u8 *lead = data; (lead = (u8 *) memchr(lead, 0xed, part->length - (lead - data))); ++lead) {
+            if (lead + 1 < data + part->length && lead[1] >= 0xa0) return(false); // A surrogate
+        }
+    }
+    return(true);
+}
 
+#if defined(DEBUG)
+// Sends 5M short random strings through the same conversions as copying to and pasting from the platform clipboard, and
+// checks that '_clipboard_survives_round_trip' never says yes when the text would come back changed. It may say no when the
+// text would survive, for example for a lone encoded surrogate, which just means we go through the platform clipboard. The
+// bytes are picked to make zeros, invalid sequences, encoded surrogates and codepoints of every length common.
+void _clipboard_round_trip_check()
+{
+    enum { COUNT = 5000000, MAX_LENGTH = 12 };
+    u8 pick[] = { 'a', 0, 0xed, 0xa0, 0x80, 0xbf, 0x9f, 0xc3, 0xa9, 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80, 0xf4, 0x90, 0xc0 };
+
+    u32 random = 0x2545f491;
+    #define RANDOM(n) ((random ^= random << 13, random ^= random >> 17, random ^= random << 5) % (n))
+    s32 direct_count = 0, unchanged_count = 0;
+    for (s32 i = 0; i < COUNT; ++i) {
+        u8 bytes[MAX_LENGTH];
+        s64 length = RANDOM(MAX_LENGTH + 1);
+        for (s64 j = 0; j < length; ++j) bytes[j] = pick[RANDOM(alen(pick))];
+        str text = { (char *) bytes, length };
+
+        // The platform clipboard holds zero terminated utf16
+        stack_enter_frame();
+        u16 wide[MAX_LENGTH + 1];
+        s64 wide_length = _utf8_to_utf16_simd(bytes, length, wide);
+        for (s64 j = 0; j < wide_length; ++j) {
+            if (wide[j] == 0) wide_length = j;
+        }
+        str pasted = utf16_to_utf8({ (wchar_t *) wide, wide_length });
+        bool unchanged = pasted.length == text.length && memcmp(pasted.data, text.data, text.length) == 0;
+        stack_leave_frame();
+
+        bool direct = _clipboard_survives_round_trip({ &text, 1 });
+        assert(!direct || unchanged);
+        direct_count += direct;
+        unchanged_count += unchanged;
+    }
+    #undef RANDOM
+
+    debug_printf("clipboard round trip: %i random strings, %i would be pasted directly, %i come back unchanged\n",
+                 COUNT, direct_count, unchanged_count);
+}
+#endif
+
+void paste(Buffer *buffer, View *view, s32 where)
+{
+    PasteReader reader = {};
+    reader.buffer = buffer;
+    reader.view = view;
+    reader.where = where;
+
+    u32 sequence = clipboard_sequence_number();
+    if (sequence != 0 && sequence == app.platform_clipboard_sequence && app.clipboard.length > 0 && _clipboard_survives_round_trip(app.clipboard)) {
+        // Nobody has touched the clipboard since we copied, so we can take the text straight from 'app.clipboard'
+        if (view->selections.length > 1 && app.clipboard.length > 1) {
+            _paste_start(&reader);
             s32 n = min(app.clipboard.length, view->selections.length);
             for (s32 i = 0; i < n; ++i) {
                 str single = app.clipboard[i];
@@ -1216,20 +1961,22 @@ void paste(Buffer *buffer, View *view, s32 where)
             }
             buffer_view_set_focus_to_focused_selection(buffer, view);
             buffer_view_show(buffer, view, BUFFER_SHOW_ANYWHERE);
-
-        } else if (clipboard_data.length > 0) {
-            if (where == 0) {
-                buffer_insert_at_all_carets(buffer, view, clipboard_data);
-            } else {
-                buffer_insert_on_new_line_at_all_carets(buffer, view, where, clipboard_data);
+            history_insert_sentinel(buffer);
+        } else {
+            for_each (part, app.clipboard) {
+                _paste_read(&reader, *part);
+                if (app.clipboard.length > 1) _paste_read(&reader, lit_to_str("\n"));
             }
+            _paste_finish(&reader);
         }
-
-        history_insert_sentinel(buffer);
     } else {
-        debug_printf("Error while pasting (%s)\n", error);
+        char *error = get_from_clipboard(&_paste_read, &reader);
+        if (!error) {
+            _paste_finish(&reader);
+        } else {
+            debug_printf("Error while pasting (%s)\n", error);
+        }
     }
-    stack_leave_frame();
 }
 
 void on_typed(s32 codepoint, bool control, bool shift)
@@ -1563,30 +2310,21 @@ void on_typed(s32 codepoint, bool control, bool shift)
             }
 
             stack_leave_frame();
-            stack_enter_frame(); // stack frame for concatenating to build 'full'
 
-            str full;
-            if (app.clipboard.length == 1) {
-                full = app.clipboard[0];
-            } else {
-                full = {};
-                for_each (part, app.clipboard) {
-                    stack_printf_append(&full, "%.*s\n", str_fmt(*part));
-                }
-            }
+            // With several selections, each goes on its own line
+            str after_each = lit_to_str("\n");
+            if (app.clipboard.length == 1) after_each.length = 0;
 
-            if (full.length > 0) {
-                char *error = put_in_clipboard(full);
+            if (app.clipboard.length > 1 || app.clipboard[0].length > 0) {
+                char *error = put_in_clipboard(app.clipboard, after_each);
                 if (!error) {
                     if (codepoint == 'D') buffer_empty_all_selections(buffer, view);
                     if (codepoint == 'd') buffer_collapse_selections(buffer, view);
-                    app.platform_clipboard_hash = hash_good_64(full);
+                    app.platform_clipboard_sequence = clipboard_sequence_number();
                 } else if (error) {
                     debug_printf("Error while copying (%s)\n", error);
                 }
             }
-
-            stack_leave_frame();
         }
 
         else if (can_edit && (codepoint == 'u' || codepoint == 'U'))
@@ -1650,6 +2388,7 @@ void on_typed(s32 codepoint, bool control, bool shift)
                     if (buffer->path && buffer->external_status == Buffer::EXT_SAME) buffer_save(buffer);
 
                     app.show_build_script_info = true;
+                    app.build_error_buffer_index = app.script_buffer_index;
                     buffer_reset(&app.buffers[app.script_buffer_index]);
                     update_build_script_errors();
                     start_script(app.build_script);
@@ -1657,6 +2396,12 @@ void on_typed(s32 codepoint, bool control, bool shift)
             }
         }
         else if (codepoint == CHAR_F6) app.show_build_script_info = false;
+        else if (codepoint == CHAR_F7 && !app.prompt.showing) prompt_find_in_files();
+        else if (codepoint == CHAR_F8 && !app.prompt.showing)
+        {
+            if (shift) prompt_declarations();
+            else       go_to_declaration();
+        }
         else if (codepoint == 230 || codepoint == 198) // 'æ' and 'Æ'
         {
             app.show_build_script_info = true;
@@ -1681,7 +2426,7 @@ void on_typed(s32 codepoint, bool control, bool shift)
                 }
 
                 for (s32 i = 0; i < (app.split_view? 2 : 1); ++i) {
-                    if (app.splits[i].buffer_index == app.script_buffer_index) {
+                    if (app.splits[i].buffer_index == app.build_error_buffer_index) {
                         Buffer *buffer = &app.buffers[app.splits[i].buffer_index];
                         View *view = &buffer->views[app.splits[i].view_index];
                         buffer_jump_to_physical_line(buffer, view, error->script_output_line, false);
@@ -1732,6 +2477,35 @@ void on_typed(s32 codepoint, bool control, bool shift)
         }
         #endif
 
+        #if defined(DEBUG)
+        else if (codepoint == CHAR_F12 && shift) {
+            timing_toggle();
+            request_redraw();
+        } else if (codepoint == CHAR_F12 && control) {
+            stack_enter_frame();
+            Path path = path_make_absolute(str_to_path("trace.json"), app.browse_directory);
+            if (path) {
+                IoError result = timing_write_trace(path);
+                debug_printf("Writing trace to \"%s\" (%s)\n", path_to_str(path).data, io_error_to_str(result));
+            }
+            stack_leave_frame();
+        }
+        else if (codepoint == CHAR_F12) {
+            draw_target_benchmark();
+            font_warmup_benchmark();
+            hash_map_benchmark();
+            _fuzzy_match_benchmark();
+            _buffer_load_benchmark();
+            _line_endings_check();
+            _find_in_files_benchmark();
+            _clipboard_round_trip_check();
+            _unicode_benchmark();
+            #if FONT_BACKEND_truetype
+            truetype_check_against_gdi();
+            #endif
+        }
+        #endif
+
     } else if (app.edit_mode == EditMode::INSERT && codepoint >= 0) {
         assert(can_edit);
 
@@ -1875,17 +2649,77 @@ bool on_click(s32 x, s32 y, bool drag, bool control, bool shift)
     return(changed);
 }
 
+// Returns true if there is more work to do
+bool on_idle()
+{
+    enum { IDLE_BUDGET_MS = 4, IDLE_CHUNK_LINES = 1024 };
+
+    if (_find_in_files_update()) request_redraw();
+
+    // Prompt suggestions point into the file index and the declaration table, so we leave them alone while a prompt is up
+    if (!app.prompt.showing) {
+        if (file_index_collect(&app.file_index)) declarations_request_update(&app.declarations);
+        if (declarations_collect(&app.declarations)) request_redraw();
+        if (app.file_index.walk_done) declarations_update(&app.declarations, app.file_index.paths.as_slice());
+    }
+
+    // The budget covers all buffers, so we stop as soon as it runs out rather than moving on to the next buffer
+    Time start = time_read();
+    for_each (buffer, app.buffers) {
+        while (buffer_highlight_in_background(buffer, IDLE_CHUNK_LINES)) {
+            if (time_convert(start, time_read(), MILLISECONDS) >= IDLE_BUDGET_MS) return(true);
+        }
+    }
+    return(false);
+}
+
 bool on_three_second_timer()
 {
     bool any_changes = false;
     for_each (buffer, app.buffers) {
         any_changes |= buffer_check_for_external_changes(buffer);
     }
+
+    // Edits don't show up in the file index, so we look for them here. Files which didn't change are not read again.
+    declarations_request_update(&app.declarations);
     return(any_changes);
 }
 
 
 
+// Identifies everything that goes into drawing the text of a line, so we can reuse the strip we made last time we drew it.
+// 'iterator' must not be past the start of the line, and is left at its last run.
+u64 draw_buffer_line_key(Buffer *buffer, s32 line_index, str line_text, HighlightIterator *iterator, u64 style)
+{
+    VirtualLine *line = &buffer->lines[line_index];
+
+    stack_enter_frame();
+    s64 max_runs = max(line_text.length, 1);
+    u8 *data = stack_alloc_uninitialized(u8, sizeof(u64) + 2*sizeof(s32) + max_runs*(sizeof(s32) + sizeof(u8)) + line_text.length);
+    u8 *cursor = data;
+
+    memcpy(cursor, &style, sizeof(u64)); cursor += sizeof(u64);
+    memcpy(cursor, &line->virtual_indent, sizeof(s32)); cursor += sizeof(s32);
+    memcpy(cursor, &line->flags, sizeof(u32)); cursor += sizeof(u32);
+
+    s32 offset = line->start;
+    while (offset < line->end) {
+        u8 kind = (u8) buffer_highlight_iterator_advance(buffer, iterator, offset);
+        s32 run_end = clamp(iterator->run_end, offset + 1, line->end);
+        s32 run_length = run_end - offset;
+        memcpy(cursor, &run_length, sizeof(s32)); cursor += sizeof(s32);
+        *cursor++ = kind;
+        offset = run_end;
+    }
+
+    memcpy(cursor, line_text.data, line_text.length); cursor += line_text.length;
+
+    str bytes = { (char *) data, cursor - data };
+    u64 key = hash_good_64(bytes);
+    stack_leave_frame();
+    return(key);
+}
+
 bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focused)
 {
     s64 visible_lines = (canvas.area.y1 - canvas.area.y0) / app.font.metrics.line_height;
@@ -1918,6 +2752,11 @@ bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focuse
     view->layout_offset = { MARGIN, y0 - line_index_start*line_height };
     s32 line_index_end = line_index_start + line_count;
 
+    // Everything we draw below moves with the text, so the renderer can reuse pixels when we scroll
+    draw_scroll_region(&canvas, -view->layout_offset.y);
+
+    buffer_highlight_until(buffer, line_index_end + margin_lines);
+
     bool in_edit_mode = focused && app.edit_mode == EditMode::INSERT;
     u32 ColorCaret = in_edit_mode? colors.caret_insert : colors.caret;
     u32 ColorCaretInactive = in_edit_mode? colors.caret_insert : colors.caret_inactive;
@@ -1936,8 +2775,26 @@ bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focuse
     s32 offset_start = buffer->lines[line_index_start].start;
     s32 offset_end   = buffer->lines[line_index_end - 1].end;
 
-    s32 highlight_index = 0;
-    while (highlight_index + 16 < buffer->highlights.length && buffer->highlights[highlight_index + 16].end < offset_start) highlight_index += 16;
+    HighlightIterator highlight_iterator = buffer_highlight_iterator(buffer, offset_start);
+
+    u64 style = 0;
+    {
+        struct {
+            Colors colors;
+            s32 font_size;
+            s32 glyph_generation; // Placeholders we drew are replaced when they finish rasterizing
+            s32 tab_width;
+            bool show_special_characters;
+            u64 declarations_generation; // Identifiers we know the declaration of get their own color
+        } style_data = {};
+        style_data.colors = colors;
+        style_data.font_size = app.font.metrics.size;
+        style_data.glyph_generation = app.font.glyph_generation;
+        style_data.tab_width = buffer->tab_width;
+        style_data.show_special_characters = app.show_special_characters;
+        style_data.declarations_generation = app.declarations.generation;
+        style = hash_good_64({ (char *) &style_data, sizeof(style_data) });
+    }
 
     // We could use a binary search here, but usually there are few selections, so I can't be bothered implementing one
     while (selection_start < selection_end && selection_start->end.offset < offset_start) ++selection_start;
@@ -2005,6 +2862,19 @@ bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focuse
         s32 x0 = MARGIN + line->virtual_indent*app.font.metrics.advance;
         s32 x = x0;
 
+        stack_enter_frame();
+        str line_text = buffer_get_virtual_line_text(buffer, line_index);
+
+        // NB The key moves the iterator through the line, so lines we reuse don't have to walk their highlights again
+        HighlightIterator line_iterator = highlight_iterator;
+        u64 strip_key = draw_buffer_line_key(buffer, line_index, line_text, &highlight_iterator, style);
+        if (draw_text_strip(&canvas, &app.text_strips, strip_key, 0, y)) {
+            stack_leave_frame();
+            continue;
+        }
+        highlight_iterator = line_iterator;
+        s32 first_command = text_strip_begin(&canvas);
+
         s32 tab_width = (buffer->tab_width? buffer->tab_width : TAB_WIDTH_DEFAULT) * app.font.metrics.advance;
 
         if (line->virtual_indent > 0) {
@@ -2014,27 +2884,30 @@ bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focuse
         s32 buffer_offset = line->start;
         s32 line_offset = 0;
 
-        stack_enter_frame();
-        str line_text = buffer_get_virtual_line_text(buffer, line_index);
+        // We look up each identifier once, when we get to its first character on this line
+        s32 identifier_end = -1;
+        bool identifier_declared = false;
 
         while (line_offset < line_text.length) {
-            while (highlight_index < buffer->highlights.length && buffer->highlights[highlight_index].end <= buffer_offset) {
-                ++highlight_index;
-            }
             u32 color = colors.foreground;
-            if (highlight_index < buffer->highlights.length && buffer->highlights[highlight_index].start <= buffer_offset) {
-                switch (buffer->highlights[highlight_index].kind) {
-                    case HighlightKind::Comment:           color = colors.comment; break;
-                    case HighlightKind::Keyword:           color = colors.keyword; break;
-                    case HighlightKind::Identifier:        color = colors.foreground; break;
-                    case HighlightKind::OtherLiteral:      color = colors.literal; break;
-                    case HighlightKind::NumberLiteral:     color = colors.literal; break;
-                    case HighlightKind::StringLiteral:     color = colors.string; break;
-                    case HighlightKind::CharacterLiteral:  color = colors.literal; break;
-                    case HighlightKind::Preprocessor:      color = colors.preprocessor; break;
-                    default: break;
-                };
-            }
+            switch (buffer_highlight_iterator_advance(buffer, &highlight_iterator, buffer_offset)) {
+                case HighlightKind::Comment:           color = colors.comment; break;
+                case HighlightKind::Keyword:           color = colors.keyword; break;
+                case HighlightKind::Identifier: {
+                    if (buffer_offset >= identifier_end) {
+                        identifier_end = min(highlight_iterator.run_end, buffer_length(buffer));
+                        str name = buffer_get_slice(buffer, min(highlight_iterator.run_start, identifier_end), identifier_end);
+                        identifier_declared = declaration_find(&app.declarations, name) != null;
+                    }
+                    color = identifier_declared? colors.declared : colors.foreground;
+                } break;
+                case HighlightKind::OtherLiteral:      color = colors.literal; break;
+                case HighlightKind::NumberLiteral:     color = colors.literal; break;
+                case HighlightKind::StringLiteral:     color = colors.string; break;
+                case HighlightKind::CharacterLiteral:  color = colors.literal; break;
+                case HighlightKind::Preprocessor:      color = colors.preprocessor; break;
+                default: break;
+            };
 
             DecodedCodepoint decoded = decode_utf8((u8 *) line_text.data + line_offset, line_text.length - line_offset);
             buffer_offset += decoded.length;
@@ -2048,11 +2921,12 @@ bool draw_buffer(DrawTargetSlice canvas, Buffer *buffer, View *view, bool focuse
             }
         }
 
-        stack_leave_frame();
-
         if (line->flags & VirtualLine::MARK_CONTINUATION) {
             draw_glyphs(&canvas, &app.font, valid_decoded_codepoint(SOFTWRAP_POST_CODEPOINT), x, y, colors.support);
         }
+
+        text_strip_end(&canvas, &app.text_strips, first_command, strip_key, 0, y);
+        stack_leave_frame();
     }
     draw_glyphs(&canvas, &app.font, valid_decoded_codepoint(BUFFER_END_MARKER), MARGIN, y0 + line_height*(line_index_end - line_index_start), colors.support);
 
@@ -2215,6 +3089,9 @@ bool draw_buffer_and_status(DrawTargetSlice canvas, s32 Split)
 
 bool redraw(DrawTargetSlice canvas)
 {
+    font_collect_glyphs(&app.font);
+    text_strip_cache_next_frame(&app.text_strips);
+
     s32 top = 0;
     s32 width = canvas.area.x1 - canvas.area.x0;
     s32 height = canvas.area.y1 - canvas.area.y0;
@@ -2227,11 +3104,16 @@ bool redraw(DrawTargetSlice canvas)
         DrawTargetSlice script_canvas = draw_target_slice(&canvas, 0, 0, width, script_info_height);
 
         s64 exit_code = script_last_exit_code();
+        bool search_results = app.build_error_buffer_index == app.search_buffer_index;
+        bool searching = find_in_files_running(&app.find_in_files);
 
         str message;
-        if (exit_code == SCRIPT_HASNT_RUN) {
+        if (search_results && app.build_error_active < 0) {
+            message = stack_printf("%s \"%.*s\", %lli results", searching? "Searching for" : "Searched for",
+                                   str_fmt(app.find_in_files.needle), app.build_errors.length);
+        } else if (!search_results && exit_code == SCRIPT_HASNT_RUN) {
             message = lit_to_str("Script has not been started");
-        } else if (exit_code == SCRIPT_STILL_RUNNING) {
+        } else if (!search_results && exit_code == SCRIPT_STILL_RUNNING) {
             char *DisplayString = path_to_str(app.build_script).data;
             message = stack_printf("Running %s...", DisplayString);
         } else if (app.build_error_active >= 0) {
@@ -2242,8 +3124,12 @@ bool redraw(DrawTargetSlice canvas)
         }
 
         u32 color_background = colors.script_running;
-        if (exit_code == 0) color_background = colors.script_good;
-        if (exit_code > 0) color_background = colors.script_bad;
+        if (search_results) {
+            if (!searching) color_background = app.build_errors.length > 0? colors.script_good : colors.script_bad;
+        } else {
+            if (exit_code == 0) color_background = colors.script_good;
+            if (exit_code > 0) color_background = colors.script_bad;
+        }
         draw_solid(&script_canvas, 0, 0, width, script_info_height, color_background);
         draw_text_ellipsis(&script_canvas, &app.font, message, 2*MARGIN, width - 2*MARGIN, MARGIN, colors.background, false);
 
@@ -2265,6 +3151,8 @@ bool redraw(DrawTargetSlice canvas)
         animating |= draw_buffer_and_status(canvas_full, 0);
     }
 
+    timing_draw(&canvas, &app.font);
+
     return(animating);
 }
 
@@ -2304,6 +3192,9 @@ BuildErrorCachedPath *build_error_get_cached_path(str raw)
 
 void update_build_script_errors()
 {
+    // Search results are added as they come in, see '_find_in_files_update'
+    if (app.build_error_buffer_index != app.script_buffer_index) return;
+
     app.build_errors.clear();
     app.build_error_active = -1;
 
@@ -5,8 +5,10 @@
 #include "graphics.hpp"
 #include "timing.hpp"
 
-char *put_in_clipboard(str data);
-char *get_from_clipboard(str *result);
+char *put_in_clipboard(Slice<str> parts, str after_each);
+typedef void ClipboardReader(void *data, str block);
+char *get_from_clipboard(ClipboardReader *reader, void *reader_data);
+u32 clipboard_sequence_number();
 bool prompt_with_dialog(str title, str message);
 
 void start_script(Path script_path);
@@ -53,6 +55,7 @@ bool on_click(s32 x, s32 y, bool drag, bool control, bool shift);
 void on_file_dropped(s32 x, s32 y, Path path);
 void on_script_output(str Data);
 bool on_three_second_timer();
+bool on_idle();
 bool on_close_requested(bool force_prompt);
 bool redraw(DrawTargetSlice canvas);
 
@@ -102,6 +105,8 @@ struct BackendWin32
     DrawTarget backbuffer;
     bool resubmit_everything_next_frame;
 
+    bool idle_work_pending;
+
     bool script_has_run_ever;
     void *script_wait_thread;
     void *script_job;
@@ -152,11 +157,20 @@ void backend_main()
     win32::ShowWindow(window_handle, win32::SW_SHOW);
 
     while (!backend.close_requested) {
-        debug_assert(!global_stack_allocator.length); // Uh oh, somebody forgot a stack frame
+        debug_assert(!stack_allocated_bytes()); // Uh oh, somebody forgot a stack frame
 
         win32::window_message msg = {};
-        s32 result = win32::GetMessageW(&msg, 0, 0, 0);
-        assert(result != -1);
+        if (backend.idle_work_pending) {
+            // NB Only do idle work when there are no messages, so it never delays input
+            if (!win32::PeekMessageW(&msg, 0, 0, 0, win32::PM_REMOVE)) {
+                backend.idle_work_pending = on_idle();
+                continue;
+            }
+        } else {
+            s32 result = win32::GetMessageW(&msg, 0, 0, 0);
+            assert(result != -1);
+        }
+        backend.idle_work_pending = true;
 
         if (msg.Message == win32::WM_APP) {
             ScriptWaitMessage *message = (ScriptWaitMessage *) msg.W;
@@ -174,6 +188,9 @@ void backend_main()
 
 int main()
 {
+    stack_init();
+    timing_init();
+
     if (win32::IsDebuggerPresent()) {
         backend_main();
     } else {
@@ -287,17 +304,21 @@ s64 my_window_proc(void *window_handle, s32 message, u64 w, s64 l)
             win32::paint_struct Paint = {};
             win32::BeginPaint(window_handle, &Paint);
 
-            timing_start("resize");
+            timing_start_frame();
+            timing_begin("resize");
             draw_target_set_size(&backend.backbuffer, width, height);
             DrawTargetSlice canvas = draw_target_as_slice(&backend.backbuffer);
-            timing_start("redraw");
+            timing_end();
+
+            timing_begin("redraw");
             bool redraw_again = redraw(canvas);
-            timing_draw(&canvas);
+            timing_end();
 
-            timing_start("draw_target_finish");
+            timing_begin("draw_target_finish");
             draw_target_finish(&backend.backbuffer);
+            timing_end();
 
-            timing_start("blit");
+            timing_begin("blit");
             win32::bitmap_info bmp = {};
             bmp.Header.Size = sizeof(bmp.Header);
             bmp.Header.Width = width;
@@ -340,11 +361,13 @@ s64 my_window_proc(void *window_handle, s32 message, u64 w, s64 l)
             }
 
             win32::EndPaint(window_handle, &Paint);
+            timing_end();
 
             if (redraw_again) request_redraw();
         
-            timing_start("dwm_flush");
+            timing_begin("dwm_flush");
             win32::DwmFlush(); // TODO On some versions of windows, this might not block. We should try detecting that, and at least issue a sleep, so we don't repaint as fast as possible
+            timing_end();
 
             timing_finish_frame();
         } break;
@@ -508,14 +531,16 @@ s64 my_window_proc(void *window_handle, s32 message, u64 w, s64 l)
 }
 
 // TODO We currently just do the bare minimum to support ansi text, and hope we only really have to deal with unicode text most of the time. In theory, when reading from the clipboard we still have to read CF_LOCALE and use it to properly decode from ansi. When pasting we would have to determine the optimal locale and translate unicode into that before passing it into CF_TEXT. Implementing this without having a program which only outputs CF_TEXT for testing seems pointless though.
-char *put_in_clipboard(str data)
+// Puts 'parts' in the clipboard, each followed by 'after_each'. We encode straight into the memory we give to the clipboard.
+// NB That memory is sized for the worst case, where every byte becomes a utf16 unit.
+char *put_in_clipboard(Slice<str> parts, str after_each)
 {
     char *error = null;
 
-    stack_enter_frame();
-    wstr encoded_string = utf8_to_utf16(data);
+    s64 max_length = 0;
+    for_each (part, parts) max_length += part->length + after_each.length;
 
-    void *global_mem = (u16*) win32::GlobalAlloc(win32::GMEM_MOVEABLE, (encoded_string.length + 1) * sizeof(wchar_t));
+    void *global_mem = (u16*) win32::GlobalAlloc(win32::GMEM_MOVEABLE, (max_length + 1) * sizeof(wchar_t));
     if (!global_mem) {
         error = "Couldn't allocate space for unicode text";
     } else {
@@ -524,8 +549,12 @@ char *put_in_clipboard(str data)
             error = "Couldn't lock memory for unicode text";
             win32::GlobalFree(global_mem);
         } else {
-            memcpy(locked_global_mem, encoded_string.data, encoded_string.length * sizeof(wchar_t));
-            locked_global_mem[encoded_string.length] = 0;
+            s64 length = 0;
+            for_each (part, parts) {
+                length += _utf8_to_utf16_simd((u8 *) part->data, part->length, locked_global_mem + length);
+                length += _utf8_to_utf16_simd((u8 *) after_each.data, after_each.length, locked_global_mem + length);
+            }
+            locked_global_mem[length] = 0;
             s32 lock_count = win32::GlobalUnlock(global_mem);
             assert(lock_count == 0);
 
@@ -540,11 +569,14 @@ char *put_in_clipboard(str data)
         }
     }
 
-    stack_leave_frame();
     return(error);
 }
 
-char *get_from_clipboard(str *result)
+enum { CLIPBOARD_BLOCK_LENGTH = 1024*1024 }; // In utf16 units
+
+// Gives the text in the clipboard to 'reader' in blocks, converting one block at a time, so we never have all of a large
+// paste on the stack at once. Blocks end after a newline where there is one, and never split a surrogate pair.
+char *get_from_clipboard(ClipboardReader *reader, void *reader_data)
 {
     char *error = null;
     if (win32::OpenClipboard(backend.window_handle)) {
@@ -558,9 +590,25 @@ char *get_from_clipboard(str *result)
         if (has_unicode) {
             void *data = win32::GetClipboardData(win32::CF_UNICODETEXT);
             wchar_t *unlocked_data = (wchar_t *) win32::GlobalLock(data);
-            if (data) {
+            if (unlocked_data) {
                 s64 data_length = cstring_length(unlocked_data);
-                *result = utf16_to_utf8({ unlocked_data, data_length });
+                for (s64 offset = 0; offset < data_length;) {
+                    s64 end = min(offset + CLIPBOARD_BLOCK_LENGTH, data_length);
+                    if (end < data_length) {
+                        s64 line_end = end;
+                        while (line_end > offset && unlocked_data[line_end - 1] != '\n') --line_end;
+                        if (line_end > offset) {
+                            end = line_end;
+                        } else if (unlocked_data[end - 1] >= 0xd800 && unlocked_data[end - 1] <= 0xdbff) {
+                            --end;
+                        }
+                    }
+
+                    stack_enter_frame();
+                    reader(reader_data, utf16_to_utf8({ unlocked_data + offset, end - offset }));
+                    stack_leave_frame();
+                    offset = end;
+                }
                 win32::GlobalUnlock(data);
             } else {
                 error = "Couldn't retrieve unicode text from clipboard data";
@@ -569,9 +617,11 @@ char *get_from_clipboard(str *result)
             debug_printf("Pasting ANSI text from clipboard. This might give messed up output!\n");
             void *data = win32::GetClipboardData(win32::CF_TEXT);
             char *unlocked_data = (char *) win32::GlobalLock(data);
-            if (data) {
+            if (unlocked_data) {
                 u64 data_length = cstring_length(unlocked_data);
-                *result = windows_ansi_to_utf8((u8 *) unlocked_data, data_length);
+                stack_enter_frame();
+                reader(reader_data, windows_ansi_to_utf8((u8 *) unlocked_data, data_length));
+                stack_leave_frame();
                 win32::GlobalUnlock(data);
             } else {
                 error = "Couldn't retrieve ansi text from clipboard data";
@@ -587,6 +637,12 @@ char *get_from_clipboard(str *result)
     return(error);
 }
 
+// Changes whenever anyone puts something in the clipboard
+u32 clipboard_sequence_number()
+{
+    return(win32::GetClipboardSequenceNumber());
+}
+
 bool prompt_with_dialog(str title, str message)
 {
     stack_enter_frame();
@@ -6,6 +6,7 @@
     X(literal,               0x967c9c,   0xa9547a) \
     X(string,                0xbebe50,   0xb07213) \
     X(preprocessor,          0x3da071,   0x40883c) \
+    X(declared,              0x7f9cb0,   0x2e6078) \
     X(special,               0xac6531,   0xe2833d) \
     X(support,               0x403c35,   0xae9e86) \
     X(caret,                 0x50d050,   0x1566b7) \
@@ -0,0 +1,875 @@
+#pragma once
+
+// Declaration index
+//
+// Knows where the functions, types, macros, enum values and globals in the C, Odin and Python files below the browse
+// directory are declared. A worker thread runs each file through the same highlight function we draw it with, and picks
+// declarations out of the identifiers, keywords and punctuation that leaves, so comments and strings never confuse it.
+// Finished tables are saved in the appdata folder, and a pass only reads files whose size or write time changed.
+// NB The worker only ever reads 'table', so the main thread can use it at any time. The main thread swaps in the table a
+// pass made in 'declarations_collect'.
+
+enum DeclarationKind : u8
+{
+    DECLARATION_FUNCTION,
+    DECLARATION_TYPE,
+    DECLARATION_MACRO,
+    DECLARATION_VALUE,     // Enum values, and constants in Odin
+    DECLARATION_VARIABLE,
+    DECLARATION_PROTOTYPE, // Functions declared without their body
+};
+
+struct Declaration
+{
+    u32 name_offset; // Into 'DeclarationTable::names'
+    u16 name_length;
+    DeclarationKind kind;
+    s32 file;        // Into 'DeclarationTable::files'
+    s32 line;        // Starting at 1
+    s32 next;        // Another declaration with the same name, or -1
+};
+
+struct DeclarationFile
+{
+    u32 path_offset; // Into 'DeclarationTable::names', relative to the indexed directory
+    u16 path_length;
+    FileStamp stamp;
+    u64 hash;        // Of the contents, so we don't look through files which were only touched
+    s32 first_declaration;
+    s32 declaration_count;
+};
+
+struct DeclarationTable
+{
+    Array<DeclarationFile> files;
+    Array<Declaration> declarations;
+    Array<char> names;
+    HashMap<str, s32> lookup; // First declaration with a given name
+};
+
+struct DeclarationIndex
+{
+    Path directory;
+    DeclarationTable *table; // Null until the first pass is done
+    u64 generation; // Changes whenever 'table' changes
+    bool update_wanted;
+
+    // Shared with the worker thread
+    Array<str> paths; // Relative to 'directory', on the heap
+    bool load_only;
+    DeclarationTable *finished; // Null if nothing changed
+    volatile long running;
+    volatile bool stop;
+    void *thread;
+};
+
+void declarations_start(DeclarationIndex *index, Path directory);
+void declarations_stop(DeclarationIndex *index);
+void declarations_request_update(DeclarationIndex *index);
+void declarations_update(DeclarationIndex *index, Slice<str> paths);
+bool declarations_collect(DeclarationIndex *index);
+Declaration *declaration_find(DeclarationIndex *index, str name);
+str declaration_name(DeclarationTable *table, Declaration *declaration);
+str declaration_path(DeclarationTable *table, Declaration *declaration);
+
+
+enum DeclarationLanguage : u8
+{
+    DECLARATION_LANGUAGE_NONE,
+    DECLARATION_LANGUAGE_C,
+    DECLARATION_LANGUAGE_ODIN,
+    DECLARATION_LANGUAGE_PYTHON,
+};
+
+DeclarationLanguage declaration_language(str path)
+{
+    auto function = HIGHLIGHT_FUNCTIONS[highlight_get_function_index(_path_string_get_extension(path))].function;
+    if (function == &highlight_c)      return(DECLARATION_LANGUAGE_C);
+    if (function == &highlight_odin)   return(DECLARATION_LANGUAGE_ODIN);
+    if (function == &highlight_python) return(DECLARATION_LANGUAGE_PYTHON);
+    return(DECLARATION_LANGUAGE_NONE);
+}
+
+str declaration_name(DeclarationTable *table, Declaration *declaration)
+{
+    str name = { table->names.data + declaration->name_offset, declaration->name_length };
+    return(name);
+}
+
+str declaration_path(DeclarationTable *table, Declaration *declaration)
+{
+    DeclarationFile *file = &table->files[declaration->file];
+    str path = { table->names.data + file->path_offset, file->path_length };
+    return(path);
+}
+
+// The first declaration of 'name', the others follow through 'Declaration::next'. Null if we don't know of any.
+Declaration *declaration_find(DeclarationIndex *index, str name)
+{
+    DeclarationTable *table = index->table;
+    if (!table || name.length == 0) return(null);
+    s32 *first = table->lookup.find(name);
+    return(first? &table->declarations[*first] : null);
+}
+
+
+// The highlight runs of a line are turned into a stream of these, which the language specific functions below look at one
+// token at a time. Comments are dropped, and everything that isn't highlighted becomes single character punctuation.
+enum DeclarationTokenKind : u8
+{
+    DECLARATION_TOKEN_IDENTIFIER,
+    DECLARATION_TOKEN_KEYWORD,
+    DECLARATION_TOKEN_DIRECTIVE,
+    DECLARATION_TOKEN_PUNCTUATION,
+    DECLARATION_TOKEN_LITERAL,
+};
+
+struct DeclarationToken
+{
+    DeclarationTokenKind kind;
+    str text;
+    char punctuation; // The character, for punctuation
+    char following;   // The character right after the token, or zero at the end of the line
+    bool first_on_line;
+    s32 line;
+    s32 column;
+};
+
+enum DeclarationBrace : u8
+{
+    DECLARATION_BRACE_SCOPE,
+    DECLARATION_BRACE_TRANSPARENT, // 'namespace' and 'extern "C"', whose contents are still at file scope
+    DECLARATION_BRACE_ENUM,
+};
+
+enum { DECLARATION_MAX_NESTING = 64 };
+
+struct DeclarationScanner
+{
+    DeclarationTable *table;
+    DeclarationLanguage language;
+    s32 file;
+    GapArray<HighlightRun> runs;
+
+    DeclarationToken previous;
+    s32 paren_depth;
+    s32 brace_depth;
+    s32 scope_depth; // Braces which aren't transparent
+    DeclarationBrace braces[DECLARATION_MAX_NESTING];
+    DeclarationBrace next_brace;
+
+    // An identifier which might be declared, depending on what comes after it
+    DeclarationToken candidate;
+    bool has_candidate;
+    s32 colons;
+
+    // C only
+    s32 directive_line;
+    bool directive_define;
+    DeclarationToken function;
+    s32 parameters_depth; // Paren depth outside of the parameter list of 'function', or -1
+    bool after_parameters;
+    enum { TYPE_NONE, TYPE_KEYWORD, TYPE_NAMED, TYPE_BASES } type_state;
+    DeclarationToken type_name;
+    bool has_type_name;
+    bool type_enum;
+    bool in_typedef;
+    bool typedef_locked;
+    bool has_typedef_name;
+    s32 typedef_scope;
+    DeclarationToken typedef_name;
+    s32 template_depth;
+};
+
+void _declarations_add(DeclarationScanner *scanner, DeclarationToken *name, DeclarationKind kind)
+{
+    DeclarationTable *table = scanner->table;
+    if (name->text.length > U16_MAX) return;
+
+    // 'typedef struct Foo {} Foo;' and the like
+    if (table->declarations.length > 0) {
+        Declaration *last = &table->declarations[table->declarations.length - 1];
+        if (last->file == scanner->file && last->line == name->line && declaration_name(table, last) == name->text) return;
+    }
+
+    Declaration declaration = {};
+    declaration.name_offset = (u32) table->names.length;
+    declaration.name_length = (u16) name->text.length;
+    declaration.kind = kind;
+    declaration.file = scanner->file;
+    declaration.line = name->line;
+    declaration.next = -1;
+    table->declarations.append(declaration);
+    memcpy(table->names.push(name->text.length), name->text.data, name->text.length);
+}
+
+bool _declarations_punctuation(DeclarationToken *token, char c)
+{
+    return(token->kind == DECLARATION_TOKEN_PUNCTUATION && token->punctuation == c);
+}
+
+// Braces and parentheses, and enum values, which C and Odin find the same way
+void _declarations_nesting(DeclarationScanner *scanner, DeclarationToken *token)
+{
+    bool in_enum = scanner->brace_depth > 0 && scanner->brace_depth <= DECLARATION_MAX_NESTING &&
+                   scanner->braces[scanner->brace_depth - 1] == DECLARATION_BRACE_ENUM;
+    if (in_enum && scanner->paren_depth == 0 && token->kind == DECLARATION_TOKEN_IDENTIFIER &&
+        (_declarations_punctuation(&scanner->previous, '{') || _declarations_punctuation(&scanner->previous, ',')))
+    {
+        _declarations_add(scanner, token, DECLARATION_VALUE);
+    }
+
+    if (token->kind != DECLARATION_TOKEN_PUNCTUATION) return;
+    switch (token->punctuation) {
+        case '(': ++scanner->paren_depth; break;
+        case ')': scanner->paren_depth = max(scanner->paren_depth - 1, 0); break;
+
+        case '{': {
+            DeclarationBrace kind = scanner->next_brace;
+            if (scanner->brace_depth < DECLARATION_MAX_NESTING) scanner->braces[scanner->brace_depth] = kind;
+            ++scanner->brace_depth;
+            if (kind != DECLARATION_BRACE_TRANSPARENT) ++scanner->scope_depth;
+            scanner->next_brace = DECLARATION_BRACE_SCOPE;
+        } break;
+
+        case '}': {
+            // NB Unbalanced braces, say from an '#if', can't take us below file scope
+            if (scanner->brace_depth > 0) {
+                --scanner->brace_depth;
+                bool transparent = scanner->brace_depth < DECLARATION_MAX_NESTING &&
+                                   scanner->braces[scanner->brace_depth] == DECLARATION_BRACE_TRANSPARENT;
+                if (!transparent) scanner->scope_depth = max(scanner->scope_depth - 1, 0);
+            }
+        } break;
+    }
+}
+
+bool _declarations_c_type_like(DeclarationToken *token)
+{
+    if (token->kind == DECLARATION_TOKEN_IDENTIFIER) return(token->text.length > 0);
+    if (token->kind != DECLARATION_TOKEN_PUNCTUATION) return(false);
+    return(token->punctuation == '*' || token->punctuation == '&' || token->punctuation == '>');
+}
+
+// At file scope, an identifier after something which could be a type is a function if a parameter list follows, and a
+// variable if ';', '=', '[' or ',' follows. Named struct, union, class and enum definitions, typedefs, enum values and
+// '#define's are declarations anywhere.
+void _declarations_c(DeclarationScanner *scanner, DeclarationToken *token)
+{
+    // Only the name in a '#define' matters in preprocessor lines, and we skip everything else so the contents of macros
+    // don't confuse us
+    if (token->kind == DECLARATION_TOKEN_DIRECTIVE) {
+        scanner->directive_line = token->line;
+        scanner->directive_define = token->text == "#define";
+        return;
+    }
+    if (token->line == scanner->directive_line) {
+        if (scanner->directive_define && token->kind == DECLARATION_TOKEN_IDENTIFIER) _declarations_add(scanner, token, DECLARATION_MACRO);
+        scanner->directive_define = false;
+        if (_declarations_punctuation(token, '\\')) scanner->directive_line = token->line + 1;
+        return;
+    }
+
+    bool punctuation = token->kind == DECLARATION_TOKEN_PUNCTUATION;
+    char c = punctuation? token->punctuation : 0;
+
+    // The parameter list of a function just ended, so this tells us whether it has a body
+    if (scanner->after_parameters) {
+        if (c == '{') {
+            _declarations_add(scanner, &scanner->function, DECLARATION_FUNCTION);
+            scanner->after_parameters = false;
+        } else if (c == ';') {
+            _declarations_add(scanner, &scanner->function, DECLARATION_PROTOTYPE);
+            scanner->after_parameters = false;
+        } else if (token->kind != DECLARATION_TOKEN_IDENTIFIER && token->kind != DECLARATION_TOKEN_KEYWORD) {
+            // Things like 'const' and 'override' can come before the body, but anything else means this wasn't a function
+            scanner->after_parameters = false;
+        }
+    }
+
+    if (scanner->has_candidate) {
+        scanner->has_candidate = false;
+        if (c == '(') {
+            scanner->function = scanner->candidate;
+            scanner->parameters_depth = scanner->paren_depth;
+        } else if (c == ';' || c == '=' || c == '[' || c == ',') {
+            _declarations_add(scanner, &scanner->candidate, DECLARATION_VARIABLE);
+        }
+    }
+
+    // 'struct Foo {', 'enum struct Foo : u8 {' and friends. The name is added once we see the brace.
+    bool type_name = false;
+    if (scanner->type_state != DeclarationScanner::TYPE_NONE) {
+        if (c == '{') {
+            if (scanner->has_type_name) _declarations_add(scanner, &scanner->type_name, DECLARATION_TYPE);
+            if (scanner->type_enum) scanner->next_brace = DECLARATION_BRACE_ENUM;
+            scanner->type_state = DeclarationScanner::TYPE_NONE;
+        } else if (scanner->type_state == DeclarationScanner::TYPE_BASES) {
+            if (c == ';' || c == '(' || c == ')') scanner->type_state = DeclarationScanner::TYPE_NONE;
+        } else if (token->kind == DECLARATION_TOKEN_IDENTIFIER && scanner->type_state == DeclarationScanner::TYPE_KEYWORD) {
+            scanner->type_name = *token;
+            scanner->has_type_name = true;
+            scanner->type_state = DeclarationScanner::TYPE_NAMED;
+            type_name = true;
+        } else if (c == ':') {
+            scanner->type_state = DeclarationScanner::TYPE_BASES;
+        } else if (!(token->kind == DECLARATION_TOKEN_KEYWORD && scanner->type_state == DeclarationScanner::TYPE_KEYWORD)) {
+            // 'struct Foo *bar' and the like
+            scanner->type_state = DeclarationScanner::TYPE_NONE;
+        }
+    }
+
+    if (token->kind == DECLARATION_TOKEN_KEYWORD) {
+        str keyword = token->text;
+        if (keyword == "struct" || keyword == "union" || keyword == "class" || keyword == "enum") {
+            if (scanner->type_state != DeclarationScanner::TYPE_KEYWORD) {
+                scanner->type_enum = false;
+                scanner->has_type_name = false;
+            }
+            scanner->type_state = DeclarationScanner::TYPE_KEYWORD;
+            if (keyword == "enum") scanner->type_enum = true;
+        } else if (keyword == "namespace" || keyword == "extern") {
+            scanner->next_brace = DECLARATION_BRACE_TRANSPARENT;
+        } else if (keyword == "template") {
+            scanner->template_depth = -1;
+        } else if (keyword == "typedef" && scanner->paren_depth == 0) {
+            scanner->in_typedef = true;
+            scanner->typedef_locked = false;
+            scanner->has_typedef_name = false;
+            scanner->typedef_scope = scanner->scope_depth;
+        }
+    }
+
+    // Template parameters aren't declarations
+    if (scanner->template_depth != 0) {
+        if (c == '<') scanner->template_depth = max(scanner->template_depth, 0) + 1;
+        if (c == '>' && scanner->template_depth > 0) --scanner->template_depth;
+    }
+
+    if (scanner->in_typedef && scanner->scope_depth == scanner->typedef_scope && !scanner->typedef_locked) {
+        // The name is the last identifier, except in function pointers like 'typedef void (*Name)(int)'
+        if (token->kind == DECLARATION_TOKEN_IDENTIFIER && scanner->paren_depth == 0) {
+            scanner->typedef_name = *token;
+            scanner->has_typedef_name = true;
+        } else if (token->kind == DECLARATION_TOKEN_IDENTIFIER && scanner->paren_depth == 1 && _declarations_punctuation(&scanner->previous, '*')) {
+            scanner->typedef_name = *token;
+            scanner->has_typedef_name = true;
+            scanner->typedef_locked = true;
+        }
+    }
+
+    bool candidate = token->kind == DECLARATION_TOKEN_IDENTIFIER && !type_name && !scanner->in_typedef &&
+                     scanner->template_depth == 0 && scanner->scope_depth == 0 && scanner->paren_depth == 0 &&
+                     _declarations_c_type_like(&scanner->previous) && token->text != "operator";
+    if (candidate) {
+        scanner->candidate = *token;
+        scanner->has_candidate = true;
+    }
+
+    _declarations_nesting(scanner, token);
+
+    if (c == ')' && scanner->parameters_depth >= 0 && scanner->paren_depth == scanner->parameters_depth) {
+        scanner->parameters_depth = -1;
+        scanner->after_parameters = true;
+    }
+    if (c == ';' && scanner->paren_depth == 0) {
+        if (scanner->in_typedef && scanner->scope_depth == scanner->typedef_scope) {
+            if (scanner->has_typedef_name) _declarations_add(scanner, &scanner->typedef_name, DECLARATION_TYPE);
+            scanner->in_typedef = false;
+        }
+        scanner->next_brace = DECLARATION_BRACE_SCOPE;
+        scanner->type_state = DeclarationScanner::TYPE_NONE;
+        scanner->template_depth = 0;
+        scanner->parameters_depth = -1;
+    }
+    if (c == '{') scanner->parameters_depth = -1;
+
+    scanner->previous = *token;
+}
+
+// 'name :: proc', 'name :: struct' and other constants, and 'name: type' and 'name := value' variables, at file scope
+void _declarations_odin(DeclarationScanner *scanner, DeclarationToken *token)
+{
+    char c = token->kind == DECLARATION_TOKEN_PUNCTUATION? token->punctuation : 0;
+
+    if (scanner->has_candidate) {
+        if (c == ':' && scanner->colons < 2) {
+            ++scanner->colons;
+        } else {
+            scanner->has_candidate = false;
+            if (scanner->colons == 2) {
+                DeclarationKind kind = DECLARATION_VALUE;
+                if (token->kind == DECLARATION_TOKEN_KEYWORD) {
+                    str keyword = token->text;
+                    if (keyword == "proc") {
+                        kind = DECLARATION_FUNCTION;
+                    } else if (keyword == "struct" || keyword == "union" || keyword == "enum" ||
+                               keyword == "distinct" || keyword == "bit_set" || keyword == "bit_field") {
+                        kind = DECLARATION_TYPE;
+                    }
+                }
+                _declarations_add(scanner, &scanner->candidate, kind);
+            } else if (scanner->colons == 1) {
+                _declarations_add(scanner, &scanner->candidate, DECLARATION_VARIABLE);
+            }
+        }
+    }
+
+    if (token->kind == DECLARATION_TOKEN_KEYWORD && token->text == "enum") scanner->next_brace = DECLARATION_BRACE_ENUM;
+
+    if (token->kind == DECLARATION_TOKEN_IDENTIFIER && token->first_on_line && scanner->scope_depth == 0 && scanner->paren_depth == 0) {
+        scanner->candidate = *token;
+        scanner->has_candidate = true;
+        scanner->colons = 0;
+    }
+
+    _declarations_nesting(scanner, token);
+    scanner->previous = *token;
+}
+
+// 'def' and 'class' anywhere, and assignments at the start of unindented lines
+void _declarations_python(DeclarationScanner *scanner, DeclarationToken *token)
+{
+    char c = token->kind == DECLARATION_TOKEN_PUNCTUATION? token->punctuation : 0;
+
+    if (scanner->has_candidate) {
+        scanner->has_candidate = false;
+        if ((c == '=' && token->following != '=') || c == ':') _declarations_add(scanner, &scanner->candidate, DECLARATION_VARIABLE);
+    }
+
+    if (token->kind == DECLARATION_TOKEN_IDENTIFIER && scanner->previous.kind == DECLARATION_TOKEN_KEYWORD) {
+        if (scanner->previous.text == "def")   _declarations_add(scanner, token, DECLARATION_FUNCTION);
+        if (scanner->previous.text == "class") _declarations_add(scanner, token, DECLARATION_TYPE);
+    }
+
+    if (token->kind == DECLARATION_TOKEN_IDENTIFIER && token->column == 0 && scanner->paren_depth == 0) {
+        scanner->candidate = *token;
+        scanner->has_candidate = true;
+    }
+
+    if (c == '(' || c == '[' || c == '{') ++scanner->paren_depth;
+    if (c == ')' || c == ']' || c == '}') scanner->paren_depth = max(scanner->paren_depth - 1, 0);
+    scanner->previous = *token;
+}
+
+void _declarations_token(DeclarationScanner *scanner, DeclarationToken *token)
+{
+    switch (scanner->language) {
+        case DECLARATION_LANGUAGE_C:      _declarations_c(scanner, token); break;
+        case DECLARATION_LANGUAGE_ODIN:   _declarations_odin(scanner, token); break;
+        case DECLARATION_LANGUAGE_PYTHON: _declarations_python(scanner, token); break;
+        default: break;
+    }
+}
+
+// Adds the declarations in 'text' to 'scanner->table', as belonging to 'scanner->file'
+void declarations_scan(DeclarationScanner *scanner, str text)
+{
+    void (*highlight)(str line, HighlightState *state, HighlightEmitter *out) = null;
+    switch (scanner->language) {
+        case DECLARATION_LANGUAGE_C:      highlight = &highlight_c; break;
+        case DECLARATION_LANGUAGE_ODIN:   highlight = &highlight_odin; break;
+        case DECLARATION_LANGUAGE_PYTHON: highlight = &highlight_python; break;
+        default: return;
+    }
+
+    GapArray<HighlightRun> runs = scanner->runs;
+    DeclarationTable *table = scanner->table;
+    s32 file = scanner->file;
+    DeclarationLanguage language = scanner->language;
+    *scanner = {};
+    scanner->table = table;
+    scanner->file = file;
+    scanner->language = language;
+    scanner->parameters_depth = -1;
+    scanner->directive_line = -1;
+
+    HighlightState state = HighlightState::Default;
+    s32 line_number = 0;
+    for (s64 i = 0; i < text.length; ) {
+        char *newline = (char *) memchr(text.data + i, '\n', text.length - i);
+        s64 line_end = newline? newline - text.data + 1 : text.length;
+        str line = { text.data + i, min(line_end - i, (s64) S32_MAX) };
+        i = line_end;
+        ++line_number;
+
+        runs.clear();
+        HighlightEmitter emitter = highlight_emitter(&runs);
+        highlight(line, &state, &emitter);
+
+        DeclarationToken token = {};
+        token.line = line_number;
+        token.first_on_line = true;
+
+        s32 position = 0;
+        for (s32 r = 0; r <= runs.length; ++r) {
+            // The text after the last run isn't highlighted either
+            HighlightRun run = r < runs.length? runs[r] : HighlightRun { (u16) 0, (u8) HighlightKind::None };
+            s32 start = position;
+            s32 end = r < runs.length? position + run.length : (s32) line.length;
+            position = end;
+
+            HighlightKind kind = (HighlightKind) run.kind;
+            if (kind == HighlightKind::Comment || start == end) continue;
+
+            if (kind == HighlightKind::None) {
+                for (s32 j = start; j < end; ++j) {
+                    char c = line.data[j];
+                    if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v') continue;
+                    token.kind = DECLARATION_TOKEN_PUNCTUATION;
+                    token.text = { line.data + j, 1 };
+                    token.punctuation = c;
+                    token.following = j + 1 < line.length? line.data[j + 1] : 0;
+                    token.column = j;
+                    _declarations_token(scanner, &token);
+                    token.first_on_line = false;
+                }
+            } else {
+                switch (kind) {
+                    case HighlightKind::Identifier:   token.kind = DECLARATION_TOKEN_IDENTIFIER; break;
+                    case HighlightKind::Keyword:      token.kind = DECLARATION_TOKEN_KEYWORD; break;
+                    case HighlightKind::Preprocessor: token.kind = DECLARATION_TOKEN_DIRECTIVE; break;
+                    default:                          token.kind = DECLARATION_TOKEN_LITERAL; break;
+                }
+                token.text = { line.data + start, end - start };
+                token.punctuation = 0;
+                token.following = end < line.length? line.data[end] : 0;
+                token.column = start;
+                _declarations_token(scanner, &token);
+                token.first_on_line = false;
+            }
+        }
+    }
+
+    scanner->runs = runs;
+}
+
+
+void _declarations_free(DeclarationTable *table)
+{
+    if (!table) return;
+    table->files.free();
+    table->declarations.free();
+    table->names.free();
+    table->lookup.free();
+    heap_free(table);
+}
+
+DeclarationTable *_declarations_new()
+{
+    DeclarationTable *table = (DeclarationTable *) heap_alloc(sizeof(DeclarationTable));
+    *table = {};
+    return(table);
+}
+
+// Chains up declarations with the same name, in the order they appear in 'declarations'
+void _declarations_link(DeclarationTable *table)
+{
+    table->lookup.clear();
+    for (s64 i = table->declarations.length - 1; i >= 0; --i) {
+        Declaration *declaration = &table->declarations[i];
+        str name = declaration_name(table, declaration);
+        s32 *first = table->lookup.find(name);
+        declaration->next = first? *first : -1;
+        table->lookup.insert(name, (s32) i);
+    }
+}
+
+enum { DECLARATIONS_MAGIC = 0x64376d61, DECLARATIONS_VERSION = 1 };
+
+struct DeclarationsHeader
+{
+    u32 magic;
+    u32 version;
+    s64 file_count;
+    s64 declaration_count;
+    s64 names_length;
+};
+
+// NB Allocates on the stack
+Path _declarations_save_path(Path directory)
+{
+    str name = stack_printf("am7_declarations_%016llx.bin", hash_good_64(path_to_str(directory)));
+    return(path_make_absolute(str_to_path(name), get_appdata_path()));
+}
+
+void _declarations_save(Path directory, DeclarationTable *table)
+{
+    stack_enter_frame();
+
+    DeclarationsHeader header = {};
+    header.magic = DECLARATIONS_MAGIC;
+    header.version = DECLARATIONS_VERSION;
+    header.file_count = table->files.length;
+    header.declaration_count = table->declarations.length;
+    header.names_length = table->names.length;
+
+    s64 files_size = header.file_count*sizeof(DeclarationFile);
+    s64 declarations_size = header.declaration_count*sizeof(Declaration);
+    str data = {};
+    data.length = sizeof(header) + files_size + declarations_size + header.names_length;
+    data.data = (char *) heap_alloc(data.length);
+
+    char *cursor = data.data;
+    memcpy(cursor, &header, sizeof(header)); cursor += sizeof(header);
+    memcpy(cursor, table->files.data, files_size); cursor += files_size;
+    memcpy(cursor, table->declarations.data, declarations_size); cursor += declarations_size;
+    memcpy(cursor, table->names.data, header.names_length);
+
+    Path path = _declarations_save_path(directory);
+    if (path) {
+        IoError error = write_entire_file(path, data);
+        if (error != IoError::OK) debug_printf("Couldn't save declarations (%s)\n", io_error_to_str(error));
+    }
+
+    heap_free(data.data);
+    stack_leave_frame();
+}
+
+// Returns null if there is nothing saved for 'directory', or if what's saved doesn't make sense
+DeclarationTable *_declarations_load(Path directory)
+{
+    stack_enter_frame();
+
+    DeclarationTable *table = null;
+    Path path = _declarations_save_path(directory);
+    str data = {};
+    DeclarationsHeader header = {};
+    if (path && read_entire_file(path, &data) == IoError::OK && data.length >= (s64) sizeof(header)) {
+        memcpy(&header, data.data, sizeof(header));
+    }
+
+    bool valid = header.magic == DECLARATIONS_MAGIC && header.version == DECLARATIONS_VERSION &&
+                 header.file_count >= 0 && header.file_count < S32_MAX &&
+                 header.declaration_count >= 0 && header.declaration_count < S32_MAX &&
+                 header.names_length >= 0 && header.names_length < U32_MAX &&
+                 data.length == (s64) sizeof(header) + header.file_count*(s64) sizeof(DeclarationFile) +
+                                header.declaration_count*(s64) sizeof(Declaration) + header.names_length;
+    if (valid) {
+        table = _declarations_new();
+        char *cursor = data.data + sizeof(header);
+        memcpy(table->files.push(header.file_count), cursor, header.file_count*sizeof(DeclarationFile));
+        cursor += header.file_count*sizeof(DeclarationFile);
+        memcpy(table->declarations.push(header.declaration_count), cursor, header.declaration_count*sizeof(Declaration));
+        cursor += header.declaration_count*sizeof(Declaration);
+        memcpy(table->names.push(header.names_length), cursor, header.names_length);
+
+        for_each (file, table->files) {
+            valid &= (s64) file->path_offset + file->path_length <= table->names.length &&
+                     file->first_declaration >= 0 && file->declaration_count >= 0 &&
+                     (s64) file->first_declaration + file->declaration_count <= table->declarations.length;
+        }
+        for_each (declaration, table->declarations) {
+            valid &= (s64) declaration->name_offset + declaration->name_length <= table->names.length &&
+                     declaration->file >= 0 && declaration->file < table->files.length;
+        }
+
+        if (valid) {
+            _declarations_link(table);
+        } else {
+            _declarations_free(table);
+            table = null;
+        }
+    }
+
+    stack_leave_frame();
+    return(table);
+}
+
+// Makes a table for 'index->paths', taking what it can from 'previous'. Sets 'changed' if the result differs from 'previous'.
+DeclarationTable *_declarations_build(DeclarationIndex *index, DeclarationTable *previous, bool *changed)
+{
+    DeclarationTable *table = _declarations_new();
+
+    HashMap<str, s32> previous_files = {};
+    if (previous) {
+        for (s32 i = 0; i < previous->files.length; ++i) {
+            DeclarationFile *file = &previous->files[i];
+            previous_files.insert({ previous->names.data + file->path_offset, file->path_length }, i);
+        }
+    }
+
+    DeclarationScanner scanner = {};
+    scanner.table = table;
+
+    for (s64 p = 0; p < index->paths.length && !index->stop; ++p) {
+        str relative = index->paths[p];
+        DeclarationLanguage language = declaration_language(relative);
+        if (language == DECLARATION_LANGUAGE_NONE || relative.length > U16_MAX) continue;
+
+        stack_enter_frame();
+        Path path = path_make_absolute(str_to_path(relative), index->directory);
+        FileStamp stamp = {};
+        if (path && file_stamp(path, &stamp)) {
+            s32 *previous_index = previous_files.find(relative);
+            DeclarationFile *old = previous_index? &previous->files[*previous_index] : null;
+
+            DeclarationFile file = {};
+            file.stamp = stamp;
+            file.first_declaration = (s32) table->declarations.length;
+
+            bool reuse = old && old->stamp == stamp;
+            bool readable = true;
+            str data = {};
+            if (reuse) {
+                file.hash = old->hash;
+            } else {
+                readable = read_entire_file(path, &data) == IoError::OK;
+                file.hash = hash_good_64(data);
+                reuse = old && old->hash == file.hash;
+                *changed = true;
+            }
+
+            // We try again next time if we can't read it now
+            if (readable) {
+                file.path_offset = (u32) table->names.length;
+                file.path_length = (u16) relative.length;
+                memcpy(table->names.push(relative.length), relative.data, relative.length);
+
+                s32 file_index = (s32) table->files.length;
+                if (reuse) {
+                    for (s32 i = 0; i < old->declaration_count; ++i) {
+                        Declaration declaration = previous->declarations[old->first_declaration + i];
+                        str name = declaration_name(previous, &declaration);
+                        declaration.name_offset = (u32) table->names.length;
+                        declaration.file = file_index;
+                        table->declarations.append(declaration);
+                        memcpy(table->names.push(name.length), name.data, name.length);
+                    }
+                } else {
+                    scanner.file = file_index;
+                    scanner.language = language;
+                    declarations_scan(&scanner, data);
+                }
+
+                file.declaration_count = (s32) table->declarations.length - file.first_declaration;
+                table->files.append(file);
+            }
+        }
+        stack_leave_frame();
+    }
+
+    if (!previous || previous->files.length != table->files.length) *changed = true;
+
+    scanner.runs.free();
+    previous_files.free();
+    _declarations_link(table);
+    return(table);
+}
+
+void _declarations_work(DeclarationIndex *index)
+{
+    // NB The main thread doesn't touch 'index->table' while we run
+    DeclarationTable *previous = index->table;
+    DeclarationTable *loaded = null;
+    if (!previous) previous = loaded = _declarations_load(index->directory);
+
+    DeclarationTable *result = null;
+    if (index->load_only) {
+        result = loaded;
+        loaded = null;
+    } else {
+        bool changed = false;
+        timing_begin("declarations");
+        DeclarationTable *table = _declarations_build(index, previous, &changed);
+        timing_end();
+        if (changed && !index->stop) _declarations_save(index->directory, table);
+
+        // The main thread doesn't have the loaded table, so it needs this one even if nothing changed
+        if ((changed || loaded) && !index->stop) {
+            result = table;
+        } else {
+            _declarations_free(table);
+        }
+    }
+    _declarations_free(loaded);
+
+    index->finished = result;
+    _InterlockedExchange(&index->running, 0);
+    request_redraw();
+}
+
+u32 _declarations_routine(void *parameter)
+{
+    _declarations_work((DeclarationIndex *) parameter);
+    timing_thread_exit();
+    stack_thread_exit();
+    return(0);
+}
+
+void _declarations_start_pass(DeclarationIndex *index, Slice<str> paths, bool load_only)
+{
+    for_each (path, paths) {
+        if (declaration_language(*path) != DECLARATION_LANGUAGE_NONE) index->paths.append(heap_copy(*path));
+    }
+    index->load_only = load_only;
+    index->running = 1;
+    index->thread = win32::CreateThread(null, 0, &_declarations_routine, (void *) index, 0, null);
+    if (!index->thread) {
+        // Better slow than nothing
+        _declarations_work(index);
+    }
+}
+
+// Starts loading what we saved last time for 'directory', and asks for an update once the files there are known
+void declarations_start(DeclarationIndex *index, Path directory)
+{
+    declarations_stop(index);
+    index->directory = heap_copy(directory);
+    index->update_wanted = true;
+    _declarations_start_pass(index, {}, true);
+}
+
+void declarations_stop(DeclarationIndex *index)
+{
+    if (index->thread) {
+        index->stop = true;
+        win32::WaitForSingleObject(index->thread, U32_MAX);
+        win32::CloseHandle(index->thread);
+    }
+
+    _declarations_free(index->finished);
+    _declarations_free(index->table);
+    for (s64 i = 0; i < index->paths.length; ++i) heap_free(index->paths[i].data);
+    index->paths.free();
+    if (index->directory) heap_free(index->directory);
+
+    u64 generation = index->generation;
+    *index = {};
+    index->generation = generation + 1;
+}
+
+void declarations_request_update(DeclarationIndex *index)
+{
+    index->update_wanted = true;
+}
+
+// Starts a pass over 'paths' if an update was requested and the last pass is done. 'paths' are relative to the directory
+// passed to 'declarations_start', and can include files we don't know how to look through.
+void declarations_update(DeclarationIndex *index, Slice<str> paths)
+{
+    if (!index->directory || !index->update_wanted || index->running || index->thread || index->finished) return;
+    index->update_wanted = false;
+    _declarations_start_pass(index, paths, false);
+}
+
+// Swaps in the table from the last pass, once it is done. Returns true if 'table' changed.
+bool declarations_collect(DeclarationIndex *index)
+{
+    if (index->running) return(false);
+
+    if (index->thread) {
+        win32::WaitForSingleObject(index->thread, U32_MAX);
+        win32::CloseHandle(index->thread);
+        index->thread = null;
+    }
+    for (s64 i = 0; i < index->paths.length; ++i) heap_free(index->paths[i].data);
+    index->paths.length = 0;
+
+    if (!index->finished) return(false);
+    _declarations_free(index->table);
+    index->table = index->finished;
+    index->finished = null;
+    ++index->generation;
+    return(true);
+}
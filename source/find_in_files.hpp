@@ -0,0 +1,274 @@
+#pragma once
+
+// Find in files
+//
+// Searches a list of files for a string on worker threads. Each worker claims one file at a time, reads all of it in one go,
+// and pushes the lines with matches, formatted as 'path:line: text', to the main thread, which picks them up in
+// 'find_in_files_collect'. Matches are found the same way 'buffer_search' finds them, and a line is reported if any match on
+// it has all the flags in 'filters'.
+// NB Workers call 'request_redraw' when they have something new, or when the last of them is done.
+
+struct FindInFilesResult
+{
+    s32 path_index;     // Into 'FindInFiles::paths'
+    s32 line;           // Starting at 1
+    s32 length;         // Of the text for this result, including the newline
+    s32 message_offset; // Where the text of the matching line starts, after the path and line number
+};
+
+struct FindInFiles
+{
+    str needle;
+    u32 filters;
+    Path directory;
+    Array<str> paths; // Relative to 'directory'. These, 'needle' and 'directory' are on the heap
+
+    // Shared with the worker threads
+    volatile long lock;
+    Array<FindInFilesResult> results;
+    Array<char> text;
+    volatile long next_path;
+    volatile long running;
+    volatile bool stop;
+
+    s32 thread_count;
+    void *threads[PARALLEL_MAX_THREADS];
+};
+
+void find_in_files_start(FindInFiles *search, Path directory, Slice<str> paths, str needle, u32 filters);
+void find_in_files_stop(FindInFiles *search);
+bool find_in_files_collect(FindInFiles *search, Array<FindInFilesResult> *results, Array<char> *text);
+bool find_in_files_running(FindInFiles *search);
+
+
+enum {
+    FIND_IN_FILES_MAX_LINE_LENGTH = 256, // Longer lines are cut off in the results
+    FIND_IN_FILES_BINARY_CHECK_LENGTH = 8*1024, // Files with a zero byte this close to the start are skipped
+};
+
+void _find_in_files_lock(FindInFiles *search)
+{
+    while (_InterlockedCompareExchange(&search->lock, 1, 0) != 0) _mm_pause();
+}
+
+void _find_in_files_unlock(FindInFiles *search)
+{
+    _InterlockedExchange(&search->lock, 0);
+}
+
+// Gives the same result as 'str_search_ignore_case_internal'. We compare the first and last byte of the needle at 16
+// places at once, and only do the full comparison where both match, which skips most of the haystack.
+s64 _find_in_files_search(str haystack, str lowercase, str uppercase)
+{
+    s64 n = lowercase.length;
+    __m128i first_lower = _mm_set1_epi8(lowercase[0]);
+    __m128i first_upper = _mm_set1_epi8(uppercase[0]);
+    __m128i last_lower = _mm_set1_epi8(lowercase[n - 1]);
+    __m128i last_upper = _mm_set1_epi8(uppercase[n - 1]);
+
+    s64 i = 0;
+    for (; i + n - 1 + 16 <= haystack.length; i += 16) {
+        __m128i first = _mm_loadu_si128((__m128i *) (haystack.data + i));
+        __m128i last = _mm_loadu_si128((__m128i *) (haystack.data + i + n - 1));
+        __m128i first_match = _mm_or_si128(_mm_cmpeq_epi8(first, first_lower), _mm_cmpeq_epi8(first, first_upper));
+        __m128i last_match = _mm_or_si128(_mm_cmpeq_epi8(last, last_lower), _mm_cmpeq_epi8(last, last_upper));
+        u32 candidates = _mm_movemask_epi8(_mm_and_si128(first_match, last_match));
+        while (candidates) {
+            unsigned long bit;
+            _BitScanForward(&bit, candidates);
+            str candidate = { haystack.data + i + bit, n };
+            if (str_search_ignore_case_internal(candidate, lowercase, uppercase) == 0) return(i + bit);
+            candidates &= candidates - 1;
+        }
+    }
+
+    s64 rest = str_search_ignore_case_internal(slice(haystack, i), lowercase, uppercase);
+    return(rest == -1? -1 : i + rest);
+}
+
+s64 _find_in_files_count_newlines(char *data, s64 length)
+{
+    s64 count = 0;
+    s64 i = 0;
+    __m128i newline = _mm_set1_epi8('\n');
+    while (i + 16 <= length) {
+        // Each byte counts up to 255 newlines, so we sum them up before they overflow
+        __m128i counts = _mm_setzero_si128();
+        s64 block_end = min(length, i + 255*16);
+        for (; i + 16 <= block_end; i += 16) {
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (data + i)), newline));
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    for (; i < length; ++i) count += data[i] == '\n';
+    return(count);
+}
+
+void _find_in_files_append(Array<char> *text, str string)
+{
+    memcpy(text->push(string.length), string.data, string.length);
+}
+
+void _find_in_files_file(FindInFiles *search, s32 path_index, str lowercase, str uppercase, Array<FindInFilesResult> *results, Array<char> *text)
+{
+    timing_begin("find_in_files");
+    stack_enter_frame();
+    str relative = search->paths[path_index];
+    Path path = path_make_absolute(str_to_path(relative), search->directory);
+
+    str data = {};
+    bool readable = path && read_entire_file(path, &data) == IoError::OK;
+    for (s64 i = 0; readable && i < min(data.length, FIND_IN_FILES_BINARY_CHECK_LENGTH); ++i) {
+        if (data.data[i] == 0) readable = false;
+    }
+
+    s32 line = 1;
+    s64 counted = 0; // Newlines before this are included in 'line'
+    s64 offset = 0;
+    while (readable) {
+        s64 match = _find_in_files_search(slice(data, offset), lowercase, uppercase);
+        if (match == -1) break;
+        match += offset;
+
+        u32 flags = search_match_flags(data, match, search->needle);
+        if ((flags & search->filters) != search->filters) {
+            offset = match + search->needle.length;
+            continue;
+        }
+
+        s64 line_start = match;
+        s64 line_end = match;
+        while (line_start > counted && data.data[line_start - 1] != '\n') --line_start;
+        while (line_end < data.length && data.data[line_end] != '\n') ++line_end;
+        line += (s32) _find_in_files_count_newlines(data.data + counted, line_start - counted);
+        counted = line_start;
+        offset = line_end; // We report each line once, however many matches are on it
+
+        str message = slice(data, line_start, line_end);
+        if (message.length > 0 && message.data[message.length - 1] == '\r') --message.length;
+        trim_spaces(&message);
+        if (message.length > FIND_IN_FILES_MAX_LINE_LENGTH) {
+            message.length = FIND_IN_FILES_MAX_LINE_LENGTH;
+            while (message.length > 0 && utf8_is_continuation(message.data[message.length])) --message.length;
+        }
+
+        str prefix = stack_printf("%.*s:%i: ", str_fmt(relative), line);
+        results->append({ path_index, line, (s32) (prefix.length + message.length + 1), (s32) prefix.length });
+        _find_in_files_append(text, prefix);
+        _find_in_files_append(text, message);
+        _find_in_files_append(text, lit_to_str("\n"));
+    }
+
+    stack_leave_frame();
+    timing_end();
+}
+
+void _find_in_files_push(FindInFiles *search, Array<FindInFilesResult> *results, Array<char> *text)
+{
+    _find_in_files_lock(search);
+    bool was_empty = search->results.length == 0;
+    for (s64 i = 0; i < results->length; ++i) search->results.append((*results)[i]);
+    _find_in_files_append(&search->text, { text->data, text->length });
+    _find_in_files_unlock(search);
+
+    results->length = 0;
+    text->length = 0;
+
+    // The main thread takes everything there is when it collects, so it only needs waking up for the first push after that
+    if (was_empty) request_redraw();
+}
+
+void _find_in_files_work(FindInFiles *search)
+{
+    stack_enter_frame();
+    str lowercase = utf8_map(search->needle, &unicode_lowercase);
+    str uppercase = utf8_map(search->needle, &unicode_uppercase);
+
+    Array<FindInFilesResult> results = {};
+    Array<char> text = {};
+    while (!search->stop) {
+        s32 path_index = (s32) _InterlockedIncrement(&search->next_path) - 1;
+        if (path_index >= search->paths.length) break;
+
+        _find_in_files_file(search, path_index, lowercase, uppercase, &results, &text);
+        if (results.length > 0) _find_in_files_push(search, &results, &text);
+    }
+    results.free();
+    text.free();
+    stack_leave_frame();
+
+    if (_InterlockedDecrement(&search->running) == 0) request_redraw();
+}
+
+u32 _find_in_files_routine(void *parameter)
+{
+    _find_in_files_work((FindInFiles *) parameter);
+    timing_thread_exit();
+    stack_thread_exit();
+    return(0);
+}
+
+void find_in_files_start(FindInFiles *search, Path directory, Slice<str> paths, str needle, u32 filters)
+{
+    assert(needle.length > 0);
+    find_in_files_stop(search);
+
+    search->needle = heap_copy(needle);
+    search->filters = filters;
+    search->directory = heap_copy(directory);
+    for_each (path, paths) search->paths.append(heap_copy(*path));
+
+    s32 thread_count = parallel_thread_count();
+    search->running = thread_count;
+    for (s32 i = 0; i < thread_count; ++i) {
+        void *thread = win32::CreateThread(null, 0, &_find_in_files_routine, (void *) search, 0, null);
+        if (!thread) {
+            // We can get by with fewer threads
+            _InterlockedExchangeAdd(&search->running, -(thread_count - i));
+            break;
+        }
+        search->threads[search->thread_count++] = thread;
+    }
+
+    if (search->thread_count == 0) {
+        // Better slow than nothing
+        search->running = 1;
+        _find_in_files_work(search);
+    }
+}
+
+void find_in_files_stop(FindInFiles *search)
+{
+    search->stop = true;
+    for (s32 i = 0; i < search->thread_count; ++i) {
+        win32::WaitForSingleObject(search->threads[i], U32_MAX);
+        win32::CloseHandle(search->threads[i]);
+    }
+
+    for (s64 i = 0; i < search->paths.length; ++i) heap_free(search->paths[i].data);
+    search->paths.free();
+    search->results.free();
+    search->text.free();
+    if (search->needle.data) heap_free(search->needle.data);
+    if (search->directory) heap_free(search->directory);
+    *search = {};
+}
+
+// Moves what the workers found since the last call to 'results' and 'text', which the caller has to free. Returns true if
+// there was anything.
+bool find_in_files_collect(FindInFiles *search, Array<FindInFilesResult> *results, Array<char> *text)
+{
+    _find_in_files_lock(search);
+    *results = search->results;
+    *text = search->text;
+    search->results = {};
+    search->text = {};
+    _find_in_files_unlock(search);
+    return(results->length > 0);
+}
+
+bool find_in_files_running(FindInFiles *search)
+{
+    return(search->running > 0);
+}
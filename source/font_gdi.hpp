@@ -1,7 +1,9 @@
 #pragma once
 #include "win32.hpp"
 
-struct FontBackend
+// Also used by 'font_truetype.hpp' when it can't load its font, so everything here works on a 'FontGdi' rather than a
+// 'FontBackend'. The '_font_backend_*' functions at the end just forward to it.
+struct FontGdi
 {
     void *hfont;
     void *hbitmap;
@@ -11,7 +13,7 @@ struct FontBackend
     enum { MAX_GLYPH_SIZE = 128 };
 };
 
-void _font_backend_change(FontBackend *backend, s32 new_size, FontMetrics *metrics)
+void _font_gdi_change(FontGdi *backend, s32 new_size, FontMetrics *metrics)
 {
     if (backend->hfont) win32::DeleteObject(backend->hfont);
 
@@ -31,8 +33,8 @@ void _font_backend_change(FontBackend *backend, s32 new_size, FontMetrics *metri
 
         win32::bitmapinfo bmp = {};
         bmp.Header.Size = sizeof(win32::bitmapinfoheader);
-        bmp.Header.Width = FontBackend::MAX_GLYPH_SIZE;
-        bmp.Header.Height = FontBackend::MAX_GLYPH_SIZE;
+        bmp.Header.Width = FontGdi::MAX_GLYPH_SIZE;
+        bmp.Header.Height = FontGdi::MAX_GLYPH_SIZE;
         bmp.Header.Planes = 1;
         bmp.Header.BitCount = 32;
         bmp.Header.Compression = win32::BI_RGB;
@@ -55,7 +57,7 @@ void _font_backend_change(FontBackend *backend, s32 new_size, FontMetrics *metri
     metrics->advance = gdi_metrics.AveCharWidth;
 }
 
-bool _font_backend_make_glyph(FontBackend *backend, s32 codepoint, Glyph *glyph)
+bool _font_gdi_glyph_index(FontGdi *backend, s32 codepoint, u16 *glyph_index)
 {
     bool supported = false;
     if (codepoint < 0xffff) {
@@ -64,48 +66,128 @@ bool _font_backend_make_glyph(FontBackend *backend, s32 codepoint, Glyph *glyph)
         }
     }
 
-    bool ok = false;
+    bool found = false;
     if (supported) {
         wchar_t fake_utf16 = codepoint;
+        win32::GetGlyphIndicesW(backend->hdc, &fake_utf16, 1, glyph_index, win32::GGI_MARK_NONEXISTING_GLYPHS);
+        found = *glyph_index != 0xffff;
+    }
+    return(found);
+}
+
+bool _font_gdi_has_glyph(FontGdi *backend, s32 codepoint)
+{
+    u16 glyph_index = 0;
+    return(_font_gdi_glyph_index(backend, codepoint, &glyph_index));
+}
+
+bool _font_gdi_render_glyph(FontGdi *backend, s32 codepoint, u16 glyph_index, win32::abc abc, s32 height, Glyph *glyph)
+{
+    glyph->codepoint = codepoint;
+    glyph->offset_x = abc.A;
+    glyph->width = round_up(abc.B, 4);
 
-        u16 glyph_index = 0;
-        win32::GetGlyphIndicesW(backend->hdc, &fake_utf16, 1, &glyph_index, win32::GGI_MARK_NONEXISTING_GLYPHS);
-        bool missing = glyph_index == 0xffff;
-
-        if (!missing) {
-            win32::abc abc = {};
-            win32::size size = {};
-            win32::GetCharABCWidthsW(backend->hdc, codepoint, codepoint, &abc);
-            win32::GetTextExtentPoint32W(backend->hdc, &fake_utf16, 1, &size);
-
-            glyph->codepoint = codepoint;
-            glyph->offset_x = abc.A;
-            glyph->width = round_up(abc.B, 4);
-
-            s32 draw_offset = max(0, -abc.A);
-            s32 read_offset = max(0, abc.A);
-            win32::ExtTextOutW(backend->hdc, draw_offset, 0, win32::ETO_GLYPH_INDEX, null, (wchar_t *) &glyph_index, 1, null);
-
-            s32 y0 = 0;
-            s32 y1 = size.Y;
-            while (y0 < y1 && mem_is_zero(&backend->bitmap_data[read_offset + (FontBackend::MAX_GLYPH_SIZE - y0 - 1)*FontBackend::MAX_GLYPH_SIZE], abc.B*4)) ++y0;
-            while (y0 < y1 && mem_is_zero(&backend->bitmap_data[read_offset + (FontBackend::MAX_GLYPH_SIZE - y1)*FontBackend::MAX_GLYPH_SIZE], abc.B*4)) --y1;
-
-            if (y0 != y1 || codepoint == ' ') {
-                glyph->offset_y = y0;
-                glyph->height = y1 - y0;
-    
-                glyph->data = stack_alloc(u32, glyph->width*glyph->height);
-                memset(glyph->data, 0, glyph->width*glyph->height*4);
-    
-                for (s32 y = 0; y < glyph->height; ++y) {
-                    memcpy(glyph->data + y*glyph->width, &backend->bitmap_data[read_offset + (FontBackend::MAX_GLYPH_SIZE - (y0 + y) - 1)*FontBackend::MAX_GLYPH_SIZE], abc.B*4);
-                }
-
-                ok = true;
-            }
+    s32 draw_offset = max(0, -abc.A);
+    s32 read_offset = max(0, abc.A);
+    win32::ExtTextOutW(backend->hdc, draw_offset, 0, win32::ETO_GLYPH_INDEX, null, (wchar_t *) &glyph_index, 1, null);
+
+    s32 y0 = 0;
+    s32 y1 = height;
+    while (y0 < y1 && mem_is_zero(&backend->bitmap_data[read_offset + (FontGdi::MAX_GLYPH_SIZE - y0 - 1)*FontGdi::MAX_GLYPH_SIZE], abc.B*4)) ++y0;
+    while (y0 < y1 && mem_is_zero(&backend->bitmap_data[read_offset + (FontGdi::MAX_GLYPH_SIZE - y1)*FontGdi::MAX_GLYPH_SIZE], abc.B*4)) --y1;
+
+    bool ok = false;
+    if (y0 != y1 || codepoint == ' ') {
+        glyph->offset_y = y0;
+        glyph->height = y1 - y0;
+
+        memset(glyph->data, 0, glyph->width*glyph->height*4);
+
+        for (s32 y = 0; y < glyph->height; ++y) {
+            memcpy(glyph->data + y*glyph->width, &backend->bitmap_data[read_offset + (FontGdi::MAX_GLYPH_SIZE - (y0 + y) - 1)*FontGdi::MAX_GLYPH_SIZE], abc.B*4);
         }
+
+        ok = true;
+    }
+    return(ok);
+}
+
+bool _font_gdi_make_glyph(FontGdi *backend, s32 codepoint, Glyph *glyph)
+{
+    bool ok = false;
+    u16 glyph_index = 0;
+    if (_font_gdi_glyph_index(backend, codepoint, &glyph_index)) {
+        wchar_t fake_utf16 = codepoint;
+
+        win32::abc abc = {};
+        win32::size size = {};
+        win32::GetCharABCWidthsW(backend->hdc, codepoint, codepoint, &abc);
+        win32::GetTextExtentPoint32W(backend->hdc, &fake_utf16, 1, &size);
+
+        ok = _font_gdi_render_glyph(backend, codepoint, glyph_index, abc, size.Y, glyph);
     }
 
     return(ok);
-}
\ No newline at end of file
+}
+
+// Looks up indices and widths for the whole range with one call each, which is most of the per glyph overhead
+void _font_gdi_make_glyphs(FontGdi *backend, s32 first_codepoint, s32 count, Glyph *glyphs, bool *available)
+{
+    assert(first_codepoint >= 0 && first_codepoint + count <= 0xffff);
+
+    stack_enter_frame();
+    wchar_t *fake_utf16 = stack_alloc(wchar_t, count);
+    u16 *glyph_indices = stack_alloc(u16, count);
+    win32::abc *abcs = stack_alloc(win32::abc, count);
+    for (s32 i = 0; i < count; ++i) fake_utf16[i] = (wchar_t) (first_codepoint + i);
+
+    win32::GetGlyphIndicesW(backend->hdc, fake_utf16, count, glyph_indices, win32::GGI_MARK_NONEXISTING_GLYPHS);
+    win32::GetCharABCWidthsW(backend->hdc, first_codepoint, first_codepoint + count - 1, abcs);
+    win32::size size = {};
+    win32::GetTextExtentPoint32W(backend->hdc, fake_utf16, 1, &size);
+
+    for (s32 i = 0; i < count; ++i) {
+        s32 codepoint = first_codepoint + i;
+        bool supported = false;
+        for (s32 j = 0; j < array_length(UNICODE_SUPPORTED_RANGES) && !supported; ++j) {
+            supported = UNICODE_SUPPORTED_RANGES[j].min <= codepoint && codepoint <= UNICODE_SUPPORTED_RANGES[j].max;
+        }
+
+        available[i] = false;
+        if (supported && glyph_indices[i] != 0xffff) {
+            available[i] = _font_gdi_render_glyph(backend, codepoint, glyph_indices[i], abcs[i], size.Y, &glyphs[i]);
+        }
+    }
+    stack_leave_frame();
+}
+
+#if FONT_BACKEND_gdi
+#define FONT_BACKEND_NAME "gdi"
+
+struct FontBackend
+{
+    FontGdi gdi;
+
+    enum { MAX_GLYPH_SIZE = FontGdi::MAX_GLYPH_SIZE };
+};
+
+void _font_backend_change(FontBackend *backend, s32 new_size, FontMetrics *metrics)
+{
+    _font_gdi_change(&backend->gdi, new_size, metrics);
+}
+
+bool _font_backend_has_glyph(FontBackend *backend, s32 codepoint)
+{
+    return(_font_gdi_has_glyph(&backend->gdi, codepoint));
+}
+
+bool _font_backend_make_glyph(FontBackend *backend, s32 codepoint, Glyph *glyph)
+{
+    return(_font_gdi_make_glyph(&backend->gdi, codepoint, glyph));
+}
+
+void _font_backend_make_glyphs(FontBackend *backend, s32 first_codepoint, s32 count, Glyph *glyphs, bool *available)
+{
+    _font_gdi_make_glyphs(&backend->gdi, first_codepoint, count, glyphs, available);
+}
+#endif
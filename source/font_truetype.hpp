@@ -0,0 +1,657 @@
+#pragma once
+#include "font_gdi.hpp"
+
+// Rasterizes TrueType outlines in process, rather than asking GDI for every glyph. Glyphs have grayscale coverage in all three
+// channels and no hinting, so they look a bit softer than the cleartype ones from 'font_gdi.hpp'. If the font can't be loaded
+// we use 'font_gdi.hpp' instead.
+// NB Only 'glyf' outlines are supported. Fonts with CFF outlines (most '.otf' files) won't load.
+
+#define FONT_BACKEND_NAME "truetype"
+
+#if !defined(FONT_TRUETYPE_PATH)
+#define FONT_TRUETYPE_PATH "C:\\Windows\\Fonts\\consola.ttf"
+#endif
+
+// Shared between all backends, so the worker thread in 'graphics.hpp' never has to load anything. It is loaded by the first
+// call to '_font_backend_change', which happens on the main thread. Set 'data' before that to use a font from memory.
+struct TrueTypeFile
+{
+    str data;
+    bool loaded, failed;
+
+    s32 units_per_em;
+    s32 ascender, descender; // From 'hhea'
+    s32 glyph_count;
+    s32 hmetric_count;
+    bool long_loca;
+
+    u8 *cmap; // The subtable we use
+    u8 *loca, *glyf, *hmtx;
+    s64 loca_length, glyf_length;
+};
+global_variable TrueTypeFile _truetype_file;
+
+struct FontBackend
+{
+    f32 scale; // Pixels per font unit
+    s32 ascent, line_height;
+    f32 *accumulation; // '(MAX_GLYPH_SIZE + 2)*MAX_GLYPH_SIZE', allocated on first use
+    FontGdi gdi; // Used instead if '_truetype_file' failed to load
+
+    enum { MAX_GLYPH_SIZE = 128 };
+};
+
+u16 _truetype_u16(u8 *p) { return((u16) ((p[0] << 8) | p[1])); }
+s16 _truetype_s16(u8 *p) { return((s16) _truetype_u16(p)); }
+u32 _truetype_u32(u8 *p) { return(((u32) p[0] << 24) | ((u32) p[1] << 16) | ((u32) p[2] << 8) | (u32) p[3]); }
+f32 _truetype_f2dot14(u8 *p) { return(_truetype_s16(p) / 16384.0f); }
+
+// NB Saves us from pulling in math.h
+f32 _truetype_floor(f32 x) { s32 i = (s32) x; return((f32) (i - (x < (f32) i))); }
+f32 _truetype_ceil(f32 x) { s32 i = (s32) x; return((f32) (i + (x > (f32) i))); }
+f32 _truetype_sqrt(f32 x) { return(_mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(x)))); }
+
+u8 *_truetype_table(TrueTypeFile *file, char *tag, s64 *length)
+{
+    u8 *data = (u8 *) file->data.data;
+    s32 table_count = _truetype_u16(data + 4);
+    for (s32 i = 0; i < table_count; ++i) {
+        u8 *record = data + 12 + i*16;
+        if (record + 16 > data + file->data.length) break;
+        if (memcmp(record, tag, 4) == 0) {
+            u32 offset = _truetype_u32(record + 8);
+            u32 table_length = _truetype_u32(record + 12);
+            if ((s64) offset + table_length > file->data.length) break;
+            if (length) *length = table_length;
+            return(data + offset);
+        }
+    }
+    return(null);
+}
+
+// Returns false if the file is missing or isn't a font we can use
+bool _truetype_load(TrueTypeFile *file)
+{
+    if (!file->data.data) {
+        stack_enter_frame();
+        str contents = {};
+        IoError error = read_entire_file(str_to_path(FONT_TRUETYPE_PATH), &contents);
+        if (error == IoError::OK) file->data = heap_copy(contents);
+        stack_leave_frame();
+        if (error != IoError::OK) return(false);
+    }
+    if (file->data.length < 12) return(false);
+
+    s64 head_length = 0, hhea_length = 0, maxp_length = 0, cmap_length = 0, hmtx_length = 0;
+    u8 *head = _truetype_table(file, "head", &head_length);
+    u8 *hhea = _truetype_table(file, "hhea", &hhea_length);
+    u8 *maxp = _truetype_table(file, "maxp", &maxp_length);
+    u8 *cmap = _truetype_table(file, "cmap", &cmap_length);
+    file->loca = _truetype_table(file, "loca", &file->loca_length);
+    file->hmtx = _truetype_table(file, "hmtx", &hmtx_length);
+    file->glyf = _truetype_table(file, "glyf", &file->glyf_length);
+    if (!head || !hhea || !maxp || !cmap || !file->loca || !file->hmtx || !file->glyf) return(false);
+    if (head_length < 54 || hhea_length < 36 || maxp_length < 6 || cmap_length < 4) return(false);
+
+    file->units_per_em = _truetype_u16(head + 18);
+    file->long_loca = _truetype_s16(head + 50) != 0;
+    file->ascender = _truetype_s16(hhea + 4);
+    file->descender = _truetype_s16(hhea + 6);
+    file->hmetric_count = _truetype_u16(hhea + 34);
+    file->glyph_count = _truetype_u16(maxp + 4);
+    if (file->units_per_em == 0 || file->glyph_count == 0 || file->hmetric_count == 0) return(false);
+    if (hmtx_length < 4*file->hmetric_count) return(false);
+    if (file->loca_length < (file->glyph_count + 1)*(file->long_loca? 4 : 2)) return(false);
+
+    // Prefer a full unicode table (format 12), but most fonts only have the basic plane (format 4)
+    s32 best_score = 0;
+    s32 subtable_count = _truetype_u16(cmap + 2);
+    for (s32 i = 0; i < subtable_count; ++i) {
+        u8 *record = cmap + 4 + i*8;
+        if (4 + i*8 + 8 > cmap_length) break;
+        u16 platform = _truetype_u16(record);
+        u16 encoding = _truetype_u16(record + 2);
+        u32 offset = _truetype_u32(record + 4);
+        if ((s64) offset + 2 > cmap_length) continue;
+        u8 *subtable = cmap + offset;
+        u16 format = _truetype_u16(subtable);
+
+        bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+        s32 score = !unicode? 0 : format == 12? 2 : format == 4? 1 : 0;
+        if (score > best_score) {
+            best_score = score;
+            file->cmap = subtable;
+        }
+    }
+    if (!file->cmap) return(false);
+    file->loaded = true;
+    return(true);
+}
+
+s32 _truetype_glyph_index(TrueTypeFile *file, s32 codepoint)
+{
+    u8 *table = file->cmap;
+    s32 glyph = 0;
+
+    if (_truetype_u16(table) == 4) {
+        if (codepoint > 0xffff) return(0);
+        s32 segment_count = _truetype_u16(table + 6) / 2;
+        u8 *end_codes = table + 14;
+        u8 *start_codes = end_codes + 2*segment_count + 2;
+        u8 *deltas = start_codes + 2*segment_count;
+        u8 *range_offsets = deltas + 2*segment_count;
+
+        s32 low = 0, high = segment_count;
+        while (low < high) {
+            s32 middle = (low + high) / 2;
+            if (_truetype_u16(end_codes + 2*middle) < codepoint) low = middle + 1; else high = middle;
+        }
+
+        if (low < segment_count && _truetype_u16(start_codes + 2*low) <= codepoint) {
+            s32 start = _truetype_u16(start_codes + 2*low);
+            s32 delta = _truetype_s16(deltas + 2*low);
+            s32 range_offset = _truetype_u16(range_offsets + 2*low);
+            if (range_offset == 0) {
+                glyph = (codepoint + delta) & 0xffff;
+            } else {
+                glyph = _truetype_u16(range_offsets + 2*low + range_offset + 2*(codepoint - start));
+                if (glyph != 0) glyph = (glyph + delta) & 0xffff;
+            }
+        }
+    } else {
+        u32 group_count = _truetype_u32(table + 12);
+        u8 *groups = table + 16;
+
+        u32 low = 0, high = group_count;
+        while (low < high) {
+            u32 middle = (low + high) / 2;
+            if (_truetype_u32(groups + 12*middle + 4) < (u32) codepoint) low = middle + 1; else high = middle;
+        }
+
+        if (low < group_count && _truetype_u32(groups + 12*low) <= (u32) codepoint) {
+            glyph = (s32) (_truetype_u32(groups + 12*low + 8) + ((u32) codepoint - _truetype_u32(groups + 12*low)));
+        }
+    }
+
+    if (glyph >= file->glyph_count) glyph = 0;
+    return(glyph);
+}
+
+// Returns null for glyphs without an outline, like space, and for glyph indices the font doesn't have
+u8 *_truetype_glyph_data(TrueTypeFile *file, s32 glyph, s64 *length)
+{
+    if (glyph < 0 || glyph >= file->glyph_count) return(null);
+
+    u32 start, end;
+    if (file->long_loca) {
+        start = _truetype_u32(file->loca + 4*glyph);
+        end = _truetype_u32(file->loca + 4*glyph + 4);
+    } else {
+        start = 2*_truetype_u16(file->loca + 2*glyph);
+        end = 2*_truetype_u16(file->loca + 2*glyph + 2);
+    }
+    if (start >= end || end > file->glyf_length || end - start < 10) return(null);
+    *length = end - start;
+    return(file->glyf + start);
+}
+
+
+// Signed area coverage accumulation. Every line adds the area it covers to the right of itself to the cells it crosses, and
+// the last cell gets the remainder. Summing a row from the left then gives the coverage of each pixel.
+struct _TrueTypeRaster
+{
+    f32 *accumulation;
+    s32 width, height; // The accumulation buffer is 'width + 2' wide
+    f32 transform[6]; // Font units to pixels
+};
+
+void _truetype_line(_TrueTypeRaster *raster, f32 x0, f32 y0, f32 x1, f32 y1)
+{
+    if (y0 == y1) return;
+
+    f32 direction = 1.0f;
+    if (y0 > y1) {
+        direction = -1.0f;
+        f32 temp;
+        temp = x0; x0 = x1; x1 = temp;
+        temp = y0; y0 = y1; y1 = temp;
+    }
+
+    f32 max_x = (f32) raster->width;
+    x0 = min(max(x0, 0.0f), max_x);
+    x1 = min(max(x1, 0.0f), max_x);
+
+    f32 dxdy = (x1 - x0) / (y1 - y0);
+    f32 x = x0;
+    if (y0 < 0.0f) x -= y0*dxdy;
+
+    s32 stride = raster->width + 2;
+    s32 row_end = min(raster->height, (s32) _truetype_ceil(y1));
+    for (s32 y = max((s32) y0, 0); y < row_end; ++y) {
+        f32 *row = raster->accumulation + y*stride;
+        f32 dy = min((f32) (y + 1), y1) - max((f32) y, y0);
+        f32 x_next = x + dxdy*dy;
+        f32 d = dy*direction;
+
+        f32 left = min(x, x_next);
+        f32 right = max(x, x_next);
+        f32 left_floor = _truetype_floor(left);
+        s32 left_index = (s32) left_floor;
+        s32 right_index = (s32) _truetype_ceil(right);
+
+        if (right_index <= left_index + 1) {
+            f32 middle = 0.5f*(x + x_next) - left_floor;
+            row[left_index] += d - d*middle;
+            row[left_index + 1] += d*middle;
+        } else {
+            f32 s = 1.0f / (right - left);
+            f32 left_fraction = left - left_floor;
+            f32 a0 = 0.5f*s*(1.0f - left_fraction)*(1.0f - left_fraction);
+            f32 right_fraction = right - (f32) right_index + 1.0f;
+            f32 am = 0.5f*s*right_fraction*right_fraction;
+
+            row[left_index] += d*a0;
+            if (right_index == left_index + 2) {
+                row[left_index + 1] += d*(1.0f - a0 - am);
+            } else {
+                f32 a1 = s*(1.5f - left_fraction);
+                row[left_index + 1] += d*(a1 - a0);
+                for (s32 i = left_index + 2; i < right_index - 1; ++i) row[i] += d*s;
+                f32 a2 = a1 + (f32) (right_index - left_index - 3)*s;
+                row[right_index - 1] += d*(1.0f - a2 - am);
+            }
+            row[right_index] += d*am;
+        }
+
+        x = x_next;
+    }
+}
+
+void _truetype_point(_TrueTypeRaster *raster, f32 x, f32 y, f32 *px, f32 *py)
+{
+    f32 *m = raster->transform;
+    *px = m[0]*x + m[2]*y + m[4];
+    *py = m[1]*x + m[3]*y + m[5];
+}
+
+void _truetype_quad(_TrueTypeRaster *raster, f32 x0, f32 y0, f32 cx, f32 cy, f32 x1, f32 y1)
+{
+    // Enough segments that the error stays well below a pixel
+    f32 dx = x0 - 2.0f*cx + x1;
+    f32 dy = y0 - 2.0f*cy + y1;
+    s32 steps = min(1 + (s32) _truetype_sqrt(_truetype_sqrt(dx*dx + dy*dy)*4.0f), 32);
+
+    f32 previous_x = x0, previous_y = y0;
+    for (s32 i = 1; i <= steps; ++i) {
+        f32 t = (f32) i / (f32) steps;
+        f32 u = 1.0f - t;
+        f32 x = u*u*x0 + 2.0f*u*t*cx + t*t*x1;
+        f32 y = u*u*y0 + 2.0f*u*t*cy + t*t*y1;
+        _truetype_line(raster, previous_x, previous_y, x, y);
+        previous_x = x;
+        previous_y = y;
+    }
+}
+
+void _truetype_outline(TrueTypeFile *file, _TrueTypeRaster *raster, s32 glyph, s32 depth)
+{
+    s64 length = 0;
+    u8 *data = _truetype_glyph_data(file, glyph, &length);
+    if (!data || depth > 8) return;
+    u8 *end = data + length;
+
+    s32 contour_count = _truetype_s16(data);
+    if (contour_count >= 0) {
+        u8 *end_points = data + 10;
+        if (contour_count == 0 || end_points + 2*contour_count + 2 > end) return;
+        s32 point_count = _truetype_u16(end_points + 2*(contour_count - 1)) + 1;
+        u8 *p = end_points + 2*contour_count;
+        p += 2 + _truetype_u16(p);
+
+        stack_enter_frame();
+        u8 *flags = stack_alloc_uninitialized(u8, point_count);
+        f32 *xs = stack_alloc_uninitialized(f32, point_count);
+        f32 *ys = stack_alloc_uninitialized(f32, point_count);
+
+        bool ok = true;
+        for (s32 i = 0; i < point_count && ok;) {
+            ok = p < end;
+            if (!ok) break;
+            u8 flag = *p++;
+            s32 repeat = 1;
+            if (flag & 8) {
+                ok = p < end;
+                if (ok) repeat += *p++;
+            }
+            while (repeat-- && i < point_count) flags[i++] = flag;
+        }
+
+        for (s32 axis = 0; axis < 2 && ok; ++axis) {
+            u8 short_bit = axis? 4 : 2;
+            u8 same_bit = axis? 32 : 16;
+            f32 *values = axis? ys : xs;
+            s32 value = 0;
+            for (s32 i = 0; i < point_count && ok; ++i) {
+                if (flags[i] & short_bit) {
+                    ok = p + 1 <= end;
+                    if (ok) value += (flags[i] & same_bit)? *p : -(s32) *p;
+                    p += 1;
+                } else if (!(flags[i] & same_bit)) {
+                    ok = p + 2 <= end;
+                    if (ok) value += _truetype_s16(p);
+                    p += 2;
+                }
+                values[i] = (f32) value;
+            }
+        }
+
+        for (s32 i = 0; i < point_count && ok; ++i) _truetype_point(raster, xs[i], ys[i], &xs[i], &ys[i]);
+
+        s32 start = 0;
+        for (s32 c = 0; c < contour_count && ok; ++c) {
+            s32 last = _truetype_u16(end_points + 2*c);
+            if (last >= point_count || last < start) break;
+
+            // Contours can start on a control point, in which case we start in the middle between it and the last point
+            f32 start_x, start_y;
+            s32 first = start;
+            s32 count = last - start + 1;
+            if (flags[start] & 1) {
+                start_x = xs[start]; start_y = ys[start];
+                first = start + 1;
+                count -= 1;
+            } else if (flags[last] & 1) {
+                start_x = xs[last]; start_y = ys[last];
+                count -= 1;
+            } else {
+                start_x = 0.5f*(xs[start] + xs[last]);
+                start_y = 0.5f*(ys[start] + ys[last]);
+            }
+
+            f32 x = start_x, y = start_y;
+            bool has_control = false;
+            f32 control_x = 0.0f, control_y = 0.0f;
+            for (s32 k = 0; k < count; ++k) {
+                s32 i = first + k;
+                if (flags[i] & 1) {
+                    if (has_control) _truetype_quad(raster, x, y, control_x, control_y, xs[i], ys[i]);
+                    else _truetype_line(raster, x, y, xs[i], ys[i]);
+                    x = xs[i]; y = ys[i];
+                    has_control = false;
+                } else {
+                    if (has_control) {
+                        f32 middle_x = 0.5f*(control_x + xs[i]);
+                        f32 middle_y = 0.5f*(control_y + ys[i]);
+                        _truetype_quad(raster, x, y, control_x, control_y, middle_x, middle_y);
+                        x = middle_x; y = middle_y;
+                    }
+                    control_x = xs[i]; control_y = ys[i];
+                    has_control = true;
+                }
+            }
+            if (has_control) _truetype_quad(raster, x, y, control_x, control_y, start_x, start_y);
+            else _truetype_line(raster, x, y, start_x, start_y);
+
+            start = last + 1;
+        }
+
+        stack_leave_frame();
+    } else {
+        // Composite glyph. Components placed by matching points aren't supported, we just put them at the origin.
+        u8 *p = data + 10;
+        f32 parent[6];
+        memcpy(parent, raster->transform, sizeof(parent));
+
+        while (p + 4 <= end) {
+            u16 flags = _truetype_u16(p);
+            s32 component = _truetype_u16(p + 2);
+            p += 4;
+            if (component >= file->glyph_count) break; // Broken font, the component has no outline
+
+            f32 dx = 0.0f, dy = 0.0f;
+            if (flags & 1) {
+                dx = _truetype_s16(p); dy = _truetype_s16(p + 2);
+                p += 4;
+            } else {
+                dx = (s8) p[0]; dy = (s8) p[1];
+                p += 2;
+            }
+            if (!(flags & 2)) dx = dy = 0.0f;
+
+            f32 a = 1.0f, b = 0.0f, c = 0.0f, d = 1.0f;
+            if (flags & 8) {
+                a = d = _truetype_f2dot14(p);
+                p += 2;
+            } else if (flags & 0x40) {
+                a = _truetype_f2dot14(p); d = _truetype_f2dot14(p + 2);
+                p += 4;
+            } else if (flags & 0x80) {
+                a = _truetype_f2dot14(p); b = _truetype_f2dot14(p + 2);
+                c = _truetype_f2dot14(p + 4); d = _truetype_f2dot14(p + 6);
+                p += 8;
+            }
+            if (p > end) break;
+
+            f32 *m = raster->transform;
+            m[0] = parent[0]*a + parent[2]*b;
+            m[1] = parent[1]*a + parent[3]*b;
+            m[2] = parent[0]*c + parent[2]*d;
+            m[3] = parent[1]*c + parent[3]*d;
+            m[4] = parent[0]*dx + parent[2]*dy + parent[4];
+            m[5] = parent[1]*dx + parent[3]*dy + parent[5];
+            _truetype_outline(file, raster, component, depth + 1);
+
+            if (!(flags & 0x20)) break;
+        }
+
+        memcpy(raster->transform, parent, sizeof(parent));
+    }
+}
+
+void _font_backend_change(FontBackend *backend, s32 new_size, FontMetrics *metrics)
+{
+    TrueTypeFile *file = &_truetype_file;
+    if (!file->loaded && !file->failed) file->failed = !_truetype_load(file);
+    if (file->failed) {
+        _font_gdi_change(&backend->gdi, new_size, metrics);
+        return;
+    }
+
+    if (!backend->accumulation) {
+        backend->accumulation = (f32 *) heap_alloc((FontBackend::MAX_GLYPH_SIZE + 2)*FontBackend::MAX_GLYPH_SIZE*sizeof(f32));
+    }
+
+    // Same em size as we ask GDI for
+    f32 pixel_size = (f32) ((new_size * 96) / 72);
+    backend->scale = pixel_size / (f32) file->units_per_em;
+
+    s32 ascent = (s32) _truetype_ceil(file->ascender*backend->scale);
+    s32 descent = (s32) _truetype_ceil(-file->descender*backend->scale);
+    backend->ascent = ascent;
+    backend->line_height = ascent + descent + 1;
+
+    s32 space = _truetype_glyph_index(file, ' ');
+    s32 advance_index = min(space, file->hmetric_count - 1);
+    f32 advance = _truetype_u16(file->hmtx + 4*advance_index) * backend->scale;
+
+    metrics->size = new_size;
+    metrics->ascent = ascent;
+    metrics->descent = -descent;
+    metrics->line_height = backend->line_height;
+    metrics->advance = (s32) (advance + 0.5f);
+}
+
+bool _font_backend_has_glyph(FontBackend *backend, s32 codepoint)
+{
+    if (_truetype_file.failed) return(_font_gdi_has_glyph(&backend->gdi, codepoint));
+    return(_truetype_glyph_index(&_truetype_file, codepoint) != 0);
+}
+
+bool _truetype_make_glyph(FontBackend *backend, s32 codepoint, s32 glyph_index, Glyph *glyph)
+{
+    TrueTypeFile *file = &_truetype_file;
+    if (glyph_index == 0) return(false);
+
+    s64 length = 0;
+    u8 *data = _truetype_glyph_data(file, glyph_index, &length);
+    if (!data) {
+        // Like GDI, we only allow empty glyphs for space
+        if (codepoint != ' ') return(false);
+        glyph->codepoint = codepoint;
+        glyph->width = glyph->height = 0;
+        glyph->offset_x = glyph->offset_y = 0;
+        return(true);
+    }
+
+    f32 scale = backend->scale;
+    s32 x0 = (s32) _truetype_floor(_truetype_s16(data + 2)*scale);
+    s32 x1 = (s32) _truetype_ceil(_truetype_s16(data + 6)*scale);
+    s32 y0 = (s32) _truetype_floor(backend->ascent - _truetype_s16(data + 8)*scale);
+    s32 y1 = (s32) _truetype_ceil(backend->ascent - _truetype_s16(data + 4)*scale);
+
+    // Glyphs are cut to the line, like they are with GDI
+    s32 size = FontBackend::MAX_GLYPH_SIZE;
+    x1 = min(x1, x0 + size);
+    y0 = max(y0, 0);
+    y1 = min(min(y1, backend->line_height), y0 + size);
+    if (x1 <= x0 || y1 <= y0) return(false);
+
+    _TrueTypeRaster raster = {};
+    raster.accumulation = backend->accumulation;
+    raster.width = x1 - x0;
+    raster.height = y1 - y0;
+    raster.transform[0] = scale;
+    raster.transform[3] = -scale;
+    raster.transform[4] = (f32) -x0;
+    raster.transform[5] = (f32) (backend->ascent - y0);
+    s32 stride = raster.width + 2;
+    memset(raster.accumulation, 0, stride*raster.height*sizeof(f32));
+
+    _truetype_outline(file, &raster, glyph_index, 0);
+
+    glyph->codepoint = codepoint;
+    glyph->offset_x = x0;
+    glyph->width = round_up(raster.width, 4);
+
+    // Resolve coverage, skipping empty rows at the top and bottom
+    s32 first_row = -1, last_row = -1;
+    for (s32 y = 0; y < raster.height; ++y) {
+        u32 *out = glyph->data + (first_row < 0? 0 : y - first_row)*glyph->width;
+        f32 *row = raster.accumulation + y*stride;
+        f32 sum = 0.0f;
+        bool any = false;
+        for (s32 x = 0; x < glyph->width; ++x) {
+            u32 c = 0;
+            if (x < raster.width) {
+                sum += row[x];
+                c = (u32) (min(abs(sum), 1.0f)*255.0f + 0.5f);
+            }
+            out[x] = c | (c << 8) | (c << 16);
+            any |= c != 0;
+        }
+
+        if (any) {
+            if (first_row < 0) first_row = y;
+            last_row = y;
+        }
+    }
+
+    if (first_row < 0) return(codepoint == ' ');
+    glyph->offset_y = y0 + first_row;
+    glyph->height = last_row - first_row + 1;
+    return(true);
+}
+
+bool _font_backend_make_glyph(FontBackend *backend, s32 codepoint, Glyph *glyph)
+{
+    if (_truetype_file.failed) return(_font_gdi_make_glyph(&backend->gdi, codepoint, glyph));
+    return(_truetype_make_glyph(backend, codepoint, _truetype_glyph_index(&_truetype_file, codepoint), glyph));
+}
+
+// Everything is set up once per size already, so this is just a loop
+void _font_backend_make_glyphs(FontBackend *backend, s32 first_codepoint, s32 count, Glyph *glyphs, bool *available)
+{
+    if (_truetype_file.failed) {
+        _font_gdi_make_glyphs(&backend->gdi, first_codepoint, count, glyphs, available);
+        return;
+    }
+
+    for (s32 i = 0; i < count; ++i) {
+        s32 codepoint = first_codepoint + i;
+        available[i] = _truetype_make_glyph(backend, codepoint, _truetype_glyph_index(&_truetype_file, codepoint), &glyphs[i]);
+    }
+}
+
+#if defined(DEBUG)
+// Adds up the coverage of 'glyph', averaged over the three channels, and finds its center relative to the glyph origin
+void _truetype_ink(Glyph glyph, f32 *ink, f32 *center_x, f32 *center_y)
+{
+    f32 sum = 0.0f, sum_x = 0.0f, sum_y = 0.0f;
+    for (s32 y = 0; y < glyph.height; ++y) {
+        for (s32 x = 0; x < glyph.width; ++x) {
+            u32 pixel = glyph.data[y*glyph.width + x];
+            f32 coverage = (f32) ((pixel & 0xff) + ((pixel >> 8) & 0xff) + ((pixel >> 16) & 0xff)) / (3.0f*255.0f);
+            sum += coverage;
+            sum_x += coverage*(glyph.offset_x + x + 0.5f);
+            sum_y += coverage*(glyph.offset_y + y + 0.5f);
+        }
+    }
+    *ink = sum;
+    *center_x = sum > 0.0f? sum_x/sum : 0.0f;
+    *center_y = sum > 0.0f? sum_y/sum : 0.0f;
+}
+
+// Makes a few glyphs with this backend and with GDI, from the same font, and checks that they agree. They can't be identical,
+// since GDI hints and uses cleartype, so we compare how much ink each glyph has and where it is.
+void truetype_check_against_gdi()
+{
+    if (!_truetype_file.loaded) {
+        debug_printf("TrueType check skipped, \"%s\" didn't load\n", FONT_TRUETYPE_PATH);
+        return;
+    }
+
+    enum { PIXELS = FontBackend::MAX_GLYPH_SIZE*FontBackend::MAX_GLYPH_SIZE };
+    char *codepoints = "AMWagjy0@#%&{}";
+
+    stack_enter_frame();
+    u32 *pixels = stack_alloc(u32, 2*PIXELS);
+    FontBackend backend = {};
+    FontMetrics metrics = {}, gdi_metrics = {};
+    f32 worst_ink = 0.0f, worst_distance = 0.0f;
+    s32 compared = 0;
+    for (s32 font_size = 10; font_size <= 24; font_size += 7) {
+        _font_backend_change(&backend, font_size, &metrics);
+        _font_gdi_change(&backend.gdi, font_size, &gdi_metrics);
+        assert(abs(metrics.advance - gdi_metrics.advance) <= 1);
+
+        for (char *c = codepoints; *c; ++c) {
+            Glyph ours = { 0, pixels };
+            Glyph theirs = { 0, pixels + PIXELS };
+            bool ours_available = _font_backend_make_glyph(&backend, *c, &ours);
+            bool theirs_available = _font_gdi_make_glyph(&backend.gdi, *c, &theirs);
+            assert(ours_available == theirs_available);
+            if (!ours_available) continue;
+
+            f32 ours_ink, ours_x, ours_y, theirs_ink, theirs_x, theirs_y;
+            _truetype_ink(ours, &ours_ink, &ours_x, &ours_y);
+            _truetype_ink(theirs, &theirs_ink, &theirs_x, &theirs_y);
+
+            f32 ink = abs(ours_ink - theirs_ink) / max(theirs_ink, 1.0f);
+            f32 distance = _truetype_sqrt((ours_x - theirs_x)*(ours_x - theirs_x) + (ours_y - theirs_y)*(ours_y - theirs_y));
+            worst_ink = max(worst_ink, ink);
+            worst_distance = max(worst_distance, distance);
+            ++compared;
+        }
+    }
+
+    debug_printf("TrueType against GDI, %i glyphs: ink differs by up to %i%%, centers by up to %i.%02i px\n", compared,
+                 (s32) (worst_ink*100.0f), (s32) worst_distance, (s32) (worst_distance*100.0f) % 100);
+    assert(worst_ink < 0.4f && worst_distance < 1.5f);
+
+    heap_free(backend.accumulation);
+    win32::DeleteObject(backend.gdi.hbitmap);
+    win32::DeleteObject(backend.gdi.hfont);
+    win32::DeleteDC(backend.gdi.hdc);
+    stack_leave_frame();
+}
+#endif
@@ -109,6 +109,10 @@ struct View
 };
 enum { FOCUS_LINE_OFFSET_SUBSTEPS = 128 };
 
+// Highlighting is lazy. Edits rehighlight at most this many lines directly, the rest is done when lines become visible or
+// when we are idle. See 'buffer_highlight_until'.
+enum { HIGHLIGHT_EAGER_LINES = 128 };
+
 struct Buffer
 {
     char *data;
@@ -120,13 +124,19 @@ struct Buffer
     s32 history_caret;
 
     Font *font;
+    s32 font_availability_changes; // 'Font::availability_changes' at the last full layout
     s32 max_glyphs_per_line;
     s32 visible_lines, margin_lines;
     bool show_special_characters;
     s32 highlight_function_index;
     GapArray<VirtualLine> lines;
-    GapArray<Highlight> highlights;
+    GapArray<HighlightRun> highlights; // See 'HighlightRun' and 'HighlightIterator'
     s32 physical_line_count;
+    // If set, highlighting is out of date from the physical line containing 'highlight_pending_offset' onwards. Lines before
+    // it are correct, and 'highlight_pending_state' is the state at the start of that line.
+    bool highlight_pending;
+    s32 highlight_pending_offset;
+    HighlightState highlight_pending_state;
 
     bool no_user_input;
 
@@ -149,6 +159,9 @@ struct Buffer
     s32 last_show_time[2]; // Set whenever the buffer is shown in a given split
 };
 
+// Changes whenever any buffer gets a new path, so code which looks buffers up by path knows when to rebuild its tables
+global_variable u32 buffer_path_generation;
+
 void buffer_free(Buffer *buffer);
 void buffer_reset(Buffer *buffer);
 void buffer_normalize(Buffer *buffer, View *view);
@@ -170,6 +183,20 @@ str buffer_get_slice(Buffer *buffer, s32 min, s32 max);
 str buffer_get_virtual_line_text(Buffer *buffer, s32 virtual_line_index);
 s32 buffer_offset_to_virtual_line_index(Buffer *buffer, s32 offset);
 s32v2 buffer_offset_to_layout_offset(Buffer *buffer, View *view, s32 offset);
+
+// Walks the highlight runs of a buffer. Offsets passed to 'buffer_highlight_iterator_advance' must not decrease.
+struct HighlightIterator
+{
+    s32 next_line_index; // First virtual line of the next physical line
+    s32 run_index, run_index_end;
+    s32 run_start, run_end;
+    HighlightKind kind;
+};
+HighlightIterator buffer_highlight_iterator(Buffer *buffer, s32 offset);
+HighlightKind buffer_highlight_iterator_advance(Buffer *buffer, HighlightIterator *iterator, s32 offset);
+HighlightKind buffer_highlight_at(Buffer *buffer, s32 offset);
+void buffer_highlight_until(Buffer *buffer, s32 virtual_line_end);
+bool buffer_highlight_in_background(Buffer *buffer, s32 line_count);
 s32 buffer_layout_offset_to_offset(Buffer *buffer, View *view, s32v2 layout_offset);
 
 void buffer_next_selection(Buffer *buffer, View *view, s32 direction);
@@ -217,6 +244,24 @@ void buffer_remove_all_search_results(Buffer *buffer, View *view);
 
 void buffer_change_line_endings(Buffer *buffer, NewlineMode new_mode);
 void buffer_insert_at_all_carets(Buffer *buffer, View *view, str text);
+// For inserting text at the caret of a view with a single selection as it comes in, e.g. a large paste from the clipboard.
+// Blocks can have any length, and the text is normalized the same way as in 'buffer_insert_at_caret'. We don't lay out any
+// of it until 'buffer_insert_stream_end', which does all of it at once.
+struct BufferInsertStream
+{
+    s32 offset; // Where the text starts
+    s32 length; // Inserted so far, after normalizing
+    s32 indent;
+    s32 indent_delta;
+    s32 previous_line;
+    bool started;
+    bool at_line_start;
+    bool starts_with_newline;
+    Array<char> pending; // Text after the last newline, which we hold on to until we have the rest of the line
+};
+void buffer_insert_stream_begin(Buffer *buffer, View *view, BufferInsertStream *stream);
+void buffer_insert_stream_block(Buffer *buffer, BufferInsertStream *stream, str block);
+void buffer_insert_stream_end(Buffer *buffer, View *view, BufferInsertStream *stream);
 void buffer_insert_tabs_at_all_carets(Buffer *buffer, View *view);
 void buffer_insert_on_new_line_at_all_carets(Buffer *buffer, View *view, s32 direction, str text);
 void buffer_insert_at_caret(Buffer *buffer, View *view, s32 selection_index, str text);
@@ -308,6 +353,219 @@ str buffer_move_gap_to_end(Buffer *buffer)
     return(full_content);
 }
 
+// Counts the newlines starting in 'data[start, end)', where a '\r\n' pair is one newline starting at the '\r', and how many of
+// them are pairs. Looks one byte past either end of the range, but never outside 'data[0, length)'.
+static
+void _buffer_count_newlines(char *data, s32 length, s32 start, s32 end, s32 *newlines, s32 *pairs)
+{
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+
+    s32 i = start;
+    if (i == 0 && i < end) {
+        *newlines += data[0] == '\r' || data[0] == '\n';
+        *pairs += data[0] == '\r' && length > 1 && data[1] == '\n';
+        ++i;
+    }
+
+    while (i + 16 <= end && i + 17 <= length) {
+        // Each byte counts up to 255, so we sum them up before they overflow
+        __m128i newline_counts = _mm_setzero_si128();
+        __m128i pair_counts = _mm_setzero_si128();
+        s32 block_end = min(min(end, length - 1), i + 255*16);
+        for (; i + 16 <= block_end; i += 16) {
+            __m128i previous_cr = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (data + i - 1)), cr);
+            __m128i current = _mm_loadu_si128((__m128i *) (data + i));
+            __m128i next_lf = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (data + i + 1)), lf);
+            __m128i current_cr = _mm_cmpeq_epi8(current, cr);
+            __m128i current_lf = _mm_cmpeq_epi8(current, lf);
+            newline_counts = _mm_sub_epi8(newline_counts, _mm_or_si128(current_cr, _mm_andnot_si128(previous_cr, current_lf)));
+            pair_counts = _mm_sub_epi8(pair_counts, _mm_and_si128(current_cr, next_lf));
+        }
+        __m128i newline_sums = _mm_sad_epu8(newline_counts, _mm_setzero_si128());
+        __m128i pair_sums = _mm_sad_epu8(pair_counts, _mm_setzero_si128());
+        *newlines += _mm_cvtsi128_si32(newline_sums) + _mm_extract_epi16(newline_sums, 4);
+        *pairs += _mm_cvtsi128_si32(pair_sums) + _mm_extract_epi16(pair_sums, 4);
+    }
+
+    for (; i < end; ++i) {
+        char c = data[i];
+        if (c == '\r') {
+            ++*newlines;
+            if (i + 1 < length && data[i + 1] == '\n') ++*pairs;
+        } else if (c == '\n' && data[i - 1] != '\r') {
+            ++*newlines;
+        }
+    }
+}
+
+// First '\r' or '\n' in 'data[start, end)', or 'end'
+static
+s32 _buffer_next_newline(char *data, s32 start, s32 end)
+{
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    s32 i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (data + i));
+        u32 mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, cr), _mm_cmpeq_epi8(bytes, lf)));
+        if (mask) {
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return(i + (s32) bit);
+        }
+    }
+    for (; i < end; ++i) if (data[i] == '\r' || data[i] == '\n') return(i);
+    return(end);
+}
+
+// Last '\r' or '\n' in 'data[start, end)', or 'start - 1'
+static
+s32 _buffer_previous_newline(char *data, s32 start, s32 end)
+{
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    s32 i = end;
+    for (; i - 16 >= start; i -= 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (data + i - 16));
+        u32 mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, cr), _mm_cmpeq_epi8(bytes, lf)));
+        if (mask) {
+            unsigned long bit;
+            _BitScanReverse(&bit, mask);
+            return(i - 16 + (s32) bit);
+        }
+    }
+    for (--i; i >= start; --i) if (data[i] == '\r' || data[i] == '\n') return(i);
+    return(start - 1);
+}
+
+// End of the physical line starting at 'offset', including its newline, or 'end' if there is no newline before it
+static
+s32 _buffer_physical_line_end(Buffer *buffer, s32 offset, s32 end)
+{
+    s32 gap = buffer->b - buffer->a;
+    s32 found = end;
+    if (offset < buffer->a) {
+        s32 half_end = min(end, buffer->a);
+        found = _buffer_next_newline(buffer->data, offset, half_end);
+        if (found == half_end) found = end;
+        offset = half_end;
+    }
+    if (found == end && offset < end) {
+        found = _buffer_next_newline(buffer->data, offset + gap, end + gap) - gap;
+    }
+    if (found == end) return(end);
+
+    s32 next = found + 1;
+    char c0 = buffer->data[found < buffer->a? found : found + gap];
+    if (c0 == '\r' && next < buffer_length(buffer) && buffer->data[next < buffer->a? next : next + gap] == '\n') ++next;
+    return(next);
+}
+
+struct BufferTextStats
+{
+    s32 lf_count, cr_count, crlf_count;
+    s32 tab_count; // Lines starting with a tab
+    s32 leading_space_count[TAB_WIDTH_MAX*2]; // Lines starting with one space, two spaces, and so on
+};
+
+static
+void _buffer_line_start_stats(str text, s32 offset, BufferTextStats *stats)
+{
+    if (text.data[offset] == '\t') {
+        ++stats->tab_count;
+    } else {
+        s32 space_count = 0;
+        while (offset + space_count < text.length && space_count <= alen(stats->leading_space_count) && text.data[offset + space_count] == ' ') ++space_count;
+        if (space_count > 0 && space_count <= alen(stats->leading_space_count)) ++stats->leading_space_count[space_count - 1];
+    }
+}
+
+// Counts newlines of each kind and the indentation of lines in one go, 16 bytes at a time. For each line start in a block we
+// get the indentation from masks of the tabs and spaces in that block and the next one, so we only look at single bytes for
+// lines with a lot of indentation.
+static
+BufferTextStats _buffer_text_stats(str text)
+{
+    BufferTextStats stats = {};
+    if (text.length == 0) return(stats);
+
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    __m128i tab = _mm_set1_epi8('\t');
+    __m128i space = _mm_set1_epi8(' ');
+    s64 lf_total = 0, cr_total = 0, crlf_total = 0;
+
+    _buffer_line_start_stats(text, 0, &stats);
+
+    s64 i = 1;
+    while (i + 32 <= text.length) {
+        // Each byte counts up to 255, so we sum them up before they overflow
+        __m128i lf_counts = _mm_setzero_si128();
+        __m128i cr_counts = _mm_setzero_si128();
+        __m128i crlf_counts = _mm_setzero_si128();
+        s64 block_end = min(text.length - 16, i + 255*16);
+        for (; i + 16 <= block_end; i += 16) {
+            __m128i previous = _mm_loadu_si128((__m128i *) (text.data + i - 1));
+            __m128i current = _mm_loadu_si128((__m128i *) (text.data + i));
+            __m128i next = _mm_loadu_si128((__m128i *) (text.data + i + 16));
+            __m128i previous_cr = _mm_cmpeq_epi8(previous, cr);
+            __m128i current_lf = _mm_cmpeq_epi8(current, lf);
+            lf_counts = _mm_sub_epi8(lf_counts, current_lf);
+            cr_counts = _mm_sub_epi8(cr_counts, _mm_cmpeq_epi8(current, cr));
+            crlf_counts = _mm_sub_epi8(crlf_counts, _mm_and_si128(previous_cr, current_lf));
+
+            // A line starts after a '\n', and after a '\r' which isn't followed by a '\n'
+            __m128i line_start = _mm_or_si128(_mm_cmpeq_epi8(previous, lf), _mm_andnot_si128(current_lf, previous_cr));
+            u32 starts = _mm_movemask_epi8(line_start);
+            if (!starts) continue;
+
+            u32 tabs = _mm_movemask_epi8(_mm_cmpeq_epi8(current, tab));
+            u32 spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(current, space)) | (_mm_movemask_epi8(_mm_cmpeq_epi8(next, space)) << 16);
+            while (starts) {
+                unsigned long bit;
+                _BitScanForward(&bit, starts);
+                starts &= starts - 1;
+
+                u32 indent = spaces >> bit;
+                if (tabs & (1 << bit)) {
+                    ++stats.tab_count;
+                } else if (indent == U32_MAX >> bit) {
+                    _buffer_line_start_stats(text, (s32) (i + bit), &stats);
+                } else if (indent & 1) {
+                    unsigned long space_count;
+                    _BitScanForward(&space_count, ~indent);
+                    ++stats.leading_space_count[space_count - 1];
+                }
+            }
+        }
+
+        __m128i zero = _mm_setzero_si128();
+        __m128i lf_sums = _mm_sad_epu8(lf_counts, zero);
+        __m128i cr_sums = _mm_sad_epu8(cr_counts, zero);
+        __m128i crlf_sums = _mm_sad_epu8(crlf_counts, zero);
+        lf_total += _mm_cvtsi128_si32(lf_sums) + _mm_extract_epi16(lf_sums, 4);
+        cr_total += _mm_cvtsi128_si32(cr_sums) + _mm_extract_epi16(cr_sums, 4);
+        crlf_total += _mm_cvtsi128_si32(crlf_sums) + _mm_extract_epi16(crlf_sums, 4);
+    }
+
+    for (; i < text.length; ++i) {
+        char previous = text.data[i - 1];
+        char current = text.data[i];
+        lf_total += current == '\n';
+        cr_total += current == '\r';
+        crlf_total += previous == '\r' && current == '\n';
+        if (previous == '\n' || (previous == '\r' && current != '\n')) _buffer_line_start_stats(text, (s32) i, &stats);
+    }
+    cr_total += text.data[0] == '\r';
+    lf_total += text.data[0] == '\n';
+
+    stats.crlf_count = (s32) crlf_total;
+    stats.lf_count = (s32) (lf_total - crlf_total);
+    stats.cr_count = (s32) (cr_total - crlf_total);
+    return(stats);
+}
+
 enum {
     HISTORY_INSERT = 0xf0,
     HISTORY_DELETE = 0xf1,
@@ -577,16 +835,66 @@ void buffer_view_set_focus_to_focused(Buffer *buffer, View *view)
     }
 }
 
-struct VirtualLineList
+// Returns true if every byte is in the range [32, 127) and has a glyph in the font
+static
+bool _layout_is_simple_ascii(Font *font, char *data, s32 length)
 {
-    VirtualLine line;
-    VirtualLineList *next;
-};
+    s32 i = 0;
 
+    __m128i low = _mm_set1_epi8(' ');
+    __m128i high = _mm_set1_epi8(126);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (data + i));
+        // NB The compares are signed, so bytes >= 0x80 are negative and end up below ' '
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(bytes, low), _mm_cmpgt_epi8(bytes, high));
+        if (_mm_movemask_epi8(bad)) return(false);
+    }
+    for (; i < length; ++i) {
+        u8 c = data[i];
+        if (c < ' ' || c >= 127) return(false);
+    }
+
+    // Fonts almost always have all of printable ascii, but not necessarily
+    u32 *ascii_glyph_map = font->current->ascii_glyph_map;
+    bool all_available = ascii_glyph_map[1] == U32_MAX && ascii_glyph_map[2] == U32_MAX && (ascii_glyph_map[3] | 0x80000000u) == U32_MAX;
+    if (!all_available) {
+        for (s32 j = 0; j < length; ++j) {
+            u8 c = data[j];
+            if (!(ascii_glyph_map[c >> 5] & (1u << (c & 31)))) return(false);
+        }
+    }
+
+    return(true);
+}
+
+// Lays out a single physical line, inserting the resulting virtual lines directly into the gap of 'buffer->lines'. The caller
+// should have moved the gap to the insert offset (see 'GapArray::reserve'). Returns the number of virtual lines inserted.
 static noinline_function
-VirtualLineList *_layout_physical_line(Buffer *buffer, s32 global_offset, str text)
+s32 _layout_physical_line(Buffer *buffer, s32 global_offset, str text, s32 physical_line_index)
 {
-    // TODO if the text.length is low enough it is impossible for the line to wrap, so we don't have to do anything here. This probably could improve our performance a lot
+    GapArray<VirtualLine> *lines = &buffer->lines;
+
+    VirtualLine line = {};
+    line.start = global_offset;
+    line.end = global_offset;
+    line.physical_line_index = physical_line_index;
+
+    bool ends_in_newline = text.length > 0 && is_newline(text.data[text.length - 1]);
+
+    // NB If the line is short enough it is impossible for it to wrap, so we can skip decoding it. We only
+    // take this path when every byte is printable ascii with a glyph in the font, because then every byte takes exactly one
+    // glyph. Tabs, non-ascii and control characters go through the slow path below. We leave one glyph of slack for the
+    // hyphen we use when force-wrapping.
+    s32 visible_length = text.length;
+    if (!buffer->show_special_characters) {
+        while (visible_length > 0 && is_newline(text.data[visible_length - 1])) --visible_length;
+    }
+    if (visible_length < buffer->max_glyphs_per_line && _layout_is_simple_ascii(buffer->font, text.data, visible_length)) {
+        line.end = global_offset + visible_length;
+        if (ends_in_newline) line.flags |= VirtualLine::ENDS_IN_ACTUAL_NEWLINE;
+        lines->insert(lines->a, line);
+        return(1);
+    }
 
     s32 max_virtual_indent = buffer->max_glyphs_per_line/2 - SOFTWRAP_PRE_SPACES;
     s32 tab_width = buffer->tab_width? buffer->tab_width : TAB_WIDTH_DEFAULT;
@@ -598,14 +906,7 @@ VirtualLineList *_layout_physical_line(Buffer *buffer, s32 global_offset, str te
     bool set_new_wrap_option = false;
     s32 virtual_indent = 0;
     bool in_leading_spaces = true;
-
-    VirtualLineList *line_list = null;
-    VirtualLineList *line_list_last = null;
-
-    line_list = stack_alloc(VirtualLineList, 1);
-    line_list_last = line_list;
-    line_list->line.start = global_offset + relative_offset;
-    line_list->line.end = global_offset + relative_offset;
+    s32 line_count = 0;
 
     while (relative_offset < text.length) {
         if (set_new_wrap_option) {
@@ -634,25 +935,27 @@ VirtualLineList *_layout_physical_line(Buffer *buffer, s32 global_offset, str te
             if (current_width + glyph_count > available_width) {
                 s32 new_width = 0;
 
-                VirtualLineList *next = stack_alloc(VirtualLineList, 1);
-                next->line.start = codepoint_offset;
+                VirtualLine next = {};
+                next.start = codepoint_offset;
+                next.physical_line_index = physical_line_index;
 
                 if (width_at_last_wrap_option > 0) {
-                    next->line.start = offset_at_last_wrap_option;
-                    line_list_last->line.end = offset_at_last_wrap_option;
+                    next.start = offset_at_last_wrap_option;
+                    line.end = offset_at_last_wrap_option;
                     new_width += current_width - width_at_last_wrap_option;
                 } else {
-                    line_list_last->line.flags |= VirtualLine::MARK_CONTINUATION;
+                    line.flags |= VirtualLine::MARK_CONTINUATION;
                 }
                 width_at_last_wrap_option = 0;
 
-                next->line.virtual_indent = virtual_indent;
-                new_width += next->line.virtual_indent;
+                next.virtual_indent = virtual_indent;
+                new_width += next.virtual_indent;
 
-                next->line.end = next->line.start;
+                next.end = next.start;
 
-                line_list_last->next = next;
-                line_list_last = next;
+                lines->insert(lines->a, line);
+                ++line_count;
+                line = next;
 
                 current_width = new_width;
             }
@@ -667,20 +970,20 @@ VirtualLineList *_layout_physical_line(Buffer *buffer, s32 global_offset, str te
             }
 
             if (decoded.codepoint == '\t') {
-                s32 base_offset = (line_list_last != line_list)? virtual_indent : 0;
+                s32 base_offset = (line_count > 0)? virtual_indent : 0;
                 current_width = current_width + tab_width - ((current_width - base_offset)%tab_width);
             } else {
                 current_width += glyph_count;
             }
         }
 
-        if (!hide) line_list_last->line.end = global_offset + relative_offset;
+        if (!hide) line.end = global_offset + relative_offset;
     }
 
-    #undef list_add
-
-    if (text.length > 0 && is_newline(text.data[text.length - 1])) line_list_last->line.flags |= VirtualLine::ENDS_IN_ACTUAL_NEWLINE;
-    return(line_list);
+    if (ends_in_newline) line.flags |= VirtualLine::ENDS_IN_ACTUAL_NEWLINE;
+    lines->insert(lines->a, line);
+    ++line_count;
+    return(line_count);
 }
 
 static
@@ -697,17 +1000,38 @@ void _buffer_offset_single(s32 *pos, s32 from, s32 to, bool insert)
     }
 }
 
+// Returns the first virtual line of the physical line where highlighting is out of date, or 'buffer->lines.length'
 static
-void _buffer_redo_highlighting(Buffer *buffer, s32 from_virtual, HighlightState highlight_state)
+s32 _buffer_highlight_frontier(Buffer *buffer)
 {
+    if (!buffer->highlight_pending) return(buffer->lines.length);
+    s32 i = buffer_offset_to_virtual_line_index(buffer, buffer->highlight_pending_offset);
+    while (i > 0 && buffer->lines[i - 1].physical_line_index == buffer->lines[i].physical_line_index) --i;
+    return(i);
+}
+
+// Rehighlights from 'from_virtual' until the state converges. If that would go past 'stop_virtual' we stop early and leave the
+// rest pending. Lines past the frontier (see 'Buffer::highlight_pending') can't converge, since their state is out of date.
+static
+void _buffer_redo_highlighting(Buffer *buffer, s32 from_virtual, HighlightState highlight_state, s32 stop_virtual)
+{
+    timing_begin("highlight");
     if (HIGHLIGHT_FUNCTIONS[buffer->highlight_function_index].function) {
         s32 i = from_virtual;
         assert(i == 0 || buffer->lines[i - 1].physical_line_index != buffer->lines[i].physical_line_index);
 
+        s32 frontier = _buffer_highlight_frontier(buffer);
+        bool stopped = false;
+
         s32 highlight_index_delta = 0;
         s32 insert_offset = buffer->lines[i].first_highlight_index;
 
-        while (i < buffer->lines.length && buffer->lines[i].prev_highlight_state != highlight_state) {
+        while (i < buffer->lines.length && (buffer->lines[i].prev_highlight_state != highlight_state || i >= frontier)) {
+            if (i >= stop_virtual) {
+                stopped = true;
+                break;
+            }
+
             VirtualLine *line = &buffer->lines[i];
             line->first_highlight_index = insert_offset;
             line->prev_highlight_state = highlight_state;
@@ -733,23 +1057,27 @@ void _buffer_redo_highlighting(Buffer *buffer, s32 from_virtual, HighlightState
             str text = buffer_get_slice(buffer, start, end);
             while (text.length > 0 && is_newline(text.data[text.length - 1])) --text.length;
 
-            HighlightList *highlights = (HIGHLIGHT_FUNCTIONS[buffer->highlight_function_index].function)(text, &highlight_state);
-            for (HighlightList *highlight = highlights; highlight; highlight = highlight->next) {
-                assert(highlight->highlight.end <= text.length);
-                highlight->highlight.start += start;
-                highlight->highlight.end += start;
-                buffer->highlights.insert(insert_offset, highlight->highlight);
-                ++insert_offset;
-                ++highlight_index_delta;
-            }
+            // NB The runs go directly into the gap, which we moved to 'insert_offset' when removing the old runs
+            HighlightEmitter emitter = highlight_emitter(&buffer->highlights);
+            (HIGHLIGHT_FUNCTIONS[buffer->highlight_function_index].function)(text, &highlight_state, &emitter);
+            debug_assert(emitter.position <= text.length);
+            s32 new_run_count = emitter.run_count;
+            insert_offset += new_run_count;
+            highlight_index_delta += new_run_count;
 
             stack_leave_frame();
         }
 
+        if (stopped) {
+            buffer->highlight_pending = true;
+            buffer->highlight_pending_offset = buffer->lines[i].start;
+            buffer->highlight_pending_state = highlight_state;
+        } else if (i >= frontier) {
+            buffer->highlight_pending = false;
+        }
+
         for (; i < buffer->lines.length; ++i) {
-            if (buffer->lines[i].prev_highlight_state != HighlightState::Invalid) {
-                buffer->lines[i].first_highlight_index += highlight_index_delta;
-            }
+            buffer->lines[i].first_highlight_index += highlight_index_delta;
         }
     } else if (buffer->highlights.length > 0) {
         buffer->highlights.clear();
@@ -757,7 +1085,28 @@ void _buffer_redo_highlighting(Buffer *buffer, s32 from_virtual, HighlightState
             buffer->lines[i].first_highlight_index = 0;
             buffer->lines[i].prev_highlight_state = HighlightState::Invalid;
         }
+        buffer->highlight_pending = false;
     }
+    timing_end();
+}
+
+void buffer_highlight_until(Buffer *buffer, s32 virtual_line_end)
+{
+    if (buffer->highlight_pending) {
+        s32 frontier = _buffer_highlight_frontier(buffer);
+        if (frontier < virtual_line_end) {
+            _buffer_redo_highlighting(buffer, frontier, buffer->highlight_pending_state, virtual_line_end);
+        }
+    }
+}
+
+// Returns true if there still is highlighting left to do
+bool buffer_highlight_in_background(Buffer *buffer, s32 line_count)
+{
+    if (buffer->highlight_pending) {
+        buffer_highlight_until(buffer, _buffer_highlight_frontier(buffer) + line_count);
+    }
+    return(buffer->highlight_pending);
 }
 
 static
@@ -808,16 +1157,15 @@ void _buffer_on_change(Buffer *buffer, s32 edit_min, s32 edit_max, bool insert)
     }
 
     if (buffer->font && buffer->max_glyphs_per_line > 0) {
+        // NB We need this before offsetting lines, as the offsets of lines in the edited range become ambiguous
+        s32 highlight_frontier = _buffer_highlight_frontier(buffer);
+
         for (s32 i = 0; i < buffer->lines.length; ++i) {
             VirtualLine *line = &buffer->lines[i];
             _buffer_offset_single(&line->start, edit_min, edit_max, insert);
             _buffer_offset_single(&line->end, edit_min, edit_max, insert);
         }
-        for (s32 i = 0; i < buffer->highlights.length; ++i) {
-            Highlight *highlight = &buffer->highlights[i];
-            _buffer_offset_single(&highlight->start, edit_min, edit_max, insert);
-            _buffer_offset_single(&highlight->end, edit_min, edit_max, insert);
-        }
+        _buffer_offset_single(&buffer->highlight_pending_offset, edit_min, edit_max, insert);
 
         if (buffer->lines.length > 0) {
             buffer->lines[0].start = 0;
@@ -841,6 +1189,7 @@ void _buffer_on_change(Buffer *buffer, s32 edit_min, s32 edit_max, bool insert)
             physical_line_delta = 0;
             virtual_line_delta = 0;
             highlight_state = HighlightState::Default;
+            buffer->highlight_pending = false;
 
             start_offset = 0;
             end_offset = buffer_length(buffer);
@@ -868,6 +1217,13 @@ void _buffer_on_change(Buffer *buffer, s32 edit_min, s32 edit_max, bool insert)
             highlight_insert_offset = buffer->lines[n0].first_highlight_index;
             highlight_state = buffer->lines[n0].prev_highlight_state;
 
+            if (highlight_frontier >= n0 && highlight_frontier < n1) {
+                // The frontier is in the lines we are about to redo, so move it to the start of them
+                if (highlight_frontier == n0) highlight_state = buffer->highlight_pending_state;
+                buffer->highlight_pending_offset = buffer->lines[n0].start;
+                buffer->highlight_pending_state = highlight_state;
+            }
+
             start_offset = buffer->lines[n0].start;
             end_offset = n1 < buffer->lines.length? buffer->lines[n1].start : buffer_length(buffer);
 
@@ -875,49 +1231,24 @@ void _buffer_on_change(Buffer *buffer, s32 edit_min, s32 edit_max, bool insert)
             buffer->lines.remove_range(n0, n1);
         }
 
+        timing_begin("layout");
         s32 initial_line_insert_offset = line_insert_offset;
+        buffer->lines.reserve(line_insert_offset, 0);
         s32 offset = start_offset;
         while (offset < end_offset) {
             s32 line_start = offset;
-
-            bool done = false;
-            while (offset < end_offset && !done) {
-                s32 actual_offset = offset;
-                if (actual_offset >= buffer->a) actual_offset += buffer->b - buffer->a;
-                ++offset;
-
-                char c0 = buffer->data[actual_offset];
-                if (c0 == '\r' || c0 == '\n') {
-                    if (c0 == '\r') {
-                        char c1 = 0;
-                        s32 c1_offset = actual_offset + 1;
-                        if (c1_offset == buffer->a) c1_offset = buffer->b;
-                        if (c1_offset < buffer->cap) c1 = buffer->data[c1_offset];
-                        if (c1 == '\n') ++offset;
-                    }
-
-                    done = true;
-                }
-            }
-
+            offset = _buffer_physical_line_end(buffer, offset, end_offset);
 
             stack_enter_frame();
             str physical_line_text = buffer_get_slice(buffer, line_start, offset);
 
-            VirtualLineList *new_lines = _layout_physical_line(buffer, line_start, physical_line_text);
-
-            if (new_lines) {
-                new_lines->line.first_highlight_index = highlight_insert_offset;
-            }
-
             ++physical_line_index;
             ++physical_line_delta;
-            for (VirtualLineList *new_line = new_lines; new_line; new_line = new_line->next) {
-                new_line->line.physical_line_index = physical_line_index;
-                buffer->lines.insert(line_insert_offset, new_line->line);
-                ++line_insert_offset;
-                ++virtual_line_delta;
-            }
+
+            s32 new_line_count = _layout_physical_line(buffer, line_start, physical_line_text, physical_line_index);
+            buffer->lines[line_insert_offset].first_highlight_index = highlight_insert_offset;
+            line_insert_offset += new_line_count;
+            virtual_line_delta += new_line_count;
 
             stack_leave_frame();
         }
@@ -934,9 +1265,11 @@ void _buffer_on_change(Buffer *buffer, s32 edit_min, s32 edit_max, bool insert)
             empty_line.first_highlight_index = highlight_insert_offset;
             buffer->lines.insert(buffer->lines.length, empty_line);
         }
+        timing_end();
 
-        if (line_insert_offset <= buffer->lines.length) {
-            _buffer_redo_highlighting(buffer, initial_line_insert_offset, highlight_state);
+        // NB If the edit is past the highlight frontier there is no point in rehighlighting, the lines will be redone later anyways
+        if (line_insert_offset <= buffer->lines.length && initial_line_insert_offset <= _buffer_highlight_frontier(buffer)) {
+            _buffer_redo_highlighting(buffer, initial_line_insert_offset, highlight_state, initial_line_insert_offset + HIGHLIGHT_EAGER_LINES);
         }
 
         buffer->physical_line_count = buffer->lines[buffer->lines.length - 1].physical_line_index;
@@ -1123,6 +1456,7 @@ void buffer_reset(Buffer *buffer)
 
     if (buffer->path) heap_free(buffer->path);
     buffer->path = null;
+    ++buffer_path_generation;
 
     if (buffer->path_display_string.data && !buffer->path_display_string_static) {
         heap_free(buffer->path_display_string.data);
@@ -1175,15 +1509,19 @@ void buffer_set_layout_parameters(Buffer *buffer, Font *font, s32 max_glyphs_per
 {
     bool changed = false;
     changed |= font != buffer->font;
+    changed |= font->availability_changes != buffer->font_availability_changes;
     changed |= max_glyphs_per_line != buffer->max_glyphs_per_line;
     changed |= show_special_characters != buffer->show_special_characters;
     if (changed) {
         buffer->font = font;
+        buffer->font_availability_changes = font->availability_changes;
         buffer->max_glyphs_per_line = max_glyphs_per_line;
         buffer->show_special_characters = show_special_characters;
         buffer->lines.clear();
 
+        timing_begin("full layout");
         _buffer_redo_full_layout(buffer);
+        timing_end();
     }
 
     if (buffer->visible_lines != visible_lines || buffer->margin_lines != margin_lines) {
@@ -1206,7 +1544,8 @@ void buffer_override_highlight_mode(Buffer *buffer, s32 highlight_function_index
             buffer->lines[i].first_highlight_index = 0;
             buffer->lines[i].prev_highlight_state = HighlightState::Invalid;
         }
-        _buffer_redo_highlighting(buffer, 0, HighlightState::Default);
+        buffer->highlight_pending = false;
+        _buffer_redo_highlighting(buffer, 0, HighlightState::Default, HIGHLIGHT_EAGER_LINES);
     }
 }
 
@@ -1222,7 +1561,7 @@ str buffer_get_slice(Buffer *buffer, s32 min, s32 max)
     } else if (min >= buffer->a) {
         result.data = (char *) buffer->data + buffer->b + (min - buffer->a);
     } else {
-        result.data = stack_alloc(char, result.length);
+        result.data = stack_alloc_uninitialized(char, result.length);
         s32 first_half = buffer->a - min;
         memcpy(result.data, buffer->data + min, first_half);
         memcpy(result.data + first_half, buffer->data + buffer->b, result.length - first_half);
@@ -1263,6 +1602,65 @@ s32 buffer_offset_to_virtual_line_index(Buffer *buffer, s32 offset)
     return(index_offset + min);
 }
 
+static
+void _highlight_iterator_enter_line(Buffer *buffer, HighlightIterator *iterator, s32 line_index)
+{
+    s32 physical_line_index = buffer->lines[line_index].physical_line_index;
+    s32 next_line_index = line_index + 1;
+    while (next_line_index < buffer->lines.length && buffer->lines[next_line_index].physical_line_index == physical_line_index) ++next_line_index;
+
+    iterator->next_line_index = next_line_index;
+    iterator->run_index = buffer->lines[line_index].first_highlight_index;
+    iterator->run_index_end = next_line_index < buffer->lines.length? buffer->lines[next_line_index].first_highlight_index : buffer->highlights.length;
+    iterator->run_start = buffer->lines[line_index].start;
+    iterator->run_end = iterator->run_start;
+    iterator->kind = HighlightKind::None;
+
+    if (buffer->lines[line_index].prev_highlight_state == HighlightState::Invalid) {
+        iterator->run_index_end = iterator->run_index;
+    }
+}
+
+HighlightIterator buffer_highlight_iterator(Buffer *buffer, s32 offset)
+{
+    HighlightIterator iterator = {};
+    iterator.run_end = S32_MAX;
+    if (buffer->highlights.length > 0 && buffer->lines.length > 0) {
+        s32 line_index = buffer_offset_to_virtual_line_index(buffer, offset);
+        while (line_index > 0 && buffer->lines[line_index - 1].physical_line_index == buffer->lines[line_index].physical_line_index) --line_index;
+        _highlight_iterator_enter_line(buffer, &iterator, line_index);
+        buffer_highlight_iterator_advance(buffer, &iterator, offset);
+    }
+    return(iterator);
+}
+
+HighlightKind buffer_highlight_iterator_advance(Buffer *buffer, HighlightIterator *iterator, s32 offset)
+{
+    while (offset >= iterator->run_end) {
+        if (iterator->run_index < iterator->run_index_end) {
+            HighlightRun run = buffer->highlights[iterator->run_index];
+            ++iterator->run_index;
+            iterator->run_start = iterator->run_end;
+            iterator->run_end += run.length;
+            iterator->kind = (HighlightKind) run.kind;
+        } else if (iterator->next_line_index < buffer->lines.length && offset >= buffer->lines[iterator->next_line_index].start) {
+            _highlight_iterator_enter_line(buffer, iterator, iterator->next_line_index);
+        } else {
+            iterator->run_start = iterator->run_end;
+            iterator->run_end = iterator->next_line_index < buffer->lines.length? buffer->lines[iterator->next_line_index].start : S32_MAX;
+            iterator->kind = HighlightKind::None;
+        }
+    }
+
+    return(offset >= iterator->run_start? iterator->kind : HighlightKind::None);
+}
+
+HighlightKind buffer_highlight_at(Buffer *buffer, s32 offset)
+{
+    HighlightIterator iterator = buffer_highlight_iterator(buffer, offset);
+    return(buffer_highlight_iterator_advance(buffer, &iterator, offset));
+}
+
 s32v2 buffer_offset_to_layout_offset(Buffer *buffer, View *view, s32 offset)
 {
     s32 virtual_line_index = buffer_offset_to_virtual_line_index(buffer, offset);
@@ -1546,6 +1944,41 @@ void _buffer_normalize_count_indent(Buffer *buffer, str text, s32 *indent, s32 *
     }
 }
 
+// Appends 'text' to 'normalized' with the buffer's newlines, and with 'indent_delta' added to the indent of each line
+// except the first, unless 'reindent_first_line'.
+static
+void _buffer_normalize_lines(Buffer *buffer, str *normalized, str text, s32 indent_delta, bool reindent_first_line)
+{
+    str newline = NEWLINE[(s32) buffer->newline_mode];
+
+    s32 i0 = 0;
+    while (i0 < text.length) {
+        s32 i1 = i0;
+        while (i1 < text.length && !is_newline(text[i1])) ++i1;
+        str line = slice(text, i0, i1);
+
+        if (i0 > 0 || reindent_first_line) {
+            s32 actual_indent = 0;
+            s32 actual_indent_bytes = 0;
+            _buffer_normalize_count_indent(buffer, line, &actual_indent, &actual_indent_bytes);
+            line = slice(line, actual_indent_bytes);
+
+            s32 delta = indent_delta + actual_indent;
+            if (delta > 0 && line.length > 0) {
+                _buffer_normalize_add_indent(buffer, normalized, delta);
+            }
+        }
+
+        stack_append(normalized, line);
+
+        i0 = i1;
+        if (i0 < text.length) {
+            i0 += (text[i0] == '\r' && i0 + 1 < text.length && text[i0 + 1] == '\n')? 2 : 1;
+            stack_append(normalized, newline);
+        }
+    }
+}
+
 static
 str _buffer_normalize_newlines_for_insert(Buffer *buffer, str text, s32 indent, s32 add_newline)
 {
@@ -1573,32 +2006,7 @@ str _buffer_normalize_newlines_for_insert(Buffer *buffer, str text, s32 indent,
         stack_append(&normalized, newline);
     }
 
-    s32 i0 = 0;
-    while (i0 < text.length) {
-        s32 i1 = i0;
-        while (i1 < text.length && !is_newline(text[i1])) ++i1;
-        str line = slice(text, i0, i1);
-
-        if (i0 > 0 || add_newline != 0) {
-            s32 actual_indent = 0;
-            s32 actual_indent_bytes = 0;
-            _buffer_normalize_count_indent(buffer, line, &actual_indent, &actual_indent_bytes);
-            line = slice(line, actual_indent_bytes);
-
-            s32 delta = indent + actual_indent - first_actual_indent;
-            if (delta > 0 && line.length > 0) {
-                _buffer_normalize_add_indent(buffer, &normalized, delta);
-            }
-        }
-
-        stack_append(&normalized, line);
-
-        i0 = i1;
-        if (i0 < text.length) {
-            i0 += (text[i0] == '\r' && i0 + 1 < text.length && text[i0 + 1] == '\n')? 2 : 1;
-            stack_append(&normalized, newline);
-        }
-    }
+    _buffer_normalize_lines(buffer, &normalized, text, indent - first_actual_indent, add_newline != 0);
 
     if (text.length == 0 && indent && add_newline != 0) {
         _buffer_normalize_add_indent(buffer, &normalized, indent);
@@ -1621,6 +2029,7 @@ bool buffer_set_path(Buffer *buffer, Path path, Path relative_to)
     if (ok) {
         if (buffer->path) heap_free(buffer->path);
         buffer->path = heap_copy(full_path);
+        ++buffer_path_generation;
         buffer_update_display_string(buffer, relative_to);
 
         stack_enter_frame();
@@ -1764,85 +2173,47 @@ IoError buffer_load(Buffer *buffer)
 
 
         // Decide on newline mode and tab width
-        s32 tab_count = 0;
-        s32 leading_space_count[TAB_WIDTH_MAX*2] = {0};
-
-        s32 lf_count = 0;
-        s32 cr_count = 0;
-        s32 crlf_count = 0;
-
-        {
-            char *start = buffer->data;
-            char *end = buffer->data + buffer->a; // Note (Morten): This loop is ok because we manually set up the data for the buffer further up in this function.
-
-            while (start < end) {
-                // Count spaces or tab at line start
-                if (*start == '\t') {
-                    ++tab_count;
-                } else {
-                    s32 space_count = 0;
-                    while (space_count <= alen(leading_space_count) && start < end && *start == ' ') ++start, ++space_count;
-                    if (space_count) leading_space_count[space_count - 1] += 1;
-                }
-
-                // Find line ending
-                while (start < end) {
-                    char c = *start++;
-                    if (c == '\n') {
-                        ++lf_count;
-                        break;
-                    } else if (c == '\r') {
-                        if (start < end && *start == '\n') {
-                            ++crlf_count;
-                            ++start;
-                        } else {
-                            ++lf_count;
-                        }
-                        break;
-                    }
-                }
-            }
-        }
-
-        buffer->tab_width = TAB_WIDTH_DEFAULT;
-        if (tab_count > 0) {
-            buffer->tab_mode = TabMode::HARD;
-        } else {
-            buffer->tab_mode = TabMode::SOFT;
-
-            s32 indent_width_likeliness = S32_MIN;
-            for (s32 width = TAB_WIDTH_MIN; width <= TAB_WIDTH_MAX; ++width) {
-                s32 likeliness = 0;
-                for (s32 i = 0; i < alen(leading_space_count); ++i) {
-                    s32 count = leading_space_count[i];
-                    if ((i + 1) % width == 0) {
-                        likeliness += count / ((i + 1) / width);
-                    } else {
-                        likeliness -= count;
-                    }
-                }
-                if (likeliness > indent_width_likeliness) {
-                    buffer->tab_width = width;
-                    indent_width_likeliness = likeliness;
-                }
-            }
-        }
+        BufferTextStats stats = _buffer_text_stats(buffer_move_gap_to_end(buffer));
+
+        buffer->tab_width = TAB_WIDTH_DEFAULT;
+        if (stats.tab_count > 0) {
+            buffer->tab_mode = TabMode::HARD;
+        } else {
+            buffer->tab_mode = TabMode::SOFT;
+
+            s32 indent_width_likeliness = S32_MIN;
+            for (s32 width = TAB_WIDTH_MIN; width <= TAB_WIDTH_MAX; ++width) {
+                s32 likeliness = 0;
+                for (s32 i = 0; i < alen(stats.leading_space_count); ++i) {
+                    s32 count = stats.leading_space_count[i];
+                    if ((i + 1) % width == 0) {
+                        likeliness += count / ((i + 1) / width);
+                    } else {
+                        likeliness -= count;
+                    }
+                }
+                if (likeliness > indent_width_likeliness) {
+                    buffer->tab_width = width;
+                    indent_width_likeliness = likeliness;
+                }
+            }
+        }
 
         s32 newline_modes = 0;
-        if (lf_count > 0) {
+        if (stats.lf_count > 0) {
             ++newline_modes;
             buffer->newline_mode = NewlineMode::LF;
         }
-        if (cr_count > 0) {
+        if (stats.cr_count > 0) {
             ++newline_modes;
             buffer->newline_mode = NewlineMode::CR;
         }
-        if (crlf_count > 0) {
+        if (stats.crlf_count > 0) {
             ++newline_modes;
             buffer->newline_mode = NewlineMode::CRLF;
         }
         if (newline_modes > 1) {
-            debug_printf("Multiple different line ending styles seen (%i LF, %i CR, %i CRLF)\n", lf_count, cr_count, crlf_count);
+            debug_printf("Multiple different line ending styles seen (%i LF, %i CR, %i CRLF)\n", stats.lf_count, stats.cr_count, stats.crlf_count);
         }
     }
 
@@ -1872,51 +2243,171 @@ bool buffer_has_internal_changes(Buffer *buffer)
 }
 
 
+// Rewrites the newlines in 'data[start, end)' as 'newline', writing from 'write' onwards, and returns where the result ends.
+// This works in place as long as the result never catches up with what we have yet to read.
+static
+s32 _buffer_convert_newlines_forward(char *data, s32 start, s32 end, s32 write, str newline)
+{
+    s32 read = start;
+    while (read < end) {
+        s32 found = _buffer_next_newline(data, read, end);
+        if (write != read) memmove(data + write, data + read, found - read);
+        write += found - read;
+        read = found;
+
+        if (read < end) {
+            read += (data[read] == '\r' && read + 1 < end && data[read + 1] == '\n')? 2 : 1;
+            memcpy(data + write, newline.data, newline.length);
+            write += (s32) newline.length;
+        }
+    }
+    return(write);
+}
+
+// Like '_buffer_convert_newlines_forward', but goes from the back, writing the result so it ends at 'write_end'. Returns where
+// the result starts.
+static
+s32 _buffer_convert_newlines_backward(char *data, s32 start, s32 end, s32 write_end, str newline)
+{
+    s32 read = end;
+    s32 write = write_end;
+    while (read > start) {
+        s32 found = _buffer_previous_newline(data, start, read) + 1;
+        write -= read - found;
+        if (write != found) memmove(data + write, data + found, read - found);
+        read = found;
+
+        if (read > start) {
+            read -= (data[read - 1] == '\n' && read - 2 >= start && data[read - 2] == '\r')? 2 : 1;
+            write -= (s32) newline.length;
+            memcpy(data + write, newline.data, newline.length);
+        }
+    }
+    return(write);
+}
+
+static
+bool _buffer_offset_pointer_order(s32 **left, s32 **right)
+{
+    return(**left <= **right);
+}
+
+// Converts the text on both sides of the gap in place, reading each byte once or twice. We only need more memory if the text
+// grows, and then only as much as it grows by. Offsets in the views are remapped, so carets and scrolling stay where they
+// were, but we have to lay out all lines again since their offsets change.
 void buffer_change_line_endings(Buffer *buffer, NewlineMode new_mode)
 {
     buffer->newline_mode = new_mode;
     str newline = NEWLINE[(s32) new_mode];
 
-    buffer_move_gap_to_end(buffer);
-    s32 old_length = buffer->a;
-    s32 max_new_length = old_length;
-    for (s32 i = 0; i < old_length; ++i) if (is_newline(buffer->data[i])) ++max_new_length;
-    _buffer_make_space(buffer, max_new_length - old_length);
+    // A pair split by the gap would be converted as two newlines
+    if (buffer->a > 0 && buffer->b < buffer->cap && buffer->data[buffer->a - 1] == '\r' && buffer->data[buffer->b] == '\n') {
+        _buffer_move_gap(buffer, buffer->a + 1);
+    }
 
     stack_enter_frame();
-    char *old = stack_alloc(char, old_length + 1);
-    memcpy(old, buffer->data, old_length);
-    old[old_length] = 0;
 
-    buffer->a = 0;
-    for (s32 i = 0; i < old_length; ++i) {
-        char c = old[i];
-        if (c == '\r' || c == '\n') {
-            if (c == '\r' && old[i + 1] == '\n') ++i;
-            memcpy(&buffer->data[buffer->a], newline.data, newline.length);
-            buffer->a += newline.length;
-        } else {
-            buffer->data[buffer->a++] = c;
+    s32 offset_count = 0;
+    for (s32 i = 0; i < alen(buffer->views); ++i) {
+        View *view = &buffer->views[i];
+        offset_count += 1 + 2*(s32) view->selections.length + 2*view->search.total;
+    }
+    Slice<s32 *> offsets = { stack_alloc_uninitialized(s32 *, offset_count), 0 };
+    for (s32 i = 0; i < alen(buffer->views); ++i) {
+        View *view = &buffer->views[i];
+        offsets[offsets.length++] = &view->focus_offset;
+        for_each (selection, view->selections) {
+            offsets[offsets.length++] = &selection->start.offset;
+            offsets[offsets.length++] = &selection->end.offset;
+        }
+        for (s32 j = 0; j < view->search.total; ++j) {
+            offsets[offsets.length++] = &view->search.list[j].min;
+            offsets[offsets.length++] = &view->search.list[j].max;
+        }
+    }
+    stable_sort(offsets, &_buffer_offset_pointer_order);
+
+    // Each newline which doesn't already have the new length grows or shrinks by one byte. We count them for both halves,
+    // and remap the offsets on the way, in one go over the text. When shrinking we don't need the totals, so we can stop at
+    // the last offset.
+    s32 length = buffer_length(buffer);
+    s32 changes[2] = {};
+    s32 counted = 0;
+    for (s64 i = 0; i <= offsets.length; ++i) {
+        s32 until = i < offsets.length? clamp(*offsets[i], 0, length) : (newline.length == 2? length : counted);
+        while (counted < until) {
+            s32 half = counted < buffer->a? 0 : 1;
+            s32 half_end = half == 0? min(until, buffer->a) : until;
+            s32 newlines = 0, pairs = 0;
+            if (half == 0) {
+                _buffer_count_newlines(buffer->data, buffer->a, counted, half_end, &newlines, &pairs);
+            } else {
+                _buffer_count_newlines(buffer->data + buffer->b, buffer->cap - buffer->b, counted - buffer->a, half_end - buffer->a, &newlines, &pairs);
+            }
+            changes[half] += newline.length == 2? newlines - pairs : pairs;
+            counted = half_end;
+        }
+        if (i < offsets.length) {
+            s32 change = changes[0] + changes[1];
+            *offsets[i] += newline.length == 2? change : -change;
         }
     }
-    assert(buffer->a <= buffer->cap && buffer->b == buffer->cap);
+
+    if (newline.length == 2) {
+        // Everything grows away from the gap, so we go back to front before it and front to back after it
+        _buffer_make_space(buffer, changes[0] + changes[1]);
+        char *data = buffer->data;
+        s32 new_a = buffer->a + changes[0];
+        s32 new_b = buffer->b - changes[1];
+        _buffer_convert_newlines_backward(data, 0, buffer->a, new_a, newline);
+        _buffer_convert_newlines_forward(data, buffer->b, buffer->cap, new_b, newline);
+        buffer->a = new_a;
+        buffer->b = new_b;
+    } else {
+        // Everything shrinks towards the gap
+        char *data = buffer->data;
+        buffer->a = _buffer_convert_newlines_forward(data, 0, buffer->a, 0, newline);
+        buffer->b = _buffer_convert_newlines_backward(data, buffer->b, buffer->cap, buffer->cap, newline);
+    }
+    assert(buffer->a <= buffer->b);
 
     stack_leave_frame();
 
     buffer->lines.clear();
-    for (s32 i = 0; i < alen(buffer->views); ++i) {
-        _buffer_reset_view(buffer, &buffer->views[i]);
-    }
     _buffer_on_change(buffer, 0, 0, false);
-    for (s32 i = 0; i < alen(buffer->views); ++i) {
-        buffer_view_set_focus_to_focused_selection(buffer, &buffer->views[i]);
-        buffer_view_show(buffer, &buffer->views[i], BUFFER_SHOW_ANYWHERE);
-    }
 
     ++buffer->revision;
     for (s32 i = 0; i < 2; ++i) ++buffer->views[i].revision;
 }
 
+// What is left to do after inserting text at the caret at 'offset': Removing the rest of the line if it was blank and the text
+// started with a newline, and keeping the focused line where it was on screen
+static
+void _buffer_finish_insert_at_caret(Buffer *buffer, View *view, s32 offset, bool starts_with_newline, s32 previous_line)
+{
+    if (starts_with_newline && _buffer_line_is_blank(buffer, offset)) {
+        s32 line_start = offset;
+        s32 line_end = offset;
+        s32 n, c;
+        n = line_start;
+        while (_buffer_step(buffer, -1, &n, &c, true) && c != '\n') line_start = n;
+        n = line_end;
+        while (_buffer_step(buffer, 1, &n, &c, true) && c != '\n') line_end = n;
+        _buffer_delete(buffer, line_start, line_end, false);
+    }
+
+    if (previous_line != -1) {
+        Selection *focused = &view->selections[view->focused_selection];
+        view->focus_offset = focused->carets[focused->focused_end].offset;
+        s32 new_line = buffer_offset_to_virtual_line_index(buffer, view->focus_offset);
+        s32 delta = previous_line - new_line;
+        view->focus_line_offset_target += delta;
+        view->focus_line_offset_current += delta*FOCUS_LINE_OFFSET_SUBSTEPS;
+    }
+
+    buffer_normalize(buffer, view);
+}
+
 void buffer_insert_at_all_carets(Buffer *buffer, View *view, str text)
 {
     for (s32 i = 0; i < view->selections.length; ++i) {
@@ -1942,28 +2433,113 @@ void buffer_insert_at_caret(Buffer *buffer, View *view, s32 selection_index, str
     s32 indent = _buffer_get_indent_size(buffer, offset, true);
     str normalized = _buffer_normalize_newlines_for_insert(buffer, text, indent, 0);
     _buffer_insert(buffer, offset, normalized, false);
-    if (normalized.length > 0 && is_newline(normalized.data[0]) && _buffer_line_is_blank(buffer, offset)) {
-        s32 line_start = offset;
-        s32 line_end = offset;
-        s32 n, c;
-        n = line_start;
-        while (_buffer_step(buffer, -1, &n, &c, true) && c != '\n') line_start = n;
-        n = line_end;
-        while (_buffer_step(buffer, 1, &n, &c, true) && c != '\n') line_end = n;
-        _buffer_delete(buffer, line_start, line_end, false);
-    }
+    _buffer_finish_insert_at_caret(buffer, view, offset, normalized.length > 0 && is_newline(normalized.data[0]), previous_line);
     stack_leave_frame();
+}
 
-    if (previous_line != -1) {
-        Selection *focused = &view->selections[view->focused_selection];
-        view->focus_offset = focused->carets[focused->focused_end].offset;
-        s32 new_line = buffer_offset_to_virtual_line_index(buffer, view->focus_offset);
-        s32 delta = previous_line - new_line;
-        view->focus_line_offset_target += delta;
-        view->focus_line_offset_current += delta*FOCUS_LINE_OFFSET_SUBSTEPS;
+enum { BUFFER_INSERT_STREAM_BLOCK_SIZE = 1024*1024 }; // Longest text we normalize on the stack in one go
+
+void buffer_insert_stream_begin(Buffer *buffer, View *view, BufferInsertStream *stream)
+{
+    assert(!buffer->no_user_input);
+    assert(view->selections.length == 1);
+    if (!buffer->tab_width) buffer->tab_width = TAB_WIDTH_DEFAULT;
+
+    *stream = {};
+    Selection selection = view->selections[0];
+    stream->offset = selection.carets[selection.focused_end].offset;
+    stream->indent = _buffer_get_indent_size(buffer, stream->offset, true);
+    stream->previous_line = buffer_offset_to_virtual_line_index(buffer, view->focus_offset);
+}
+
+// Normalizes 'text' and puts it in the gap, after what we already inserted
+static
+void _buffer_insert_stream_text(Buffer *buffer, BufferInsertStream *stream, str text)
+{
+    stack_enter_frame();
+    str normalized = {};
+    normalized.data = stack_alloc(char, 0);
+
+    bool reindent_first_line = stream->at_line_start;
+    stream->at_line_start = is_newline(text[text.length - 1]);
+    if (!stream->started) {
+        // The same as '_buffer_normalize_newlines_for_insert' does at the start of the text
+        stream->started = true;
+        if (is_newline(text[0])) {
+            text = slice(text, (text.length >= 2 && text[0] == '\r' && text[1] == '\n')? 2 : 1);
+            stack_append(&normalized, NEWLINE[(s32) buffer->newline_mode]);
+            stream->starts_with_newline = true;
+            reindent_first_line = true;
+
+            // Only happens if the newline is all there is
+            if (text.length == 0 && stream->indent) _buffer_normalize_add_indent(buffer, &normalized, stream->indent);
+        }
+        s32 first_actual_indent = 0;
+        _buffer_normalize_count_indent(buffer, text, &first_actual_indent, 0);
+        stream->indent_delta = stream->indent - first_actual_indent;
+    }
+    _buffer_normalize_lines(buffer, &normalized, text, stream->indent_delta, reindent_first_line);
+
+    _buffer_make_space(buffer, normalized.length);
+    _buffer_move_gap(buffer, stream->offset + stream->length);
+    memcpy(buffer->data + buffer->a, normalized.data, normalized.length);
+    buffer->a += normalized.length;
+    stream->length += normalized.length;
+    stack_leave_frame();
+}
+
+void buffer_insert_stream_block(Buffer *buffer, BufferInsertStream *stream, str block)
+{
+    // We only normalize whole lines, so every line gets reindented and no '\r\n' is split. Lines longer than a block go in
+    // in pieces, which only means the pieces after the first aren't reindented
+    while (block.length > 0) {
+        s64 piece_length = min(block.length, BUFFER_INSERT_STREAM_BLOCK_SIZE - stream->pending.length);
+        s64 searched = stream->pending.length; // Nothing before this has a '\n'
+        memcpy(stream->pending.push(piece_length), block.data, piece_length);
+        block = slice(block, piece_length);
+
+        s64 end = stream->pending.length;
+        while (end > searched && stream->pending[end - 1] != '\n') --end;
+        if (end == searched) {
+            end = 0;
+            if (stream->pending.length == BUFFER_INSERT_STREAM_BLOCK_SIZE) {
+                end = stream->pending.length;
+                if (stream->pending[end - 1] == '\r') --end;
+            }
+        } else if (!stream->started) {
+            // We reindent relative to the first line after a leading newline, so we need to see that line first
+            str text = { stream->pending.data, end };
+            s64 leading_newline = 0;
+            if (is_newline(text[0])) leading_newline = (text.length >= 2 && text[0] == '\r' && text[1] == '\n')? 2 : 1;
+            if (end <= leading_newline) end = 0;
+        }
+
+        if (end > 0) {
+            _buffer_insert_stream_text(buffer, stream, { stream->pending.data, end });
+            memmove(stream->pending.data, stream->pending.data + end, stream->pending.length - end);
+            stream->pending.length -= end;
+        }
     }
+}
 
-    buffer_normalize(buffer, view);
+void buffer_insert_stream_end(Buffer *buffer, View *view, BufferInsertStream *stream)
+{
+    if (stream->pending.length > 0) {
+        _buffer_insert_stream_text(buffer, stream, { stream->pending.data, stream->pending.length });
+    }
+    stream->pending.free();
+
+    if (stream->length > 0) {
+        // NB The text is still right before the gap here, but '_buffer_on_change' might move the gap
+        _history_add(buffer, true, stream->offset, { buffer->data + stream->offset, stream->length });
+
+        ++buffer->revision;
+        for (s32 i = 0; i < array_length(buffer->views); ++i) ++buffer->views[i].revision;
+        _buffer_on_change(buffer, stream->offset, stream->offset + stream->length, true);
+
+        _buffer_finish_insert_at_caret(buffer, view, stream->offset, stream->starts_with_newline, stream->previous_line);
+        buffer_view_show(buffer, view, BUFFER_SHOW_ANYWHERE_DONT_SMOOTHSCROLL_ONE_LINE_AFTER_INSERT);
+    }
 }
 
 void buffer_insert_at_end(Buffer *buffer, str text)
@@ -2116,6 +2692,23 @@ void buffer_search_filter(Buffer *buffer, View *view, u32 filters)
     _buffer_search_refilter(buffer, view);
 }
 
+// Flags for 'needle' found at 'offset' in 'text', ignoring case
+u32 search_match_flags(str text, s64 offset, str needle)
+{
+    u32 flags = 0;
+    if (memcmp(text.data + offset, needle.data, needle.length) == 0) {
+        flags |= SEARCH_RESULT_CASE_MATCH;
+    }
+
+    char a = offset > 0? text[offset - 1] : 0;
+    char b = offset + needle.length < text.length? text[offset + needle.length] : 0;
+    if (!(is_ascii_letter(a) || a == '_' || is_ascii_letter(b) || b == '_')) {
+        // Note (Morten, 2020-08-15) This isn't ideal, because we don't account for unicode identifiers
+        flags |= SEARCH_RESULT_IDENTIFIER_MATCH;
+    }
+    return(flags);
+}
+
 void buffer_search(Buffer *buffer, View *view, str needle)
 {
     view->search.active = 0;
@@ -2124,6 +2717,7 @@ void buffer_search(Buffer *buffer, View *view, str needle)
     view->search.filters = SEARCH_RESULT_CASE_MATCH;
 
     if (needle.length > 0) {
+        timing_begin("search");
         stack_enter_frame();
         str lowercase = utf8_map(needle, &unicode_lowercase);
         str uppercase = utf8_map(needle, &unicode_uppercase);
@@ -2147,17 +2741,7 @@ void buffer_search(Buffer *buffer, View *view, str needle)
                 SearchResult range = {0};
                 range.min = start_offset + search_offset;
                 range.max = start_offset + search_offset + (s32) needle.length;
-
-                if (memcmp(line.data + search_offset, needle.data, needle.length) == 0) {
-                    range.flags |= SEARCH_RESULT_CASE_MATCH;
-                }
-
-                char a = search_offset > 0? line[search_offset - 1] : 0;
-                char b = search_offset + needle.length < line.length? line[search_offset + needle.length] : 0;
-                if (!(is_ascii_letter(a) || a == '_' || is_ascii_letter(b) || b == '_')) {
-                    // Note (Morten, 2020-08-15) This isn't ideal, because we don't account for unicode identifiers
-                    range.flags |= SEARCH_RESULT_IDENTIFIER_MATCH;
-                }
+                range.flags = search_match_flags(line, search_offset, needle);
 
                 if (view->search.total + 1 > view->search.capacity) {
                     view->search.capacity = max(view->search.capacity*2, 64);
@@ -2171,6 +2755,7 @@ void buffer_search(Buffer *buffer, View *view, str needle)
         stack_leave_frame();
 
         _buffer_search_refilter(buffer, view);
+        timing_end();
     }
 }
 
@@ -2807,7 +3392,7 @@ void _buffer_expand(Buffer *buffer, View *view, Selection *selection, s32 delimi
 
         s32 offset_left, offset_right;
 
-        s32 n, h, c, count;
+        s32 n, c, count;
         bool ok = true;
 
         if (view->revision == view->revision_at_last_repeatable_expand && selection->start.offset != selection->end.offset) {
@@ -2826,22 +3411,12 @@ void _buffer_expand(Buffer *buffer, View *view, Selection *selection, s32 delimi
             offset_right = offset;
         }
 
-        s32 highlight_index = -1;
-        if (buffer->highlights.length > 0) {
-            s32 v = buffer_offset_to_virtual_line_index(buffer, offset_left);
-            while (v > 0 && buffer->lines[v - 1].physical_line_index == buffer->lines[v].physical_line_index) --v;
-            highlight_index = buffer->lines[v].first_highlight_index;
-            while (highlight_index < buffer->highlights.length && buffer->highlights[highlight_index].end < offset_left) ++highlight_index;
-        }
-
         n = offset_left;
-        h = highlight_index;
         count = 1;
         while (ok && _buffer_step(buffer, -1, &n, &c, true)) {
-            if ((c == left || c == right) && h >= 0 && h < buffer->highlights.length) {
-                while (h > 0 && buffer->highlights[h].start > n) --h;
-                Highlight highlight = buffer->highlights[h];
-                if (highlight.start <= n && n < highlight.end && highlight.kind != HighlightKind::Comment) c = 0;
+            if (c == left || c == right) {
+                HighlightKind kind = buffer_highlight_at(buffer, n);
+                if (kind != HighlightKind::None && kind != HighlightKind::Comment) c = 0;
             }
 
             if (c == left) --count;
@@ -2854,13 +3429,11 @@ void _buffer_expand(Buffer *buffer, View *view, Selection *selection, s32 delimi
         ok &= count == 0;
 
         n = offset_right;
-        h = highlight_index;
         count = 1;
         while (ok && _buffer_step(buffer, 1, &n, &c, true)) {
-            if ((c == left || c == right) && h >= 0 && h < buffer->highlights.length) {
-                while (h + 1 < buffer->highlights.length && buffer->highlights[h].end < n) ++h;
-                Highlight highlight = buffer->highlights[h];
-                if (highlight.start < n && n <= highlight.end && highlight.kind != HighlightKind::Comment) c = 0; // NB (Morten, 2020-07-07) n is the index of the character after c, hence this check is different than the one in the loop above
+            if (c == left || c == right) {
+                HighlightKind kind = buffer_highlight_at(buffer, n - 1); // NB n is the index of the character after c when stepping forwards
+                if (kind != HighlightKind::None && kind != HighlightKind::Comment) c = 0;
             }
 
             if (c == left) ++count;
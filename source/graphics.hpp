@@ -8,6 +8,7 @@ struct Glyph
     s32 width, height;
     s32 offset_x;
     s32 offset_y;
+    bool placeholder_drawn; // For placeholders in 'Font::Size::available', whether we handed them out to be drawn
 };
 
 struct FontMetrics
@@ -22,48 +23,89 @@ struct FontMetrics
 struct FontBackend;
 
 void _font_backend_change(FontBackend *backend, s32 size, FontMetrics *metrics);
+bool _font_backend_has_glyph(FontBackend *backend, s32 codepoint);
+// 'glyph->data' must point to room for 'FontBackend::MAX_GLYPH_SIZE' squared pixels
 bool _font_backend_make_glyph(FontBackend *backend, s32 codepoint, Glyph *glyph);
+// Same as calling '_font_backend_make_glyph' for each codepoint in the range, but cheaper. Only called from the main thread.
+void _font_backend_make_glyphs(FontBackend *backend, s32 first_codepoint, s32 count, Glyph *glyphs, bool *available);
 
 #if FONT_BACKEND_gdi
 #include "font_gdi.hpp"
+#elif FONT_BACKEND_truetype
+#include "font_truetype.hpp"
 #endif
 
+struct FontWorker;
+
 struct Font
 {
     FontBackend backend;
     FontMetrics metrics;
 
-    u32 ascii_glyph_map[4];
-    Glyph ascii_glyphs[128];
-    HashMap32 known_glyphs;
-    Array<Glyph> available;
-
     struct DataBlock
     {
         DataBlock *previous;
         s32 length;
         u32 _padding;
-        u32 data[1024*1024];
+        u32 data[256*1024];
+    };
+
+    // Glyphs for one font size. Recently used sizes are kept around, so zooming back and forth doesn't rasterize anything
+    // again. Once the pixel data of all sizes goes over 'budget' we drop the least recently used sizes, except the current one.
+    struct Size
+    {
+        s32 size;
+        s64 last_used;
+
+        u32 ascii_glyph_map[4];
+        Glyph ascii_glyphs[128];
+        HashMap<u32, u32> known_glyphs;
+        Array<Glyph> available; // Glyphs which turned out to be missing after all have 'codepoint' set to 0
+        Glyph placeholder;
+
+        DataBlock *pixel_data;
+        s32 pixel_blocks;
     };
-    DataBlock *pixel_data;
-    DataBlock *pixel_data_free;
+    enum { MAX_SIZES = 16, DEFAULT_BUDGET = 16*1024*1024 };
+    Size sizes[MAX_SIZES];
+    s32 sizes_length;
+    Size *current;
+    s64 budget;
+    s64 use_counter;
+
+    // Non-ascii glyphs are rasterized on a separate thread, unless 'rasterize_synchronously' is set. They are drawn as
+    // 'Size::placeholder' until 'font_collect_glyphs' picks them up.
+    bool rasterize_synchronously;
+    FontWorker *worker;
+    void (*on_glyphs_ready)(); // Called from the worker thread
+    s32 glyphs_pending;
+    s32 glyph_generation; // Changes whenever a glyph we handed out to be drawn before changes
+    s32 availability_changes; // Changes when a glyph we said exists turned out to be missing, which affects layout
 };
 
 void font_change_size(Font *font, s32 new_size);
+bool font_collect_glyphs(Font *font);
 void glyphs_for_codepoint(Font *font, DecodedCodepoint decoded, Glyph glyphs[8], s32 *glyph_count, bool *glyphs_are_escape_sequence);
 
+struct TextStrip;
+
 struct DrawCommand
 {
     s32 x0, y0;
     s32 x1, y1;
-    enum {
+    enum : u8 {
         SOLID,
         MULTIPLY,
         GLYPH,
+        TEXT_STRIP,
     } kind;
+    u16 strip_row, strip_column; // For TEXT_STRIP, the pixel of the strip at 'x0', 'y0'
 
-    u32 color;
-    u32 *glyph_data;
+    u32 color; // For TEXT_STRIP, 'TextStrip::id'
+    union {
+        u32 *glyph_data;
+        TextStrip *strip;
+    };
 };
 
 struct DrawTarget
@@ -73,17 +115,70 @@ struct DrawTarget
     u32 *buffer;
     s32 buffer_capacity;
 
+    // Changed cells are rasterized independently, in parallel unless 'rasterize_serially' is set. The output is the same either
+    // way, since cells don't overlap.
     enum { GRID_WIDTH = 6, GRID_HEIGHT = 8 };
     struct GridCell
     {
         Rect area;
         bool changed_this_frame;
         u32 current_hash;
+
+        // Indices into 'commands' touching this cell, in submission order. Rebuilt in 'draw_target_finish'.
+        u32 *commands;
+        s32 commands_length, commands_capacity;
     };
     GridCell grid[GRID_WIDTH * GRID_HEIGHT];
+    s32 changed_cells[GRID_WIDTH * GRID_HEIGHT];
+    s32 changed_cells_length;
+    bool rasterize_serially;
+
+    // Areas where the content scrolls vertically, declared each frame with 'draw_scroll_region'. Commands in a region are hashed
+    // in content space in bands of 'SCROLL_BAND_HEIGHT' rows, so when only the scroll changed we can move the old pixels and only
+    // rasterize the newly exposed rows and bands whose content changed. Pixels in a region are never touched by grid cells.
+    enum { MAX_SCROLL_REGIONS = 4, SCROLL_BAND_HEIGHT = 16 };
+    struct ScrollBand
+    {
+        u32 *commands;
+        s32 commands_length, commands_capacity;
+    };
+    struct ScrollRegion
+    {
+        Rect area;
+        s32 scroll; // Content row 'scroll' is at the top of the region
+
+        // State from the previous frame. Bands are indexed relative to 'first_band', band 'b' covers content rows
+        // [b*SCROLL_BAND_HEIGHT, (b + 1)*SCROLL_BAND_HEIGHT).
+        bool valid;
+        s32 previous_scroll;
+        s32 first_band, band_count;
+        u32 *band_hashes;
+        s32 band_capacity;
+
+        ScrollBand *bands;
+    };
+    struct ScrollJob
+    {
+        s32 region, band;
+        Rect box;
+    };
+    ScrollRegion scroll_regions[MAX_SCROLL_REGIONS];
+    s32 scroll_regions_length;
+    ScrollJob *scroll_jobs;
+    s32 scroll_jobs_length, scroll_jobs_capacity;
 
     DrawCommand *commands;
     s32 commands_length, commands_capacity;
+
+    s32 glyphs_clipped; // Glyphs cut or dropped by 'draw_glyph' since 'text_strip_begin'
+
+    // Counters for the last 'draw_target_finish'
+    struct {
+        s32 commands;
+        s32 changed_cells;
+        s32 scroll_jobs;
+        s64 hashed_bytes;
+    } stats;
 };
 
 struct DrawTargetSlice
@@ -93,8 +188,58 @@ struct DrawTargetSlice
 };
 
 
+// A line of text blended into a single image, so drawing it again is one command instead of one per glyph. Pixels are blended
+// with the color of the segment they are in, exactly like the glyphs they were made from would have been.
+struct TextStrip
+{
+    u64 key;
+    u32 id; // Unique for every strip we make, so draw commands referring to different strips never hash the same
+    s32 offset_x, offset_y; // Relative to the position given to 'draw_text_strip'
+    s32 width, height;
+    u32 *coverage;
+
+    struct Segment
+    {
+        s32 x0, x1;
+        u32 color;
+    };
+    Segment *segments;
+    s32 segments_length;
+
+    s64 size;
+    s64 last_used_frame;
+    TextStrip *lru_previous, *lru_next;
+};
+
+// Least recently used strips are freed when we go over 'budget', but never strips used in the current frame, since draw
+// commands point to them until 'draw_target_finish'.
+struct TextStripCache
+{
+    enum { DEFAULT_BUDGET = 32*1024*1024 };
+    s64 budget;
+    s64 size;
+    s64 frame;
+    u32 next_id;
+
+    s32 strips_live;
+    TextStrip *lru_first, *lru_last;
+
+    HashMap<u64, TextStrip *> strips;
+
+    s64 hits, misses;
+};
+
+void text_strip_cache_next_frame(TextStripCache *cache);
+void text_strip_cache_free(TextStripCache *cache);
+bool draw_text_strip(DrawTargetSlice *slice, TextStripCache *cache, u64 key, s32 x, s32 y);
+s32 text_strip_begin(DrawTargetSlice *slice);
+void text_strip_end(DrawTargetSlice *slice, TextStripCache *cache, s32 first_command, u64 key, s32 x, s32 y);
+
+
 void draw_target_finish(DrawTarget *target);
+void draw_target_free(DrawTarget *target);
 void draw_target_set_size(DrawTarget *target, s32 width, s32 height);
+void draw_scroll_region(DrawTargetSlice *slice, s32 scroll);
 
 DrawTargetSlice draw_target_as_slice(DrawTarget *target);
 DrawTargetSlice draw_target_slice(DrawTargetSlice *slice, s32 x0, s32 y0, s32 x1, s32 y1);
@@ -113,6 +258,32 @@ void _draw_target_hash(u32 *hash, u8 *data, s32 size)
     while (size--) *hash = (*hash ^ *data++) * 16777619;
 }
 
+// Damage tracking hashes each command once, as four packed 64 bit words, and then folds that hash into every cell or band the
+// command touches. NB We pack the fields explicitly rather than hashing the struct, so padding never leaks into the hash.
+enum { _DRAW_COMMAND_HASHED_BYTES = 4*sizeof(u64) };
+u32 _draw_command_hash(DrawCommand *command)
+{
+    u64 words[4] = {
+        (u64) (u32) command->x0 | ((u64) (u32) command->y0 << 32),
+        (u64) (u32) command->x1 | ((u64) (u32) command->y1 << 32),
+        (u64) command->kind | ((u64) command->strip_row << 16) | ((u64) command->color << 32),
+        (u64) command->glyph_data ^ ((u64) command->strip_column << 48), // Pointers only use the low 48 bits
+    };
+
+    u64 hash = 0x9e3779b97f4a7c15;
+    for (s32 i = 0; i < 4; ++i) {
+        hash = (hash ^ words[i]) * 0xff51afd7ed558ccd;
+        hash ^= hash >> 32;
+    }
+    hash *= 0xc4ceb9fe1a85ec53;
+    return (u32) (hash ^ (hash >> 29));
+}
+
+void _draw_target_hash_word(u32 *hash, u32 word)
+{
+    *hash = (*hash ^ word) * 16777619;
+}
+
 void _draw_target_add_command(DrawTarget *target, DrawCommand command)
 {
     if (target->commands_length + 1 > target->commands_capacity) {
@@ -144,16 +315,145 @@ void draw_target_set_size(DrawTarget *target, s32 width, s32 height)
                 target->grid[slot].area.y1 = (gy + 1) * target->height / DrawTarget::GRID_HEIGHT;
             }
         }
+        for (s32 i = 0; i < DrawTarget::MAX_SCROLL_REGIONS; ++i) target->scroll_regions[i].valid = false;
     }
 }
 
 
-void _draw_target_do_command(DrawTarget *target, DrawCommand *command, Rect box)
+// Which kernels '_draw_target_do_command' uses. Picked based on cpuid on the first 'draw_target_finish', but can be overridden
+// for testing.
+enum struct DrawKernels
+{
+    Unknown,
+    Generic,
+    AVX2,
+};
+global_variable DrawKernels draw_kernels;
+
+// If set, blending rounds to the nearest value. Otherwise glyphs are blended with a faster /256 approximation (see the
+// comment in '_draw_generic') and 'draw_blend' truncates.
+global_variable bool draw_exact_blending;
+
+enum BlendMode
+{
+    BLEND_APPROXIMATE, // (background*(256 - factor) + foreground*factor) / 256
+    BLEND_TRUNCATE,    // (background*(255 - factor) + foreground*factor) / 255, rounded down
+    BLEND_ROUND,       // (background*(255 - factor) + foreground*factor) / 255, rounded to nearest
+};
+
+// All arguments have one 16 bit word per channel
+inline __m128i _blend_words_sse2(__m128i background, __m128i foreground, __m128i factor, BlendMode mode)
+{
+    if (mode == BLEND_APPROXIMATE) {
+        __m128i left = _mm_mullo_epi16(background, _mm_sub_epi16(_mm_set1_epi16(0x100), factor));
+        __m128i right = _mm_mullo_epi16(foreground, factor);
+        return(_mm_srli_epi16(_mm_add_epi16(left, right), 8));
+    } else {
+        __m128i left = _mm_mullo_epi16(background, _mm_sub_epi16(_mm_set1_epi16(0xff), factor));
+        __m128i right = _mm_mullo_epi16(foreground, factor);
+        __m128i x = _mm_add_epi16(left, right);
+
+        // NB For x in [0, 255*255], x/255 == (x + 1 + (x >> 8)) >> 8 and (x + 127)/255 == (t + (t >> 8)) >> 8 with t = x + 128
+        if (mode == BLEND_ROUND) {
+            x = _mm_add_epi16(x, _mm_set1_epi16(128));
+            return(_mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8));
+        } else {
+            __m128i x_plus_one = _mm_add_epi16(x, _mm_set1_epi16(1));
+            return(_mm_srli_epi16(_mm_add_epi16(x_plus_one, _mm_srli_epi16(x, 8)), 8));
+        }
+    }
+}
+
+target_function("avx2")
+inline __m256i _blend_words_avx2(__m256i background, __m256i foreground, __m256i factor, BlendMode mode)
+{
+    if (mode == BLEND_APPROXIMATE) {
+        __m256i left = _mm256_mullo_epi16(background, _mm256_sub_epi16(_mm256_set1_epi16(0x100), factor));
+        __m256i right = _mm256_mullo_epi16(foreground, factor);
+        return(_mm256_srli_epi16(_mm256_add_epi16(left, right), 8));
+    } else {
+        __m256i left = _mm256_mullo_epi16(background, _mm256_sub_epi16(_mm256_set1_epi16(0xff), factor));
+        __m256i right = _mm256_mullo_epi16(foreground, factor);
+        __m256i x = _mm256_add_epi16(left, right);
+        if (mode == BLEND_ROUND) {
+            x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+            return(_mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8));
+        } else {
+            __m256i x_plus_one = _mm256_add_epi16(x, _mm256_set1_epi16(1));
+            return(_mm256_srli_epi16(_mm256_add_epi16(x_plus_one, _mm256_srli_epi16(x, 8)), 8));
+        }
+    }
+}
+
+// Blends a single pixel, for the ends of rows
+inline void _blend_pixel_sse2(u32 *pixel, __m128i foreground_word, __m128i factor_word, BlendMode mode)
+{
+    __m128i background = _mm_unpacklo_epi8(_mm_loadu_si32((__m128i *) pixel), _mm_setzero_si128());
+    __m128i result = _blend_words_sse2(background, foreground_word, factor_word, mode);
+    _mm_storeu_si32((__m128i *) pixel, _mm_packus_epi16(result, _mm_setzero_si128()));
+}
+
+// Blends 'count' pixels of a glyph with a single color
+void _blend_row_sse2(u32 *dst, u32 *src, s32 count, __m128i foreground_word, BlendMode mode)
+{
+    /*
+    NB (Morten, 2020-07-18)
+    dst is the backbuffer, src is the glyph texture and color is command->color.
+    We want to do the following linear blend:
+        dst' = dst*(1.0 - src) + color*src
+    Because all values are represented as integers between 0 and 255 we in practice want to do:
+        dst' = ( dst*(255 - src) + color*src ) / 255
+    Division by 255 is non-trivial in SSE, but division by 256 is. We therefore do:
+        dst' = ( dst*(256 - src) + color*src ) / 256
+    Note that we pretend src is in [0, 256] when in reality it is in [0, 256[.
+    When src = 0 we still properly get dst' = dst, which means we won't have visible artifacts around glyphs.
+    When src = 255 we will however still get 1/256th of dst blended in.
+    I suspect the error introduced by this will be quite hard to spot though.
+    */
+
+    u32 *src_end_simd = src + count/4*4;
+    u32 *src_end = src + count;
+    for (; src < src_end_simd; src += 4, dst += 4) {
+        __m128i background = _mm_loadu_si128((__m128i *) dst);
+        __m128i factor = _mm_loadu_si128((__m128i *) src);
+
+        __m128i background01 = _mm_unpacklo_epi8(background, _mm_setzero_si128());
+        __m128i background23 = _mm_unpackhi_epi8(background, _mm_setzero_si128());
+        __m128i factor01 = _mm_unpacklo_epi8(factor, _mm_setzero_si128());
+        __m128i factor23 = _mm_unpackhi_epi8(factor, _mm_setzero_si128());
+        __m128i result01 = _blend_words_sse2(background01, foreground_word, factor01, mode);
+        __m128i result23 = _blend_words_sse2(background23, foreground_word, factor23, mode);
+        _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(result01, result23));
+    }
+    for (; src < src_end; ++src, ++dst) {
+        __m128i factor = _mm_unpacklo_epi8(_mm_loadu_si32((__m128i *) src), _mm_setzero_si128());
+        _blend_pixel_sse2(dst, foreground_word, factor, mode);
+    }
+}
+
+target_function("avx2")
+void _blend_row_avx2(u32 *dst, u32 *src, s32 count, __m256i foreground_word, BlendMode mode)
+{
+    u32 *src_end_simd = src + count/8*8;
+    u32 *src_end = src + count;
+    for (; src < src_end_simd; src += 8, dst += 8) {
+        __m256i background = _mm256_loadu_si256((__m256i *) dst);
+        __m256i factor = _mm256_loadu_si256((__m256i *) src);
+        __m256i low = _blend_words_avx2(_mm256_unpacklo_epi8(background, _mm256_setzero_si256()), foreground_word,
+                                        _mm256_unpacklo_epi8(factor, _mm256_setzero_si256()), mode);
+        __m256i high = _blend_words_avx2(_mm256_unpackhi_epi8(background, _mm256_setzero_si256()), foreground_word,
+                                         _mm256_unpackhi_epi8(factor, _mm256_setzero_si256()), mode);
+        _mm256_storeu_si256((__m256i *) dst, _mm256_packus_epi16(low, high));
+    }
+    __m128i foreground_word_narrow = _mm256_castsi256_si128(foreground_word);
+    for (; src < src_end; ++src, ++dst) {
+        __m128i factor = _mm_unpacklo_epi8(_mm_loadu_si32((__m128i *) src), _mm_setzero_si128());
+        _blend_pixel_sse2(dst, foreground_word_narrow, factor, mode);
+    }
+}
+
+void _draw_generic(DrawTarget *target, DrawCommand *command, s32 x0, s32 y0, s32 x1, s32 y1)
 {
-    s32 x0 = max(command->x0, box.x0);
-    s32 x1 = min(command->x1, box.x1);
-    s32 y0 = max(command->y0, box.y0);
-    s32 y1 = min(command->y1, box.y1);
     s32 row_width = x1 - x0;
 
     switch (command->kind) {
@@ -177,15 +477,16 @@ void _draw_target_do_command(DrawTarget *target, DrawCommand *command, Rect box)
 
             int t1 = color_swizzle.a;
             int t2 = 255 - t1;
+            int rounding = draw_exact_blending? 127 : 0;
 
             for (s32 y = y0; y < y1; ++y) {
                 u32 *pixel = &target->buffer[y*target->width + x0];
                 u32 *row_end = pixel + row_width;
                 while (pixel < row_end) {
                     pixel_swizzle.v = *pixel;
-                    pixel_swizzle.r = (u8) (((((int) pixel_swizzle.r)*t2) + (((int)color_swizzle.r)*t1)) / 255);
-                    pixel_swizzle.g = (u8) (((((int) pixel_swizzle.g)*t2) + (((int)color_swizzle.g)*t1)) / 255);
-                    pixel_swizzle.b = (u8) (((((int) pixel_swizzle.b)*t2) + (((int)color_swizzle.b)*t1)) / 255);
+                    pixel_swizzle.r = (u8) (((((int) pixel_swizzle.r)*t2) + (((int)color_swizzle.r)*t1) + rounding) / 255);
+                    pixel_swizzle.g = (u8) (((((int) pixel_swizzle.g)*t2) + (((int)color_swizzle.g)*t1) + rounding) / 255);
+                    pixel_swizzle.b = (u8) (((((int) pixel_swizzle.b)*t2) + (((int)color_swizzle.b)*t1) + rounding) / 255);
                     *pixel = pixel_swizzle.v;
                     ++pixel;
                 }
@@ -202,74 +503,117 @@ void _draw_target_do_command(DrawTarget *target, DrawCommand *command, Rect box)
             u32 *dst = &target->buffer[y0*dst_stride + x0];
 
             __m128i foreground_word = _mm_unpacklo_epi8(_mm_set1_epi32(command->color), _mm_setzero_si128());
+            BlendMode mode = draw_exact_blending? BLEND_ROUND : BLEND_APPROXIMATE;
 
             debug_assert(src_stride%4 == 0);
-            s32 simd_row_width = row_width/4*4;
-            while (src < src_end) {
-                u32 *src_pixel = src;
-                u32 *dst_pixel = dst;
-
-                /*
-                NB (Morten, 2020-07-18)
-                dst is the backbuffer, src is the glyph texture and color is command->color.
-                We want to do the following linear blend:
-                    dst' = dst*(1.0 - src) + color*src
-                Because all values are represented as integers between 0 and 255 we in practice want to do:
-                    dst' = ( dst*(255 - src) + color*src ) / 255
-                Division by 255 is non-trivial in SSE, but division by 256 is. We therefore do:
-                    dst' = ( dst*(256 - src) + color*src ) / 256
-                Note that we pretend src is in [0, 256] when in reality it is in [0, 256[.
-                When src = 0 we still properly get dst' = dst, which means we won't have visible artifacts around glyphs.
-                When src = 255 we will however still get 1/256th of dst blended in.
-                I suspect the error introduced by this will be quite hard to spot though.
-                */
-
-                u32 *src_pixel_end_simd = src + simd_row_width;
-                u32 *src_pixel_end = src + row_width;
-                while (src_pixel < src_pixel_end_simd) {
-                    __m128i background = _mm_loadu_si128((__m128i *) dst_pixel);
-                    __m128i factor = _mm_loadu_si128((__m128i *) src_pixel);
-
-                    __m128i background01 = _mm_unpacklo_epi8(background, _mm_setzero_si128());
-                    __m128i background23 = _mm_unpackhi_epi8(background, _mm_setzero_si128());
-                    __m128i factor01 = _mm_unpacklo_epi8(factor, _mm_setzero_si128());
-                    __m128i factor23 = _mm_unpackhi_epi8(factor, _mm_setzero_si128());
-                    __m128i factor_inv01 = _mm_sub_epi16(_mm_set1_epi16(0x100), factor01);
-                    __m128i factor_inv23 = _mm_sub_epi16(_mm_set1_epi16(0x100), factor23);
-                    __m128i left01 = _mm_mullo_epi16(background01, factor_inv01);
-                    __m128i left23 = _mm_mullo_epi16(background23, factor_inv23);
-                    __m128i right01 = _mm_mullo_epi16(foreground_word, factor01);
-                    __m128i right23 = _mm_mullo_epi16(foreground_word, factor23);
-                    __m128i result01 = _mm_add_epi16(left01, right01);
-                    __m128i result23 = _mm_add_epi16(left23, right23);
-                    result01 = _mm_srli_epi16(result01, 8);
-                    result23 = _mm_srli_epi16(result23, 8);
-                    __m128i result = _mm_packus_epi16(result01, result23);
-
-                    _mm_storeu_si128((__m128i *) dst_pixel, result);
-                    dst_pixel += 4;
-                    src_pixel += 4;
+            for (; src < src_end; src += src_stride, dst += dst_stride) {
+                _blend_row_sse2(dst, src, row_width, foreground_word, mode);
+            }
+        } break;
+
+        case DrawCommand::TEXT_STRIP: {
+            TextStrip *strip = command->strip;
+            s32 strip_x0 = command->x0 - command->strip_column;
+            s32 strip_y0 = command->y0 - command->strip_row;
+            BlendMode mode = draw_exact_blending? BLEND_ROUND : BLEND_APPROXIMATE;
+
+            for (s32 y = y0; y < y1; ++y) {
+                u32 *src = strip->coverage + (y - strip_y0)*strip->width - strip_x0;
+                u32 *dst = &target->buffer[y*target->width];
+                for (s32 i = 0; i < strip->segments_length; ++i) {
+                    TextStrip::Segment segment = strip->segments[i];
+                    s32 segment_x0 = max(strip_x0 + segment.x0, x0);
+                    s32 segment_x1 = min(strip_x0 + segment.x1, x1);
+                    if (segment_x0 >= segment_x1) continue;
+
+                    __m128i foreground_word = _mm_unpacklo_epi8(_mm_set1_epi32(segment.color), _mm_setzero_si128());
+                    _blend_row_sse2(dst + segment_x0, src + segment_x0, segment_x1 - segment_x0, foreground_word, mode);
                 }
-                while (src_pixel < src_pixel_end) {
-                    __m128i background = _mm_loadu_si32((__m128i *) dst_pixel);
-                    __m128i factor = _mm_loadu_si32((__m128i *) src_pixel);
-
-                    __m128i background01 = _mm_unpacklo_epi8(background, _mm_setzero_si128());
-                    __m128i factor01 = _mm_unpacklo_epi8(factor, _mm_setzero_si128());
-                    __m128i factor_inv01 = _mm_sub_epi16(_mm_set1_epi16(0x100), factor01);
-                    __m128i left01 = _mm_mullo_epi16(background01, factor_inv01);
-                    __m128i right01 = _mm_mullo_epi16(foreground_word, factor01);
-                    __m128i result01 = _mm_add_epi16(left01, right01);
-                    result01 = _mm_srli_epi16(result01, 8);
-                    __m128i result = _mm_packus_epi16(result01, _mm_setzero_si128());
-
-                    _mm_storeu_si32((__m128i *) dst_pixel, result);
-                    dst_pixel += 1;
-                    src_pixel += 1;
+            }
+        } break;
+
+        default: assert(false);
+    }
+}
+
+// Gives the same output as '_draw_generic'
+target_function("avx2")
+void _draw_avx2(DrawTarget *target, DrawCommand *command, s32 x0, s32 y0, s32 x1, s32 y1)
+{
+    s32 row_width = x1 - x0;
+    s32 simd_row_width = row_width/8*8;
+
+    switch (command->kind) {
+        case DrawCommand::SOLID: {
+            __m256i color = _mm256_set1_epi32(command->color);
+
+            for (s32 y = y0; y < y1; ++y) {
+                u32 *pixel = &target->buffer[y*target->width + x0];
+                u32 *row_end_simd = pixel + simd_row_width;
+                u32 *row_end = pixel + row_width;
+                for (; pixel < row_end_simd; pixel += 8) _mm256_storeu_si256((__m256i *) pixel, color);
+                while (pixel < row_end) *pixel++ = command->color;
+            }
+        } break;
+
+        case DrawCommand::MULTIPLY: {
+            // NB This is the same as blending with a constant factor. The alpha channel gets a factor of zero, so it is kept.
+            u32 alpha = command->color >> 24;
+            u32 factor = alpha | (alpha << 8) | (alpha << 16);
+            BlendMode mode = draw_exact_blending? BLEND_ROUND : BLEND_TRUNCATE;
+
+            __m256i foreground_word = _mm256_unpacklo_epi8(_mm256_set1_epi32(command->color), _mm256_setzero_si256());
+            __m256i factor_word = _mm256_unpacklo_epi8(_mm256_set1_epi32(factor), _mm256_setzero_si256());
+            __m128i foreground_word_narrow = _mm256_castsi256_si128(foreground_word);
+            __m128i factor_word_narrow = _mm256_castsi256_si128(factor_word);
+
+            for (s32 y = y0; y < y1; ++y) {
+                u32 *pixel = &target->buffer[y*target->width + x0];
+                u32 *row_end_simd = pixel + simd_row_width;
+                u32 *row_end = pixel + row_width;
+                for (; pixel < row_end_simd; pixel += 8) {
+                    __m256i background = _mm256_loadu_si256((__m256i *) pixel);
+                    __m256i low = _blend_words_avx2(_mm256_unpacklo_epi8(background, _mm256_setzero_si256()), foreground_word, factor_word, mode);
+                    __m256i high = _blend_words_avx2(_mm256_unpackhi_epi8(background, _mm256_setzero_si256()), foreground_word, factor_word, mode);
+                    _mm256_storeu_si256((__m256i *) pixel, _mm256_packus_epi16(low, high));
                 }
+                for (; pixel < row_end; ++pixel) _blend_pixel_sse2(pixel, foreground_word_narrow, factor_word_narrow, mode);
+            }
+        } break;
+
+        case DrawCommand::GLYPH: {
+            s32 src_stride = command->x1 - command->x0;
+            u32 *src = command->glyph_data + (x0 - command->x0) + src_stride*(y0 - command->y0);
+            u32 *src_end = src + src_stride*(y1 - y0);
+            s32 dst_stride = target->width;
+            u32 *dst = &target->buffer[y0*dst_stride + x0];
 
-                dst += dst_stride;
-                src += src_stride;
+            __m256i foreground_word = _mm256_unpacklo_epi8(_mm256_set1_epi32(command->color), _mm256_setzero_si256());
+            BlendMode mode = draw_exact_blending? BLEND_ROUND : BLEND_APPROXIMATE;
+
+            for (; src < src_end; src += src_stride, dst += dst_stride) {
+                _blend_row_avx2(dst, src, row_width, foreground_word, mode);
+            }
+        } break;
+
+        case DrawCommand::TEXT_STRIP: {
+            TextStrip *strip = command->strip;
+            s32 strip_x0 = command->x0 - command->strip_column;
+            s32 strip_y0 = command->y0 - command->strip_row;
+            BlendMode mode = draw_exact_blending? BLEND_ROUND : BLEND_APPROXIMATE;
+
+            for (s32 y = y0; y < y1; ++y) {
+                u32 *src = strip->coverage + (y - strip_y0)*strip->width - strip_x0;
+                u32 *dst = &target->buffer[y*target->width];
+                for (s32 i = 0; i < strip->segments_length; ++i) {
+                    TextStrip::Segment segment = strip->segments[i];
+                    s32 segment_x0 = max(strip_x0 + segment.x0, x0);
+                    s32 segment_x1 = min(strip_x0 + segment.x1, x1);
+                    if (segment_x0 >= segment_x1) continue;
+
+                    __m256i foreground_word = _mm256_unpacklo_epi8(_mm256_set1_epi32(segment.color), _mm256_setzero_si256());
+                    _blend_row_avx2(dst + segment_x0, src + segment_x0, segment_x1 - segment_x0, foreground_word, mode);
+                }
             }
         } break;
 
@@ -277,76 +621,780 @@ void _draw_target_do_command(DrawTarget *target, DrawCommand *command, Rect box)
     }
 }
 
+void _draw_target_do_command(DrawTarget *target, DrawCommand *command, Rect box)
+{
+    s32 x0 = max(command->x0, box.x0);
+    s32 x1 = min(command->x1, box.x1);
+    s32 y0 = max(command->y0, box.y0);
+    s32 y1 = min(command->y1, box.y1);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    if (draw_kernels == DrawKernels::AVX2) {
+        _draw_avx2(target, command, x0, y0, x1, y1);
+    } else {
+        _draw_generic(target, command, x0, y0, x1, y1);
+    }
+}
+
+// Finds the cells covering pixels [p0, p1) along one axis. Cell 'g' covers [g*size/count, (g + 1)*size/count).
+void _draw_target_cell_range(s32 p0, s32 p1, s32 size, s32 count, s32 *g0, s32 *g1)
+{
+    *g0 = clamp(((p0 + 1)*count - 1) / size, 0, count - 1);
+    *g1 = clamp((p1*count - 1) / size, 0, count - 1);
+}
+
+// Rasterizes the parts of 'box' which are not in scroll regions 'region' and later
+void _draw_target_rasterize_outside_regions(DrawTarget *target, u32 *commands, s32 commands_length, Rect box, s32 region)
+{
+    for (; region < target->scroll_regions_length; ++region) {
+        Rect area = target->scroll_regions[region].area;
+        if (box.x0 < area.x1 && area.x0 < box.x1 && box.y0 < area.y1 && area.y0 < box.y1) {
+            // Above, below, left and right of the region
+            Rect parts[4] = { box, box, box, box };
+            parts[0].y1 = area.y0;
+            parts[1].y0 = area.y1;
+            parts[2].y0 = parts[3].y0 = max(box.y0, area.y0);
+            parts[2].y1 = parts[3].y1 = min(box.y1, area.y1);
+            parts[2].x1 = area.x0;
+            parts[3].x0 = area.x1;
+
+            for (s32 i = 0; i < 4; ++i) {
+                if (parts[i].x0 < parts[i].x1 && parts[i].y0 < parts[i].y1) {
+                    _draw_target_rasterize_outside_regions(target, commands, commands_length, parts[i], region + 1);
+                }
+            }
+            return;
+        }
+    }
+
+    for (s32 i = 0; i < commands_length; ++i) {
+        _draw_target_do_command(target, &target->commands[commands[i]], box);
+    }
+}
+
+// Changed cells come first, then scroll jobs
+void _draw_target_rasterize_job(void *data, s32 index)
+{
+    DrawTarget *target = (DrawTarget *) data;
+
+    if (index < target->changed_cells_length) {
+        DrawTarget::GridCell *cell = &target->grid[target->changed_cells[index]];
+        _draw_target_rasterize_outside_regions(target, cell->commands, cell->commands_length, cell->area, 0);
+    } else {
+        DrawTarget::ScrollJob *job = &target->scroll_jobs[index - target->changed_cells_length];
+        DrawTarget::ScrollBand *band = &target->scroll_regions[job->region].bands[job->band];
+        for (s32 i = 0; i < band->commands_length; ++i) {
+            _draw_target_do_command(target, &target->commands[band->commands[i]], job->box);
+        }
+    }
+}
+
+void draw_scroll_region(DrawTargetSlice *slice, s32 scroll)
+{
+    DrawTarget *target = slice->target;
+
+    Rect area = {};
+    area.x0 = clamp(slice->area.x0, 0, target->width);
+    area.x1 = clamp(slice->area.x1, 0, target->width);
+    area.y0 = clamp(slice->area.y0, 0, target->height);
+    area.y1 = clamp(slice->area.y1, 0, target->height);
+    if (area.x0 >= area.x1 || area.y0 >= area.y1) return;
+
+    // NB Pixels in a region belong to that region alone, so overlapping regions are just dropped
+    for (s32 i = 0; i < target->scroll_regions_length; ++i) {
+        Rect other = target->scroll_regions[i].area;
+        if (area.x0 < other.x1 && other.x0 < area.x1 && area.y0 < other.y1 && other.y0 < area.y1) return;
+    }
+    if (target->scroll_regions_length >= DrawTarget::MAX_SCROLL_REGIONS) return;
+
+    DrawTarget::ScrollRegion *region = &target->scroll_regions[target->scroll_regions_length++];
+    if (area.x0 != region->area.x0 || area.x1 != region->area.x1 || area.y0 != region->area.y0 || area.y1 != region->area.y1) {
+        region->valid = false;
+    }
+    region->area = area;
+    region->scroll = scroll;
+}
+
+s32 _draw_floor_div(s32 a, s32 b)
+{
+    return(a >= 0? a / b : -((-a + b - 1) / b));
+}
+
+void _draw_target_add_scroll_job(DrawTarget *target, s32 region, s32 band, s32 content_y0, s32 content_y1)
+{
+    if (content_y0 >= content_y1) return;
+
+    if (target->scroll_jobs_length + 1 > target->scroll_jobs_capacity) {
+        target->scroll_jobs_capacity = next_power_of_two(target->scroll_jobs_capacity + 64);
+        target->scroll_jobs = (DrawTarget::ScrollJob *) heap_grow(target->scroll_jobs, target->scroll_jobs_capacity * sizeof(DrawTarget::ScrollJob));
+    }
+
+    DrawTarget::ScrollRegion *scroll_region = &target->scroll_regions[region];
+    DrawTarget::ScrollJob *job = &target->scroll_jobs[target->scroll_jobs_length++];
+    job->region = region;
+    job->band = band;
+    job->box.x0 = scroll_region->area.x0;
+    job->box.x1 = scroll_region->area.x1;
+    job->box.y0 = scroll_region->area.y0 + content_y0 - scroll_region->scroll;
+    job->box.y1 = scroll_region->area.y0 + content_y1 - scroll_region->scroll;
+}
+
+struct _DrawScrollMove
+{
+    DrawTarget *target;
+    Rect area;
+    s32 delta;
+    s32 strip_width;
+};
+
+void _draw_target_move_strip(void *data, s32 index)
+{
+    _DrawScrollMove *move = (_DrawScrollMove *) data;
+    DrawTarget *target = move->target;
+    s32 x0 = move->area.x0 + index*move->strip_width;
+    s32 x1 = min(x0 + move->strip_width, move->area.x1);
+    s32 rows = (move->area.y1 - move->area.y0) - abs(move->delta);
+
+    // NB Order matters, we must read each row before it is overwritten
+    if (move->delta > 0) {
+        for (s32 y = move->area.y0; y < move->area.y0 + rows; ++y) {
+            memcpy(&target->buffer[y*target->width + x0], &target->buffer[(y + move->delta)*target->width + x0], (x1 - x0)*sizeof(u32));
+        }
+    } else {
+        for (s32 y = move->area.y1 - 1; y >= move->area.y1 - rows; --y) {
+            memcpy(&target->buffer[y*target->width + x0], &target->buffer[(y + move->delta)*target->width + x0], (x1 - x0)*sizeof(u32));
+        }
+    }
+}
+
+// Sorts commands into the bands of each scroll region, moves pixels which are still valid after scrolling and queues jobs for
+// the bands we have to rasterize.
+void _draw_target_prepare_scroll_regions(DrawTarget *target)
+{
+    enum { BAND_HEIGHT = DrawTarget::SCROLL_BAND_HEIGHT };
+
+    target->scroll_jobs_length = 0;
+    for (s32 i = target->scroll_regions_length; i < DrawTarget::MAX_SCROLL_REGIONS; ++i) target->scroll_regions[i].valid = false;
+
+    for (s32 r = 0; r < target->scroll_regions_length; ++r) {
+        DrawTarget::ScrollRegion *region = &target->scroll_regions[r];
+        Rect area = region->area;
+        s32 height = area.y1 - area.y0;
+        s32 content_y0 = region->scroll;
+        s32 content_y1 = region->scroll + height;
+        s32 first_band = _draw_floor_div(content_y0, BAND_HEIGHT);
+        s32 band_count = _draw_floor_div(content_y1 - 1, BAND_HEIGHT) - first_band + 1;
+
+        if (band_count > region->band_capacity) {
+            s32 new_capacity = next_power_of_two(band_count);
+            region->band_hashes = (u32 *) heap_grow(region->band_hashes, new_capacity * sizeof(u32));
+            region->bands = (DrawTarget::ScrollBand *) heap_grow(region->bands, new_capacity * sizeof(DrawTarget::ScrollBand));
+            memset(region->bands + region->band_capacity, 0, (new_capacity - region->band_capacity) * sizeof(DrawTarget::ScrollBand));
+            region->band_capacity = new_capacity;
+        }
+
+        stack_enter_frame();
+        u32 *new_hashes = stack_alloc_uninitialized(u32, band_count);
+        for (s32 b = 0; b < band_count; ++b) {
+            new_hashes[b] = _DRAW_TARGET_HASH_INITIAL;
+            region->bands[b].commands_length = 0;
+        }
+
+        for (s32 i = 0; i < target->commands_length; ++i) {
+            DrawCommand *command = &target->commands[i];
+            if (command->x0 >= command->x1 || command->y0 >= command->y1) continue;
+            if (command->x0 >= area.x1 || command->x1 <= area.x0 || command->y0 >= area.y1 || command->y1 <= area.y0) continue;
+
+            // Hash commands in content space, so scrolling alone doesn't change the hashes. Fills covering the whole height of
+            // the region, like the background, look the same on every row so they get a placeholder position.
+            DrawCommand key = {};
+            key.kind = command->kind;
+            key.color = command->color;
+            key.strip_row = command->strip_row;
+            key.strip_column = command->strip_column;
+            key.glyph_data = command->glyph_data;
+            key.x0 = command->x0;
+            key.x1 = command->x1;
+            bool is_fill = command->kind == DrawCommand::SOLID || command->kind == DrawCommand::MULTIPLY;
+            if (is_fill && command->y0 <= area.y0 && command->y1 >= area.y1) {
+                key.y0 = S32_MIN;
+                key.y1 = S32_MAX;
+            } else {
+                key.y0 = command->y0 - area.y0 + region->scroll;
+                key.y1 = command->y1 - area.y0 + region->scroll;
+            }
+
+            u32 key_hash = _draw_command_hash(&key);
+            target->stats.hashed_bytes += _DRAW_COMMAND_HASHED_BYTES;
+
+            s32 b0 = _draw_floor_div(max(command->y0, area.y0) - area.y0 + region->scroll, BAND_HEIGHT) - first_band;
+            s32 b1 = _draw_floor_div(min(command->y1, area.y1) - area.y0 + region->scroll - 1, BAND_HEIGHT) - first_band;
+            for (s32 b = b0; b <= b1; ++b) {
+                DrawTarget::ScrollBand *band = &region->bands[b];
+                _draw_target_hash_word(&new_hashes[b], key_hash);
+
+                if (band->commands_length + 1 > band->commands_capacity) {
+                    band->commands_capacity = next_power_of_two(band->commands_capacity + 128);
+                    band->commands = (u32 *) heap_grow(band->commands, band->commands_capacity * sizeof(u32));
+                }
+                band->commands[band->commands_length++] = i;
+            }
+        }
+
+        s32 delta = region->scroll - region->previous_scroll;
+        bool can_move = region->valid && abs(delta) < height;
+
+        if (can_move && delta != 0) {
+            // Moving pixels is limited by memory bandwidth, so we spread it over threads. Vertical strips can be moved
+            // independently of each other.
+            _DrawScrollMove move = {};
+            move.target = target;
+            move.area = area;
+            move.delta = delta;
+            move.strip_width = (s32) round_up((area.x1 - area.x0 + parallel_thread_count()*2 - 1) / (parallel_thread_count()*2), 16);
+            s32 strip_count = (area.x1 - area.x0 + move.strip_width - 1) / move.strip_width;
+            if (target->rasterize_serially) {
+                for (s32 i = 0; i < strip_count; ++i) _draw_target_move_strip(&move, i);
+            } else {
+                parallel_for(strip_count, &_draw_target_move_strip, &move);
+            }
+        }
+
+        for (s32 b = 0; b < band_count; ++b) {
+            s32 band_y0 = max((first_band + b)*BAND_HEIGHT, content_y0);
+            s32 band_y1 = min((first_band + b + 1)*BAND_HEIGHT, content_y1);
+
+            s32 previous_b = first_band + b - region->first_band;
+            bool unchanged = can_move && previous_b >= 0 && previous_b < region->band_count && region->band_hashes[previous_b] == new_hashes[b];
+            if (unchanged) {
+                // Only rows which were visible last frame have valid pixels
+                s32 previous_y0 = region->previous_scroll;
+                s32 previous_y1 = region->previous_scroll + height;
+                _draw_target_add_scroll_job(target, r, b, band_y0, min(band_y1, previous_y0));
+                _draw_target_add_scroll_job(target, r, b, max(band_y0, previous_y1), band_y1);
+            } else {
+                _draw_target_add_scroll_job(target, r, b, band_y0, band_y1);
+            }
+        }
+
+        memcpy(region->band_hashes, new_hashes, band_count*sizeof(u32));
+        region->first_band = first_band;
+        region->band_count = band_count;
+        region->previous_scroll = region->scroll;
+        region->valid = true;
+        stack_leave_frame();
+    }
+}
+
 void draw_target_finish(DrawTarget *target)
 {
-    u32 new_hashes[alen(target->grid)];
-    for (s32 i = 0; i < alen(target->grid); ++i) {
+    s32 cell_count = alen(target->grid);
+
+    // Hash commands into the cells they touch, so we can tell which cells changed since last frame. At the same time we sort
+    // commands into per-cell lists, so rasterizing a cell only has to look at its own commands.
+    target->stats = {};
+    target->stats.commands = target->commands_length;
+
+    stack_enter_frame();
+    u32 *new_hashes = stack_alloc_uninitialized(u32, cell_count);
+    for (s32 i = 0; i < cell_count; ++i) {
         new_hashes[i] = _DRAW_TARGET_HASH_INITIAL;
         target->grid[i].changed_this_frame = false;
+        target->grid[i].commands_length = 0;
     }
 
     for (s32 i = 0; i < target->commands_length; ++i) {
         DrawCommand *command = &target->commands[i];
-        s32 gx0 = command->x0*DrawTarget::GRID_WIDTH / target->width;
-        s32 gx1 = (command->x1*DrawTarget::GRID_WIDTH - 1) / target->width;
-        s32 gy0 = command->y0*DrawTarget::GRID_HEIGHT / target->height;
-        s32 gy1 = (command->y1*DrawTarget::GRID_HEIGHT - 1) / target->height;
+        if (command->x0 >= command->x1 || command->y0 >= command->y1) continue;
+
+        s32 gx0, gx1, gy0, gy1;
+        _draw_target_cell_range(command->x0, command->x1, target->width, DrawTarget::GRID_WIDTH, &gx0, &gx1);
+        _draw_target_cell_range(command->y0, command->y1, target->height, DrawTarget::GRID_HEIGHT, &gy0, &gy1);
+
+        u32 command_hash = _draw_command_hash(command);
+        target->stats.hashed_bytes += _DRAW_COMMAND_HASHED_BYTES;
+
+        for (s32 gy = gy0; gy <= gy1; ++gy) {
+            for (s32 gx = gx0; gx <= gx1; ++gx) {
+                s32 slot = gx + gy*DrawTarget::GRID_WIDTH;
+                DrawTarget::GridCell *cell = &target->grid[slot];
+
+                _draw_target_hash_word(&new_hashes[slot], command_hash);
 
-        for (s32 gx = gx0; gx <= gx1; ++gx) {
-            for (s32 gy = gy0; gy <= gy1; ++gy) {
-                _draw_target_hash(&new_hashes[gx + gy*DrawTarget::GRID_WIDTH], (u8 *) command, sizeof(DrawCommand));
+                if (cell->commands_length + 1 > cell->commands_capacity) {
+                    cell->commands_capacity = next_power_of_two(cell->commands_capacity + 128);
+                    cell->commands = (u32 *) heap_grow(cell->commands, cell->commands_capacity * sizeof(u32));
+                }
+                cell->commands[cell->commands_length++] = i;
             }
         }
     }
 
-    for (s32 gx = 0; gx < DrawTarget::GRID_WIDTH; ++gx) {
-        for (s32 gy = 0; gy < DrawTarget::GRID_HEIGHT; ++gy) {
-            s32 slot = gx + gy*DrawTarget::GRID_WIDTH;
-            DrawTarget::GridCell *cell = &target->grid[slot];
+    target->changed_cells_length = 0;
+    for (s32 slot = 0; slot < cell_count; ++slot) {
+        DrawTarget::GridCell *cell = &target->grid[slot];
+        cell->changed_this_frame = new_hashes[slot] != cell->current_hash;
+        if (cell->changed_this_frame) {
+            cell->current_hash = new_hashes[slot];
+            target->changed_cells[target->changed_cells_length++] = slot;
+        }
+    }
+    stack_leave_frame();
 
-            cell->changed_this_frame = new_hashes[slot] != cell->current_hash;
-            if (cell->changed_this_frame) {
-                cell->current_hash = new_hashes[slot];
+    _draw_target_prepare_scroll_regions(target);
 
-                for (s32 i = 0; i < target->commands_length; ++i) {
-                    DrawCommand *command = &target->commands[i];
-                    bool inside = command->x1 >= cell->area.x0 && command->x0 <= cell->area.x1 &&
-                                  command->y1 >= cell->area.y0 && command->y0 <= cell->area.y1;
-                    if (inside) {
-                        _draw_target_do_command(target, command, cell->area);
-                    }
+    if (draw_kernels == DrawKernels::Unknown) {
+        draw_kernels = cpu_supports_avx2()? DrawKernels::AVX2 : DrawKernels::Generic;
+    }
+
+    target->stats.changed_cells = target->changed_cells_length;
+    target->stats.scroll_jobs = target->scroll_jobs_length;
+
+    s32 job_count = target->changed_cells_length + target->scroll_jobs_length;
+    if (target->rasterize_serially) {
+        for (s32 i = 0; i < job_count; ++i) _draw_target_rasterize_job(target, i);
+    } else {
+        parallel_for(job_count, &_draw_target_rasterize_job, target);
+    }
+
+    #if 0
+    // For debugging, fade squares which didn't change to white
+    for (s32 slot = 0; slot < cell_count; ++slot) {
+        DrawTarget::GridCell *cell = &target->grid[slot];
+        if (!cell->changed_this_frame) {
+            union Swizzle
+            {
+                u32 v;
+                struct { u8 b, g, r, a; };
+            } swizzle;
+
+            for (s32 y = cell->area.y0; y < cell->area.y1; ++y) {
+                u32 *pixel = &target->buffer[y*target->width + cell->area.x0];
+                u32 *row_end = pixel + (cell->area.x1 - cell->area.x0);
+                while (pixel < row_end) {
+                    swizzle.v = *pixel;
+                    swizzle.r = min(swizzle.r + 3, 255);
+                    swizzle.g = min(swizzle.g + 4, 255);
+                    swizzle.b = min(swizzle.b + 3, 255);
+                    *pixel = swizzle.v;
+                    ++pixel;
                 }
             }
+        }
+    }
+    #endif
+
+    target->commands_length = 0;
+    target->scroll_regions_length = 0;
+}
+
+void draw_target_free(DrawTarget *target)
+{
+    if (target->buffer) heap_free(target->buffer);
+    if (target->commands) heap_free(target->commands);
+    for (s32 i = 0; i < alen(target->grid); ++i) {
+        if (target->grid[i].commands) heap_free(target->grid[i].commands);
+    }
+    for (s32 r = 0; r < DrawTarget::MAX_SCROLL_REGIONS; ++r) {
+        DrawTarget::ScrollRegion *region = &target->scroll_regions[r];
+        if (region->bands) {
+            for (s32 b = 0; b < region->band_capacity; ++b) heap_free(region->bands[b].commands);
+            heap_free(region->bands);
+            heap_free(region->band_hashes);
+        }
+    }
+    if (target->scroll_jobs) heap_free(target->scroll_jobs);
+    *target = {};
+}
+
+#if defined(DEBUG)
+// Poor mans benchmark. Times full repaints and unchanged frames of a 4k target covered in glyphs, which is about what we
+// see when showing a dense file fullscreen. Returns a hash of the final image.
+u32 _draw_target_benchmark_run(bool rasterize_serially)
+{
+    enum { WIDTH = 3840, HEIGHT = 2160, GLYPH_WIDTH = 12, GLYPH_HEIGHT = 24, FRAMES = 32 };
+
+    static u32 glyph_data[GLYPH_WIDTH*GLYPH_HEIGHT];
+    for (s32 i = 0; i < alen(glyph_data); ++i) glyph_data[i] = (i*37 % 256)*0x010101;
+
+    DrawTarget target = {};
+    draw_target_set_size(&target, WIDTH, HEIGHT);
+    target.rasterize_serially = rasterize_serially;
+    DrawTargetSlice slice = draw_target_as_slice(&target);
+
+    s64 times[2] = {};
+    s32 command_count = 0;
+    for (s32 frame = 0; frame < FRAMES*2; ++frame) {
+        bool repaint = frame < FRAMES;
+        u32 color = repaint? 0x101010*(frame & 7) : 0;
+
+        draw_solid(&slice, 0, 0, WIDTH, HEIGHT, 0xff202020 + color);
+        draw_blend(&slice, 0, 10*GLYPH_HEIGHT, WIDTH, 11*GLYPH_HEIGHT, 0x40ffffff);
+        for (s32 y = 0; y + GLYPH_HEIGHT <= HEIGHT; y += GLYPH_HEIGHT) {
+            for (s32 x = 0; x + GLYPH_WIDTH <= WIDTH; x += GLYPH_WIDTH) {
+                DrawCommand command = {};
+                command.x0 = x;
+                command.x1 = x + GLYPH_WIDTH;
+                command.y0 = y;
+                command.y1 = y + GLYPH_HEIGHT;
+                command.kind = DrawCommand::GLYPH;
+                command.color = 0xffd0d0d0 - color;
+                command.glyph_data = glyph_data;
+                _draw_target_add_command(&target, command);
+            }
+        }
+        command_count = target.commands_length;
+
+        Time start = time_read();
+        draw_target_finish(&target);
+        // NB The first unchanged frame still differs from the last repaint
+        if (frame != FRAMES) times[repaint? 0 : 1] += time_convert(start, time_read(), MICROSECONDS);
+    }
+
+    debug_printf("%i commands on a %ix%i target, %s: Full repaint %i us, unchanged frame %i us, %i kb hashed\n",
+                 command_count, WIDTH, HEIGHT,
+                 rasterize_serially? "serial" : stack_printf("%i threads", parallel_thread_count()).data,
+                 (s32) (times[0] / FRAMES), (s32) (times[1] / (FRAMES - 1)), (s32) (target.stats.hashed_bytes / 1024));
+
+    u32 hash = _DRAW_TARGET_HASH_INITIAL;
+    _draw_target_hash(&hash, (u8 *) target.buffer, WIDTH*HEIGHT*sizeof(u32));
+    draw_target_free(&target);
+    return(hash);
+}
+
+// Scrolls a page of glyphs a few pixels per frame, the way 'draw_buffer' does while animating, with a caret which stays put on
+// screen. Returns a hash of the final image, which should not depend on whether we use a scroll region.
+u32 _draw_scroll_benchmark_run(bool use_scroll_region)
+{
+    enum { WIDTH = 3840, HEIGHT = 2160, STATUS_HEIGHT = 40, GLYPH_WIDTH = 12, GLYPH_HEIGHT = 24, FRAMES = 64, STEP = 7 };
+
+    static u32 glyph_data[GLYPH_WIDTH*GLYPH_HEIGHT];
+    for (s32 i = 0; i < alen(glyph_data); ++i) glyph_data[i] = (i*37 % 256)*0x010101;
+
+    DrawTarget target = {};
+    draw_target_set_size(&target, WIDTH, HEIGHT);
+    DrawTargetSlice canvas = draw_target_as_slice(&target);
+    DrawTargetSlice text_canvas = draw_target_slice(&canvas, 0, 0, WIDTH, HEIGHT - STATUS_HEIGHT);
+
+    Glyph glyph = {};
+    glyph.data = glyph_data;
+    glyph.width = GLYPH_WIDTH;
+    glyph.height = GLYPH_HEIGHT;
+
+    s64 time = 0;
+    for (s32 frame = 0; frame < FRAMES; ++frame) {
+        s32 scroll = frame*STEP;
+
+        draw_solid(&canvas, 0, HEIGHT - STATUS_HEIGHT, WIDTH, HEIGHT, 0xff303030);
+        draw_solid(&canvas, 0, 0, WIDTH, HEIGHT - STATUS_HEIGHT, 0xff202020);
+        if (use_scroll_region) draw_scroll_region(&text_canvas, scroll);
+
+        s32 first_row = scroll / GLYPH_HEIGHT;
+        s32 last_row = (scroll + HEIGHT - STATUS_HEIGHT) / GLYPH_HEIGHT;
+        draw_solid(&text_canvas, 0, (first_row + 3)*GLYPH_HEIGHT - scroll, WIDTH/2, (first_row + 5)*GLYPH_HEIGHT - scroll, 0xff404060);
+        for (s32 row = first_row; row <= last_row; ++row) {
+            for (s32 x = 0; x + GLYPH_WIDTH <= WIDTH; x += GLYPH_WIDTH) {
+                draw_glyph(&text_canvas, null, glyph, x, row*GLYPH_HEIGHT - scroll, 0xff000000 | (row*0x3517 + x));
+            }
+        }
+        draw_solid(&text_canvas, 600, 500, 602, 520, 0xffff0000);
+
+        Time start = time_read();
+        draw_target_finish(&target);
+        if (frame > 0) time += time_convert(start, time_read(), MICROSECONDS);
+    }
+
+    debug_printf("Scrolling %i px per frame on a %ix%i target, %s: %i us per frame\n", (s32) STEP, WIDTH, HEIGHT,
+                 use_scroll_region? "with scroll region" : "without scroll region", (s32) (time / (FRAMES - 1)));
+
+    u32 hash = _DRAW_TARGET_HASH_INITIAL;
+    _draw_target_hash(&hash, (u8 *) target.buffer, WIDTH*HEIGHT*sizeof(u32));
+    draw_target_free(&target);
+    return(hash);
+}
+
+// Draws a static page of text with a blinking caret, either one command per glyph or through a 'TextStripCache'. Returns a
+// hash of the final image, which should not depend on whether we use strips.
+u32 _draw_text_strip_benchmark_run(bool use_strips)
+{
+    enum { WIDTH = 3840, HEIGHT = 2160, GLYPH_WIDTH = 12, GLYPH_HEIGHT = 24, LINE_HEIGHT = 20, FRAMES = 32 };
+
+    // Glyphs don't touch their neighbours, like most glyphs in a monospace font
+    static u32 glyph_data[GLYPH_WIDTH*GLYPH_HEIGHT];
+    for (s32 i = 0; i < alen(glyph_data); ++i) {
+        s32 column = i % GLYPH_WIDTH;
+        glyph_data[i] = (column > 0 && column < GLYPH_WIDTH - 1)? (i*37 % 256)*0x010101 : 0;
+    }
+
+    DrawTarget target = {};
+    draw_target_set_size(&target, WIDTH, HEIGHT);
+    DrawTargetSlice canvas = draw_target_as_slice(&target);
+    TextStripCache cache = {};
+
+    Glyph glyph = {};
+    glyph.data = glyph_data;
+    glyph.width = GLYPH_WIDTH;
+    glyph.height = GLYPH_HEIGHT;
+    glyph.offset_y = -2;
+
+    s64 time = 0;
+    s32 command_count = 0;
+    for (s32 frame = 0; frame < FRAMES; ++frame) {
+        Time start = time_read();
+        text_strip_cache_next_frame(&cache);
+
+        draw_solid(&canvas, 0, 0, WIDTH, HEIGHT, 0xff202020);
+        for (s32 line = 0; (line + 1)*LINE_HEIGHT < HEIGHT; ++line) {
+            s32 y = line*LINE_HEIGHT + 2;
+            if (use_strips && draw_text_strip(&canvas, &cache, line + 1, 0, y)) continue;
+
+            s32 first_command = text_strip_begin(&canvas);
+            for (s32 x = 0; x + GLYPH_WIDTH <= WIDTH; x += GLYPH_WIDTH) {
+                u32 color = ((x / GLYPH_WIDTH / 5 + line) % 3 == 0)? 0xffd0a070 : 0xffd0d0d0;
+                draw_glyph(&canvas, null, glyph, x, y, color);
+            }
+            if (use_strips) text_strip_end(&canvas, &cache, first_command, line + 1, 0, y);
+        }
+        if (frame & 1) draw_solid(&canvas, 600, 500, 602, 520, 0xffff0000);
+
+        command_count = target.commands_length;
+        draw_target_finish(&target);
+        if (frame > 0) time += time_convert(start, time_read(), MICROSECONDS);
+    }
+
+    debug_printf("Static text on a %ix%i target, %s: %i commands, %i us per frame\n", WIDTH, HEIGHT,
+                 use_strips? "with text strips" : "without text strips", command_count, (s32) (time / (FRAMES - 1)));
+
+    u32 hash = _DRAW_TARGET_HASH_INITIAL;
+    _draw_target_hash(&hash, (u8 *) target.buffer, WIDTH*HEIGHT*sizeof(u32));
+    draw_target_free(&target);
+    text_strip_cache_free(&cache);
+    return(hash);
+}
+
+// xorshift32
+u32 _draw_random(u32 *state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return(x);
+}
+
+// Runs random commands through every kernel and checks that they agree on every pixel, then times each kernel on its own.
+void _draw_kernels_benchmark()
+{
+    enum { WIDTH = 256, HEIGHT = 128, ROUNDS = 4096, TIMED_ROUNDS = 256 };
 
-            #if 0
-            // For debugging, fade squares which didn't change to white
-            else {
-                union Swizzle
-                {
-                    u32 v;
-                    struct { u8 b, g, r, a; };
-                } swizzle;
-
-                for (s32 y = y0; y < y1; ++y) {
-                    u32 *pixel = &target->buffer[y*target->width + x0];
-                    u32 *row_end = pixel + (x1 - x0);
-                    while (pixel < row_end) {
-                        swizzle.v = *pixel;
-                        swizzle.r = min(swizzle.r + 3, 255);
-                        swizzle.g = min(swizzle.g + 4, 255);
-                        swizzle.b = min(swizzle.b + 3, 255);
-                        *pixel = swizzle.v;
-                        ++pixel;
+    u32 random = 0x12345678;
+
+    static u32 glyph_data[WIDTH*HEIGHT];
+    for (s32 i = 0; i < alen(glyph_data); ++i) glyph_data[i] = _draw_random(&random) & 0x00ffffff;
+
+    DrawTarget targets[2] = {};
+    for (s32 i = 0; i < 2; ++i) {
+        targets[i].width = WIDTH;
+        targets[i].height = HEIGHT;
+        targets[i].buffer = (u32 *) heap_alloc(WIDTH*HEIGHT*sizeof(u32));
+    }
+    for (s32 i = 0; i < WIDTH*HEIGHT; ++i) targets[0].buffer[i] = targets[1].buffer[i] = _draw_random(&random);
+
+    bool have_avx2 = cpu_supports_avx2();
+    DrawKernels kernels[] = { DrawKernels::Generic, DrawKernels::AVX2 };
+    decltype(DrawCommand::kind) kinds[] = { DrawCommand::SOLID, DrawCommand::MULTIPLY, DrawCommand::GLYPH, DrawCommand::TEXT_STRIP };
+    char *kind_names[] = { "solid", "multiply", "glyph", "text strip" };
+
+    TextStrip::Segment segments[WIDTH/32];
+    for (s32 i = 0; i < alen(segments); ++i) segments[i] = { i*32, i*32 + 24, _draw_random(&random) };
+    TextStrip strip = {};
+    strip.width = WIDTH;
+    strip.height = HEIGHT;
+    strip.coverage = glyph_data;
+    strip.segments = segments;
+    strip.segments_length = alen(segments);
+
+    DrawKernels old_kernels = draw_kernels;
+    bool old_exact_blending = draw_exact_blending;
+
+    for (s32 exact = 0; exact < 2; ++exact) {
+        draw_exact_blending = exact;
+
+        if (have_avx2) {
+            for (s32 round = 0; round < ROUNDS; ++round) {
+                // Glyph data has to be a multiple of four pixels wide, see '_draw_generic'
+                DrawCommand command = {};
+                command.kind = kinds[round % alen(kinds)];
+                command.color = _draw_random(&random);
+                command.x0 = _draw_random(&random) % WIDTH;
+                command.y0 = _draw_random(&random) % HEIGHT;
+                command.x1 = command.x0 + 4*(1 + _draw_random(&random) % 16);
+                command.y1 = command.y0 + 1 + _draw_random(&random) % 16;
+                command.glyph_data = glyph_data;
+                if (command.kind == DrawCommand::TEXT_STRIP) {
+                    command.strip_column = (u16) (_draw_random(&random) % strip.width);
+                    command.x1 = command.x0 + strip.width - command.strip_column;
+                    command.strip_row = (u16) (_draw_random(&random) % (strip.height - (command.y1 - command.y0) + 1));
+                    command.strip = &strip;
+                }
+
+                Rect box = {};
+                box.x0 = _draw_random(&random) % WIDTH;
+                box.y0 = _draw_random(&random) % HEIGHT;
+                box.x1 = box.x0 + _draw_random(&random) % (WIDTH - box.x0 + 1);
+                box.y1 = box.y0 + _draw_random(&random) % (HEIGHT - box.y0 + 1);
+
+                for (s32 i = 0; i < 2; ++i) {
+                    draw_kernels = kernels[i];
+                    _draw_target_do_command(&targets[i], &command, box);
+                }
+                assert(memcmp(targets[0].buffer, targets[1].buffer, WIDTH*HEIGHT*sizeof(u32)) == 0);
+            }
+        }
+
+        for (s32 k = 0; k < alen(kinds); ++k) {
+            for (s32 i = 0; i < (have_avx2? 2 : 1); ++i) {
+                draw_kernels = kernels[i];
+
+                DrawCommand command = {};
+                command.kind = kinds[k];
+                command.color = 0x80d0c0b0;
+                command.x1 = WIDTH;
+                command.y1 = HEIGHT;
+                command.glyph_data = glyph_data;
+                if (command.kind == DrawCommand::TEXT_STRIP) command.strip = &strip;
+                Rect box = {};
+                box.x1 = WIDTH;
+                box.y1 = HEIGHT;
+
+                Time start = time_read();
+                for (s32 round = 0; round < TIMED_ROUNDS; ++round) _draw_target_do_command(&targets[i], &command, box);
+                s64 microseconds = max(time_convert(start, time_read(), MICROSECONDS), 1);
+
+                s64 megapixels_per_second = ((s64) WIDTH*HEIGHT*TIMED_ROUNDS) / microseconds;
+                debug_printf("%s %s%s: %i Mpx/s\n", kernels[i] == DrawKernels::AVX2? "avx2" : "generic", kind_names[k],
+                             exact? " (exact)" : "", (s32) megapixels_per_second);
+            }
+        }
+    }
+
+    draw_kernels = old_kernels;
+    draw_exact_blending = old_exact_blending;
+    for (s32 i = 0; i < 2; ++i) heap_free(targets[i].buffer);
+}
+
+u8 _draw_blend_reference(u32 background, u32 foreground, u32 factor, BlendMode mode)
+{
+    if (mode == BLEND_APPROXIMATE) return((u8) ((background*(256 - factor) + foreground*factor) / 256));
+    u32 x = background*(255 - factor) + foreground*factor;
+    return((u8) (mode == BLEND_ROUND? (x + 127)/255 : x/255));
+}
+
+// Checks every kernel we can run against the formulas in 'BlendMode', computed one channel at a time, for every
+// combination of factor, background and foreground. Every channel gets different values, so swapped channels show up.
+void _draw_kernels_check_blending()
+{
+    enum { SIZE = 256 };
+
+    // Pixels get their background from x, and glyphs their coverage from y
+    static u32 coverage[SIZE*SIZE];
+    for (u32 y = 0; y < SIZE; ++y) {
+        for (u32 x = 0; x < SIZE; ++x) coverage[x + y*SIZE] = (y << 16) | ((255 - y) << 8) | (y ^ 0x5a);
+    }
+    u32 backgrounds[SIZE];
+    for (u32 x = 0; x < SIZE; ++x) backgrounds[x] = 0xff000000 | ((x ^ 0xa5) << 16) | (x << 8) | (255 - x);
+
+    DrawTarget target = {};
+    target.width = SIZE;
+    target.height = SIZE;
+    target.buffer = (u32 *) heap_alloc(SIZE*SIZE*sizeof(u32));
+    Rect box = {};
+    box.x1 = SIZE;
+    box.y1 = SIZE;
+
+    TextStrip::Segment segment = { 0, SIZE, 0 };
+    TextStrip strip = {};
+    strip.width = SIZE;
+    strip.height = SIZE;
+    strip.coverage = coverage;
+    strip.segments = &segment;
+    strip.segments_length = 1;
+
+    DrawKernels old_kernels = draw_kernels;
+    bool old_exact_blending = draw_exact_blending;
+
+    DrawKernels kernels[] = { DrawKernels::Generic, DrawKernels::AVX2 };
+    decltype(DrawCommand::kind) kinds[] = { DrawCommand::MULTIPLY, DrawCommand::GLYPH, DrawCommand::TEXT_STRIP };
+    for (s32 i = 0; i < (cpu_supports_avx2()? 2 : 1); ++i) {
+        draw_kernels = kernels[i];
+        for (s32 exact = 0; exact < 2; ++exact) {
+            draw_exact_blending = exact;
+            for (s32 k = 0; k < alen(kinds); ++k) {
+                BlendMode mode = exact? BLEND_ROUND : (kinds[k] == DrawCommand::MULTIPLY? BLEND_TRUNCATE : BLEND_APPROXIMATE);
+
+                for (u32 value = 0; value < 256; ++value) {
+                    u32 foreground = (value << 16) | ((value ^ 0x3c) << 8) | (255 - value);
+                    for (s32 y = 0; y < SIZE; ++y) memcpy(&target.buffer[y*SIZE], backgrounds, sizeof(backgrounds));
+
+                    DrawCommand command = {};
+                    command.kind = kinds[k];
+                    command.x1 = SIZE;
+                    command.y1 = SIZE;
+                    if (command.kind == DrawCommand::MULTIPLY) {
+                        // The factor is the alpha of the color, so each row gets its own command
+                        for (u32 y = 0; y < SIZE; ++y) {
+                            command.y0 = y;
+                            command.y1 = y + 1;
+                            command.color = (y << 24) | foreground;
+                            _draw_target_do_command(&target, &command, box);
+                        }
+                    } else if (command.kind == DrawCommand::GLYPH) {
+                        command.color = foreground;
+                        command.glyph_data = coverage;
+                        _draw_target_do_command(&target, &command, box);
+                    } else {
+                        segment.color = foreground;
+                        command.strip = &strip;
+                        _draw_target_do_command(&target, &command, box);
+                    }
+
+                    for (u32 y = 0; y < SIZE; ++y) {
+                        for (u32 x = 0; x < SIZE; ++x) {
+                            u32 pixel = target.buffer[x + y*SIZE];
+                            for (s32 shift = 0; shift < 24; shift += 8) {
+                                u32 factor = command.kind == DrawCommand::MULTIPLY? y : (coverage[x + y*SIZE] >> shift) & 0xff;
+                                u8 expected = _draw_blend_reference((backgrounds[x] >> shift) & 0xff, (foreground >> shift) & 0xff, factor, mode);
+                                assert(((pixel >> shift) & 0xff) == expected);
+                            }
+                        }
                     }
                 }
             }
-            #endif
         }
     }
 
-    target->commands_length = 0;
+    draw_kernels = old_kernels;
+    draw_exact_blending = old_exact_blending;
+    heap_free(target.buffer);
 }
 
+void draw_target_benchmark()
+{
+    stack_enter_frame();
+    _draw_kernels_check_blending();
+    _draw_kernels_benchmark();
+
+    u32 reference = _draw_target_benchmark_run(true);
+    assert(_draw_target_benchmark_run(false) == reference); // Parallel rasterization must give the same pixels as serial rasterization
+    u32 text_reference = _draw_text_strip_benchmark_run(false);
+    assert(_draw_text_strip_benchmark_run(true) == text_reference); // Strips must look exactly like the glyphs they replace
+    u32 scroll_reference = _draw_scroll_benchmark_run(false);
+    assert(_draw_scroll_benchmark_run(true) == scroll_reference); // Moving pixels must give the same result as repainting
+    stack_leave_frame();
+}
+#endif
+
 DrawTargetSlice draw_target_as_slice(DrawTarget *target)
 {
     DrawTargetSlice slice = {0};
@@ -370,91 +1418,379 @@ DrawTargetSlice draw_target_slice(DrawTargetSlice *slice, s32 x0, s32 y0, s32 x1
     return(subslice);
 }
 
+u32 *_font_store_pixels(Font::Size *size, u32 *data, s32 count)
+{
+    if (!size->pixel_data || size->pixel_data->length + count > alen(size->pixel_data->data)) {
+        Font::DataBlock *new_block = (Font::DataBlock *) heap_alloc(sizeof(Font::DataBlock));
+        new_block->previous = size->pixel_data;
+        new_block->length = 0;
+        size->pixel_data = new_block;
+        ++size->pixel_blocks;
+    }
+    u32 *new_data = size->pixel_data->data + size->pixel_data->length;
+    memcpy(new_data, data, count*sizeof(u32));
+    size->pixel_data->length += count;
+    assert(((u64) new_data) % 16 == 0); // must be aligned for simd
+    return(new_data);
+}
+
 bool _make_glyph(Font *font, s32 codepoint, Glyph *glyph_out)
 {
     stack_enter_frame();
+    glyph_out->data = stack_alloc(u32, FontBackend::MAX_GLYPH_SIZE*FontBackend::MAX_GLYPH_SIZE);
     bool ok = _font_backend_make_glyph(&font->backend, codepoint, glyph_out);
-    if (ok) {
-        s32 data_size = glyph_out->width*glyph_out->height;
-        if (!font->pixel_data || font->pixel_data->length + data_size > alen(font->pixel_data->data)) {
-            Font::DataBlock *new_block = null;
-            if (font->pixel_data_free) {
-                new_block = font->pixel_data_free;
-                font->pixel_data_free = new_block->previous;
+    if (ok) glyph_out->data = _font_store_pixels(font->current, glyph_out->data, glyph_out->width*glyph_out->height);
+    stack_leave_frame();
+    return(ok);
+}
+
+
+struct FontWorker
+{
+    volatile long lock;
+    void *wake_event;
+
+    struct Request
+    {
+        s32 size;
+        s32 codepoint;
+    };
+    struct Result
+    {
+        s32 size;
+        bool ok;
+        Glyph glyph; // 'data' is heap allocated
+    };
+    Array<Request> requests;
+    Array<Result> results;
+};
+
+void _font_worker_lock(FontWorker *worker)
+{
+    while (_InterlockedCompareExchange(&worker->lock, 1, 0) != 0) _mm_pause();
+}
+
+void _font_worker_unlock(FontWorker *worker)
+{
+    _InterlockedExchange(&worker->lock, 0);
+}
+
+// The worker has its own backend, so it never touches the GDI objects of the main thread
+u32 _font_worker_routine(void *parameter)
+{
+    Font *font = (Font *) parameter;
+    FontWorker *worker = font->worker;
+
+    FontBackend backend = {};
+    FontMetrics metrics = {};
+    s32 backend_size = 0;
+    u32 *scratch = (u32 *) heap_alloc(FontBackend::MAX_GLYPH_SIZE*FontBackend::MAX_GLYPH_SIZE*sizeof(u32));
+    Array<FontWorker::Request> requests = {};
+
+    while (true) {
+        win32::WaitForSingleObject(worker->wake_event, U32_MAX);
+
+        _font_worker_lock(worker);
+        Array<FontWorker::Request> temp = worker->requests;
+        worker->requests = requests;
+        requests = temp;
+        _font_worker_unlock(worker);
+
+        for (s64 i = 0; i < requests.length; ++i) {
+            FontWorker::Request request = requests[i];
+            if (request.size != backend_size) {
+                _font_backend_change(&backend, request.size, &metrics);
+                backend_size = request.size;
+            }
+
+            FontWorker::Result result = {};
+            result.size = request.size;
+            result.glyph.data = scratch;
+            result.ok = _font_backend_make_glyph(&backend, request.codepoint, &result.glyph);
+            result.glyph.codepoint = request.codepoint;
+            if (result.ok) {
+                s32 data_size = result.glyph.width*result.glyph.height;
+                result.glyph.data = (u32 *) heap_alloc(data_size*sizeof(u32));
+                memcpy(result.glyph.data, scratch, data_size*sizeof(u32));
             } else {
-                new_block = (Font::DataBlock *) heap_alloc(sizeof(Font::DataBlock));
+                result.glyph.data = null;
             }
-            new_block->previous = font->pixel_data;
-            font->pixel_data = new_block;
-            new_block->length = 0;
+
+            _font_worker_lock(worker);
+            worker->results.append(result);
+            _font_worker_unlock(worker);
         }
-        u32 *new_data = font->pixel_data->data + font->pixel_data->length;
-        memcpy(font->pixel_data->data + font->pixel_data->length, glyph_out->data, data_size*sizeof(u32));
-        glyph_out->data = new_data;
-        font->pixel_data->length += data_size;
-        assert(((u64) new_data) % 16 == 0); // must be aligned for simd
+
+        if (requests.length > 0 && font->on_glyphs_ready) font->on_glyphs_ready();
+        requests.clear();
     }
-    stack_leave_frame();
-    return(ok);
+}
+
+// 'size->available[index]' holds a placeholder until the glyph is ready
+void _font_request_glyph(Font *font, Font::Size *size, u32 index)
+{
+    if (!font->worker && !font->rasterize_synchronously) {
+        FontWorker *worker = (FontWorker *) heap_alloc(sizeof(FontWorker));
+        *worker = {};
+        worker->wake_event = win32::CreateEventW(null, false, false, null);
+        font->worker = worker;
+
+        void *thread = worker->wake_event? win32::CreateThread(null, 0, &_font_worker_routine, (void *) font, 0, null) : null;
+        if (thread) {
+            win32::CloseHandle(thread);
+        } else {
+            // We can get by without
+            font->worker = null;
+            font->rasterize_synchronously = true;
+            if (worker->wake_event) win32::CloseHandle(worker->wake_event);
+            heap_free(worker);
+        }
+    }
+
+    Glyph *glyph = &size->available[index];
+    if (font->rasterize_synchronously) {
+        if (!_make_glyph(font, glyph->codepoint, glyph)) *glyph = {};
+    } else {
+        FontWorker::Request request = {};
+        request.size = size->size;
+        request.codepoint = glyph->codepoint;
+
+        _font_worker_lock(font->worker);
+        font->worker->requests.append(request);
+        _font_worker_unlock(font->worker);
+        win32::SetEvent(font->worker->wake_event);
+        ++font->glyphs_pending;
+    }
+}
+
+Font::Size *_font_find_size(Font *font, s32 size)
+{
+    for (s32 i = 0; i < font->sizes_length; ++i) {
+        if (font->sizes[i].size == size) return(&font->sizes[i]);
+    }
+    return(null);
+}
+
+// Moves glyphs finished by the worker thread into their size. Returns true if any glyph which was drawn or laid out
+// changed, in which case the app should redraw.
+bool font_collect_glyphs(Font *font)
+{
+    if (!font->worker || font->glyphs_pending == 0) return(false);
+
+    _font_worker_lock(font->worker);
+    Array<FontWorker::Result> results = font->worker->results;
+    font->worker->results = {};
+    _font_worker_unlock(font->worker);
+
+    // NB Glyphs which were only measured so far don't show up anywhere, so finishing them doesn't need a new generation
+    bool changed = false;
+    for (s64 i = 0; i < results.length; ++i) {
+        FontWorker::Result *result = &results[i];
+        --font->glyphs_pending;
+
+        // NB The size might have been dropped since we requested the glyph, or even dropped and made again
+        u32 index = U32_MAX;
+        Font::Size *size = _font_find_size(font, result->size);
+        if (size && size->known_glyphs.get(result->glyph.codepoint, &index) && index != U32_MAX) {
+            if (size->available[index].placeholder_drawn) {
+                ++font->glyph_generation;
+                changed = true;
+            }
+
+            if (result->ok) {
+                Glyph glyph = result->glyph;
+                glyph.data = _font_store_pixels(size, result->glyph.data, glyph.width*glyph.height);
+                size->available[index] = glyph;
+            } else {
+                size->available[index].codepoint = 0;
+                ++font->availability_changes;
+                changed = true;
+            }
+        }
+        heap_free(result->glyph.data);
+    }
+
+    results.free();
+    return(changed);
 }
 
 bool _get_glyph(Font *font, s32 codepoint, Glyph *glyph_out)
 {
+    Font::Size *size = font->current;
     if (codepoint <= 128) {
-        bool available = font->ascii_glyph_map[codepoint >> 5] & (1u << (codepoint&31));
-        if (available && glyph_out) *glyph_out = font->ascii_glyphs[codepoint];
+        bool available = size->ascii_glyph_map[codepoint >> 5] & (1u << (codepoint&31));
+        if (available && glyph_out) *glyph_out = size->ascii_glyphs[codepoint];
         return(available);
     } else {
+        // NB Whether a glyph exists is cheap to find out, so layout never has to wait for the worker thread. Glyphs which
+        // rasterize to nothing still count as missing though, see 'Font::availability_changes'.
         u32 index = U32_MAX;
-        if (!font->known_glyphs.get(codepoint, &index)) {
-            Glyph new_glyph = {0};
-            stack_enter_frame();
-            if (_make_glyph(font, codepoint, &new_glyph)) {
-                index = font->available.length;
-                font->available.append(new_glyph);
+        if (!size->known_glyphs.get(codepoint, &index)) {
+            if (_font_backend_has_glyph(&font->backend, codepoint)) {
+                index = (u32) size->available.length;
+                Glyph placeholder = size->placeholder;
+                placeholder.codepoint = codepoint;
+                size->available.append(placeholder);
+                _font_request_glyph(font, size, index);
             }
-            stack_leave_frame();
-            font->known_glyphs.insert(codepoint, index);
+            size->known_glyphs.insert(codepoint, index);
         }
 
-        if (index != U32_MAX && glyph_out) *glyph_out = font->available[index];
-        return(index != U32_MAX);
+        bool available = index != U32_MAX && size->available[index].codepoint != 0;
+        if (available && glyph_out) {
+            if (size->available[index].data == size->placeholder.data) size->available[index].placeholder_drawn = true;
+            *glyph_out = size->available[index];
+        }
+        return(available);
     }
 }
 
+void _font_free_size(Font *font, Font::Size *size)
+{
+    while (size->pixel_data) {
+        Font::DataBlock *previous = size->pixel_data->previous;
+        heap_free(size->pixel_data);
+        size->pixel_data = previous;
+    }
+    size->known_glyphs.free();
+    size->available.free();
+
+    s32 index = (s32) (size - font->sizes);
+    font->sizes[index] = font->sizes[--font->sizes_length];
+    if (font->current == &font->sizes[font->sizes_length]) font->current = &font->sizes[index];
+}
+
 void font_change_size(Font *font, s32 new_size)
 {
     _font_backend_change(&font->backend, new_size, &font->metrics);
+    if (!font->budget) font->budget = Font::DEFAULT_BUDGET;
+
+    Font::Size *size = _font_find_size(font, new_size);
+    if (!size) {
+        if (font->sizes_length == Font::MAX_SIZES) {
+            Font::Size *oldest = &font->sizes[0];
+            for (s32 i = 1; i < font->sizes_length; ++i) {
+                if (font->sizes[i].last_used < oldest->last_used) oldest = &font->sizes[i];
+            }
+            _font_free_size(font, oldest);
+        }
 
-    font->available.clear();
-    font->known_glyphs.clear();
-    while (font->pixel_data) {
-        Font::DataBlock *temp = font->pixel_data->previous;
-        font->pixel_data->previous = font->pixel_data_free;
-        font->pixel_data_free = font->pixel_data;
-        font->pixel_data = temp;
+        size = &font->sizes[font->sizes_length++];
+        *size = {};
+        size->size = new_size;
+        font->current = size;
+
+        stack_enter_frame();
+        enum { FIRST = 32, COUNT = 128 - 32, PIXELS = FontBackend::MAX_GLYPH_SIZE*FontBackend::MAX_GLYPH_SIZE };
+        Glyph *glyphs = stack_alloc(Glyph, COUNT);
+        bool *available = stack_alloc(bool, COUNT);
+        u32 *ascii_pixels = stack_alloc(u32, COUNT*PIXELS);
+        for (s32 i = 0; i < COUNT; ++i) glyphs[i] = { 0, ascii_pixels + i*PIXELS };
+        _font_backend_make_glyphs(&font->backend, FIRST, COUNT, glyphs, available);
+
+        for (s32 i = 0; i < COUNT; ++i) {
+            s32 codepoint = FIRST + i;
+            if (available[i]) {
+                Glyph glyph = glyphs[i];
+                glyph.data = _font_store_pixels(size, glyph.data, glyph.width*glyph.height);
+                size->ascii_glyph_map[codepoint >> 5] |= 1u << (codepoint & 31);
+                size->ascii_glyphs[codepoint] = glyph;
+            }
+
+            // We need these codepoints to render escape sequences for unavailable codepoints
+            if ((codepoint >= '0' && codepoint <= '9') || (codepoint >= 'a' && codepoint <= 'f') || (codepoint == '\\')) assert(available[i]);
+        }
+        stack_leave_frame();
+
+        // A faint box, about the size of a lowercase letter
+        stack_enter_frame();
+        Glyph *placeholder = &size->placeholder;
+        placeholder->width = round_up(max(font->metrics.advance, 4), 4);
+        placeholder->offset_y = font->metrics.ascent/3;
+        placeholder->height = max(font->metrics.ascent - placeholder->offset_y, 2);
+        s32 box_x1 = max(font->metrics.advance - 1, 2);
+        u32 *pixels = stack_alloc(u32, placeholder->width*placeholder->height);
+        memset(pixels, 0, placeholder->width*placeholder->height*sizeof(u32));
+        for (s32 y = 0; y < placeholder->height; ++y) {
+            for (s32 x = 1; x < box_x1; ++x) {
+                bool edge = y == 0 || y == placeholder->height - 1 || x == 1 || x == box_x1 - 1;
+                if (edge) pixels[x + y*placeholder->width] = 0x606060;
+            }
+        }
+        placeholder->data = _font_store_pixels(size, pixels, placeholder->width*placeholder->height);
+        stack_leave_frame();
+    }
+    size->last_used = ++font->use_counter;
+    font->current = size;
+
+    while (true) {
+        s64 total = 0;
+        Font::Size *oldest = null;
+        for (s32 i = 0; i < font->sizes_length; ++i) {
+            Font::Size *other = &font->sizes[i];
+            total += other->pixel_blocks*sizeof(Font::DataBlock);
+            if (other != font->current && (!oldest || other->last_used < oldest->last_used)) oldest = other;
+        }
+        if (total <= font->budget || !oldest) break;
+        _font_free_size(font, oldest);
     }
-    memset(font->ascii_glyph_map, 0, sizeof(font->ascii_glyph_map));
+}
 
-    for (s32 codepoint = 32; codepoint < 128; ++codepoint) {
-        Glyph glyph = {};
-        bool available = _make_glyph(font, codepoint, &glyph);
-        if (available) {
-            font->ascii_glyph_map[codepoint >> 5] |= 1u << (codepoint & 31);
-            font->ascii_glyphs[codepoint] = glyph;
+#if defined(DEBUG)
+// Times making all of printable ascii at a range of sizes, which is what we do at startup and when zooming to a new size.
+// Build with different 'FONT_BACKEND_*'s to compare backends.
+void font_warmup_benchmark()
+{
+    enum { FIRST = 32, COUNT = 128 - 32, PIXELS = FontBackend::MAX_GLYPH_SIZE*FontBackend::MAX_GLYPH_SIZE };
+    stack_enter_frame();
+    Glyph *single = stack_alloc(Glyph, COUNT);
+    Glyph *batch = stack_alloc(Glyph, COUNT);
+    bool *single_available = stack_alloc(bool, COUNT);
+    bool *batch_available = stack_alloc(bool, COUNT);
+    u32 *pixels = stack_alloc(u32, 2*COUNT*PIXELS);
+
+    FontBackend backend = {};
+    FontMetrics metrics = {};
+    s64 times[2] = {};
+    s32 size_count = 0;
+    for (s32 font_size = 8; font_size <= 32; font_size += 2, ++size_count) {
+        for (s32 i = 0; i < COUNT; ++i) {
+            single[i] = { 0, pixels + i*PIXELS };
+            batch[i] = { 0, pixels + (COUNT + i)*PIXELS };
         }
 
-        // We need these codepoints to render escape sequences for unavailable codepoints
-        if ((codepoint >= '0' && codepoint <= '9') || (codepoint >= 'a' && codepoint <= 'f') || (codepoint == '\\')) assert(available);
+        Time start = time_read();
+        _font_backend_change(&backend, font_size, &metrics);
+        for (s32 i = 0; i < COUNT; ++i) single_available[i] = _font_backend_make_glyph(&backend, FIRST + i, &single[i]);
+        times[0] += time_convert(start, time_read(), MICROSECONDS);
+
+        start = time_read();
+        _font_backend_change(&backend, font_size, &metrics);
+        _font_backend_make_glyphs(&backend, FIRST, COUNT, batch, batch_available);
+        times[1] += time_convert(start, time_read(), MICROSECONDS);
+
+        for (s32 i = 0; i < COUNT; ++i) {
+            assert(single_available[i] == batch_available[i]);
+            if (!single_available[i]) continue;
+            Glyph a = single[i], b = batch[i];
+            assert(a.width == b.width && a.height == b.height && a.offset_x == b.offset_x && a.offset_y == b.offset_y);
+            assert(memcmp(a.data, b.data, a.width*a.height*sizeof(u32)) == 0);
+        }
     }
+
+    debug_printf("Font warmup (%s), ascii at %i sizes: one glyph at a time %i us, batched %i us\n",
+                 FONT_BACKEND_NAME, size_count, (s32) times[0], (s32) times[1]);
+    stack_leave_frame();
 }
+#endif
 
 void glyphs_for_codepoint(Font *font, DecodedCodepoint decoded, Glyph glyphs[8], s32 *glyph_count, bool *glyphs_are_escape_sequence)
 {
     char escape_prefix = 0;
     if (decoded.valid) {
+        // NB Only ask for the glyph itself when we are going to draw it, see 'Glyph::placeholder_drawn'
         Glyph glyph;
-        if (_get_glyph(font, decoded.codepoint, &glyph)) {
+        if (_get_glyph(font, decoded.codepoint, glyphs? &glyph : null)) {
             *glyph_count = 1;
             if (glyphs) glyphs[0] = glyph;
         } else {
@@ -500,7 +1836,7 @@ void glyphs_for_codepoint(Font *font, DecodedCodepoint decoded, Glyph glyphs[8],
 // NB (Morten, 2020-05-30) Needs to be in sync with the above function. Having this split out is better for the optimizer though.
 s32 glyph_count_for_codepoint(Font *font, DecodedCodepoint decoded)
 {
-    if (decoded.codepoint <= 128 && font->ascii_glyph_map[decoded.codepoint >> 5] & (1u << (decoded.codepoint&31))) {
+    if (decoded.codepoint <= 128 && font->current->ascii_glyph_map[decoded.codepoint >> 5] & (1u << (decoded.codepoint&31))) {
         return(1);
     } else {
         s32 count = 0;
@@ -515,7 +1851,7 @@ s32 draw_text_ellipsis(DrawTargetSlice *slice, Font *font, str text, s32 x0, s32
     s32 count = 0;
     if (max_glyphs > 3) {
         stack_enter_frame();
-        Glyph *glyphs = stack_alloc(Glyph, max_glyphs + 8);
+        Glyph *glyphs = stack_alloc_uninitialized(Glyph, max_glyphs + 8);
 
         while (count < max_glyphs && text.length > 0) {
             DecodedCodepoint decoded = decode_utf8((u8 *) text.data, text.length);
@@ -583,9 +1919,11 @@ void draw_glyph(DrawTargetSlice *slice, Font *font, Glyph glyph, s32 x, s32 y, u
         if (y0 < 0) {
             data += (-y0) * data_stride;
             y0 = 0;
+            ++slice->target->glyphs_clipped;
         }
         if (y1 > slice_height) {
             y1 = slice_height;
+            ++slice->target->glyphs_clipped;
         }
 
         //debug_assert(0 <= x0 && x1 <= (slice->area.x1 - slice->area.x0));
@@ -599,6 +1937,8 @@ void draw_glyph(DrawTargetSlice *slice, Font *font, Glyph glyph, s32 x, s32 y, u
         command.color = color;
         command.glyph_data = data;
         _draw_target_add_command(slice->target, command);
+    } else {
+        ++slice->target->glyphs_clipped;
     }
 }
 
@@ -635,4 +1975,220 @@ void draw_blend(DrawTargetSlice *slice, s32 x0, s32 y0, s32 x1, s32 y1, u32 colo
     command.kind = DrawCommand::MULTIPLY;
     command.color = color;
     _draw_target_add_command(slice->target, command);
-}
\ No newline at end of file
+}
+
+
+void text_strip_cache_next_frame(TextStripCache *cache)
+{
+    ++cache->frame;
+}
+
+void text_strip_cache_free(TextStripCache *cache)
+{
+    for (TextStrip *strip = cache->lru_first; strip;) {
+        TextStrip *next = strip->lru_next;
+        heap_free(strip);
+        strip = next;
+    }
+    cache->strips.free();
+    *cache = {};
+}
+
+void _text_strip_lru_unlink(TextStripCache *cache, TextStrip *strip)
+{
+    if (strip->lru_previous) strip->lru_previous->lru_next = strip->lru_next;
+    else                     cache->lru_first = strip->lru_next;
+    if (strip->lru_next) strip->lru_next->lru_previous = strip->lru_previous;
+    else                 cache->lru_last = strip->lru_previous;
+}
+
+void _text_strip_lru_push(TextStripCache *cache, TextStrip *strip)
+{
+    strip->lru_previous = null;
+    strip->lru_next = cache->lru_first;
+    if (cache->lru_first) cache->lru_first->lru_previous = strip;
+    else                  cache->lru_last = strip;
+    cache->lru_first = strip;
+}
+
+void _text_strip_evict(TextStripCache *cache)
+{
+    while (cache->size > cache->budget && cache->lru_last) {
+        TextStrip *strip = cache->lru_last;
+        if (strip->last_used_frame == cache->frame) break;
+
+        cache->strips.remove(strip->key);
+        _text_strip_lru_unlink(cache, strip);
+        cache->size -= strip->size;
+        --cache->strips_live;
+        heap_free(strip);
+    }
+}
+
+// Returns false if the part of 'strip' inside 'slice' can't be described by a single command, in which case nothing is drawn
+bool _text_strip_add_command(DrawTargetSlice *slice, TextStrip *strip, s32 x, s32 y)
+{
+    if (strip->width == 0) return(true);
+
+    s32 x0 = slice->area.x0 + x + strip->offset_x;
+    s32 y0 = slice->area.y0 + y + strip->offset_y;
+    s32 x1 = x0 + strip->width;
+    s32 y1 = y0 + strip->height;
+    s32 column = 0;
+    s32 row = 0;
+    if (x0 < slice->area.x0) {
+        column = slice->area.x0 - x0;
+        x0 = slice->area.x0;
+    }
+    if (y0 < slice->area.y0) {
+        row = slice->area.y0 - y0;
+        y0 = slice->area.y0;
+    }
+    x1 = min(x1, slice->area.x1);
+    y1 = min(y1, slice->area.y1);
+    if (x0 >= x1 || y0 >= y1) return(true);
+    if (column > U16_MAX) return(false);
+
+    DrawCommand command = {};
+    command.x0 = x0;
+    command.x1 = x1;
+    command.y0 = y0;
+    command.y1 = y1;
+    command.kind = DrawCommand::TEXT_STRIP;
+    command.strip_row = (u16) row;
+    command.strip_column = (u16) column;
+    command.color = strip->id;
+    command.strip = strip;
+    _draw_target_add_command(slice->target, command);
+    return(true);
+}
+
+// Draws a line previously passed to 'text_strip_end' with the same key, if it still is in the cache and can be drawn at this
+// position. When this returns false the caller draws the glyphs instead.
+bool draw_text_strip(DrawTargetSlice *slice, TextStripCache *cache, u64 key, s32 x, s32 y)
+{
+    TextStrip *strip;
+    if (cache->strips.get(key, &strip)) {
+        strip->last_used_frame = cache->frame;
+        _text_strip_lru_unlink(cache, strip);
+        _text_strip_lru_push(cache, strip);
+        if (_text_strip_add_command(slice, strip, x, y)) {
+            ++cache->hits;
+            return(true);
+        }
+    }
+    ++cache->misses;
+    return(false);
+}
+
+s32 text_strip_begin(DrawTargetSlice *slice)
+{
+    slice->target->glyphs_clipped = 0;
+    return(slice->target->commands_length);
+}
+
+// Turns the glyphs drawn since 'text_strip_begin' into a strip, and replaces them with a single command drawing that strip.
+// We give up if anything but glyphs was drawn, if glyphs were clipped by the slice or if glyphs overlap, since we then can't
+// make a strip which looks exactly the same wherever it is drawn.
+void text_strip_end(DrawTargetSlice *slice, TextStripCache *cache, s32 first_command, u64 key, s32 x, s32 y)
+{
+    DrawTarget *target = slice->target;
+    DrawCommand *commands = target->commands + first_command;
+    s32 commands_length = target->commands_length - first_command;
+
+    if (target->glyphs_clipped > 0) return;
+    if (cache->strips.find(key)) return; // 'draw_text_strip' had it, but couldn't draw it here
+
+    Rect bounds = {};
+    bounds.x0 = bounds.y0 = S32_MAX;
+    bounds.x1 = bounds.y1 = S32_MIN;
+    for (s32 i = 0; i < commands_length; ++i) {
+        DrawCommand *command = &commands[i];
+        if (command->kind != DrawCommand::GLYPH) return;
+        bounds.x0 = min(bounds.x0, command->x0);
+        bounds.y0 = min(bounds.y0, command->y0);
+        bounds.x1 = max(bounds.x1, command->x1);
+        bounds.y1 = max(bounds.y1, command->y1);
+    }
+    if (commands_length == 0) bounds = {};
+
+    s32 width = bounds.x1 - bounds.x0;
+    s32 height = bounds.y1 - bounds.y0;
+    if (height > U16_MAX) return;
+
+    stack_enter_frame();
+    u32 *coverage = stack_alloc(u32, width*height);
+    u32 *column_colors = stack_alloc_uninitialized(u32, width);
+    bool *column_used = stack_alloc(bool, width);
+    TextStrip::Segment *segments = stack_alloc_uninitialized(TextStrip::Segment, width);
+    s32 segments_length = 0;
+
+    bool ok = true;
+    for (s32 i = 0; i < commands_length && ok; ++i) {
+        DrawCommand *command = &commands[i];
+        s32 command_width = command->x1 - command->x0;
+        for (s32 row = 0; row < command->y1 - command->y0 && ok; ++row) {
+            u32 *src = command->glyph_data + row*command_width;
+            u32 *dst = coverage + (command->y0 - bounds.y0 + row)*width + (command->x0 - bounds.x0);
+            for (s32 column = 0; column < command_width; ++column) {
+                if (src[column] == 0) continue;
+
+                // A zero pixel doesn't change what is below it, so where only one glyph isn't zero, blending all glyphs gives
+                // the same as blending that glyph alone
+                s32 strip_column = command->x0 - bounds.x0 + column;
+                if (dst[column] != 0 || (column_used[strip_column] && column_colors[strip_column] != command->color)) {
+                    ok = false;
+                    break;
+                }
+                dst[column] = src[column];
+                column_used[strip_column] = true;
+                column_colors[strip_column] = command->color;
+            }
+        }
+    }
+
+    // Neighbouring columns with the same color become one segment, even if there are unused columns between them
+    for (s32 column = 0; column < width && ok; ++column) {
+        if (!column_used[column]) continue;
+        if (segments_length > 0 && segments[segments_length - 1].color == column_colors[column]) {
+            segments[segments_length - 1].x1 = column + 1;
+        } else {
+            segments[segments_length++] = { column, column + 1, column_colors[column] };
+        }
+    }
+
+    if (ok) {
+        // Everything goes in one allocation, so the strip stays where it is until it is evicted
+        s64 size = sizeof(TextStrip) + segments_length*sizeof(TextStrip::Segment) + width*height*sizeof(u32);
+        TextStrip *strip = (TextStrip *) heap_alloc(size);
+        *strip = {};
+        strip->key = key;
+        strip->id = ++cache->next_id;
+        strip->offset_x = bounds.x0 - slice->area.x0 - x;
+        strip->offset_y = bounds.y0 - slice->area.y0 - y;
+        strip->width = width;
+        strip->height = height;
+        strip->segments = (TextStrip::Segment *) (strip + 1);
+        strip->segments_length = segments_length;
+        strip->coverage = (u32 *) (strip->segments + segments_length);
+        strip->size = size;
+        strip->last_used_frame = cache->frame;
+        memcpy(strip->segments, segments, segments_length*sizeof(TextStrip::Segment));
+        memcpy(strip->coverage, coverage, width*height*sizeof(u32));
+
+        if (cache->budget == 0) cache->budget = TextStripCache::DEFAULT_BUDGET;
+        cache->strips.insert(key, strip);
+        _text_strip_lru_push(cache, strip);
+        cache->size += size;
+        ++cache->strips_live;
+
+        // If the strip can't replace the glyphs they are still in 'commands', so we just keep them
+        s32 glyphs_end = target->commands_length;
+        target->commands_length = first_command;
+        if (!_text_strip_add_command(slice, strip, x, y)) target->commands_length = glyphs_end;
+
+        _text_strip_evict(cache);
+    }
+
+    stack_leave_frame();
+}
@@ -31,24 +31,38 @@ struct Highlight
     s32 end;
 };
 
-struct HighlightList
+// Buffers store highlights as runs relative to the start of their physical line. Each run starts where the previous one
+// ended, with 'HighlightKind::None' runs filling the gaps between highlights. This takes 3 bytes per run rather than 12 per
+// 'Highlight', and means we don't have to offset highlights after edits.
+#pragma pack(push, 1)
+struct HighlightRun
 {
-    Highlight highlight;
-    HighlightList *next;
+    u16 length;
+    u8 kind;
+};
+#pragma pack(pop)
+static_assert(sizeof(HighlightRun) == 3);
+
+// Highlight functions emit runs straight into the gap of 'out' through this, see 'highlight_emit'
+struct HighlightEmitter
+{
+    GapArray<HighlightRun> *out;
+    s32 position; // End of the last run, relative to the start of the line
+    s32 run_count;
 };
 
 struct NamedHighlightFunction
 {
     char *name;
-    HighlightList *(*function)(str line, HighlightState *state);
+    void (*function)(str line, HighlightState *state, HighlightEmitter *out);
     str extensions[4];
 };
 
-HighlightList *highlight_c(str line, HighlightState *state);
-HighlightList *highlight_asm(str line, HighlightState *state);
-HighlightList *highlight_python(str line, HighlightState *state);
-HighlightList *highlight_odin(str line, HighlightState *state);
-HighlightList *highlight_bat(str line, HighlightState *state);
+void highlight_c(str line, HighlightState *state, HighlightEmitter *out);
+void highlight_asm(str line, HighlightState *state, HighlightEmitter *out);
+void highlight_python(str line, HighlightState *state, HighlightEmitter *out);
+void highlight_odin(str line, HighlightState *state, HighlightEmitter *out);
+void highlight_bat(str line, HighlightState *state, HighlightEmitter *out);
 
 NamedHighlightFunction HIGHLIGHT_FUNCTIONS[] = {
     { "None", null, {} },
@@ -73,6 +87,33 @@ s32 highlight_get_function_index(str ext) {
     return(0);
 }
 
+HighlightEmitter highlight_emitter(GapArray<HighlightRun> *out)
+{
+    HighlightEmitter emitter = {};
+    emitter.out = out;
+    return(emitter);
+}
+
+// Highlights must be emitted in order, and must not overlap. The gap since the last highlight is filled with a
+// 'HighlightKind::None' run.
+void highlight_emit(HighlightEmitter *emitter, HighlightKind kind, s32 start, s32 end)
+{
+    start = max(start, emitter->position);
+    if (end <= start) return;
+
+    for (s32 pass = 0; pass < 2; ++pass) {
+        HighlightKind run_kind = pass == 0? HighlightKind::None : kind;
+        s32 length = pass == 0? start - emitter->position : end - start;
+        while (length > 0) {
+            HighlightRun *run = emitter->out->insert_range(emitter->out->a, 1);
+            run->length = (u16) min(length, U16_MAX);
+            run->kind = (u8) run_kind;
+            length -= run->length;
+            ++emitter->run_count;
+        }
+    }
+    emitter->position = end;
+}
 
 struct EatResult
 {
@@ -150,6 +191,43 @@ EatResult eat_number_c(str input)
     return(result);
 }
 
+// The highlight functions below are built from the pieces in this section: A character class table, a keyword lookup and
+// some helpers which skip over runs of uninteresting characters 16 bytes at a time.
+
+enum
+{
+    CHAR_IDENTIFIER_START = 1 << 0, // a-z, A-Z and _
+    CHAR_IDENTIFIER       = 1 << 1, // a-z, A-Z, _ and 0-9
+    CHAR_DIGIT            = 1 << 2,
+    CHAR_SPACE            = 1 << 3, // ' ' and '\t'
+    CHAR_NEWLINE          = 1 << 4,
+};
+
+#define CC_L (CHAR_IDENTIFIER_START | CHAR_IDENTIFIER)
+#define CC_D (CHAR_DIGIT | CHAR_IDENTIFIER)
+#define CC_S CHAR_SPACE
+#define CC_N CHAR_NEWLINE
+static const u8 CHAR_CLASSES[256] = {
+    0,    0,    0,    0,    0,    0,    0,    0,    0,    CC_S, CC_N, 0,    0,    CC_N, 0,    0,
+    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+    CC_S, 0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+    CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, 0,    0,    0,    0,    0,    0,
+    0,    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L,
+    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, 0,    0,    0,    0,    CC_L,
+    0,    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L,
+    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, 0,    0,    0,    0,    0,
+    // Everything from 0x80 is zero. We don't handle unicode identifiers yet.
+};
+#undef CC_L
+#undef CC_D
+#undef CC_S
+#undef CC_N
+
+inline bool char_is(char c, u8 classes)
+{
+    return((CHAR_CLASSES[(u8) c] & classes) != 0);
+}
+
 bool is_identifier_start_c(s32 c)
 {
     return(c == '_' || is_ascii_letter(c));
@@ -160,73 +238,176 @@ bool is_identifier_character_c(s32 c)
     return(c == '_' || is_ascii_letter(c) || is_digit(c));
 }
 
-HighlightList *highlight_c(str line, HighlightState *state)
+// Returns the index of the first character at or after 'i' which is not an identifier character
+s32 lexer_skip_identifier(str line, s32 i)
 {
-    static const
-    struct { char *name; bool other_kind; }
-    KEYWORDS[] = {
-        { "break", 0 },
-        { "case", 0 },
-        { "class", 0 },
-        { "const", 0 },
-        { "continue", 0 },
-        { "default", 0 },
-        { "delete", 0 },
-        { "do", 0 },
-        { "else", 0 },
-        { "enum", 0 },
-        { "extern", 0 },
-        { "false", 1 },
-        { "for", 0 },
-        { "goto", 0 },
-        { "if", 0 },
-        { "inline", 0 },
-        { "namespace", 0 },
-        { "new", 0 },
-        { "null", 1 },
-        { "nullptr", 1 },
-        { "register", 0 },
-        { "restrict", 0 },
-        { "return", 0 },
-        { "static", 0 },
-        { "struct", 0 },
-        { "switch", 0 },
-        { "template", 0 },
-        { "this", 0 },
-        { "true", 1 },
-        { "typedef", 0 },
-        { "union", 0 },
-        { "volatile", 0 },
-        { "while", 0 },
-        { "NULL", 1 },
-    };
-    enum { KEYWORD_FIRST_MIN = 'b', KEYWORD_FIRST_MAX = 'w' };
-    static s32 ORDERED_KEYWORD_OFFSETS[KEYWORD_FIRST_MAX - KEYWORD_FIRST_MIN + 2] = {0};
-    static bool ORDERED_KEYWORDS_INITIALIZED = false;
-    if (!ORDERED_KEYWORDS_INITIALIZED) {
-        ORDERED_KEYWORDS_INITIALIZED = true;
-        s32 i = 0;
-        char c = KEYWORD_FIRST_MIN;
-        while (i < array_length(KEYWORDS) && KEYWORDS[i].name[0] != c) ++i;
-        while (c <= KEYWORD_FIRST_MAX) {
-            ORDERED_KEYWORD_OFFSETS[c - KEYWORD_FIRST_MIN] = i;
-            while (i < array_length(KEYWORDS) && KEYWORDS[i].name[0] == c) ++i;
-            ++c;
+    __m128i a = _mm_set1_epi8('a');
+    __m128i zero = _mm_set1_epi8('0');
+    __m128i letter_range = _mm_set1_epi8('z' - 'a');
+    __m128i digit_range = _mm_set1_epi8('9' - '0');
+    __m128i underscore = _mm_set1_epi8('_');
+    __m128i case_bit = _mm_set1_epi8(0x20);
+
+    for (; i + 16 <= line.length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (line.data + i));
+
+        // NB Unsigned 'x - low <= high - low' is a range check. Setting the case bit maps A-Z to a-z, and nothing else into a-z.
+        __m128i letter = _mm_sub_epi8(_mm_or_si128(bytes, case_bit), a);
+        letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, letter_range), letter);
+        __m128i digit = _mm_sub_epi8(bytes, zero);
+        digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, digit_range), digit);
+        __m128i identifier = _mm_or_si128(_mm_or_si128(letter, digit), _mm_cmpeq_epi8(bytes, underscore));
+
+        if (_mm_movemask_epi8(identifier) != 0xffff) break;
+    }
+
+    while (i < line.length && char_is(line[i], CHAR_IDENTIFIER)) ++i;
+    return(i);
+}
+
+// Returns the index of the first character at or after 'i' which is not a space or tab
+s32 lexer_skip_spaces(str line, s32 i)
+{
+    __m128i space = _mm_set1_epi8(' ');
+    __m128i tab = _mm_set1_epi8('\t');
+
+    for (; i + 16 <= line.length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (line.data + i));
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab));
+        if (_mm_movemask_epi8(match) != 0xffff) break;
+    }
+
+    while (i < line.length && char_is(line[i], CHAR_SPACE)) ++i;
+    return(i);
+}
+
+// Returns the index of the first occurrence of 'a', 'b' or 'c' at or after 'i', or 'line.length' if there is none
+s32 lexer_find(str line, s32 i, char a, char b, char c)
+{
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    __m128i vc = _mm_set1_epi8(c);
+
+    for (; i + 16 <= line.length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *) (line.data + i));
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, va), _mm_cmpeq_epi8(bytes, vb)), _mm_cmpeq_epi8(bytes, vc));
+        if (_mm_movemask_epi8(match)) break;
+    }
+
+    while (i < line.length && line[i] != a && line[i] != b && line[i] != c) ++i;
+    return(i);
+}
+
+struct KeywordDefinition
+{
+    char *name;
+    bool other_kind; // 'HighlightKind::OtherLiteral' rather than 'HighlightKind::Keyword'
+};
+
+// A perfect hash of a set of keywords. Identifiers are hashed by their length and first and last two characters, so a lookup
+// only touches the whole identifier for the final compare. Built on first use by trying multipliers until no two keywords end
+// up in the same slot, see 'keyword_table_get'.
+struct KeywordTable
+{
+    enum { SLOT_BITS = 8, SLOT_COUNT = 1 << SLOT_BITS };
+
+    const KeywordDefinition *keywords;
+    s32 keyword_count;
+    u64 multiplier;
+    s32 min_length, max_length;
+    struct { u8 index, length; } slots[SLOT_COUNT]; // 'index' is into 'keywords' plus one, or zero if the slot is empty
+};
+
+static
+u32 _keyword_slot(KeywordTable *table, char *name, s32 length)
+{
+    u64 key = (u64) length | ((u64) (u8) name[0] << 8) | ((u64) (u8) name[min(1, length - 1)] << 16) |
+              ((u64) (u8) name[max(length - 2, 0)] << 24) | ((u64) (u8) name[length - 1] << 32);
+    return((u32) ((key*table->multiplier) >> (64 - KeywordTable::SLOT_BITS)));
+}
+
+void keyword_table_init(KeywordTable *table, const KeywordDefinition *keywords, s32 keyword_count)
+{
+    assert(keyword_count < KeywordTable::SLOT_COUNT);
+
+    table->keywords = keywords;
+    table->keyword_count = keyword_count;
+    table->min_length = S32_MAX;
+    table->max_length = 0;
+    for (s32 i = 0; i < keyword_count; ++i) {
+        s32 length = (s32) cstring_length(keywords[i].name);
+        table->min_length = min(table->min_length, length);
+        table->max_length = max(table->max_length, length);
+    }
+
+    u64 multiplier = 0x9e3779b97f4a7c15;
+    for (s32 attempt = 0; attempt < 100000; ++attempt) {
+        table->multiplier = multiplier;
+        memset(table->slots, 0, sizeof(table->slots));
+
+        bool collided = false;
+        for (s32 i = 0; i < keyword_count && !collided; ++i) {
+            s32 length = (s32) cstring_length(keywords[i].name);
+            u32 slot = _keyword_slot(table, keywords[i].name, length);
+            if (table->slots[slot].index) {
+                collided = true;
+            } else {
+                table->slots[slot].index = (u8) (i + 1);
+                table->slots[slot].length = (u8) length;
+            }
+        }
+        if (!collided) return;
+
+        multiplier = multiplier*6364136223846793005 + 1442695040888963407;
+        multiplier |= 1;
+    }
+
+    fail("Couldn't find a perfect hash for %i keywords", keyword_count);
+}
+
+// Builds '*table' the first time it is called. The declaration indexer highlights on its own thread, so we build the table
+// on the side and only publish it once it is done. If two threads get here at once, one of them throws its table away.
+KeywordTable *keyword_table_get(KeywordTable *volatile *table, const KeywordDefinition *keywords, s32 keyword_count)
+{
+    KeywordTable *result = *table;
+    if (!result) {
+        KeywordTable *built = (KeywordTable *) heap_alloc(sizeof(KeywordTable));
+        keyword_table_init(built, keywords, keyword_count);
+        result = (KeywordTable *) _InterlockedCompareExchangePointer((void *volatile *) table, built, null);
+        if (result) {
+            heap_free(built);
+        } else {
+            result = built;
         }
-        ORDERED_KEYWORD_OFFSETS[array_length(ORDERED_KEYWORD_OFFSETS) - 1] = i;
     }
+    return(result);
+}
 
+// Returns 'HighlightKind::Identifier' if 'name' isn't a keyword
+HighlightKind keyword_table_lookup(KeywordTable *table, char *name, s32 length)
+{
+    if (length < table->min_length || length > table->max_length) return(HighlightKind::Identifier);
 
-    HighlightList *result = null;
-    HighlightList *last = null;
-    #define list_add() (last = ((last? last->next : result) = stack_alloc(HighlightList, 1)), &last->highlight) // c is nice :)
+    u32 slot = _keyword_slot(table, name, length);
+    if (table->slots[slot].index && table->slots[slot].length == length) {
+        const KeywordDefinition *keyword = &table->keywords[table->slots[slot].index - 1];
+        if (memcmp(keyword->name, name, length) == 0) {
+            return(keyword->other_kind? HighlightKind::OtherLiteral : HighlightKind::Keyword);
+        }
+    }
+    return(HighlightKind::Identifier);
+}
 
+// Highlights C and languages with C-like comments, strings and identifiers
+static
+void _highlight_c_like(str line, HighlightState *state, HighlightEmitter *out, KeywordTable *keywords, bool preprocessor)
+{
     s32 i = 0;
     bool at_start_of_line = true;
     bool block_comment_started_on_this_line = false;
 
     while (i < line.length) {
-        if (is_newline(line[i])) {
+        if (char_is(line[i], CHAR_NEWLINE)) {
             i = line.length;
         } else if (*state == HighlightState::BlockComment) {
             s32 i0 = i;
@@ -234,43 +415,43 @@ HighlightList *highlight_c(str line, HighlightState *state)
             if (block_comment_started_on_this_line) i += 2;
             block_comment_started_on_this_line = false;
 
-            while (i < line.length && !is_newline(line[i]) && !(i + 1 < line.length && line[i] == '*' && line[i + 1] == '/')) ++i;
+            while (true) {
+                i = lexer_find(line, i, '*', '\r', '\n');
+                if (i < line.length && line[i] == '*' && !(i + 1 < line.length && line[i + 1] == '/')) {
+                    ++i;
+                } else {
+                    break;
+                }
+            }
 
             if (i + 1 < line.length && line[i] == '*') {
                 i += 2;
                 *state = HighlightState::Default;
             }
 
-            if (i != i0) {
-                Highlight *entry = list_add();
-                entry->kind = HighlightKind::Comment;
-                entry->start = i0;
-                entry->end = i;
-            }
+            if (i != i0) highlight_emit(out, HighlightKind::Comment, i0, i);
         } else {
             char a = (i + 0 < line.length)? line[i + 0] : 0;
             char b = (i + 1 < line.length)? line[i + 1] : 0;
             char c = (i + 2 < line.length)? line[i + 2] : 0;
+            u8 a_class = CHAR_CLASSES[(u8) a];
+
+            if (a_class & CHAR_SPACE) {
+                i = lexer_skip_spaces(line, i);
 
-            if (a == '/' && b == '*') {
+            } else if (a == '/' && b == '*') {
                 *state = HighlightState::BlockComment;
                 block_comment_started_on_this_line = true;
 
             } else if (a == '/' && b == '/') {
-                Highlight *entry = list_add();
-                entry->start = i;
-                entry->kind = HighlightKind::Comment;
-                i += 2;
-                while (i < line.length && !(line[i] == '\r' || line[i] == '\n')) ++i;
-                entry->end = i;
+                s32 start = i;
+                i = lexer_find(line, i + 2, '\r', '\n', '\n');
+                highlight_emit(out, HighlightKind::Comment, start, i);
 
-            } else if (at_start_of_line && a == '#') {
-                Highlight *entry = list_add();
-                entry->start = i;
-                entry->kind = HighlightKind::Preprocessor;
-                ++i;
-                while (i < line.length && is_identifier_character_c(line[i])) ++i;
-                entry->end = i;
+            } else if (preprocessor && at_start_of_line && a == '#') {
+                s32 start = i;
+                i = lexer_skip_identifier(line, i + 1);
+                highlight_emit(out, HighlightKind::Preprocessor, start, i);
 
             } else if (a == '\'' || a == '"' ||
                        ((a == 'u' || a == 'U' || a == 'L') && (b == '\'' || b == '"')) ||
@@ -291,79 +472,94 @@ HighlightList *highlight_c(str line, HighlightState *state)
 
                 while (i < line.length && line[i] != quote) ++i;
                 ++i;
-                while (i < line.length && end == -1) {
-                    if (line[i] == quote) end = i + 1;
-                    if (i + 1 < line.length && line[i] == '\\') ++i;
-                    ++i;
+                while (i < line.length) {
+                    i = lexer_find(line, i, quote, '\\', '\\');
+                    if (i >= line.length) break;
+                    if (line[i] == quote) {
+                        end = i + 1;
+                        break;
+                    }
+                    i += (i + 1 < line.length)? 2 : 1;
                 }
 
                 if (end == -1) {
                     i = start + 1;
                 } else {
-                    Highlight *entry = list_add();
-                    entry->kind = kind;
-                    entry->start = start;
-                    entry->end = end;
+                    i = end;
+                    highlight_emit(out, kind, start, end);
                 }
 
             // TODO Raw strings
 
-            } else if (is_identifier_start_c(a)) {
+            } else if (a_class & CHAR_IDENTIFIER_START) {
                 // TODO Unicode characters in identifiers
+                s32 start = i;
+                i = lexer_skip_identifier(line, i + 1);
+                highlight_emit(out, keyword_table_lookup(keywords, line.data + start, i - start), start, i);
 
-                Highlight *entry = list_add();
-                entry->start = i;
-                i += 1;
-                while (i < line.length && is_identifier_character_c(line[i])) i++;
-                entry->end = i;
-                entry->kind = HighlightKind::Identifier;
-
-                str identifier = slice(line, entry->start, entry->end);
-
-                s32 index_min, index_max;
-                char first = identifier[0];
-                if (first >= KEYWORD_FIRST_MIN && first <= KEYWORD_FIRST_MAX) {
-                    index_min = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN];
-                    index_max = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN + 1];
-                } else {
-                    index_min = ORDERED_KEYWORD_OFFSETS[array_length(ORDERED_KEYWORD_OFFSETS) - 1];
-                    index_max = array_length(KEYWORDS);
-                }
-                for (s32 i = index_min; i < index_max; ++i) {
-                    char *keyword = KEYWORDS[i].name;
-                    if (keyword == identifier) {
-                        entry->kind = KEYWORDS[i].other_kind? HighlightKind::OtherLiteral : HighlightKind::Keyword;
-                        break;
-                    }
-                }
-            } else if (is_digit(a) || (a == '.' && is_digit(b))) {
+            } else if ((a_class & CHAR_DIGIT) || (a == '.' && is_digit(b))) {
                 EatResult number = eat_number_c(slice(line, i));
-                if (number.valid) {
-                    Highlight *entry = list_add();
-                    entry->start = i;
-                    entry->end = i + number.length;
-                    entry->kind = HighlightKind::NumberLiteral;
-                }
+                if (number.valid) highlight_emit(out, HighlightKind::NumberLiteral, i, i + (s32) number.length);
                 i += max(number.length, 1);
 
             } else {
                 ++i;
             }
 
-            if (a != ' ' && a != '\t') at_start_of_line = false;
+            if (!(a_class & CHAR_SPACE)) at_start_of_line = false;
         }
     }
+}
 
-    #undef list_add
+void highlight_c(str line, HighlightState *state, HighlightEmitter *out)
+{
+    static const
+    KeywordDefinition KEYWORDS[] = {
+        { "break", 0 },
+        { "case", 0 },
+        { "class", 0 },
+        { "const", 0 },
+        { "continue", 0 },
+        { "default", 0 },
+        { "delete", 0 },
+        { "do", 0 },
+        { "else", 0 },
+        { "enum", 0 },
+        { "extern", 0 },
+        { "false", 1 },
+        { "for", 0 },
+        { "goto", 0 },
+        { "if", 0 },
+        { "inline", 0 },
+        { "namespace", 0 },
+        { "new", 0 },
+        { "null", 1 },
+        { "nullptr", 1 },
+        { "register", 0 },
+        { "restrict", 0 },
+        { "return", 0 },
+        { "static", 0 },
+        { "struct", 0 },
+        { "switch", 0 },
+        { "template", 0 },
+        { "this", 0 },
+        { "true", 1 },
+        { "typedef", 0 },
+        { "union", 0 },
+        { "volatile", 0 },
+        { "while", 0 },
+        { "NULL", 1 },
+    };
+    static KeywordTable *volatile TABLE;
+    KeywordTable *table = keyword_table_get(&TABLE, KEYWORDS, array_length(KEYWORDS));
 
-    return(result);
+    _highlight_c_like(line, state, out, table, true);
 }
 
-HighlightList *highlight_odin(str line, HighlightState *state)
+void highlight_odin(str line, HighlightState *state, HighlightEmitter *out)
 {
     static const
-    struct { char *name; bool other_kind; }
-    KEYWORDS[] = {
+    KeywordDefinition KEYWORDS[] = {
         //{ "align_of", 0 },
         { "auto_cast", 0 },
         { "bit_field", 0 },
@@ -405,225 +601,79 @@ HighlightList *highlight_odin(str line, HighlightState *state)
         { "using", 0 },
         { "when", 0 },
     };
-    enum { KEYWORD_FIRST_MIN = 'a', KEYWORD_FIRST_MAX = 'w' };
-    static s32 ORDERED_KEYWORD_OFFSETS[KEYWORD_FIRST_MAX - KEYWORD_FIRST_MIN + 2] = {0};
-    static bool ORDERED_KEYWORDS_INITIALIZED = false;
-    if (!ORDERED_KEYWORDS_INITIALIZED) {
-        ORDERED_KEYWORDS_INITIALIZED = true;
-        s32 i = 0;
-        char c = KEYWORD_FIRST_MIN;
-        while (i < array_length(KEYWORDS) && KEYWORDS[i].name[0] != c) ++i;
-        while (c <= KEYWORD_FIRST_MAX) {
-            ORDERED_KEYWORD_OFFSETS[c - KEYWORD_FIRST_MIN] = i;
-            while (i < array_length(KEYWORDS) && KEYWORDS[i].name[0] == c) ++i;
-            ++c;
-        }
-        ORDERED_KEYWORD_OFFSETS[array_length(ORDERED_KEYWORD_OFFSETS) - 1] = i;
-    }
-
-
-    HighlightList *result = null;
-    HighlightList *last = null;
-    #define list_add() (last = ((last? last->next : result) = stack_alloc(HighlightList, 1)), &last->highlight) // c is nice :)
-
-    s32 i = 0;
-    bool at_start_of_line = true;
-    bool block_comment_started_on_this_line = false;
-
-    while (i < line.length) {
-        if (is_newline(line[i])) {
-            i = line.length;
-        } else if (*state == HighlightState::BlockComment) {
-            s32 i0 = i;
-
-            if (block_comment_started_on_this_line) i += 2;
-            block_comment_started_on_this_line = false;
-
-            while (i < line.length && !is_newline(line[i]) && !(i + 1 < line.length && line[i] == '*' && line[i + 1] == '/')) ++i;
-
-            if (i + 1 < line.length && line[i] == '*') {
-                i += 2;
-                *state = HighlightState::Default;
-            }
-
-            if (i != i0) {
-                Highlight *entry = list_add();
-                entry->kind = HighlightKind::Comment;
-                entry->start = i0;
-                entry->end = i;
-            }
-        } else {
-            char a = (i + 0 < line.length)? line[i + 0] : 0;
-            char b = (i + 1 < line.length)? line[i + 1] : 0;
-            char c = (i + 2 < line.length)? line[i + 2] : 0;
-
-            if (a == '/' && b == '*') {
-                *state = HighlightState::BlockComment;
-                block_comment_started_on_this_line = true;
-
-            } else if (a == '/' && b == '/') {
-                Highlight *entry = list_add();
-                entry->start = i;
-                entry->kind = HighlightKind::Comment;
-                i += 2;
-                while (i < line.length && !(line[i] == '\r' || line[i] == '\n')) ++i;
-                entry->end = i;
-
-            } else if (a == '\'' || a == '"' ||
-                       ((a == 'u' || a == 'U' || a == 'L') && (b == '\'' || b == '"')) ||
-                       (a == 'u' && b == '8' && (c == '\'' || c == '"')))
-            {
-                s32 start = i;
-                s32 end = -1;
-
-                HighlightKind kind;
-                char quote;
-                if (a == '"' || (a != '\'' && b == '"') || (a != '\'' && b != '\'' && c == '"')) {
-                    quote = '"';
-                    kind = HighlightKind::StringLiteral;
-                } else {
-                    quote = '\'';
-                    kind = HighlightKind::CharacterLiteral;
-                }
-
-                while (i < line.length && line[i] != quote) ++i;
-                ++i;
-                while (i < line.length && end == -1) {
-                    if (line[i] == quote) end = i + 1;
-                    if (i + 1 < line.length && line[i] == '\\') ++i;
-                    ++i;
-                }
-
-                if (end == -1) {
-                    i = start + 1;
-                } else {
-                    Highlight *entry = list_add();
-                    entry->kind = kind;
-                    entry->start = start;
-                    entry->end = end;
-                }
-
-            } else if (is_identifier_start_c(a)) {
-                // TODO Unicode characters in identifiers
-
-                Highlight *entry = list_add();
-                entry->start = i;
-                i += 1;
-                while (i < line.length && is_identifier_character_c(line[i])) i++;
-                entry->end = i;
-                entry->kind = HighlightKind::Identifier;
-
-                str identifier = slice(line, entry->start, entry->end);
-
-                s32 index_min, index_max;
-                char first = identifier[0];
-                if (first >= KEYWORD_FIRST_MIN && first <= KEYWORD_FIRST_MAX) {
-                    index_min = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN];
-                    index_max = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN + 1];
-                } else {
-                    index_min = ORDERED_KEYWORD_OFFSETS[array_length(ORDERED_KEYWORD_OFFSETS) - 1];
-                    index_max = array_length(KEYWORDS);
-                }
-                for (s32 i = index_min; i < index_max; ++i) {
-                    char *keyword = KEYWORDS[i].name;
-                    if (keyword == identifier) {
-                        entry->kind = KEYWORDS[i].other_kind? HighlightKind::OtherLiteral : HighlightKind::Keyword;
-                        break;
-                    }
-                }
-            } else if (is_digit(a) || (a == '.' && is_digit(b))) {
-                EatResult number = eat_number_c(slice(line, i));
-                if (number.valid) {
-                    Highlight *entry = list_add();
-                    entry->start = i;
-                    entry->end = i + number.length;
-                    entry->kind = HighlightKind::NumberLiteral;
-                }
-                i += max(number.length, 1);
-
-            } else {
-                ++i;
-            }
-
-            if (a != ' ' && a != '\t') at_start_of_line = false;
-        }
-    }
-
-    #undef list_add
+    static KeywordTable *volatile TABLE;
+    KeywordTable *table = keyword_table_get(&TABLE, KEYWORDS, array_length(KEYWORDS));
 
-    return(result);
+    _highlight_c_like(line, state, out, table, false);
 }
 
-HighlightList *highlight_bat(str line, HighlightState *state)
+void highlight_bat(str line, HighlightState *state, HighlightEmitter *out)
 {
-    HighlightList *result = null;
-    HighlightList *last = null;
-    #define list_add() (last = ((last? last->next : result) = stack_alloc(HighlightList, 1)), &last->highlight) // c is nice :)
-
     s32 i = 0;
     bool at_start_of_line = true;
     while (i < line.length) {
-        if (is_newline(line[i])) break;
+        if (char_is(line[i], CHAR_NEWLINE)) break;
 
         char c = line[i];
 
         if (at_start_of_line && line.length - i >= 4 && (c == 'R' || c == 'r') && (memcmp(line.data + i, "rem ", 4) == 0 || memcmp(line.data + i, "REM ", 4) == 0)) {
-            Highlight *entry = list_add();
-            entry->start = i;
-            entry->kind = HighlightKind::Comment;
-            i += 2;
-            while (i < line.length && !(line[i] == '\r' || line[i] == '\n')) ++i;
-            entry->end = i;
+            s32 start = i;
+            i = lexer_find(line, i + 2, '\r', '\n', '\n');
+            highlight_emit(out, HighlightKind::Comment, start, i);
 
         } else if (c == '"' || c == '\'') {
             s32 start = i;
             s32 end = -1;
             char quote = c;
 
-            while (i < line.length && line[i] != quote) ++i;
             ++i;
-            while (i < line.length && end == -1) {
-                if (line[i] == quote) end = i + 1;
-                if (i + 1 < line.length && line[i] == '\\') ++i;
-                ++i;
+            while (i < line.length) {
+                i = lexer_find(line, i, quote, '\\', '\\');
+                if (i >= line.length) break;
+                if (line[i] == quote) {
+                    end = i + 1;
+                    break;
+                }
+                i += (i + 1 < line.length)? 2 : 1;
             }
 
             if (end == -1) {
                 i = start + 1;
             } else {
-                Highlight *entry = list_add();
-                entry->kind = HighlightKind::StringLiteral;
-                entry->start = start;
-                entry->end = end;
+                i = end;
+                highlight_emit(out, HighlightKind::StringLiteral, start, end);
             }
 
         } else if (is_ascii_letter(c) || c == '%') {
-            while (i < line.length && (is_ascii_letter(line[i]) || is_digit(line[i]) || line[i] == '_' || line[i] == '%')) ++i;
+            while (true) {
+                i = lexer_skip_identifier(line, i);
+                if (i < line.length && line[i] == '%') {
+                    ++i;
+                } else {
+                    break;
+                }
+            }
 
-        } else if (is_digit(c)) {
-            Highlight *entry = list_add();
-            entry->start = i;
-            while (i < line.length && is_digit(line[i])) ++i;
-            entry->end = i;
-            entry->kind = HighlightKind::NumberLiteral;
+        } else if (char_is(c, CHAR_DIGIT)) {
+            s32 start = i;
+            while (i < line.length && char_is(line[i], CHAR_DIGIT)) ++i;
+            highlight_emit(out, HighlightKind::NumberLiteral, start, i);
+
+        } else if (char_is(c, CHAR_SPACE)) {
+            i = lexer_skip_spaces(line, i);
 
         } else {
             ++i;
         }
 
-        if (!is_whitespace(c)) at_start_of_line = false;
+        if (!char_is(c, CHAR_SPACE)) at_start_of_line = false;
     }
-
-    #undef list_add
-    return(result);
 }
 
-
-HighlightList *highlight_python(str line, HighlightState *state)
+void highlight_python(str line, HighlightState *state, HighlightEmitter *out)
 {
     static const
-    struct { char *name; bool other_kind; }
-    KEYWORDS[] = {
+    KeywordDefinition KEYWORDS[] = {
         { "and", 0 },
         { "as", 0 },
         { "assert", 0 },
@@ -660,36 +710,20 @@ HighlightList *highlight_python(str line, HighlightState *state)
         { "with", 0 },
         { "yield", 0 },
     };
-    enum { KEYWORD_FIRST_MIN = 'a', KEYWORD_FIRST_MAX = 'y' };
-    static s32 ORDERED_KEYWORD_OFFSETS[KEYWORD_FIRST_MAX - KEYWORD_FIRST_MIN + 2] = {0};
-    static bool ORDERED_KEYWORDS_INITIALIZED = false;
-    if (!ORDERED_KEYWORDS_INITIALIZED) {
-        ORDERED_KEYWORDS_INITIALIZED = true;
-        s32 i = 0;
-        char c = KEYWORD_FIRST_MIN;
-        while (i < array_length(KEYWORDS) && KEYWORDS[i].name[0] != c) ++i;
-        while (c <= KEYWORD_FIRST_MAX) {
-            ORDERED_KEYWORD_OFFSETS[c - KEYWORD_FIRST_MIN] = i;
-            while (i < array_length(KEYWORDS) && ascii_lowercase(KEYWORDS[i].name[0]) == c) ++i;
-            ++c;
-        }
-        ORDERED_KEYWORD_OFFSETS[array_length(ORDERED_KEYWORD_OFFSETS) - 1] = i;
-    }
-
-    HighlightList *result = null;
-    HighlightList *last = null;
-    #define list_add() (last = ((last? last->next : result) = stack_alloc(HighlightList, 1)), &last->highlight) // c is nice :)
+    static KeywordTable *volatile TABLE;
+    KeywordTable *table = keyword_table_get(&TABLE, KEYWORDS, array_length(KEYWORDS));
 
     for (s32 i = 0; i < line.length; ) {
         char a = line[i];
-        if (is_newline(a)) {
+        u8 a_class = CHAR_CLASSES[(u8) a];
+        if (a_class & CHAR_NEWLINE) {
             i = line.length;
+        } else if (a_class & CHAR_SPACE) {
+            i = lexer_skip_spaces(line, i);
         } else if (a == '#') {
-            Highlight *entry = list_add();
-            entry->kind = HighlightKind::Comment;
-            entry->start = i;
-            entry->end = line.length;
-            while (entry->end > entry->start && is_newline(line[entry->end - 1])) --entry->end;
+            s32 end = line.length;
+            while (end > i && is_newline(line[end - 1])) --end;
+            highlight_emit(out, HighlightKind::Comment, i, end);
             i = line.length;
 
         // NB (Morten, 2020-07-08) There are string prefixes in python, but we ignore those for now
@@ -698,84 +732,74 @@ HighlightList *highlight_python(str line, HighlightState *state)
 
             s32 start = i;
             ++i;
-            while (i < line.length && line[i] != a) {
-                if (line[i] == '\\') ++i;
-                ++i;
+            while (i < line.length) {
+                i = lexer_find(line, i, a, '\\', '\\');
+                if (i >= line.length || line[i] == a) break;
+                i += 2;
             }
 
             if (i < line.length) {
                 ++i;
-                Highlight *entry = list_add();
-                entry->kind = HighlightKind::StringLiteral;
-                entry->start = start;
-                entry->end = i;
+                highlight_emit(out, HighlightKind::StringLiteral, start, i);
             }
-        } else if ((a >= 'a' && a <= 'z') || (a >= 'A' && a <= 'Z') || a == '_') {
-            Highlight *entry = list_add();
-            entry->start = i;
-            ++i;
-            while (i < line.length && ((line[i] >= 'a' && line[i] <= 'z') || (line[i] >= 'A' && line[i] <= 'Z') || (line[i] >= '0' && line[i] <= '9') || line[i] == '_')) ++i;
-            entry->end = i;
-            entry->kind = HighlightKind::Identifier;
-
-            str identifier = slice(line, entry->start, entry->end);
+        } else if (a_class & CHAR_IDENTIFIER_START) {
+            s32 start = i;
+            i = lexer_skip_identifier(line, i + 1);
+            highlight_emit(out, keyword_table_lookup(table, line.data + start, i - start), start, i);
 
-            s32 index_min = 0, index_max = 0;
-            char first = ascii_lowercase(identifier[0]);
-            if (first >= KEYWORD_FIRST_MIN && first <= KEYWORD_FIRST_MAX) {
-                index_min = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN];
-                index_max = ORDERED_KEYWORD_OFFSETS[first - KEYWORD_FIRST_MIN + 1];
-            }
-            for (s32 i = index_min; i < index_max; ++i) {
-                char *keyword = KEYWORDS[i].name;
-                if (keyword == identifier) {
-                    entry->kind = KEYWORDS[i].other_kind? HighlightKind::OtherLiteral : HighlightKind::Keyword;
-                    break;
-                }
-            }
-        } else if (is_digit(a) || (a == '.' && i + 1 < line.length && is_digit(line[i + 1]))) {
+        } else if ((a_class & CHAR_DIGIT) || (a == '.' && i + 1 < line.length && is_digit(line[i + 1]))) {
             // TODO (Morten, 2020-07-08) This is wrong for sure, but its not that wrong, so hey ho
 
             EatResult number = eat_number_c(slice(line, i));
-            if (number.valid) {
-                Highlight *entry = list_add();
-                entry->start = i;
-                entry->end = i + number.length;
-                entry->kind = HighlightKind::NumberLiteral;
-            }
+            if (number.valid) highlight_emit(out, HighlightKind::NumberLiteral, i, i + (s32) number.length);
             i += max(number.length, 1);
 
         } else {
             ++i;
         }
     }
-
-    #undef list_add
-    return(result);
 }
 
-HighlightList *highlight_asm(str line, HighlightState *state)
+void highlight_asm(str line, HighlightState *state, HighlightEmitter *out)
 {
-    HighlightList *result = null;
-    HighlightList *last = null;
-    #define list_add() (last = ((last? last->next : result) = stack_alloc(HighlightList, 1)), &last->highlight) // c is nice :)
+    s32 i = lexer_find(line, 0, ';', '\r', '\n');
+    if (i < line.length && line[i] == ';') {
+        s32 end = line.length;
+        while (end > i && is_newline(line[end - 1])) --end;
+        highlight_emit(out, HighlightKind::Comment, i, end);
+    }
+}
 
-    for (s32 i = 0; i < line.length; ) {
-        char a = line[i];
-        if (is_newline(a)) {
-            i = line.length;
-        } else if (a == ';') {
-            Highlight *entry = list_add();
-            entry->kind = HighlightKind::Comment;
-            entry->start = i;
-            entry->end = line.length;
-            while (entry->end > entry->start && is_newline(line[entry->end - 1])) --entry->end;
-            i = line.length;
-        } else {
-            ++i;
+#if defined(DEBUG)
+// Poor mans benchmark, run from '_buffer_load_benchmark'. Runs every highlight function over 'text', regardless of which
+// language it actually is in.
+void highlight_benchmark(str text)
+{
+    GapArray<HighlightRun> runs = {};
+
+    for (s32 f = 0; f < array_length(HIGHLIGHT_FUNCTIONS); ++f) {
+        if (!HIGHLIGHT_FUNCTIONS[f].function) continue;
+
+        Time start = time_read();
+        HighlightState state = HighlightState::Default;
+        s64 run_count = 0;
+        for (s64 i = 0; i < text.length; ) {
+            s64 line_end = i;
+            while (line_end < text.length && text[line_end] != '\n') ++line_end;
+            str line = { text.data + i, line_end - i };
+            i = line_end + 1;
+
+            runs.clear();
+            HighlightEmitter emitter = highlight_emitter(&runs);
+            (HIGHLIGHT_FUNCTIONS[f].function)(line, &state, &emitter);
+            run_count += emitter.run_count;
         }
+        s64 time = max(time_convert(start, time_read(), MICROSECONDS), (s64) 1);
+
+        s64 megabytes_per_second = text.length / time;
+        debug_printf("Highlighting as %s: %i runs, %i MB/s\n", HIGHLIGHT_FUNCTIONS[f].name, (s32) run_count, (s32) megabytes_per_second);
     }
 
-    #undef list_add
-    return(result);
-}
\ No newline at end of file
+    runs.free();
+}
+#endif
@@ -12,6 +12,17 @@ Path arena_copy(Arena *arena, Path source);
 
 bool path_compare(Path left, Path right);
 
+// Volume serial number and file index, which together say which file a path refers to
+struct PathIdentity
+{
+    u32 volume;
+    u32 index_low;
+    u32 index_high;
+};
+bool operator==(PathIdentity left, PathIdentity right);
+u64 hash_map_hash(PathIdentity identity);
+bool path_identity(Path path, PathIdentity *identity);
+
 Path path_make_absolute(Path subpath, Path relative_to);
 bool path_is_directory(Path maybe_directory);
 bool path_is_normal_file(Path maybe_file);
@@ -52,23 +63,44 @@ IoError create_directory(Path path);
 IoError read_entire_file(Path path, str *data);
 IoError write_entire_file(Path path, str data);
 
-struct DirItem
+// When a file was last written and how large it is, which is a cheap way of telling whether it changed
+struct FileStamp
 {
-    str display_string;
-    Path full_path;
-    DirItem *next;
+    u64 write_time;
+    u64 size;
 };
+bool operator==(FileStamp left, FileStamp right);
+bool file_stamp(Path path, FileStamp *stamp);
 
+// All files below 'directory', as paths relative to it. A worker thread walks the directory once and then watches it for
+// changes, and the main thread picks up what the worker found in 'file_index_collect'. Strings in 'paths' stay valid until
+// the next call to 'file_index_collect' or 'file_index_stop'.
+struct FileIndexChange
+{
+    enum Kind : u8 { ADD, REMOVE, RESET };
+    Kind kind;
+    str path; // On the heap. Removing a path we don't have removes everything below it, since it might have been a directory
+};
 
-enum { DirItemList_MAX = 2*1024 };
-
-struct DirItemList
+struct FileIndex
 {
-    DirItem *first;
-    s32 count;
+    Path directory;
+    Array<str> paths;
+    HashMap<str, s32> lookup; // Index into 'paths'
+    u64 generation; // Changes whenever 'paths' changes
+
+    // Shared with the worker thread
+    volatile long lock;
+    Array<FileIndexChange> changes;
+    volatile bool walk_done;
+    volatile bool stop;
+    void *stop_event;
+    void *thread;
 };
 
-DirItemList path_list_directory(Path directory);
+void file_index_start(FileIndex *index, Path directory);
+void file_index_stop(FileIndex *index);
+bool file_index_collect(FileIndex *index);
 
 
 
@@ -112,7 +144,7 @@ Path str_to_path(wchar_t *string)
 struct _Path
 {
     s16 length;
-    u32 identifier[3];
+    PathIdentity identifier;
     wchar_t data[0]; // Guaranteed to be null-terminated
 };
 
@@ -185,6 +217,35 @@ wchar_t *_path_to_extended_format(Path path)
     return(result);
 }
 
+bool operator==(PathIdentity left, PathIdentity right)
+{
+    return(left.volume == right.volume && left.index_low == right.index_low && left.index_high == right.index_high);
+}
+
+u64 hash_map_hash(PathIdentity identity)
+{
+    return(hash_mix_64(((u64) identity.index_high << 32 | identity.index_low) ^ ((u64) identity.volume * 0x9e3779b97f4a7c15ull)));
+}
+
+// Identities by path string, so looking up the same path again doesn't have to open the file. Entries for files which
+// existed are checked against the file's timestamps on every lookup, so a file which was deleted, recreated or replaced by
+// a rename gets its identity loaded again. Paths of missing files are checked again after a while, since the file might
+// have been made since. Once there are 'MAX_ENTRIES' we start over. Only used from the main thread.
+struct PathIdentityCache
+{
+    struct Entry
+    {
+        PathIdentity identity; // All zero if the file didn't exist
+        u64 creation_time, write_time;
+        Time checked;
+    };
+    enum { RECHECK_MISSING_MILLISECONDS = 1000, MAX_ENTRIES = 4096 };
+
+    HashMap<wstr, Entry> entries;
+    Arena keys;
+};
+global_variable PathIdentityCache path_identity_cache;
+
 bool _path_load_identifier(Path path)
 {
     // Note (Morten, 2020-03-12)
@@ -194,40 +255,88 @@ bool _path_load_identifier(Path path)
     // I am not sure whether or not we might get issues with files being renamed, etc. This might be something we want to catch at a different level anyways though.
     // One issue this presents is that it won't detect when two new-and-not-yet-saved files are equal...
     
-    bool has_identifier = path->identifier[0] || path->identifier[1] || path->identifier[2];
+    PathIdentity none = {};
+    bool has_identifier = !(path->identifier == none);
     if (!has_identifier) {
-        stack_enter_frame();
-        wchar_t *open_path  = _path_to_extended_format(path);
-        void *handle = win32::CreateFileW(open_path, 0, win32::FILE_SHARE_READ | win32::FILE_SHARE_WRITE | win32::FILE_SHARE_DELETE, null, win32::OPEN_EXISTING, win32::FILE_ATTRIBUTE_NORMAL, null);
-        stack_leave_frame();
+        wstr key = { path->data, path->length };
+        PathIdentityCache::Entry *entry = path_identity_cache.entries.find(key);
+        bool fresh = false;
+        if (entry && entry->identity == none) {
+            fresh = time_convert(entry->checked, time_read(), MILLISECONDS) < PathIdentityCache::RECHECK_MISSING_MILLISECONDS;
+        } else if (entry) {
+            // NB This is much cheaper than opening the file, which is what we would have to do otherwise
+            stack_enter_frame();
+            win32::file_attribute_data data;
+            s32 result = win32::GetFileAttributesExW(_path_to_extended_format(path), 0, &data);
+            stack_leave_frame();
+
+            fresh = result &&
+                    entry->creation_time == (((u64) data.CreationTime.High << 32) | (u64) data.CreationTime.Low) &&
+                    entry->write_time == (((u64) data.LastWriteTime.High << 32) | (u64) data.LastWriteTime.Low);
+        }
 
-        if (handle == ((void *) -1) || handle == 0) {
-            has_identifier = false; // Can't have an identifier if the file doesn't exist
+        if (fresh) {
+            path->identifier = entry->identity;
         } else {
-            win32::by_handle_file_information info;
-            s32 result = win32::GetFileInformationByHandle(handle, &info);
-            if (!result) {
-                has_identifier = false; // Maybe we actually need to look into the situation here...
+            stack_enter_frame();
+            wchar_t *open_path  = _path_to_extended_format(path);
+            void *handle = win32::CreateFileW(open_path, 0, win32::FILE_SHARE_READ | win32::FILE_SHARE_WRITE | win32::FILE_SHARE_DELETE, null, win32::OPEN_EXISTING, win32::FILE_ATTRIBUTE_NORMAL, null);
+            stack_leave_frame();
+
+            u64 creation_time = 0, write_time = 0;
+
+            if (handle == ((void *) -1) || handle == 0) {
+                // Can't have an identifier if the file doesn't exist
             } else {
-                path->identifier[0] = info.VolumeSerialNumber;
-                path->identifier[1] = info.FileIndexLow;
-                path->identifier[2] = info.FileIndexHigh;
-                has_identifier = true;
+                win32::by_handle_file_information info;
+                s32 result = win32::GetFileInformationByHandle(handle, &info);
+                if (!result) {
+                    // Maybe we actually need to look into the situation here...
+                } else {
+                    path->identifier.volume = info.VolumeSerialNumber;
+                    path->identifier.index_low = info.FileIndexLow;
+                    path->identifier.index_high = info.FileIndexHigh;
+                    creation_time = ((u64) info.CreationTime.High << 32) | (u64) info.CreationTime.Low;
+                    write_time = ((u64) info.LastWriteTime.High << 32) | (u64) info.LastWriteTime.Low;
+                }
+                win32::CloseHandle(handle);
+            }
+
+            if (!entry) {
+                if (path_identity_cache.entries.count >= PathIdentityCache::MAX_ENTRIES) {
+                    path_identity_cache.entries.clear();
+                    arena_reset(&path_identity_cache.keys);
+                }
+
+                wstr arena_key = arena_copy(&path_identity_cache.keys, key);
+                path_identity_cache.entries.insert(arena_key, {});
+                entry = path_identity_cache.entries.find(arena_key);
             }
-            win32::CloseHandle(handle);
+            entry->identity = path->identifier;
+            entry->creation_time = creation_time;
+            entry->write_time = write_time;
+            entry->checked = time_read();
         }
+        has_identifier = !(path->identifier == none);
     }
     
     return(has_identifier);
 }
 
+bool path_identity(Path path, PathIdentity *identity)
+{
+    bool ok = path && _path_load_identifier(path);
+    if (ok) *identity = path->identifier;
+    return(ok);
+}
+
 bool path_compare(Path left, Path right)
 {
     if (!left || !right) return(!left && !right);
     if (left->length == right->length && memcmp(left->data, right->data, left->length*sizeof(wchar_t)) == 0) return(true);
     bool left_ok = _path_load_identifier(left);
     bool right_ok = _path_load_identifier(right);
-    return(left_ok && right_ok && (memcmp(left->identifier, right->identifier, sizeof(left->identifier)) == 0));
+    return(left_ok && right_ok && left->identifier == right->identifier);
 }
 
 Path _path_empty(s16 size)
@@ -340,7 +449,7 @@ IoError read_entire_file(Path path, str *result)
         } else {
             result->length = size;
             s64 allocation_size = round_up(size + 1, 16);
-            result->data = (char *) stack_alloc_aligned(allocation_size, 16);
+            result->data = (char *) stack_alloc_aligned(allocation_size, 16, false);
 
             for (s64 i = size; i < allocation_size; ++i) result->data[i] = 0;
 
@@ -393,6 +502,40 @@ IoError write_entire_file(Path path, str data)
     return(result);
 }
 
+bool operator==(FileStamp left, FileStamp right)
+{
+    return(left.write_time == right.write_time && left.size == right.size);
+}
+
+bool file_stamp(Path path, FileStamp *stamp)
+{
+    stack_enter_frame();
+    win32::file_attribute_data data;
+    s32 result = win32::GetFileAttributesExW(_path_to_extended_format(path), 0, &data);
+    stack_leave_frame();
+
+    if (result) {
+        stamp->write_time = ((u64) data.LastWriteTime.High << 32) | (u64) data.LastWriteTime.Low;
+        stamp->size = ((u64) data.FileSizeHigh << 32) | (u64) data.FileSizeLow;
+    }
+    return(result != 0);
+}
+
+static
+str _path_string_get_extension(str path)
+{
+    str extension = {};
+    for (s64 i = path.length; i > 0; i -= 1) {
+        if (path.data[i - 1] == '.') {
+            extension = { &path.data[i], path.length - i };
+            break;
+        } else if (path.data[i - 1] == '/' || path.data[i - 1] == '\\') {
+            break;
+        }
+    }
+    return(extension);
+}
+
 IoError create_directory(Path path)
 {
     IoError result = IoError::OK;
@@ -593,120 +736,281 @@ Path path_make_absolute(Path subpath, Path relative_to)
     return(_path_make_absolute(subpath->data, relative_to->data));
 }
 
-DirItemList path_list_directory(Path directory)
+bool path_is_directory(Path maybe_directory)
 {
-    DirItemList result = {};
-    DirItem *list_tail = 0;
+    return(win32::PathIsDirectoryW(maybe_directory->data));
+}
 
-    struct DirectoryFifo
-    {
-        wstr subdirectory;
-        DirectoryFifo *next;
-    };
+bool path_is_normal_file(Path maybe_file)
+{
+    u32 attributes = win32::GetFileAttributesW(maybe_file->data);
+    return(attributes == win32::FILE_ATTRIBUTE_NORMAL);
+}
+
+void _file_index_lock(FileIndex *index)
+{
+    while (_InterlockedCompareExchange(&index->lock, 1, 0) != 0) _mm_pause();
+}
+
+void _file_index_unlock(FileIndex *index)
+{
+    _InterlockedExchange(&index->lock, 0);
+}
 
-    DirectoryFifo *fifo_head = stack_alloc(DirectoryFifo, 1);
-    fifo_head->subdirectory = {};
-    fifo_head->next = 0;
-    DirectoryFifo *fifo_tail = fifo_head;
+void _file_index_push(FileIndex *index, Array<FileIndexChange> *changes)
+{
+    if (changes->length == 0) return;
+    _file_index_lock(index);
+    for (s64 i = 0; i < changes->length; ++i) index->changes.append((*changes)[i]);
+    _file_index_unlock(index);
+    changes->length = 0;
+}
 
-    while (fifo_head && result.count < DirItemList_MAX) {
-        wstr subdirectory = fifo_head->subdirectory;
-        fifo_head = fifo_head->next;
-        if (!fifo_head) {
-            fifo_tail = 0;
+// I don't want the mess in .git to show up in the file browser
+bool _file_index_ignored(wstr relative_path)
+{
+    s64 component_start = 0;
+    for (s64 i = 0; i <= relative_path.length; ++i) {
+        if (i == relative_path.length || relative_path.data[i] == '\\') {
+            wstr component = { relative_path.data + component_start, i - component_start };
+            if (component == L".git") return(true);
+            component_start = i + 1;
         }
+    }
+    return(false);
+}
 
-        wchar_t *search_path = stack_alloc(wchar_t, directory->length+1 + subdirectory.length+1 + 2);
-        s32 search_path_length = 0;
+// Returns 'left\right', or just 'right' if 'left' is empty, on the stack and zero terminated
+wstr _file_index_join(wstr left, wstr right)
+{
+    wstr result = {};
+    result.data = stack_alloc_uninitialized(wchar_t, left.length + 1 + right.length + 1);
+    memcpy(result.data, left.data, left.length*sizeof(wchar_t));
+    result.length = left.length;
+    if (left.length > 0 && left.data[left.length - 1] != '\\') result.data[result.length++] = '\\';
+    memcpy(result.data + result.length, right.data, right.length*sizeof(wchar_t));
+    result.length += right.length;
+    result.data[result.length] = 0;
+    return(result);
+}
 
-        memcpy(search_path + search_path_length, directory->data, directory->length*sizeof(wchar_t));
-        search_path_length += directory->length;
-        if (search_path[search_path_length - 1] != '\\') search_path[search_path_length++] = '\\';
+// Breadth first, so files near the top get to the main thread first. Changes are pushed once per directory.
+void _file_index_walk(FileIndex *index, wstr root, Array<FileIndexChange> *changes)
+{
+    wstr directory = { index->directory->data, index->directory->length };
+    Array<wstr> queue = {};
+    queue.append({ (wchar_t *) heap_alloc((root.length + 1)*sizeof(wchar_t)), root.length });
+    memcpy(queue[0].data, root.data, root.length*sizeof(wchar_t));
 
-        memcpy(search_path + search_path_length, subdirectory.data, subdirectory.length*sizeof(wchar_t));
-        search_path_length += subdirectory.length;
-        if (search_path[search_path_length - 1] != '\\') search_path[search_path_length++] = '\\';
+    for (s64 q = 0; q < queue.length; ++q) {
+        wstr subdirectory = queue[q];
+        if (index->stop) continue;
 
-        search_path[search_path_length++] = '*';
-        search_path[search_path_length] = 0;
+        stack_enter_frame();
+        wstr search_path = _file_index_join(_file_index_join(directory, subdirectory), { L"*", 1 });
 
         win32::find_data_w find_data;
-        void *handle = win32::FindFirstFileW(search_path, &find_data);
+        void *handle = win32::FindFirstFileW(search_path.data, &find_data);
         bool done = handle == ((void *) -1);
-        while (!done && result.count < DirItemList_MAX) {
+        while (!done) {
             wstr file_name = { find_data.FileName, cstring_length(find_data.FileName, alen(find_data.FileName)) };
-
-            if (file_name == L"." || file_name == L"..") {
-                // Skip these entries.
-
-            } else if (file_name == L".git") {
-                // I don't want the mess in .git to show up in the file browser.
-                // TODO maybe we should have some more inteligent logic here?
-
-            } else {
-                wstr file_relative_path;
-                file_relative_path.data = stack_alloc(wchar_t, subdirectory.length + 1 + file_name.length + 1);
-                file_relative_path.length = 0;
-
-                if (subdirectory.length > 0) {
-                    memcpy(file_relative_path.data + file_relative_path.length, subdirectory.data, subdirectory.length * sizeof(wchar_t));
-                    file_relative_path.length += subdirectory.length;
-                    if (file_relative_path.data[file_relative_path.length - 1] != '\\') {
-                        file_relative_path.data[file_relative_path.length++] = '\\';
-                    }
+            if (file_name != L"." && file_name != L".." && file_name != L".git") {
+                wstr relative_path = _file_index_join(subdirectory, file_name);
+                if (find_data.FileAttributes & win32::FILE_ATTRIBUTE_DIRECTORY) {
+                    wstr copy = { (wchar_t *) heap_alloc((relative_path.length + 1)*sizeof(wchar_t)), relative_path.length };
+                    memcpy(copy.data, relative_path.data, (relative_path.length + 1)*sizeof(wchar_t));
+                    queue.append(copy);
+                } else {
+                    changes->append({ FileIndexChange::ADD, heap_copy(utf16_to_utf8(relative_path)) });
                 }
+            }
+            done = win32::FindNextFileW(handle, &find_data) == 0;
+        }
+        if (handle != ((void *) -1)) win32::FindClose(handle);
+        stack_leave_frame();
 
-                memcpy(file_relative_path.data + file_relative_path.length, file_name.data, file_name.length * sizeof(wchar_t));
-                file_relative_path.length += file_name.length;
+        _file_index_push(index, changes);
+    }
 
-                file_relative_path.data[file_relative_path.length] = 0;
+    for (s64 q = 0; q < queue.length; ++q) heap_free(queue[q].data);
+    queue.free();
+}
 
-                // Directories.
-                if (find_data.FileAttributes & win32::FILE_ATTRIBUTE_DIRECTORY) {
-                    DirectoryFifo *fifo_entry = stack_alloc(DirectoryFifo, 1);
-                    fifo_entry->subdirectory = file_relative_path;
-                    if (fifo_tail) {
-                        fifo_tail->next = fifo_entry;
-                    } else {
-                        fifo_head = fifo_entry;
-                    }
-                    fifo_tail = fifo_entry;
-
-                // Normal files.
+void _file_index_handle_notifications(FileIndex *index, u8 *buffer, Array<FileIndexChange> *changes)
+{
+    wstr directory = { index->directory->data, index->directory->length };
+    while (true) {
+        win32::file_notify_information *info = (win32::file_notify_information *) buffer;
+        wstr relative_path = { info->FileName, (s64) (info->FileNameLength / sizeof(wchar_t)) };
+
+        if (!_file_index_ignored(relative_path)) {
+            stack_enter_frame();
+            if (info->Action == win32::FILE_ACTION_ADDED || info->Action == win32::FILE_ACTION_RENAMED_NEW_NAME) {
+                // NB A new or renamed directory is reported once, not once for each file in it
+                wstr full_path = _file_index_join(directory, relative_path);
+                u32 attributes = win32::GetFileAttributesW(full_path.data);
+                if (attributes == U32_MAX) {
+                    // Already gone again
+                } else if (attributes & win32::FILE_ATTRIBUTE_DIRECTORY) {
+                    _file_index_walk(index, relative_path, changes);
                 } else {
-                    DirItem *item = stack_alloc(DirItem, 1);
-                    item->display_string = utf16_to_utf8(file_relative_path);
-                    item->full_path = _path_make_absolute(file_relative_path.data, directory->data);
-                    item->next = null;
-
-                    result.count += 1;
-                    if (list_tail) {
-                        list_tail->next = item;
-                    } else {
-                        result.first = item;
-                    }
-                    list_tail = item;
+                    changes->append({ FileIndexChange::ADD, heap_copy(utf16_to_utf8(relative_path)) });
                 }
+            } else if (info->Action == win32::FILE_ACTION_REMOVED || info->Action == win32::FILE_ACTION_RENAMED_OLD_NAME) {
+                changes->append({ FileIndexChange::REMOVE, heap_copy(utf16_to_utf8(relative_path)) });
             }
+            stack_leave_frame();
+        }
 
-            s32 find_result = win32::FindNextFileW(handle, &find_data);
-            done = find_result == 0;
+        if (info->NextEntryOffset == 0) break;
+        buffer += info->NextEntryOffset;
+    }
+}
+
+u32 _file_index_routine(void *parameter)
+{
+    FileIndex *index = (FileIndex *) parameter;
+    Array<FileIndexChange> changes = {};
+
+    // NB We start watching before walking, so files made during the walk aren't missed. Seeing them twice is harmless.
+    enum { NOTIFY_BUFFER_SIZE = 64*1024 };
+    u32 filter = win32::FILE_NOTIFY_CHANGE_FILE_NAME | win32::FILE_NOTIFY_CHANGE_DIR_NAME;
+    u8 *notify_buffer = (u8 *) heap_alloc(NOTIFY_BUFFER_SIZE);
+    win32::overlapped overlapped = {};
+    overlapped.Event = win32::CreateEventW(null, true, false, null);
+    void *directory = win32::CreateFileW(index->directory->data, win32::FILE_LIST_DIRECTORY,
+                                         win32::FILE_SHARE_READ | win32::FILE_SHARE_WRITE | win32::FILE_SHARE_DELETE, null,
+                                         win32::OPEN_EXISTING, win32::FILE_FLAG_BACKUP_SEMANTICS | win32::FILE_FLAG_OVERLAPPED, null);
+    bool watching = overlapped.Event && directory != ((void *) -1) &&
+                    win32::ReadDirectoryChangesW(directory, notify_buffer, NOTIFY_BUFFER_SIZE, true, filter, null, &overlapped, null);
+
+    changes.append({ FileIndexChange::RESET });
+    _file_index_walk(index, {}, &changes);
+    index->walk_done = true;
+
+    while (watching && !index->stop) {
+        void *handles[2] = { overlapped.Event, index->stop_event };
+        u32 wait_result = win32::WaitForMultipleObjects(2, handles, false, U32_MAX);
+        u32 bytes = 0;
+        if (wait_result != win32::WAIT_OBJECT_0 || !win32::GetOverlappedResult(directory, &overlapped, &bytes, false)) break;
+
+        if (bytes == 0) {
+            // Too much changed at once for the buffer, so we have to look at everything again
+            changes.append({ FileIndexChange::RESET });
+            _file_index_walk(index, {}, &changes);
+        } else {
+            _file_index_handle_notifications(index, notify_buffer, &changes);
         }
-        if (handle != ((void *) -1)) {
-            win32::FindClose(handle);
+        _file_index_push(index, &changes);
+
+        win32::ResetEvent(overlapped.Event);
+        watching = win32::ReadDirectoryChangesW(directory, notify_buffer, NOTIFY_BUFFER_SIZE, true, filter, null, &overlapped, null);
+    }
+
+    if (directory != ((void *) -1)) {
+        if (watching) {
+            u32 bytes;
+            win32::CancelIo(directory);
+            win32::GetOverlappedResult(directory, &overlapped, &bytes, true);
         }
+        win32::CloseHandle(directory);
     }
+    if (overlapped.Event) win32::CloseHandle(overlapped.Event);
+    heap_free(notify_buffer);
+    for (s64 i = 0; i < changes.length; ++i) heap_free(changes[i].path.data);
+    changes.free();
+    stack_thread_exit();
+    return(0);
+}
 
-    return result;
+void file_index_start(FileIndex *index, Path directory)
+{
+    file_index_stop(index);
+    index->directory = heap_copy(directory);
+    index->stop_event = win32::CreateEventW(null, true, false, null);
+    index->thread = index->stop_event? win32::CreateThread(null, 0, &_file_index_routine, (void *) index, 0, null) : null;
+    if (!index->thread) {
+        // Better slow than nothing
+        Array<FileIndexChange> changes = {};
+        _file_index_walk(index, {}, &changes);
+        changes.free();
+        index->walk_done = true;
+    }
 }
 
-bool path_is_directory(Path maybe_directory)
+void file_index_stop(FileIndex *index)
 {
-    return(win32::PathIsDirectoryW(maybe_directory->data));
+    if (index->thread) {
+        index->stop = true;
+        win32::SetEvent(index->stop_event);
+        win32::WaitForSingleObject(index->thread, U32_MAX);
+        win32::CloseHandle(index->thread);
+    }
+    if (index->stop_event) win32::CloseHandle(index->stop_event);
+
+    for (s64 i = 0; i < index->changes.length; ++i) heap_free(index->changes[i].path.data);
+    for (s64 i = 0; i < index->paths.length; ++i) heap_free(index->paths[i].data);
+    index->changes.free();
+    index->paths.free();
+    index->lookup.free();
+    heap_free(index->directory);
+
+    u64 generation = index->generation;
+    *index = {};
+    index->generation = generation + 1;
 }
 
-bool path_is_normal_file(Path maybe_file)
+void _file_index_remove(FileIndex *index, s32 i)
 {
-    u32 attributes = win32::GetFileAttributesW(maybe_file->data);
-    return(attributes == win32::FILE_ATTRIBUTE_NORMAL);
+    str path = index->paths[i];
+    str last = index->paths[index->paths.length - 1];
+    index->lookup.remove(path);
+    index->paths[i] = last;
+    --index->paths.length;
+    if (i < index->paths.length) index->lookup.insert(last, i);
+    heap_free(path.data);
+}
+
+// Applies what the worker thread found since the last call. Returns true if 'paths' changed.
+bool file_index_collect(FileIndex *index)
+{
+    _file_index_lock(index);
+    Array<FileIndexChange> changes = index->changes;
+    index->changes = {};
+    _file_index_unlock(index);
+
+    for (s64 c = 0; c < changes.length; ++c) {
+        FileIndexChange change = changes[c];
+        if (change.kind == FileIndexChange::RESET) {
+            for (s64 i = 0; i < index->paths.length; ++i) heap_free(index->paths[i].data);
+            index->paths.length = 0;
+            index->lookup.clear();
+        } else if (change.kind == FileIndexChange::ADD) {
+            if (index->lookup.find(change.path)) {
+                heap_free(change.path.data);
+            } else {
+                index->lookup.insert(change.path, (s32) index->paths.length);
+                index->paths.append(change.path);
+            }
+        } else if (change.kind == FileIndexChange::REMOVE) {
+            s32 *at = index->lookup.find(change.path);
+            if (at) {
+                _file_index_remove(index, *at);
+            } else {
+                for (s32 i = 0; i < index->paths.length;) {
+                    str path = index->paths[i];
+                    bool below = path.length > change.path.length && path.data[change.path.length] == '\\' &&
+                                 memcmp(path.data, change.path.data, change.path.length) == 0;
+                    if (below) _file_index_remove(index, i);
+                    else       ++i;
+                }
+            }
+            heap_free(change.path.data);
+        }
+    }
+
+    bool changed = changes.length > 0;
+    if (changed) ++index->generation;
+    changes.free();
+    return(changed);
 }
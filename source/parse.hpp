@@ -204,4 +204,196 @@ bool is_octal_digit(s32 c)
 bool is_hex_digit(s32 c)
 {
     return((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
-}
\ No newline at end of file
+}
+
+
+// Fuzzy matching
+//
+// A pattern matches a candidate if all its characters appear in the candidate in order, ignoring case. 'fuzzy_score' then
+// picks the best way of lining the two up: matches at the start of path components and words, and runs of consecutive
+// matches, score higher, while gaps between matches score lower. Leading and trailing unmatched characters are free.
+// 'fuzzy_char_mask' is a cheap prefilter, as a candidate can only match if its mask contains all bits of the pattern's mask.
+
+enum {
+    FUZZY_NO_MATCH = S32_MIN,
+    FUZZY_MAX_SCORED_LENGTH = 64, // Longer patterns are only checked for a match, and all matches get the same score
+
+    FUZZY_SCORE_MATCH = 16,
+    FUZZY_GAP_START = 3,
+    FUZZY_GAP_EXTEND = 1,
+    FUZZY_BONUS_CONSECUTIVE = 4,
+    FUZZY_BONUS_PATH = 9,      // After a path separator, or at the start of the candidate
+    FUZZY_BONUS_DELIMITER = 8, // After '_', '.', ' ' and the like
+    FUZZY_BONUS_CAMEL = 7,     // An uppercase letter after a lowercase one, or a digit after a non-digit
+};
+
+struct FuzzyPattern
+{
+    Slice<s32> codepoints; // Lowercase
+    u64 mask;
+};
+
+s32 _fuzzy_lowercase(s32 codepoint)
+{
+    return(codepoint < 0x80? ascii_lowercase(codepoint) : unicode_lowercase(codepoint));
+}
+
+s32 _fuzzy_next_codepoint(str string, s64 *index)
+{
+    u8 byte = (u8) string.data[*index];
+    if (byte < 0x80) {
+        *index += 1;
+        return(byte);
+    }
+    DecodedCodepoint decoded = decode_utf8((u8 *) string.data + *index, string.length - *index);
+    *index += decoded.length;
+    return(decoded.codepoint);
+}
+
+s64 _fuzzy_previous_codepoint_start(str string, s64 index)
+{
+    do --index; while (index > 0 && utf8_is_continuation(string.data[index]));
+    return(index);
+}
+
+u64 _fuzzy_bit(s32 lowercase)
+{
+    if (lowercase >= 'a' && lowercase <= 'z') return(1ull << (lowercase - 'a'));
+    if (lowercase >= '0' && lowercase <= '9') return(1ull << (26 + lowercase - '0'));
+    if (lowercase < 0x80) return(1ull << (36 + lowercase % 27));
+    return(1ull << 63);
+}
+
+u64 fuzzy_char_mask(str string)
+{
+    u64 mask = 0;
+    for (s64 i = 0; i < string.length; ) {
+        u8 byte = string[i];
+        if (byte < 0x80) {
+            mask |= _fuzzy_bit(ascii_lowercase(byte));
+            ++i;
+        } else {
+            mask |= _fuzzy_bit(_fuzzy_lowercase(_fuzzy_next_codepoint(string, &i)));
+        }
+    }
+    return(mask);
+}
+
+// NB Allocates on the stack
+FuzzyPattern fuzzy_pattern(str typed)
+{
+    FuzzyPattern pattern = {};
+    pattern.codepoints.data = stack_alloc_uninitialized(s32, typed.length);
+    for (s64 i = 0; i < typed.length; ) {
+        s32 lowercase = _fuzzy_lowercase(_fuzzy_next_codepoint(typed, &i));
+        pattern.codepoints[pattern.codepoints.length++] = lowercase;
+        pattern.mask |= _fuzzy_bit(lowercase);
+    }
+    return(pattern);
+}
+
+// Everything 'pattern' matches is also matched by 'wider' if 'wider' is a subsequence of 'pattern', so when the typed text
+// grows we only need to look at what matched before.
+bool fuzzy_pattern_narrows(FuzzyPattern *pattern, FuzzyPattern *wider)
+{
+    s64 found = 0;
+    for (s64 i = 0; i < pattern->codepoints.length && found < wider->codepoints.length; ++i) {
+        if (pattern->codepoints[i] == wider->codepoints[found]) ++found;
+    }
+    return(found == wider->codepoints.length);
+}
+
+enum FuzzyClass : u8 { FUZZY_LOWER, FUZZY_UPPER, FUZZY_DIGIT, FUZZY_SEPARATOR, FUZZY_DELIMITER };
+
+FuzzyClass _fuzzy_class(s32 codepoint, s32 lowercase)
+{
+    if (codepoint == '/' || codepoint == '\\') return(FUZZY_SEPARATOR);
+    if (codepoint == ' ' || codepoint == '_' || codepoint == '-' || codepoint == '.' || codepoint == ':' || codepoint == ',' || codepoint == ';') return(FUZZY_DELIMITER);
+    if (is_digit(codepoint)) return(FUZZY_DIGIT);
+    return(codepoint != lowercase? FUZZY_UPPER : FUZZY_LOWER);
+}
+
+s32 _fuzzy_bonus(FuzzyClass previous, FuzzyClass current)
+{
+    if (current == FUZZY_SEPARATOR || current == FUZZY_DELIMITER) return(0);
+    if (previous == FUZZY_SEPARATOR) return(FUZZY_BONUS_PATH);
+    if (previous == FUZZY_DELIMITER) return(FUZZY_BONUS_DELIMITER);
+    if (previous == FUZZY_LOWER && current == FUZZY_UPPER) return(FUZZY_BONUS_CAMEL);
+    if (previous != FUZZY_DIGIT && current == FUZZY_DIGIT) return(FUZZY_BONUS_CAMEL);
+    return(0);
+}
+
+// Returns 'FUZZY_NO_MATCH' if 'pattern' does not match. Safe to call from any thread.
+s32 fuzzy_score(FuzzyPattern *pattern, str candidate)
+{
+    s64 length = pattern->codepoints.length;
+    if (length == 0) return(0);
+
+    // Most candidates which get past the mask fail here, before we do any of the more expensive scoring
+    s32 *codepoints = pattern->codepoints.data;
+    s64 first = -1;
+    s64 found = 0;
+    for (s64 i = 0; i < candidate.length && found < length; ) {
+        s64 at = i;
+        if (_fuzzy_lowercase(_fuzzy_next_codepoint(candidate, &i)) == codepoints[found]) {
+            if (found == 0) first = at;
+            ++found;
+        }
+    }
+    if (found < length) return(FUZZY_NO_MATCH);
+    if (length > FUZZY_MAX_SCORED_LENGTH) return(0);
+
+    // Nothing before the first place the pattern can start, or after the last place it can end, affects the score
+    s64 end = candidate.length;
+    for (s64 i = candidate.length; i > first; ) {
+        s64 at = _fuzzy_previous_codepoint_start(candidate, i);
+        s64 next = at;
+        if (_fuzzy_lowercase(_fuzzy_next_codepoint(candidate, &next)) == codepoints[length - 1]) {
+            end = next;
+            break;
+        }
+        i = at;
+    }
+    FuzzyClass previous_class = FUZZY_SEPARATOR;
+    if (first > 0) {
+        s64 at = _fuzzy_previous_codepoint_start(candidate, first);
+        s32 codepoint = _fuzzy_next_codepoint(candidate, &at);
+        previous_class = _fuzzy_class(codepoint, _fuzzy_lowercase(codepoint));
+    }
+
+    // 'matched[k]' is the best score with pattern character 'k' matched at the current candidate character, and 'gapped[k]'
+    // the best score with it matched somewhere before the current character, including the penalty for the gap.
+    enum { NONE = S32_MIN/2 };
+    s32 matched[FUZZY_MAX_SCORED_LENGTH];
+    s32 gapped[FUZZY_MAX_SCORED_LENGTH];
+    for (s64 k = 0; k < length; ++k) matched[k] = gapped[k] = NONE;
+
+    s32 best = NONE;
+    for (s64 i = first; i < end; ) {
+        s32 codepoint = _fuzzy_next_codepoint(candidate, &i);
+        s32 lowercase = _fuzzy_lowercase(codepoint);
+        FuzzyClass current_class = _fuzzy_class(codepoint, lowercase);
+        s32 bonus = _fuzzy_bonus(previous_class, current_class);
+        previous_class = current_class;
+
+        // Going backwards, so 'matched[k - 1]' and 'gapped[k - 1]' are still the values for the previous character
+        for (s64 k = length - 1; k >= 0; --k) {
+            s32 new_gapped = max(matched[k] - FUZZY_GAP_START, gapped[k] - FUZZY_GAP_EXTEND);
+            s32 new_matched = NONE;
+            if (lowercase == codepoints[k]) {
+                if (k == 0) {
+                    new_matched = FUZZY_SCORE_MATCH + 2*bonus;
+                } else {
+                    s32 before = max(matched[k - 1] + FUZZY_BONUS_CONSECUTIVE, gapped[k - 1]);
+                    if (before > NONE/2) new_matched = before + FUZZY_SCORE_MATCH + bonus;
+                }
+            }
+            matched[k] = new_matched;
+            gapped[k] = max(new_gapped, (s32) NONE);
+        }
+        best = max(best, matched[length - 1]);
+    }
+
+    debug_assert(best > NONE/2);
+    return(best);
+}
@@ -1,151 +1,357 @@
+#pragma once
+
 #include "util.hpp"
+#include "io.hpp"
 #include "graphics.hpp"
 
-void timing_start(char *label);
-void timing_finish_frame();
-void timing_draw(DrawTargetSlice *canvas);
-
-#if 1
-
-void timing_start(char *label)
-{}
-
-void timing_finish_frame()
-{}
+// Profiling
+//
+// Everything between 'timing_begin' and the matching 'timing_end' is a zone, and zones nest the same way stack frames do.
+// Each thread writes the zones it finishes to a ring buffer only it writes to, and then publishes how many it has
+// written, so recording takes no locks. Readers copy a buffer and then drop whatever the thread overwrote in the meantime.
+// The overlay shows the zones of all threads during the last frame, and 'timing_write_trace' writes everything still in
+// the buffers as json for chrome://tracing or ui.perfetto.dev.
+// Zones are only recorded in debug builds, and only cost a branch until recording is switched on with 'timing_toggle'.
+// NB Labels are kept as they are, so they have to be string literals. Threads which record zones and then exit call
+// 'timing_thread_exit', so their buffer can be reused. Like the stack allocators, each thread finds its buffer through a
+// TLS slot, which 'timing_init' sets up before any other thread starts.
 
-void timing_draw(DrawTargetSlice *canvas)
-{}
+void timing_init();
+void timing_begin(char *label);
+void timing_end();
+void timing_thread_exit();
+void timing_start_frame();
+void timing_finish_frame();
+void timing_toggle();
+IoError timing_write_trace(Path path);
+void timing_draw(DrawTargetSlice *canvas, Font *font);
 
-#else
+#if defined(DEBUG)
 
 enum {
-    TIMING_FRAMES = 64,
-    TIMING_ENTRIES_PER_FRAME = 8,
+    TIMING_MAX_THREADS = 64,
+    TIMING_MAX_DEPTH = 32,
+    TIMING_RING_SIZE = 16*1024, // Zones per thread, must be a power of two
 };
 
-struct TimingEntry {
-    Time t;
+struct TimingZone
+{
+    Time start, end;
     char *label;
+    s32 depth;
+    u32 thread_id;
 };
 
-struct TimingFrame
+struct TimingThread
 {
-    TimingEntry entries[TIMING_ENTRIES_PER_FRAME];
-    s32 entries_len;
+    TimingZone zones[TIMING_RING_SIZE];
+    volatile s64 written; // The last 'TIMING_RING_SIZE' of these are in 'zones'
+    volatile long in_use;
+
+    // Only used by the thread owning this
+    s32 depth;
+    u32 thread_id;
+    Time starts[TIMING_MAX_DEPTH];
+    char *labels[TIMING_MAX_DEPTH];
 };
 
-struct Timings
+struct Timing
 {
-    TimingFrame frames[TIMING_FRAMES];
-    s32 current;
+    volatile bool recording;
+    s64 frequency;
+
+    u32 tls_index;
+    TimingThread *volatile threads[TIMING_MAX_THREADS];
+    volatile long thread_count; // Can go past 'TIMING_MAX_THREADS', in which case further threads are not recorded
+    volatile long open_threads; // Threads with at least one zone open
+
+    Time frame_start, last_frame_start, last_frame_end;
 };
+global_variable Timing timing;
+
+void timing_init()
+{
+    timing.tls_index = win32::TlsAlloc();
+    assert(timing.tls_index != win32::TLS_OUT_OF_INDEXES);
+}
+
+TimingThread *_timing_claim_thread()
+{
+    TimingThread *thread = null;
+
+    s32 count = min((s32) timing.thread_count, (s32) TIMING_MAX_THREADS);
+    for (s32 i = 0; i < count && !thread; ++i) {
+        TimingThread *slot = timing.threads[i];
+        if (slot && _InterlockedCompareExchange(&slot->in_use, 1, 0) == 0) thread = slot;
+    }
+
+    if (!thread) {
+        s32 index = (s32) _InterlockedIncrement(&timing.thread_count) - 1;
+        if (index >= TIMING_MAX_THREADS) return(null);
+        thread = (TimingThread *) heap_alloc(sizeof(TimingThread));
+        memset(thread, 0, sizeof(TimingThread));
+        thread->in_use = 1;
+        timing.threads[index] = thread;
+    }
 
-global_variable Timings timings;
+    thread->depth = 0;
+    thread->thread_id = win32::GetCurrentThreadId();
+    return(thread);
+}
+
+// NB Whether a thread records is only decided when it opens an outermost zone. Once it has a zone open, nested zones
+// are recorded even if recording is switched off in the meantime, so every 'timing_end' still matches its own
+// 'timing_begin'. A skipped zone is always outermost, so its 'timing_end' finds the depth at 0 and does nothing.
+void timing_begin(char *label)
+{
+    if (!timing.recording && timing.open_threads == 0) return;
+
+    TimingThread *thread = (TimingThread *) win32::TlsGetValue(timing.tls_index);
+    if (!thread || thread->depth == 0) {
+        if (!timing.recording) return;
+        if (!thread) {
+            thread = _timing_claim_thread();
+            if (!thread) return;
+            win32::TlsSetValue(timing.tls_index, thread);
+        }
+        _InterlockedIncrement(&timing.open_threads);
+    }
+
+    assert(thread->depth < TIMING_MAX_DEPTH);
+    thread->labels[thread->depth] = label;
+    thread->starts[thread->depth++] = time_read();
+}
+
+void timing_end()
+{
+    // NB A thread with a zone open has counted itself in 'open_threads', and sees its own increment, so when recording is
+    // off this only looks the thread up while some thread still has a zone open
+    if (!timing.recording && timing.open_threads == 0) return;
+    TimingThread *thread = (TimingThread *) win32::TlsGetValue(timing.tls_index);
+    if (!thread || thread->depth == 0) return;
+
+    Time end = time_read();
+    s32 depth = --thread->depth;
+    if (depth == 0) _InterlockedDecrement(&timing.open_threads);
+    s64 index = thread->written;
+    TimingZone *zone = &thread->zones[index & (TIMING_RING_SIZE - 1)];
+    *zone = { thread->starts[depth], end, thread->labels[depth], depth, thread->thread_id };
+    // NB Stores are not reordered on x86, so this only has to keep the compiler from publishing the zone before writing it
+    _ReadWriteBarrier();
+    thread->written = index + 1;
+}
 
-void timing_start(char *label)
+void timing_thread_exit()
 {
-    Time now = time_read();
+    if (timing.thread_count == 0) return;
+    TimingThread *thread = (TimingThread *) win32::TlsGetValue(timing.tls_index);
+    if (thread) {
+        assert(thread->depth == 0);
+        win32::TlsSetValue(timing.tls_index, null);
+        _InterlockedExchange(&thread->in_use, 0);
+    }
+}
+
+// Copies the zones 'thread' has not overwritten yet, in the order they finished. NB Allocates on the stack
+Slice<TimingZone> _timing_read(TimingThread *thread)
+{
+    s64 end = thread->written;
+    _ReadWriteBarrier();
+    s64 begin = max(end - TIMING_RING_SIZE, 0ll);
+
+    Slice<TimingZone> zones = { stack_alloc_uninitialized(TimingZone, end - begin), end - begin };
+    for (s64 i = begin; i < end; ++i) zones[i - begin] = thread->zones[i & (TIMING_RING_SIZE - 1)];
+    _ReadWriteBarrier();
+
+    // While we were copying the thread might have overwritten the oldest zones, including the one it is writing right now
+    s64 overwritten = min(thread->written - TIMING_RING_SIZE + 1 - begin, zones.length);
+    if (overwritten > 0) {
+        zones.data += overwritten;
+        zones.length -= overwritten;
+    }
+    return(zones);
+}
+
+s64 _timing_nanoseconds(Time ticks)
+{
+    // Split up, so we don't overflow for long traces
+    return((ticks / timing.frequency)*NANOSECONDS + (ticks % timing.frequency)*NANOSECONDS/timing.frequency);
+}
 
-    TimingFrame *frame = &timings.frames[timings.current];
-    assert(frame->entries_len + 1 <= TIMING_ENTRIES_PER_FRAME);
-    frame->entries[frame->entries_len++] = { now, label };
+void timing_start_frame()
+{
+    if (timing.recording) timing.frame_start = time_read();
+    timing_begin("frame");
 }
 
 void timing_finish_frame()
 {
-    timing_start(null);
-    timings.current = (timings.current + 1) % TIMING_FRAMES;
-    timings.frames[timings.current] = {};
+    timing_end();
+    if (timing.recording && timing.frame_start) {
+        timing.last_frame_start = timing.frame_start;
+        timing.last_frame_end = time_read();
+    }
+    timing.frame_start = 0;
 }
 
-/*
-    hue is an angle in degrees (can be any value, gets normalized to 0..365)
-    saturation and value are in 0..256
-*/
-static u32
-hsv_to_rgb(s32 hue, u8 saturation, u8 value)
+void timing_toggle()
 {
-    hue %= 360;
-    if (hue < 0) hue = 360 + hue;
+    if (!timing.frequency) win32::QueryPerformanceFrequency(&timing.frequency);
+    timing.recording = !timing.recording;
+    timing.last_frame_start = 0;
+    timing.last_frame_end = 0;
+}
 
-    s32 ci = ((s32) saturation) * ((s32) value);
-    s32 xi = ci * (60 - abs(hue%120 - 60));
-    xi = xi / (256*60);
-    s32 mi = (((s32) value)*256 - ci) / 256;
+void _timing_append(Array<char> *json, str string)
+{
+    memcpy(json->push(string.length), string.data, string.length);
+}
 
-    u8 m = (u8) mi;
-    u8 c = (u8) clamp(ci/256 + mi, 0, 256);
-    u8 x = (u8) clamp(xi + mi, 0, 256);
+IoError timing_write_trace(Path path)
+{
+    stack_enter_frame();
+    if (!timing.frequency) win32::QueryPerformanceFrequency(&timing.frequency);
 
-    u8 r, g, b;
+    Slice<TimingZone> zones[TIMING_MAX_THREADS] = {};
+    s32 thread_count = min((s32) timing.thread_count, (s32) TIMING_MAX_THREADS);
+    Time base = S64_MAX;
+    for (s32 i = 0; i < thread_count; ++i) {
+        if (timing.threads[i]) zones[i] = _timing_read(timing.threads[i]);
+        for_each (zone, zones[i]) base = min(base, zone->start);
+    }
 
-    if (hue < 60)       { r = c; g = x; b = m; }
-    else if (hue < 120) { r = x; g = c; b = m; }
-    else if (hue < 180) { r = m; g = c; b = x; }
-    else if (hue < 240) { r = m; g = x; b = c; }
-    else if (hue < 300) { r = x; g = m; b = c; }
-    else                { r = c; g = m; b = x; }
+    // Timestamps in the trace are in microseconds, and start at the oldest zone we still have
+    Array<char> json = {};
+    _timing_append(&json, lit_to_str("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"));
+    bool first = true;
+    for (s32 i = 0; i < thread_count; ++i) {
+        for_each (zone, zones[i]) {
+            stack_enter_frame();
+            s64 start = _timing_nanoseconds(zone->start - base);
+            s64 duration = _timing_nanoseconds(zone->end - zone->start);
+            str event = stack_printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lli.%03lli,\"dur\":%lli.%03lli}",
+                                     first? "" : ",\n", zone->label, zone->thread_id, start/1000, start%1000, duration/1000, duration%1000);
+            _timing_append(&json, event);
+            first = false;
+            stack_leave_frame();
+        }
+    }
+    _timing_append(&json, lit_to_str("\n]}\n"));
 
-    u32 color = (((u32) r) << 16) | (((u32) g) << 8) | ((u32) b);
-    return(color);
+    IoError result = write_entire_file(path, { json.data, json.length });
+    json.free();
+    stack_leave_frame();
+    return(result);
 }
 
-void timing_draw(DrawTargetSlice *canvas)
+s32 _timing_x(Time t, s32 x0, s32 x1)
 {
-    enum {
-        DX = 5,
-        DY_MS = 6,
-        MS_TARGET = 16,
-        MARGIN = 50,
-    };
-    static const
-    uint32_t COLORS[] = { 0xc555a0, 0xeb2428, 0xffe444, 0xa6cB3a, 0x23a9e1 };
+    Time start = timing.last_frame_start;
+    Time length = max(timing.last_frame_end - start, 1ll);
+    t = clamp(t, start, timing.last_frame_end);
+    return(x0 + (s32) ((t - start)*(x1 - x0) / length));
+}
 
-    s32 width = canvas->area.x1 - canvas->area.x0;
-    s32 height = canvas->area.y1 - canvas->area.y0;
+// Draws the zones of all threads during the last frame as a timeline, with one row per thread and nesting level. Above that
+// goes how much of the main thread's stack allocator is in use, and the most it ever used.
+void timing_draw(DrawTargetSlice *canvas, Font *font)
+{
+    if (!timing.recording || timing.last_frame_end == 0) return;
 
-    s32 x1 = width - MARGIN;
-    s32 x0 = x1 - TIMING_FRAMES*DX;
-    s32 y1 = height - MARGIN;
-    s32 y0 = y1 - DY_MS*MS_TARGET;
-
-    struct {
-        u32 hash;
-        char *text;
-    } labels[64];
-    s32 labels_len = 0;
-
-    for (s32 fi = 0; fi < TIMING_FRAMES; ++fi) {
-        s32 x = x0 + fi*DX;
-        s32 y = y1;
-
-        for (s32 pi = 0; pi < timings.frames[fi].entries_len - 1; ++pi) {
-            s32 dy = time_convert(timings.frames[fi].entries[pi].t, timings.frames[fi].entries[pi + 1].t, DY_MS*MILLISECONDS);
-            char *label = timings.frames[fi].entries[pi].label;
-            u32 label_hash = hash_fnv1a(label);
-            u32 color = hsv_to_rgb(label_hash, 200, 180);
-            draw_solid(canvas, x, y - dy, x + DX - 1, y, color);
-            y -= dy;
-
-            bool label_found = false;
-            for (s32 li = 0; li < labels_len; ++li) {
-                if (labels[li].hash == label_hash) {
-                    label_found = true;
-                }
-            }
-            if (!label_found && labels_len < alen(labels)) {
-                labels[labels_len++] = { label_hash, label };
+    enum { MARGIN = 8 };
+    static const u32 COLORS[] = { 0xc555a0, 0xeb2428, 0xffe444, 0xa6cb3a, 0x23a9e1 };
+    u32 color_background = 0x202020;
+    u32 color_text = 0x000000;
+    u32 color_label = 0xdddddd;
+    u32 color_separator = 0x888888;
+
+    stack_enter_frame();
+
+    // Only the zones which overlap the last frame, sorted by thread
+    Slice<TimingZone> zones[TIMING_MAX_THREADS] = {};
+    s32 rows[TIMING_MAX_THREADS] = {};
+    s32 row_count = 0;
+    s32 thread_count = min((s32) timing.thread_count, (s32) TIMING_MAX_THREADS);
+    for (s32 i = 0; i < thread_count; ++i) {
+        if (!timing.threads[i]) continue;
+        Slice<TimingZone> all = _timing_read(timing.threads[i]);
+        zones[i] = { all.data, 0 };
+        for_each (zone, all) {
+            if (zone->end > timing.last_frame_start && zone->start < timing.last_frame_end) {
+                zones[i].data[zones[i].length++] = *zone;
+                rows[i] = max(rows[i], zone->depth + 1);
             }
         }
+        row_count += rows[i];
     }
 
-    for (s32 li = 0; li < labels_len; ++li) {
+    s32 width = canvas->area.x1 - canvas->area.x0;
+    s32 height = canvas->area.y1 - canvas->area.y0;
+    s32 row_height = font->metrics.line_height + 2;
+    s32 x0 = MARGIN;
+    s32 x1 = width - MARGIN;
+    s32 y = max(height - MARGIN - (row_count + 1)*row_height, 0);
+    draw_solid(canvas, 0, y - MARGIN, width, height, color_background);
+
+    s64 stack_kb = stack_allocated_bytes() / 1024;
+    s64 stack_high_water_mark_kb = stack_high_water_mark() / 1024;
+    str stack_text = stack_printf("Main thread stack: %lli kB in use, at most %lli kB", stack_kb, stack_high_water_mark_kb);
+    draw_text_ellipsis(canvas, font, stack_text, x0, x1, y + 1, color_label, false);
+    y += row_height;
+
+    for (s32 i = 0; i < thread_count; ++i) {
+        if (rows[i] == 0) continue;
+
+        for_each (zone, zones[i]) {
+            s32 zone_x0 = _timing_x(zone->start, x0, x1);
+            s32 zone_x1 = max(_timing_x(zone->end, x0, x1), zone_x0 + 2);
+            s32 zone_y = y + zone->depth*row_height;
+            u32 color = COLORS[hash_fnv1a(zone->label) % alen(COLORS)];
+            draw_solid(canvas, zone_x0, zone_y, zone_x1 - 1, zone_y + row_height - 1, color);
+
+            stack_enter_frame();
+            s64 microseconds = _timing_nanoseconds(zone->end - zone->start) / 1000;
+            str text = stack_printf("%s %lli.%02lli ms", zone->label, microseconds/1000, (microseconds%1000)/10);
+            draw_text_ellipsis(canvas, font, text, zone_x0 + 2, zone_x1 - 2, zone_y + 1, color_text, false);
+            stack_leave_frame();
+        }
+
+        y += rows[i]*row_height;
+        draw_solid(canvas, x0, y - 1, x1, y, color_separator);
     }
 
-    draw_solid(canvas, x0, y1, x1, y1 + 1, 0x888888);
-    draw_solid(canvas, x0 - 1, y0 - 1, x0, y1 + 1, 0x888888);
-    draw_solid(canvas, x1, y0 - 1, x1 + 1, y1 + 1, 0x888888);
-    draw_solid(canvas, x0, y0 - 1, x1, y0, 0xff0000);
+    stack_leave_frame();
 }
 
-#endif
\ No newline at end of file
+#else
+
+void timing_init()
+{}
+
+void timing_begin(char *label)
+{}
+
+void timing_end()
+{}
+
+void timing_thread_exit()
+{}
+
+void timing_start_frame()
+{}
+
+void timing_finish_frame()
+{}
+
+void timing_toggle()
+{}
+
+IoError timing_write_trace(Path path)
+{
+    return(IoError::OK);
+}
+
+void timing_draw(DrawTargetSlice *canvas, Font *font)
+{}
+
+#endif
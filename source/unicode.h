@@ -48,6 +48,12 @@ bool utf8_is_continuation(u8 byte);
 s32 utf8_expected_length(u8 byte);
 s64 utf8_string_length(u8 *bytes, s64 length);
 
+// Bulk helpers, which look at 16 bytes at a time.
+// 'utf8_ascii_length' gives the length of the run of ascii bytes at the start of 'data'. 'utf8_validate' returns true if
+// 'decode_utf8' would decode every codepoint in 'data' as valid, which means surrogates are accepted (see note below).
+s64 utf8_ascii_length(u8 *data, s64 length);
+bool utf8_validate(u8 *data, s64 length);
+
 
 DecodedCodepoint decode_utf8(u8 *data, s64 length)
 {
@@ -169,27 +175,277 @@ u8 encode_utf16(s32 codepoint, u16 *buffer)
     return(length);
 }
 
-wstr utf8_to_utf16(str input)
+s64 utf8_ascii_length(u8 *data, s64 length)
 {
-    wstr result = {};
+    s64 i = 0;
+    for (; i + 16 <= length; i += 16) {
+        u32 mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i *) (data + i)));
+        if (mask) {
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return(i + bit);
+        }
+    }
+    while (i < length && data[i] < 0x80) ++i;
+    return(i);
+}
 
-    // 1, 2 or 3 utf8 bytes map to 1 utf16 short, 4 utf8 bytes map to 2 utf16 shorts, +1 for null termination
-    s64 max_result_length = input.length;
-    result.data = stack_alloc(wchar_t, max_result_length + 1);
+bool _utf8_validate_scalar(u8 *data, s64 length)
+{
+    for (s64 i = 0; i < length; ) {
+        DecodedCodepoint decoded = decode_utf8(data + i, length - i);
+        if (!decoded.valid) return(false);
+        i += decoded.length;
+    }
+    return(true);
+}
+
+// Classifies each byte together with the one before it by looking up both their nibbles in three tables. Each bit is a kind
+// of error, and only stays set if all three lookups agree on it. This catches everything except sequences which are cut
+// short or run too long, which we check by comparing the continuation bytes we expect with those we got. See "Validating
+// UTF-8 In Less Than One Instruction Per Byte" (Keiser, Lemire).
+// NB 'decode_utf8' accepts surrogates, so unlike the paper we don't check for those.
+void _utf8_validate_block(__m128i input, __m128i *previous, __m128i *previous_incomplete, __m128i *error)
+{
+    if (_mm_movemask_epi8(input) == 0) {
+        // All ascii, so the only thing which can be wrong is a sequence which the previous block didn't finish
+        *error = _mm_or_si128(*error, *previous_incomplete);
+    } else {
+        enum : u8 {
+            TOO_SHORT = 1 << 0, // Lead byte followed by a lead byte or ascii
+            TOO_LONG = 1 << 1, // Ascii followed by a continuation byte
+            OVERLONG_3 = 1 << 2,
+            TOO_LARGE = 1 << 3, // Above 0x10ffff
+            OVERLONG_2 = 1 << 5,
+            TOO_LARGE_1000 = 1 << 6,
+            OVERLONG_4 = 1 << 6,
+            TWO_CONTS = 1 << 7, // Two continuation bytes, which is fine if they are part of a longer sequence
+            CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+        };
+        __m128i byte_1_high_table = _mm_setr_epi8(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3,
+            (char) (TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4));
+        __m128i byte_1_low_table = _mm_setr_epi8(
+            (char) (CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+            (char) (CARRY | OVERLONG_2),
+            (char) CARRY,
+            (char) CARRY,
+            (char) (CARRY | TOO_LARGE),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000), (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000), (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000), (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000), (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000), (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000));
+        __m128i byte_2_high_table = _mm_setr_epi8(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+            (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+            (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | TOO_LARGE),
+            (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | TOO_LARGE),
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+        __m128i nibble = _mm_set1_epi8(0x0f);
+        __m128i previous_1 = _mm_alignr_epi8(input, *previous, 15);
+        __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(previous_1, 4), nibble));
+        __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(previous_1, nibble));
+        __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+        __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+        // The third and fourth byte of a sequence must be continuations. Those are the only places 'special' flags two
+        // continuation bytes in a row, so these cancel out if all is well
+        __m128i previous_2 = _mm_alignr_epi8(input, *previous, 14);
+        __m128i previous_3 = _mm_alignr_epi8(input, *previous, 13);
+        __m128i third = _mm_subs_epu8(previous_2, _mm_set1_epi8(0xe0 - 0x80));
+        __m128i fourth = _mm_subs_epu8(previous_3, _mm_set1_epi8(0xf0 - 0x80));
+        __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char) 0x80));
+        *error = _mm_or_si128(*error, _mm_xor_si128(must_continue, special));
+    }
+
+    // Nonzero where the last three bytes start a sequence which doesn't fit in this block
+    __m128i incomplete_limit = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+    *previous_incomplete = _mm_subs_epu8(input, incomplete_limit);
+    *previous = input;
+}
+
+bool utf8_validate(u8 *data, s64 length)
+{
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();
+    __m128i previous_incomplete = _mm_setzero_si128();
 
+    s64 i = 0;
+    for (; i + 16 <= length; i += 16) {
+        _utf8_validate_block(_mm_loadu_si128((__m128i *) (data + i)), &previous, &previous_incomplete, &error);
+    }
+
+    // Padding with zeros, which are ascii, also catches sequences cut short by the end of the string
+    u8 tail[16] = {};
+    memcpy(tail, data + i, length - i);
+    _utf8_validate_block(_mm_loadu_si128((__m128i *) tail), &previous, &previous_incomplete, &error);
+    error = _mm_or_si128(error, previous_incomplete);
+
+    return(_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff);
+}
+
+// The scalar conversions. 'output' needs room for 'length' utf16 units or '3*length' bytes respectively, and both return
+// how much they wrote
+s64 _utf8_to_utf16_scalar(u8 *input, s64 length, u16 *output)
+{
+    s64 written = 0;
     s64 offset = 0;
-    while (offset < input.length) {
-        DecodedCodepoint decoded = decode_utf8((u8*) (input.data + offset), input.length - offset);
+    while (offset < length) {
+        DecodedCodepoint decoded = decode_utf8(input + offset, length - offset);
+        offset += max(decoded.length, 1); // Advance even on invalid input
+
+        if (decoded.valid) {
+            u8 encoded_length = encode_utf16(decoded.codepoint, output + written);
+            assert(encoded_length > 0); // We should be able to encode all codepoints 'decode_utf8' marks as valid
+            written += encoded_length;
+        } else {
+            output[written++] = 0xfffd; // Unicode replacement character
+        }
+    }
+    return(written);
+}
+
+s64 _utf16_to_utf8_scalar(u16 *input, s64 length, u8 *output)
+{
+    s64 written = 0;
+    s64 offset = 0;
+    while (offset < length) {
+        DecodedCodepoint decoded = decode_utf16(input + offset, length - offset);
         offset += max(decoded.length, 1); // Advance even on invalid input
 
         if (decoded.valid) {
-            u8 encoded_length = encode_utf16(decoded.codepoint, (u16 *) &result.data[result.length]);
+            u8 encoded_length = encode_utf8(decoded.codepoint, output + written);
             assert(encoded_length > 0); // We should be able to encode all codepoints 'decode_utf8' marks as valid
-            result.length += encoded_length;
+            written += encoded_length;
         } else {
-            result.data[result.length++] = 0xfffd; // Unicode replacement character
+            // Unicode replacement character
+            output[written++] = 0xef;
+            output[written++] = 0xbf;
+            output[written++] = 0xbd;
+        }
+    }
+    return(written);
+}
+
+// Same results as the scalar versions. Runs of ascii are widened or narrowed 16 or 8 at a time, and we go back to one
+// codepoint at a time for everything else. If the input validates we can decode those without checking each of them.
+// NB Output never runs ahead of input (one byte gives at most one utf16 unit, one utf16 unit at most three bytes), so we
+// can always store a whole block, even if only part of it is ascii.
+s64 _utf8_to_utf16_simd(u8 *input, s64 length, u16 *output)
+{
+    bool valid = utf8_validate(input, length);
+    __m128i zero = _mm_setzero_si128();
+
+    s64 written = 0;
+    s64 offset = 0;
+    while (offset < length) {
+        if (offset + 16 <= length) {
+            __m128i bytes = _mm_loadu_si128((__m128i *) (input + offset));
+            _mm_storeu_si128((__m128i *) (output + written), _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128((__m128i *) (output + written + 8), _mm_unpackhi_epi8(bytes, zero));
+
+            u32 mask = _mm_movemask_epi8(bytes);
+            if (mask == 0) {
+                offset += 16;
+                written += 16;
+                continue;
+            }
+
+            unsigned long ascii;
+            _BitScanForward(&ascii, mask);
+            offset += ascii;
+            written += ascii;
+        }
+
+        // One codepoint at a time until we have a block which starts with ascii again
+        do {
+            u8 byte = input[offset];
+            if (byte < 0x80) {
+                output[written++] = byte;
+                offset += 1;
+            } else if (valid) {
+                s32 codepoint;
+                if (byte < 0xe0) {
+                    codepoint = ((byte & 0x1f) << 6) | (input[offset + 1] & 0x3f);
+                    offset += 2;
+                } else if (byte < 0xf0) {
+                    codepoint = ((byte & 0x0f) << 12) | ((input[offset + 1] & 0x3f) << 6) | (input[offset + 2] & 0x3f);
+                    offset += 3;
+                } else {
+                    codepoint = ((byte & 0x07) << 18) | ((input[offset + 1] & 0x3f) << 12) | ((input[offset + 2] & 0x3f) << 6) | (input[offset + 3] & 0x3f);
+                    offset += 4;
+                }
+                written += encode_utf16(codepoint, output + written);
+            } else {
+                DecodedCodepoint decoded = decode_utf8(input + offset, length - offset);
+                offset += decoded.length;
+                if (decoded.valid) {
+                    written += encode_utf16(decoded.codepoint, output + written);
+                } else {
+                    output[written++] = 0xfffd;
+                }
+            }
+        } while (offset < length && (offset + 16 > length || input[offset] >= 0x80));
+    }
+    return(written);
+}
+
+s64 _utf16_to_utf8_simd(u16 *input, s64 length, u8 *output)
+{
+    __m128i non_ascii_bits = _mm_set1_epi16((short) 0xff80);
+
+    s64 written = 0;
+    s64 offset = 0;
+    while (offset < length) {
+        if (offset + 8 <= length) {
+            __m128i units = _mm_loadu_si128((__m128i *) (input + offset));
+            _mm_storel_epi64((__m128i *) (output + written), _mm_packus_epi16(units, units));
+
+            // Two bits per unit
+            u32 ascii_mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii_bits), _mm_setzero_si128()));
+            if (ascii_mask == 0xffff) {
+                offset += 8;
+                written += 8;
+                continue;
+            }
+
+            unsigned long bit;
+            _BitScanForward(&bit, ~ascii_mask);
+            offset += bit/2;
+            written += bit/2;
         }
+
+        do {
+            u16 unit = input[offset];
+            if (unit < 0x80) {
+                output[written++] = (u8) unit;
+                offset += 1;
+            } else {
+                DecodedCodepoint decoded = decode_utf16(input + offset, length - offset);
+                offset += decoded.length;
+                written += encode_utf8(decoded.codepoint, output + written);
+            }
+        } while (offset < length && (offset + 8 > length || input[offset] >= 0x80));
     }
+    return(written);
+}
+
+wstr utf8_to_utf16(str input)
+{
+    wstr result = {};
+
+    // 1, 2 or 3 utf8 bytes map to 1 utf16 short, 4 utf8 bytes map to 2 utf16 shorts, +1 for null termination
+    s64 max_result_length = input.length;
+    result.data = stack_alloc(wchar_t, max_result_length + 1);
+    result.length = _utf8_to_utf16_simd((u8 *) input.data, input.length, (u16 *) result.data);
 
     assert(result.length <= max_result_length);
     stack_trim_allocation(result.data, (result.length + 1) * sizeof(wchar_t));
@@ -204,23 +460,7 @@ str utf16_to_utf8(wstr input)
     // 2 utf16 bytes map to 1, 2 or 3 utf8 bytes, 4 utf16 bytes map to 4 utf8 bytes, +1 for null termination
     s64 max_result_length = input.length*3;
     result.data = stack_alloc(char, max_result_length + 1);
-
-    s64 offset = 0;
-    while (offset < input.length) {
-        DecodedCodepoint decoded = decode_utf16((u16 *) (input.data + offset), input.length - offset);
-        offset += max(decoded.length, 1); // Advance even on invalid input
-
-        if (decoded.valid) {
-            u8 encoded_length = encode_utf8(decoded.codepoint, (u8*) &result.data[result.length]);
-            assert(encoded_length > 0); // We should be able to encode all codepoints 'decode_utf8' marks as valid
-            result.length += encoded_length;
-        } else {
-            // Unicode replacement character
-            result.data[result.length++] = 0xef;
-            result.data[result.length++] = 0xbf;
-            result.data[result.length++] = 0xbd;
-        }
-    }
+    result.length = _utf16_to_utf8_simd((u16 *) input.data, input.length, (u8 *) result.data);
 
     assert(result.length <= max_result_length);
     stack_trim_allocation(result.data, result.length + 1);
@@ -307,6 +547,11 @@ s64 utf8_string_length(u8 *data, s64 length)
     s64 result = 0;
     s64 offset = 0;
     while (offset < length) {
+        s64 ascii = utf8_ascii_length(data + offset, length - offset);
+        result += ascii;
+        offset += ascii;
+        if (offset >= length) break;
+
         result += 1;
         DecodedCodepoint decoded = decode_utf8(&data[offset], length - offset);
         offset += decoded.length;
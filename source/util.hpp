@@ -14,7 +14,9 @@
 //#include <nmmintrin.h> // SSE4.2
 //#include <ammintrin.h> // SSE4A
 #include <wmmintrin.h> // AES
-//#include <immintrin.h> // AVX, AVX2, FMA
+#include <immintrin.h> // AVX, AVX2, FMA. Only used in functions marked with target_function, see cpu_supports_avx2
+
+#include <intrin.h> // _Interlocked*
 
 #define STB_SPRINTF_IMPLEMENTATION
 #define STB_SPRINTF_NOFLOAT
@@ -30,6 +32,7 @@ typedef int8_t s8;
 typedef int16_t s16;
 typedef int32_t s32;
 typedef int64_t s64;
+typedef float f32;
 typedef wchar_t wchar;
 #define null nullptr
 
@@ -41,6 +44,13 @@ typedef wchar_t wchar;
 #define noinline_function __attribute__((noinline))
 #endif
 
+// Lets functions use instructions beyond what we compile for. Msvc always allows that, clang and gcc need to be told.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define target_function(features)
+#else
+#define target_function(features) __attribute__((target(features)))
+#endif
+
 #define U8_MAX   0xff
 #define U16_MAX  0xffff
 #define U32_MAX  0xffffffffull
@@ -198,6 +208,8 @@ void app_debug_print_hook(str string);
 
 void *MemBigAlloc(s64 Size);
 void MemBigFree(void *Pointer);
+void *MemBigReserve(s64 size);
+void MemBigCommit(void *data, s64 size);
 
 #include "allocators.hpp"
 #include "unicode.h"
@@ -315,14 +327,14 @@ struct GapArray
     {
         if (this->a < offset) {
             s32 delta = offset - this->a;
-            memcpy(this->data + this->a, this->data + this->b, delta * sizeof(Type));
+            memmove(this->data + this->a, this->data + this->b, delta * sizeof(Type));
             this->a += delta;
             this->b += delta;
         } else if (this->a > offset) {
             s32 delta = this->a - offset;
             this->a -= delta;
             this->b -= delta;
-            memcpy(this->data + this->b, this->data + this->a, delta * sizeof(Type));
+            memmove(this->data + this->b, this->data + this->a, delta * sizeof(Type));
         }
     }
 
@@ -331,27 +343,50 @@ struct GapArray
         return(this->a + this->cap - this->b);
     }
 
-    void insert(s32 offset, Type value)
+    void _grow(s32 min_gap)
     {
-        if (this->b - this->a <= 0) {
-            s32 new_cap = max(this->cap*2, 128);
-            s32 new_b = new_cap - this->cap + this->b;
-            Type *new_data = (Type *) heap_alloc(new_cap * sizeof(Type));
-            if (this->data) {
-                memcpy(new_data, this->data, this->a*sizeof(Type));
-                memcpy(new_data + new_b, this->data + this->b, (this->cap - this->b)*sizeof(Type));
-                heap_free(this->data);
-            }
-            this->b = new_b;
-            this->cap = new_cap;
-            this->data = new_data;
+        s32 new_cap = max(max(this->cap*2, 128), this->_length() + min_gap);
+        s32 new_b = new_cap - this->cap + this->b;
+        Type *new_data = (Type *) heap_alloc(new_cap * sizeof(Type));
+        if (this->data) {
+            memcpy(new_data, this->data, this->a*sizeof(Type));
+            memcpy(new_data + new_b, this->data + this->b, (this->cap - this->b)*sizeof(Type));
+            heap_free(this->data);
         }
+        this->b = new_b;
+        this->cap = new_cap;
+        this->data = new_data;
+    }
 
+    // Moves the gap to 'offset' and makes sure it has room for at least 'count' elements. Inserting up to 'count' elements at
+    // 'offset', 'offset + 1', ... afterwards neither moves the gap nor reallocates.
+    void reserve(s32 offset, s32 count)
+    {
+        assert(0 <= offset && offset <= this->length && count >= 0);
+        if (this->b - this->a < count) this->_grow(count);
         this->_move_gap(offset);
+    }
 
-        this->data[this->a] = value;
-        ++this->a;
+    // Inserts 'count' uninitialized elements at 'offset' and returns a pointer to them. The pointer is valid until the next
+    // call that modifies the array.
+    Type *insert_range(s32 offset, s32 count)
+    {
+        this->reserve(offset, count);
+        Type *result = this->data + this->a;
+        this->a += count;
         this->length = this->_length();
+        return(result);
+    }
+
+    void insert_range(s32 offset, Type *values, s32 count)
+    {
+        Type *into = this->insert_range(offset, count);
+        memcpy(into, values, count*sizeof(Type));
+    }
+
+    void insert(s32 offset, Type value)
+    {
+        *this->insert_range(offset, 1) = value;
     }
 
     void remove_range(s32 min, s32 max)
@@ -425,96 +460,216 @@ u32 hash_rehash_32(u32 hash)
     return(hash);
 }
 
-struct HashMap32
+u64 hash_mix_64(u64 key)
 {
-    struct Slot
-    {
-        u32 key;
-        u32 value;
-    };
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return(key);
+}
 
+u64 hash_map_hash(u32 key) { return(hash_mix_64(key)); }
+u64 hash_map_hash(u64 key) { return(hash_mix_64(key)); }
+u64 hash_map_hash(str key) { return(hash_good_64(key)); }
+u64 hash_map_hash(wstr key) { return(hash_good_64({ (char *) key.data, key.length*(s64) sizeof(wchar_t) })); }
+
+// Open addressing with linear probing. Each slot has a control byte holding the generation it was written in (top three
+// bits) and a few bits of its hash, so lookups test 16 slots per SSE2 compare and only touch keys on a tag match. A slot
+// is live only if its generation matches the map's, which makes 'clear' O(1) (the control bytes are wiped once every
+// seven clears, when the generation wraps). 'remove' shifts following entries back instead of leaving tombstones, so the
+// first dead slot always ends a probe. Keys and values are copied around freely and must be plain data.
+// NB If 'arena' is set before the first insert, storage comes from it and is abandoned when the map grows or is freed.
+template<typename Key, typename Value>
+struct HashMap
+{
     enum {
-        EMPTY = 0,
-        TOMB = 1,
+        GROUP = 16,
+        MIN_CAPACITY = 16,
+        GENERATION_SHIFT = 5,
+        TAG_MASK = (1 << GENERATION_SHIFT) - 1,
+        MAX_GENERATION = 7,
+    };
+
+    struct Slot
+    {
+        Key key;
+        Value value;
     };
 
+    u8 *control; // 'capacity + GROUP - 1' bytes, the tail mirrors the head so a group can be loaded starting at any slot
     Slot *slots;
     s32 capacity;
-    u32 capacity_mask;
-    s32 internal_count;
+    s32 count;
+    u8 generation;
+    Arena *arena;
 
-    u32 extra_slots[2];
-    u32 extra_slots_occupied;
+    u8 _control_byte(u64 hash)
+    {
+        return((u8) ((this->generation << GENERATION_SHIFT) | ((hash >> 57) & TAG_MASK)));
+    }
 
-    void _grow()
+    bool _live(s32 index)
     {
-        if ((this->internal_count + 1)*3/2 > this->capacity) {
-            Slot *old_slots = this->slots;
-            s32 old_capacity = this->capacity;
+        return((this->control[index] >> GENERATION_SHIFT) == this->generation);
+    }
 
-            s32 new_capacity = max(this->capacity*2, 128);
-            assert(new_capacity > this->capacity);
-            Slot *new_slots = (Slot *) heap_alloc(new_capacity * sizeof(Slot));
-            memset(new_slots, 0, new_capacity * sizeof(Slot));
-            this->slots = new_slots;
-            this->capacity = new_capacity;
-            this->capacity_mask = new_capacity - 1;
-            this->internal_count = 0;
-
-            if (old_slots) {
-                for (s32 i = 0; i < old_capacity; ++i) {
-                    if (old_slots[i].key >= 2) {
-                        this->insert(old_slots[i].key, old_slots[i].value);
-                    }
-                }
-                heap_free(old_slots);
+    void _set_control(s32 index, u8 control)
+    {
+        this->control[index] = control;
+        if (index < GROUP - 1) this->control[this->capacity + index] = control;
+    }
+
+    // Bit 'i' of 'matches' is set if slot 'index + i' holds 'wanted', bit 'i' of the result is set if that slot is live
+    u32 _load_group(s32 index, u8 wanted, u32 *matches)
+    {
+        __m128i group = _mm_loadu_si128((__m128i *) &this->control[index]);
+        __m128i generation = _mm_set1_epi8((char) (this->generation << GENERATION_SHIFT));
+        __m128i generation_bits = _mm_and_si128(group, _mm_set1_epi8((char) (MAX_GENERATION << GENERATION_SHIFT)));
+        *matches = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) wanted)));
+        return(_mm_movemask_epi8(_mm_cmpeq_epi8(generation_bits, generation)));
+    }
+
+    Slot *_find(Key key, u64 hash)
+    {
+        if (this->count == 0) return(null);
+
+        u8 wanted = this->_control_byte(hash);
+        u32 mask = this->capacity - 1;
+        s32 index = hash & mask;
+        while (true) {
+            u32 matches;
+            u32 live = this->_load_group(index, wanted, &matches);
+            while (matches) {
+                unsigned long bit;
+                _BitScanForward(&bit, matches);
+                Slot *slot = &this->slots[(index + bit) & mask];
+                if (slot->key == key) return(slot);
+                matches &= matches - 1;
             }
+            if (live != 0xffff) return(null);
+            index = (index + GROUP) & mask;
         }
-        ++this->internal_count;
     }
 
-    void insert(u32 key, u32 value)
+    // Assumes 'key' is not in the map and that there is room for it
+    Slot *_insert_new(Key key, u64 hash)
     {
-        if (key < 2) {
-            this->extra_slots[key] = value;
-            this->extra_slots_occupied |= 1 << key;
-        } else {
-            this->_grow();
-            s32 index = hash_rehash_32(key) & this->capacity_mask;
-            while (this->slots[index].key >= 2) index = (index + 1) & this->capacity_mask;
-            this->slots[index] = { key, value };
+        u32 mask = this->capacity - 1;
+        s32 index = hash & mask;
+        while (true) {
+            u32 matches;
+            u32 live = this->_load_group(index, 0, &matches);
+            if (live != 0xffff) {
+                unsigned long bit;
+                _BitScanForward(&bit, ~live);
+                index = (index + bit) & mask;
+                break;
+            }
+            index = (index + GROUP) & mask;
         }
+
+        this->_set_control(index, this->_control_byte(hash));
+        Slot *slot = &this->slots[index];
+        slot->key = key;
+        ++this->count;
+        return(slot);
     }
 
-    bool get(u32 key, u32 *value)
-    {
-        if (key < 2) {
-            bool available = this->extra_slots_occupied & (1 << key);
-            if (available) *value = this->extra_slots[key];
-            return(available);
-        } else if (this->capacity) {
-            s32 index = hash_rehash_32(key) & this->capacity_mask;
-            while (true) {
-                s32 current_key = this->slots[index].key;
-                if (current_key == key) {
-                    *value = this->slots[index].value;
-                    return(true);
-                }
-                if (current_key == EMPTY) {
-                    return(false);
-                }
-                index = (index + 1) & this->capacity_mask;
+    void _rehash(s32 new_capacity)
+    {
+        assert(new_capacity >= MIN_CAPACITY && (new_capacity & (new_capacity - 1)) == 0);
+
+        u8 *old_control = this->control;
+        Slot *old_slots = this->slots;
+        s32 old_capacity = this->capacity;
+        u8 old_generation = this->generation;
+
+        s64 control_size = round_up(new_capacity + GROUP - 1, alignof(Slot));
+        s64 size = control_size + new_capacity*sizeof(Slot);
+        u8 *memory = (u8 *) (this->arena? arena_alloc_aligned(this->arena, size, alignof(Slot)) : heap_alloc(size));
+        memset(memory, 0, control_size);
+        this->control = memory;
+        this->slots = (Slot *) (memory + control_size);
+        this->capacity = new_capacity;
+        this->count = 0;
+        this->generation = 1;
+
+        for (s32 i = 0; i < old_capacity; ++i) {
+            if ((old_control[i] >> GENERATION_SHIFT) == old_generation) {
+                Slot *slot = this->_insert_new(old_slots[i].key, hash_map_hash(old_slots[i].key));
+                slot->value = old_slots[i].value;
             }
         }
-        return(false);
+
+        if (!this->arena) heap_free(old_control);
+    }
+
+    bool get(Key key, Value *value)
+    {
+        Slot *slot = this->_find(key, hash_map_hash(key));
+        if (slot) *value = slot->value;
+        return(slot != null);
+    }
+
+    Value *find(Key key)
+    {
+        Slot *slot = this->_find(key, hash_map_hash(key));
+        return(slot? &slot->value : null);
+    }
+
+    // Inserts or overwrites
+    void insert(Key key, Value value)
+    {
+        u64 hash = hash_map_hash(key);
+        Slot *slot = this->_find(key, hash);
+        if (!slot) {
+            if ((this->count + 1)*4 > this->capacity*3) this->_rehash(max(this->capacity*2, (s32) MIN_CAPACITY));
+            slot = this->_insert_new(key, hash);
+        }
+        slot->value = value;
+    }
+
+    bool remove(Key key)
+    {
+        Slot *slot = this->_find(key, hash_map_hash(key));
+        if (!slot) return(false);
+
+        // Move later entries of the same run back into the hole, unless that would put them before their home slot
+        u32 mask = this->capacity - 1;
+        s32 hole = slot - this->slots;
+        for (s32 index = (hole + 1) & mask; this->_live(index); index = (index + 1) & mask) {
+            s32 home = hash_map_hash(this->slots[index].key) & mask;
+            if (((index - home) & mask) >= ((index - hole) & mask)) {
+                this->slots[hole] = this->slots[index];
+                this->_set_control(hole, this->control[index]);
+                hole = index;
+            }
+        }
+        this->_set_control(hole, 0);
+        --this->count;
+        return(true);
     }
 
     void clear()
     {
-        for (s32 i = 0; i < this->capacity; ++i) {
-            this->slots[i].key = EMPTY;
+        if (!this->capacity) return;
+        this->count = 0;
+        ++this->generation;
+        if (this->generation > MAX_GENERATION) {
+            memset(this->control, 0, this->capacity + GROUP - 1);
+            this->generation = 1;
         }
     }
+
+    void free()
+    {
+        if (!this->arena) heap_free(this->control);
+        Arena *arena = this->arena;
+        *this = {};
+        this->arena = arena;
+    }
 };
 
 
@@ -685,18 +840,40 @@ bool in_length_order(str *left, str *right)
 template<typename Type>
 void stable_sort(Slice<Type> slice, bool (*in_proper_order)(Type *left, Type *right))
 {
-    // Insertion sort
-    for (s64 i = 1; i < slice.length; i += 1) {
-        if (!(*in_proper_order)(&slice[i - 1], &slice[i])) {
-            Type temp = slice[i];
-            s64 j = i;
-            do {
-                slice[j] = slice[j - 1];
-                --j;
-            } while (j > 0 && !(*in_proper_order)(&slice[j - 1], &temp));
-            slice[j] = temp;
+    // Insertion sort on short runs, then merge runs bottom up
+    enum { RUN = 16 };
+    for (s64 start = 0; start < slice.length; start += RUN) {
+        s64 end = min(start + RUN, slice.length);
+        for (s64 i = start + 1; i < end; i += 1) {
+            if (!(*in_proper_order)(&slice[i - 1], &slice[i])) {
+                Type temp = slice[i];
+                s64 j = i;
+                do {
+                    slice[j] = slice[j - 1];
+                    --j;
+                } while (j > start && !(*in_proper_order)(&slice[j - 1], &temp));
+                slice[j] = temp;
+            }
+        }
+    }
+    if (slice.length <= RUN) return;
+
+    Type *from = slice.data;
+    Type *to = (Type *) heap_alloc(slice.length * sizeof(Type));
+    Type *buffer = to;
+    for (s64 width = RUN; width < slice.length; width *= 2) {
+        for (s64 start = 0; start < slice.length; start += 2*width) {
+            s64 middle = min(start + width, slice.length);
+            s64 end = min(start + 2*width, slice.length);
+            s64 i = start, j = middle, k = start;
+            while (i < middle && j < end) to[k++] = (*in_proper_order)(&from[i], &from[j])? from[i++] : from[j++];
+            while (i < middle) to[k++] = from[i++];
+            while (j < end) to[k++] = from[j++];
         }
+        swap(from, to);
     }
+    if (from != slice.data) memcpy(slice.data, from, slice.length * sizeof(Type));
+    heap_free(buffer);
 }
 
 template<typename Left, typename Right>
@@ -928,6 +1105,26 @@ void MemBigFree(void *data)
     win32::VirtualFree(data, 0, win32::MEM_RELEASE);
 }
 
+// Reserves address space without backing it with memory, see 'MemBigCommit'
+void *MemBigReserve(s64 size)
+{
+    void *result = win32::VirtualAlloc(null, size, win32::MEM_RESERVE, win32::PAGE_READWRITE);
+    if (!result) {
+        u32 error_code = win32::GetLastError();
+        fail("Couldn't reserve virtual memory: %u\n", error_code);
+    }
+    return(result);
+}
+
+void MemBigCommit(void *data, s64 size)
+{
+    void *result = win32::VirtualAlloc(data, size, win32::MEM_COMMIT, win32::PAGE_READWRITE);
+    if (!result) {
+        u32 error_code = win32::GetLastError();
+        fail("Couldn't commit virtual memory: %u\n", error_code);
+    }
+}
+
 
 enum
 {
@@ -953,6 +1150,230 @@ s64 time_convert(Time start, Time end, s64 unit)
     return((end - start) * unit / frequency);
 }
 
+#if defined(DEBUG)
+// Times 'HashMap' with scattered u32 keys, as in the glyph caches, and checks that 'remove' and 'clear' leave the map
+// consistent. The first round inserts into an empty map, so it includes growing it, and later rounds reuse it after 'clear'.
+void hash_map_benchmark()
+{
+    enum { ROUNDS = 4 };
+    s32 counts[] = { 1000, 30000, 250000 };
+    for (s32 c = 0; c < alen(counts); ++c) {
+        s32 count = counts[c];
+        // Multiplying by an odd number is a bijection, so these are all distinct, and keys never equal misses
+        #define KEY(i)  ((u32) (2*(i))*2654435761u)
+        #define MISS(i) ((u32) (2*(i) + 1)*2654435761u)
+
+        HashMap<u32, u32> map = {};
+        s64 first_insert = 0;
+        s64 times[3] = {}; // insert (not counting the first round), hit, miss
+        for (s32 round = 0; round < ROUNDS; ++round) {
+            u32 value;
+            s32 found = 0;
+
+            Time start = time_read();
+            for (s32 i = 0; i < count; ++i) map.insert(KEY(i), i);
+            s64 insert = time_convert(start, time_read(), MICROSECONDS);
+            if (round == 0) first_insert = insert;
+            else times[0] += insert;
+            start = time_read();
+            for (s32 i = 0; i < count; ++i) found += map.get(KEY(i), &value) && value == (u32) i;
+            times[1] += time_convert(start, time_read(), MICROSECONDS);
+            start = time_read();
+            for (s32 i = 0; i < count; ++i) found -= map.get(MISS(i), &value);
+            times[2] += time_convert(start, time_read(), MICROSECONDS);
+            assert(found == count && map.count == count);
+
+            map.clear();
+            assert(map.count == 0 && !map.find(KEY(0)));
+        }
+
+        // Removing every other key must not lose any of the others, and must leave no trace of the removed ones
+        for (s32 i = 0; i < count; ++i) map.insert(KEY(i), i);
+        for (s32 i = 0; i < count; i += 2) map.remove(KEY(i));
+        for (s32 i = 0; i < count; ++i) {
+            u32 *value = map.find(KEY(i));
+            assert((i & 1)? (value && *value == (u32) i) : !value);
+        }
+        assert(map.count == count/2);
+        map.free();
+
+        #undef KEY
+        #undef MISS
+
+        debug_printf("HashMap, %i keys, average of %i rounds: insert %i us into an empty map, %i us after clear, hit %i us, miss %i us\n",
+                     count, ROUNDS, (s32) first_insert, (s32) (times[0]/(ROUNDS - 1)),
+                     (s32) (times[1]/ROUNDS), (s32) (times[2]/ROUNDS));
+    }
+}
+#endif
+
+// Checks that both the cpu supports avx2 and that the os saves the full ymm registers on context switches
+target_function("xsave")
+bool cpu_supports_avx2()
+{
+    static s32 result = -1;
+    if (result == -1) {
+        result = 0;
+
+        s32 info[4];
+        __cpuid(info, 0);
+        if (info[0] >= 7) {
+            __cpuid(info, 1);
+            bool osxsave = info[2] & (1 << 27);
+            bool avx = info[2] & (1 << 28);
+            if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+                __cpuidex(info, 7, 0);
+                result = (info[1] & (1 << 5)) != 0;
+            }
+        }
+    }
+    return(result);
+}
+
+// Worker threads
+//
+// 'parallel_for' calls 'function(data, index)' for all indices in [0, count), spread over the worker threads and the calling
+// thread, and returns once all calls have returned. Each thread starts out with a contiguous range of indices. Threads which
+// run out steal half of the remaining range of another thread, so uneven work still balances out.
+// NB Functions run by 'parallel_for' must be safe to call in any order and on any thread. They can use the stack allocator,
+// which is per thread, as long as they leave every frame they enter. 'parallel_for' itself must only be called from the
+// main thread.
+
+typedef void (*ParallelFunction)(void *data, s32 index);
+
+enum { PARALLEL_MAX_THREADS = 64 };
+
+struct ParallelPool
+{
+    bool initialized;
+    s32 thread_count; // Including the main thread
+
+    void *start_events[PARALLEL_MAX_THREADS];
+    void *done_event;
+    volatile long running_workers;
+
+    ParallelFunction function;
+    void *data;
+
+    // Packed as 'begin | (end << 32)', so they can be updated with a single compare-exchange
+    struct alignas(64) Range { volatile s64 packed; };
+    Range ranges[PARALLEL_MAX_THREADS];
+};
+global_variable ParallelPool _parallel_pool;
+
+s64 _parallel_pack(s32 begin, s32 end)
+{
+    return((s64) ((u64) (u32) begin | ((u64) (u32) end << 32)));
+}
+
+bool _parallel_take(s32 thread, s32 *index)
+{
+    volatile s64 *range = &_parallel_pool.ranges[thread].packed;
+    while (true) {
+        s64 old = *range;
+        s32 begin = (s32) old;
+        s32 end = (s32) (old >> 32);
+        if (begin >= end) return(false);
+
+        if (_InterlockedCompareExchange64(range, _parallel_pack(begin + 1, end), old) == old) {
+            *index = begin;
+            return(true);
+        }
+    }
+}
+
+bool _parallel_steal(s32 thread)
+{
+    for (s32 i = 1; i < _parallel_pool.thread_count; ++i) {
+        volatile s64 *victim = &_parallel_pool.ranges[(thread + i) % _parallel_pool.thread_count].packed;
+        while (true) {
+            s64 old = *victim;
+            s32 begin = (s32) old;
+            s32 end = (s32) (old >> 32);
+            if (begin >= end) break;
+
+            s32 middle = begin + (end - begin)/2;
+            if (_InterlockedCompareExchange64(victim, _parallel_pack(begin, middle), old) == old) {
+                // NB Other threads only ever steal from our range, so it being empty until we get here is fine
+                _InterlockedExchange64(&_parallel_pool.ranges[thread].packed, _parallel_pack(middle, end));
+                return(true);
+            }
+        }
+    }
+    return(false);
+}
+
+void _parallel_work(s32 thread)
+{
+    s32 index;
+    while (true) {
+        if (_parallel_take(thread, &index)) {
+            _parallel_pool.function(_parallel_pool.data, index);
+        } else if (!_parallel_steal(thread)) {
+            break;
+        }
+    }
+}
+
+u32 _parallel_worker_routine(void *parameter)
+{
+    s32 thread = (s32) (s64) parameter;
+    while (true) {
+        win32::WaitForSingleObject(_parallel_pool.start_events[thread], U32_MAX);
+        _parallel_work(thread);
+        if (_InterlockedDecrement(&_parallel_pool.running_workers) == 0) win32::SetEvent(_parallel_pool.done_event);
+    }
+}
+
+void _parallel_init()
+{
+    ParallelPool *pool = &_parallel_pool;
+    pool->initialized = true;
+    pool->thread_count = clamp((s32) win32::GetActiveProcessorCount(win32::ALL_PROCESSOR_GROUPS), 1, (s32) PARALLEL_MAX_THREADS);
+    pool->done_event = win32::CreateEventW(null, false, false, null);
+
+    for (s32 i = 1; i < pool->thread_count; ++i) {
+        pool->start_events[i] = win32::CreateEventW(null, false, false, null);
+        void *thread = win32::CreateThread(null, 0, &_parallel_worker_routine, (void *) (s64) i, 0, null);
+        if (!thread) {
+            // We can get by with fewer threads
+            pool->thread_count = i;
+            break;
+        }
+        win32::CloseHandle(thread);
+    }
+}
+
+s32 parallel_thread_count()
+{
+    if (!_parallel_pool.initialized) _parallel_init();
+    return(_parallel_pool.thread_count);
+}
+
+void parallel_for(s32 count, ParallelFunction function, void *data)
+{
+    ParallelPool *pool = &_parallel_pool;
+    s32 threads = min(parallel_thread_count(), count);
+
+    if (threads <= 1) {
+        for (s32 i = 0; i < count; ++i) function(data, i);
+        return;
+    }
+
+    pool->function = function;
+    pool->data = data;
+    for (s32 i = 0; i < pool->thread_count; ++i) {
+        s32 begin = i < threads? (s32) ((s64) count*i/threads) : 0;
+        s32 end = i < threads? (s32) ((s64) count*(i + 1)/threads) : 0;
+        pool->ranges[i].packed = _parallel_pack(begin, end);
+    }
+    pool->running_workers = threads - 1;
+
+    for (s32 i = 1; i < threads; ++i) win32::SetEvent(pool->start_events[i]);
+    _parallel_work(0);
+    win32::WaitForSingleObject(pool->done_event, U32_MAX);
+}
+
 Slice<CmdArg> get_command_line_arguments()
 {
     wchar *argument_string = win32::GetCommandLineW();
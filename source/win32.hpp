@@ -193,6 +193,24 @@ struct find_data_w
     u16 FinderFlags;
 };
 
+struct file_notify_information
+{
+    u32 NextEntryOffset;
+    u32 Action;
+    u32 FileNameLength; // In bytes
+    wchar_t FileName[1];
+};
+
+struct file_attribute_data
+{
+    u32 FileAttributes;
+    filetime CreationTime;
+    filetime LastAccessTime;
+    filetime LastWriteTime;
+    u32 FileSizeHigh;
+    u32 FileSizeLow;
+};
+
 struct by_handle_file_information
 {
     u32 FileAttributes;
@@ -534,6 +552,8 @@ extern "C"
     __declspec(dllimport)
     u32 MsgWaitForMultipleObjects(u32 Count, void **Handles, s32 WaitAll, u32 Milliseconds, u32 WakeMask);
     __declspec(dllimport)
+    u32 WaitForMultipleObjects(u32 Count, void **Handles, s32 WaitAll, u32 Milliseconds);
+    __declspec(dllimport)
     s32 TranslateMessage(window_message *Message);
     __declspec(dllimport)
     s64 DispatchMessageW(window_message *Message);
@@ -604,6 +624,8 @@ extern "C"
     __declspec(dllimport)
     s32 CloseClipboard();
     __declspec(dllimport)
+    u32 GetClipboardSequenceNumber();
+    __declspec(dllimport)
     void *GlobalAlloc(u32 Flags, u64 Bytes);
     __declspec(dllimport)
     void *GlobalFree(void *Pointer);
@@ -630,6 +652,12 @@ extern "C"
     __declspec(dllimport)
     u32 GetCurrentThreadId();
     __declspec(dllimport)
+    u32 TlsAlloc();
+    __declspec(dllimport)
+    void *TlsGetValue(u32 TlsIndex);
+    __declspec(dllimport)
+    s32 TlsSetValue(u32 TlsIndex, void *TlsValue);
+    __declspec(dllimport)
     s32 CreatePipe(void **ReadPipe, void **WritePipe, security_attributes *Attributes, u32 Size);
     __declspec(dllimport)
     u32 GetCurrentDirectoryW(u32 BufferLength, wchar_t *Buffer);
@@ -664,6 +692,8 @@ extern "C"
     __declspec(dllimport)
     s32 FindCloseChangeNotification(void *Handle);
     __declspec(dllimport)
+    s32 ReadDirectoryChangesW(void *Directory, void *Buffer, u32 BufferLength, s32 WatchSubtree, u32 NotifyFilter, u32 *BytesReturned, overlapped *Overlapped, void *CompletionRoutine);
+    __declspec(dllimport)
     void *GetActiveWindow();
     __declspec(dllimport)
     s32 GetOpenFileNameW(open_file_name_w *);
@@ -724,6 +754,8 @@ extern "C"
     __declspec(dllimport)
     u32 GetFileAttributesW(wchar_t *Path);
     __declspec(dllimport)
+    s32 GetFileAttributesExW(wchar_t *Path, s32 InfoLevel, file_attribute_data *Information);
+    __declspec(dllimport)
     s32 PathIsRelativeW(wchar_t *Path);
     __declspec(dllimport)
     wchar_t *CharUpperW(wchar_t *);
@@ -770,6 +802,8 @@ extern "C"
     __declspec(dllimport)
     s32 DeleteObject(void *);
     __declspec(dllimport)
+    s32 DeleteDC(void *Hdc);
+    __declspec(dllimport)
     void *CreateDIBSection(void *Hdc, bitmapinfo *Info, u32 Usage, void **Data, void *Section, u32 Offset);
     __declspec(dllimport)
     u32 GetGlyphIndicesW(void *Hdc, wchar_t *Text, s32 Count, u16 *GlyphIndices, u32 Flags);
@@ -791,6 +825,8 @@ extern "C"
     void *HeapReAlloc(void *Heap, u32 Flags, void *Memory, u64 Size);
     __declspec(dllimport)
     void *GetProcessHeap();
+    __declspec(dllimport)
+    u32 GetActiveProcessorCount(u16 GroupNumber);
 
     unsigned long _exception_code();
 };
@@ -955,6 +991,7 @@ enum {
     STARTF_USESIZE = 0x00000002,
     STARTF_USESTDHANDLES = 0x00000100,
     STILL_ACTIVE = 259,
+    TLS_OUT_OF_INDEXES = 0xFFFFFFFF,
     MEM_COMMIT      = 0x00001000,
     MEM_RESERVE     = 0x00002000,
     MEM_RESET       = 0x00080000,
@@ -996,6 +1033,7 @@ enum {
     WAIT_OBJECT_0   = 0x000,
     WAIT_TIMEOUT    = 0x102,
     WAIT_FAILED     = -1,
+    ALL_PROCESSOR_GROUPS = 0xffff,
     IDABORT = 3,
     IDCANCEL = 2,
     IDCONTINUE = 11,
@@ -1074,6 +1112,11 @@ enum {
     FILE_NOTIFY_CHANGE_SIZE         = 0x008,
     FILE_NOTIFY_CHANGE_LAST_WRITE   = 0x010,
     FILE_NOTIFY_CHANGE_SECURITY     = 0x100,
+    FILE_ACTION_ADDED            = 1,
+    FILE_ACTION_REMOVED          = 2,
+    FILE_ACTION_MODIFIED         = 3,
+    FILE_ACTION_RENAMED_OLD_NAME = 4,
+    FILE_ACTION_RENAMED_NEW_NAME = 5,
     OFN_ALLOWMULTISELECT = 0x00000200,
     OFN_CREATEPROMPT = 0x00002000,
     OFN_DONTADDTORECENT = 0x02000000,
@@ -1120,6 +1163,8 @@ enum {
     FILE_FLAG_FIRST_PIPE_INSTANCE = 0x00080000,
     FILE_FLAG_WRITE_THROUGH = 0x80000000,
     FILE_FLAG_OVERLAPPED = 0x40000000,
+    FILE_FLAG_BACKUP_SEMANTICS = 0x02000000,
+    FILE_LIST_DIRECTORY = 0x1,
     JobObjectBasicLimitInformation = 2,
     JobObjectBasicProcessIdList = 3,
     JobObjectExtendedLimitInformation = 9,